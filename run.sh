@@ -9,7 +9,7 @@ elif [ -e ${my_link} ] ; then
 	ln -s src/ lib
 fi
 
-inputSize=(32 64 128 256 512 1024 2048 4096 8192 16384 32768 65536 131072 262144 524288)
+inputSize=(32 64 128 256 512 1024 2048 4096 8192 16384 32768 65536 131072 262144 524288 1048576 2097152 4194304 8388608 16777216 33554432 67108864)
 for s in ${inputSize[@]}; do
     ./build/bin/gpuBenchmark $s
 done
@@ -22,8 +22,17 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <algorithm>
+#include <stdlib.h>
 #include "instruction.hpp"
 #include "bytecodes.hpp"
+#include "decoder.hpp"
+#include "superinstructions.hpp"
+#include "verifier.hpp"
+#include "heap.hpp"
+#include "reduction.hpp"
+#include "atomics.hpp"
+#include "scratchpad.hpp"
 
 using namespace std;
 
@@ -31,12 +40,14 @@ class AbstractVM {
 
     public:
 
+        // The stack size is only used for recursive programs. Otherwise the verifier sizes the stack
+        // to the exact depth that the program needs.
         void setVMConfig(int stackSize, int dataSize) {
-            this->stack.resize(stackSize);
             this->data.resize(dataSize);
-            this->stackSize = stackSize;
+            this->configStackSize = stackSize;
             this->dataSize = dataSize;
             vmAllocated = true;
+            verifyProgram();
         }
 
         void setTrace() {
@@ -45,11 +56,14 @@ class AbstractVM {
 
         void printTrace(int opcode) {
             Instruction instruction = ins[opcode];
+            DecodedInstruction decoded = decodedCode[ip];
             cout << print(instruction) << " ";
-            if (instruction.numOperarands == 1) {
-                cout << code[ip + 1];
-            } else if (instruction.numOperarands == 2) {
-                cout << code[ip + 1] << " " << code[ip + 2];
+            if (hasBranchTarget(opcode) && instruction.numOperarands == 2) {
+                cout << decoded.target << " " << decoded.operand;
+            } else if (hasBranchTarget(opcode)) {
+                cout << decoded.target;
+            } else if (instruction.numOperarands == 1) {
+                cout << decoded.operand;
             }
 
             cout << "\t[";
@@ -75,14 +89,127 @@ class AbstractVM {
 
         virtual void runInterpreter() = 0;
 
+        // Result of reduction r (REDUCE_ADD/REDUCE_MIN/REDUCE_MAX r) in the last run, combined over all the work-groups
+        int getReduction(int reduction) {
+            return reductions[reduction];
+        }
+
+        // Accumulate the atomics on the first `size` elements of heap `heap` in a copy per work-group, that every
+        // group adds to the heap once (atomics.hpp). The program must update the heap with only one of ATOMIC_ADD,
+        // ATOMIC_MIN or ATOMIC_MAX. The OpenCL VMs need it before initOpenCL.
+        void setLocalAtomics(int heap, int size) {
+            int opcode = 0;
+            for (auto &instruction : decodedCode) {
+                if (isAtomicOpcode(instruction.opcode) && instruction.operand == heap) {
+                    opcode = (opcode == 0 || opcode == instruction.opcode) ? instruction.opcode : ATOMIC_CAS;
+                }
+            }
+            if (opcode == 0 || opcode == ATOMIC_CAS || size < 1) {
+                cout << "[ATOMICS] Heap " << heap << " is not updated with one of ATOMIC_ADD, ATOMIC_MIN or ATOMIC_MAX. "
+                     << "Running its atomics on the heap" << endl;
+                return;
+            }
+            this->localAtomicsHeap = heap;
+            this->localAtomicsSize = size;
+            this->localAtomicsOpcode = opcode;
+        }
+
+        // Elements of the scratchpad of every work-group (LLOAD/LSTORE/LLOAD_TILE, scratchpad.hpp). It must be called
+        // before setVMConfig, and for the OpenCL VMs before initOpenCL.
+        void setScratchpadSize(int size) {
+            this->scratchpadSize = size;
+            this->scratchpad.assign(size, 0);
+            if (vmAllocated) {
+                verifyProgram();
+            }
+        }
+
+        // Select the superinstructions to fuse (FUSE_* flags) and decode the program again
+        void setSuperinstructions(int superinstructions) {
+            this->superinstructions = superinstructions;
+            decodeProgram(mainByteCodeIndex);
+        }
+
     protected:
+        // Translate the bytecode into the decoded instruction stream executed by the interpreters,
+        // and fuse the enabled superinstructions. ip is set to the entry point in the decoded stream.
+        void decodeProgram(int mainByteCodeIndex) {
+            DecodedProgram program = ::decodeProgram(code, mainByteCodeIndex, ins);
+            fuseSuperinstructions(program, superinstructions);
+            this->mainByteCodeIndex = mainByteCodeIndex;
+            this->decodedCode = program.instructions;
+            this->decodedSize = program.instructions.size();
+            this->ip = program.entryPoint;
+            this->entryPoint = program.entryPoint;
+            if (vmAllocated) {
+                verifyProgram();
+            }
+        }
+
+        // Verify the decoded program and size the stack. Programs with a bounded stack depth run without
+        // any bounds checks. Recursive programs keep the configured stack size and check on every CALL
+        // that the callee frame fits in the stack.
+        void verifyProgram() {
+            VerifierResult result = ::verifyProgram(decodedCode, entryPoint, dataSize, numParallelHeaps, scratchpadSize, ins);
+            if (!result.valid) {
+                cout << "[VERIFIER] Program rejected" << endl;
+                exit(-1);
+            }
+            if (result.bounded) {
+                this->stackSize = result.maxStackDepth;
+                this->checkStackBounds = false;
+            } else {
+                this->stackSize = max(configStackSize, result.maxFrameDepth);
+                this->checkStackBounds = true;
+            }
+            this->frameDepth = result.maxFrameDepth;
+            this->stackDepths = result.stackDepths;
+            this->stackSlots.resize(stackSize + 1);
+            this->stack = stackSlots.data() + 1;
+            this->reductionOpcodes = result.reductionOpcodes;
+            this->reductions.assign(MAX_REDUCTIONS, 0);
+            this->numReductions = 0;
+            for (int r = 0; r < (int) reductionOpcodes.size(); r++) {
+                if (reductionOpcodes[r] != 0) {
+                    numReductions = r + 1;
+                }
+            }
+        }
+
+        // Second stage of the reductions: combine the partial results of the work-groups, stored as
+        // partials[r * numGroups + group]
+        void combinePartials(const int* partials, int numGroups) {
+            for (int r = 0; r < numReductions; r++) {
+                int opcode = reductionOpcodes[r];
+                if (opcode == 0) {
+                    continue;
+                }
+                int result = reductionIdentity(opcode);
+                for (int group = 0; group < numGroups; group++) {
+                    result = combineReduction(opcode, result, partials[(size_t) r * numGroups + group]);
+                }
+                reductions[r] = result;
+            }
+        }
+
         vector<int> code;
-        vector<int> stack;
-        vector<int> data;
+        vector<DecodedInstruction> decodedCode;
+        // The stack starts at slot 1 of stackSlots. Slot 0 is stack[-1], the guard slot of the interpreters that cache
+        // the top of the stack: pushing onto an empty stack spills the (meaningless) cached top there.
+        vector<int> stackSlots;
+        int* stack = nullptr;
+        Heap data;
 
         int codeSize;
+        int decodedSize;
         int stackSize;
         int dataSize;
+        // Heaps of PARALLEL_GLOAD_INDEXED/PARALLEL_GSTORE_INDEXED
+        int numParallelHeaps = NUM_PARALLEL_HEAPS;
+
+        int mainByteCodeIndex = 0;
+        int entryPoint = 0;
+        int superinstructions = FUSE_ALL;
 
         int ip = 0;
         int sp = -1;
@@ -92,6 +219,26 @@ class AbstractVM {
 
         bool vmAllocated = false;
 
+        // Set by the verifier for recursive programs: CALL checks that sp + 3 + frameDepth fits in the stack
+        bool checkStackBounds = false;
+        int configStackSize = 0;
+        int frameDepth = 0;
+        vector<int> stackDepths;
+
+        // Operation of every reduction number, and the results of the last run
+        vector<int> reductionOpcodes;
+        vector<int> reductions = vector<int>(MAX_REDUCTIONS, 0);
+        int numReductions = 0;
+
+        // Scratchpad of the work-group. The sequential VMs run a work-group of one work-item.
+        int scratchpadSize = 0;
+        vector<int> scratchpad;
+
+        // Work-group copy of the atomics (setLocalAtomics), disabled with opcode 0
+        int localAtomicsHeap = 0;
+        int localAtomicsSize = 0;
+        int localAtomicsOpcode = 0;
+
         Instruction* ins;
 
 };
@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2020-2021, APT Group, Department of Computer Science,
+ * The University of Manchester.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef ATOMICS_HPP
+#define ATOMICS_HPP
+
+#include <climits>
+#include "bytecodes.hpp"
+
+/*
+ * ATOMIC_ADD/ATOMIC_MIN/ATOMIC_MAX/ATOMIC_CAS h update an element of heap h atomically, so histograms and scatter
+ * accumulations do not race when several work-items update the same element. The index is an element of the whole
+ * heap (not of the tile of the work-group), and the bytecodes push the value of the element before the update.
+ * The OpenCL kernels run them with atomic_* in global memory, and ParallelCPUVM with the atomic builtins of GCC/Clang.
+ *
+ * With setLocalAtomics, the first elements of one heap are accumulated in a copy per work-group (local memory in
+ * the kernels), and every group adds its copy to the heap once, after its work-items halt. The value pushed is
+ * then the value of the copy of the group.
+ */
+
+inline bool isAtomicOpcode(int opcode) {
+    return opcode >= ATOMIC_ADD && opcode <= ATOMIC_CAS;
+}
+
+// Initial value of the elements of a work-group copy
+inline int atomicIdentity(int opcode) {
+    switch (opcode) {
+        case ATOMIC_MIN:
+            return INT_MAX;
+        case ATOMIC_MAX:
+            return INT_MIN;
+        default:
+            return 0;
+    }
+}
+
+// ATOMIC_ADD/ATOMIC_MIN/ATOMIC_MAX: returns the value before the update
+inline int atomicUpdate(int opcode, int* address, int value) {
+    if (opcode == ATOMIC_ADD) {
+        return __atomic_fetch_add(address, value, __ATOMIC_RELAXED);
+    }
+    int old = __atomic_load_n(address, __ATOMIC_RELAXED);
+    while ((opcode == ATOMIC_MIN) ? value < old : value > old) {
+        if (__atomic_compare_exchange_n(address, &old, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    return old;
+}
+
+// ATOMIC_CAS: stores `value` if the element holds `expected`, and returns the value before
+inline int atomicCompareExchange(int* address, int expected, int value) {
+    __atomic_compare_exchange_n(address, &expected, value, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    return expected;
+}
+
+// Update of an element of the copy of a work-group, that only one thread accesses
+inline int localAtomicUpdate(int opcode, int* address, int value) {
+    int old = *address;
+    switch (opcode) {
+        case ATOMIC_MIN:
+            *address = (value < old) ? value : old;
+            break;
+        case ATOMIC_MAX:
+            *address = (value > old) ? value : old;
+            break;
+        default:
+            *address = old + value;
+            break;
+    }
+    return old;
+}
+
+#endif
@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2020-2021, APT Group, Department of Computer Science,
+ * The University of Manchester.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <iostream>
+#include "bufferPool.hpp"
+
+using namespace std;
+
+// ====================================================================
+// PooledBuffer Class
+// ====================================================================
+PooledBuffer::PooledBuffer(BufferPool* pool, cl_mem mem, size_t size, cl_mem_flags flags) {
+    this->pool = pool;
+    this->mem = mem;
+    this->size = size;
+    this->flags = flags;
+}
+
+PooledBuffer::PooledBuffer(PooledBuffer &&other) {
+    *this = move(other);
+}
+
+PooledBuffer& PooledBuffer::operator=(PooledBuffer &&other) {
+    if (this != &other) {
+        reset();
+        pool = other.pool;
+        mem = other.mem;
+        size = other.size;
+        flags = other.flags;
+        other.pool = nullptr;
+        other.mem = nullptr;
+        other.size = 0;
+    }
+    return *this;
+}
+
+PooledBuffer::~PooledBuffer() {
+    reset();
+}
+
+void PooledBuffer::reset() {
+    if (mem != nullptr) {
+        pool->giveBack(mem, size, flags);
+    }
+    pool = nullptr;
+    mem = nullptr;
+    size = 0;
+}
+
+bool PooledBuffer::matches(size_t size, cl_mem_flags flags) {
+    return mem != nullptr && this->size == size && this->flags == flags;
+}
+
+cl_mem PooledBuffer::get() {
+    return mem;
+}
+
+cl_mem* PooledBuffer::address() {
+    return &mem;
+}
+
+size_t PooledBuffer::getSize() {
+    return size;
+}
+
+// ====================================================================
+// BufferPool Class
+// ====================================================================
+BufferPool::BufferPool(cl_context context) {
+    this->context = context;
+}
+
+BufferPool::~BufferPool() {
+    trim();
+}
+
+PooledBuffer BufferPool::acquire(size_t size, cl_mem_flags flags) {
+    auto found = freeBuffers.find(make_pair(flags, size));
+    if (found != freeBuffers.end()) {
+        cl_mem mem = found->second;
+        freeBuffers.erase(found);
+        return PooledBuffer(this, mem, size, flags);
+    }
+    cl_int status;
+    cl_mem mem = clCreateBuffer(context, flags, size, NULL, &status);
+    if (status != CL_SUCCESS) {
+        cout << "Error in clCreateBuffer: " << status << endl;
+        return PooledBuffer();
+    }
+    numCreated++;
+    return PooledBuffer(this, mem, size, flags);
+}
+
+void BufferPool::giveBack(cl_mem mem, size_t size, cl_mem_flags flags) {
+    freeBuffers.insert(make_pair(make_pair(flags, size), mem));
+}
+
+void BufferPool::trim() {
+    for (auto &entry : freeBuffers) {
+        clReleaseMemObject(entry.second);
+    }
+    freeBuffers.clear();
+}
+
+int BufferPool::getNumCreated() {
+    return numCreated;
+}
@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2020-2021, APT Group, Department of Computer Science,
+ * The University of Manchester.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef BUFFER_POOL_HPP
+#define BUFFER_POOL_HPP
+
+#ifndef CL_TARGET_OPENCL_VERSION
+    #define CL_TARGET_OPENCL_VERSION 300
+#endif
+
+#include <map>
+#include <utility>
+
+#ifdef __APPLE__
+	#include <OpenCL/cl.h>
+#else
+	#include <CL/cl.h>
+#endif
+
+using namespace std;
+
+class BufferPool;
+
+/*
+ * Device buffer owned by a BufferPool. The buffer goes back to the pool when the handle is destroyed or reset,
+ * so it can be used again by the next run without calling clCreateBuffer. Handles can be moved but not copied.
+ */
+class PooledBuffer {
+
+    public:
+        PooledBuffer() {};
+        PooledBuffer(BufferPool* pool, cl_mem mem, size_t size, cl_mem_flags flags);
+        PooledBuffer(PooledBuffer &&other);
+        PooledBuffer& operator=(PooledBuffer &&other);
+        PooledBuffer(const PooledBuffer &) = delete;
+        PooledBuffer& operator=(const PooledBuffer &) = delete;
+
+        ~PooledBuffer();
+
+        // Give the buffer back to the pool
+        void reset();
+
+        bool matches(size_t size, cl_mem_flags flags);
+
+        cl_mem get();
+
+        // Address of the cl_mem, for clSetKernelArg
+        cl_mem* address();
+
+        size_t getSize();
+
+    private:
+        BufferPool* pool = nullptr;
+        cl_mem mem = nullptr;
+        size_t size = 0;
+        cl_mem_flags flags = 0;
+};
+
+/*
+ * Pool of device buffers of a context, keyed by size and flags. Buffers that are given back are kept for the next
+ * acquire with the same size and flags, and all of them are released with the pool.
+ */
+class BufferPool {
+
+    public:
+        BufferPool(cl_context context);
+
+        ~BufferPool();
+
+        // Buffer of `size` bytes. The handle is empty if clCreateBuffer fails
+        PooledBuffer acquire(size_t size, cl_mem_flags flags);
+
+        // Release the free buffers
+        void trim();
+
+        int getNumCreated();
+
+    private:
+        friend class PooledBuffer;
+
+        void giveBack(cl_mem mem, size_t size, cl_mem_flags flags);
+
+        cl_context context;
+        multimap<pair<cl_mem_flags, size_t>, cl_mem> freeBuffers;
+        int numCreated = 0;
+};
+
+#endif
@@ -50,6 +50,75 @@
 #define PARALLEL_GLOAD_INDEXED 27
 #define PARALLEL_GSTORE_INDEXED 28
 
+// Superinstructions: fused sequences of the bytecodes above. They are normally introduced by the fusion
+// pass (superinstructions.hpp) on the decoded stream. In raw bytecode, a branch target comes first.
+#define DUP_ICONST_IEQ_BRT 29                // DUP; ICONST n; IEQ; BRT t -> branch to t if top == n (top stays)
+#define DUP_GLOAD_INDEXED 30                 // DUP; GLOAD_INDEXED k -> push global[k + top] (top stays)
+#define ICONST1_IADD 31                      // ICONST1; IADD -> top = top + 1
+#define THREAD_ID_PARALLEL_GLOAD_INDEXED 32  // THREAD_ID; PARALLEL_GLOAD_INDEXED h -> push heap_h[thread-id]
+
+// Single precision: a float takes one stack slot and one heap element, with the bits of the float (floatingPoint.hpp).
+// Heaps of floats use the integer loads and stores. Operands are in the same order as the integer bytecodes.
+#define FADD    33
+#define FSUB    34
+#define FMUL    35
+#define FDIV    36
+#define FMA     37   // top * second + third
+#define FLT     38
+#define FEQ     39
+#define I2F     40   // int to float
+#define F2I     41   // float to int (truncation)
+
+// Double precision (cl_khr_fp64 on OpenCL devices): a double takes two stack slots and two heap elements, the low
+// word first and the high word on top.
+#define DADD    42
+#define DSUB    43
+#define DMUL    44
+#define DDIV    45
+#define DFMA    46
+#define DLT     47
+#define DEQ     48
+#define I2D     49
+#define D2I     50
+#define F2D     51
+#define D2F     52
+#define DLOAD_INDEXED  53             // push global[k + 2 * top] (two words)
+#define DSTORE_INDEXED 54             // global[k + 2 * offset] <- double on top, offset below it
+#define PARALLEL_DLOAD_INDEXED  55    // heap h of doubles, indexed with the thread-id
+#define PARALLEL_DSTORE_INDEXED 56
+
+// Vectors of four ints or floats (shortVector.hpp): a vector takes four stack slots and four heap elements, the first
+// element deepest and the last one on top.
+#define VLOAD4  57                    // push global[k + 4 * top] ... global[k + 4 * top + 3]
+#define VSTORE4 58                    // global[k + 4 * offset] ... <- vector on top, offset below it
+#define VADD4   59
+#define VMUL4   60
+#define VSUM4   61                    // sum of the elements of the vector on top
+#define VFADD4  62
+#define VFMUL4  63
+#define VFSUM4  64
+#define PARALLEL_VLOAD4  65           // heap h of vectors, indexed with the thread-id
+#define PARALLEL_VSTORE4 66
+
+// Work-group collectives (reduction.hpp): every work-item of the work-group runs them together
+#define REDUCE_ADD 67                 // top <- sum of top over the work-group, stored as the result of reduction r
+#define REDUCE_MIN 68
+#define REDUCE_MAX 69
+#define SCAN_ADD   70                 // top <- sum of top over the work-items before it in the work-group
+
+// Atomic updates of heap h (atomics.hpp), at an index of the whole heap: the value on top, the index below it.
+// They push the value of the element before the update.
+#define ATOMIC_ADD 71
+#define ATOMIC_MIN 72
+#define ATOMIC_MAX 73
+#define ATOMIC_CAS 74                 // new value on top, then the expected value, then the index
+
+// Scratchpad of the work-group in local memory (scratchpad.hpp)
+#define BARRIER    75                 // wait for all the work-items of the work-group
+#define LLOAD      76                 // top <- local[k + top]
+#define LSTORE     77                 // local[k + offset] <- top, offset below it
+#define LLOAD_TILE 78                 // local[offset ..] <- count elements of heap h from index (relative to the work-group)
+
 #define TRUE    1
 #define FALSE   0
 
@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2020-2021, APT Group, Department of Computer Science,
+ * The University of Manchester.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <iostream>
+#include <vector>
+#include <stdlib.h>
+#include "decoder.hpp"
+
+using namespace std;
+
+bool hasBranchTarget(int opcode) {
+    return opcode == BR || opcode == BRT || opcode == BRF || opcode == CALL || opcode == DUP_ICONST_IEQ_BRT;
+}
+
+DecodedProgram decodeProgram(vector<int> &code, int mainByteCodeIndex, Instruction* ins) {
+    DecodedProgram program;
+    int codeSize = code.size();
+
+    // First pass: find the start of every instruction. Positions that are not the start of
+    // an instruction (i.e., operands) keep -1.
+    vector<int> rawToDecoded(codeSize + 1, -1);
+    int numInstructions = 0;
+    for (int pc = 0; pc < codeSize; ) {
+        int opcode = code[pc];
+        int length = 1;
+        if (opcode > 0 && opcode < TOTAL_INSTRUCTIONS) {
+            length += ins[opcode].numOperarands;
+        }
+        rawToDecoded[pc] = numInstructions++;
+        pc += length;
+    }
+    // Jumping to the end of the code is the same as halting
+    rawToDecoded[codeSize] = numInstructions;
+
+    // Second pass: emit the records with resolved operands and targets
+    program.instructions.reserve(numInstructions + 1);
+    for (int pc = 0; pc < codeSize; ) {
+        DecodedInstruction instruction;
+        int opcode = code[pc];
+        if (opcode <= 0 || opcode >= TOTAL_INSTRUCTIONS) {
+            cout << "[DECODER] Invalid opcode " << opcode << " at position " << pc << endl;
+            opcode = INVALID_OPCODE;
+        }
+        int numOperands = ins[opcode].numOperarands;
+        if (pc + numOperands >= codeSize) {
+            cout << "[DECODER] Missing operands for " << print(ins[opcode]) << " at position " << pc << endl;
+            exit(-1);
+        }
+
+        instruction.opcode = opcode;
+        instruction.operand = 0;
+        instruction.target = -1;
+        instruction.stackEffect = ins[opcode].stackEffect;
+
+        if (hasBranchTarget(opcode)) {
+            int address = code[pc + 1];
+            if (address < 0 || address > codeSize || rawToDecoded[address] == -1) {
+                cout << "[DECODER] Invalid branch target " << address << " at position " << pc << endl;
+                exit(-1);
+            }
+            instruction.target = rawToDecoded[address];
+            if (numOperands == 2) {
+                // CALL address numArgs
+                instruction.operand = code[pc + 2];
+            }
+        } else if (numOperands == 1) {
+            instruction.operand = code[pc + 1];
+        }
+
+        program.instructions.push_back(instruction);
+        pc += 1 + numOperands;
+    }
+
+    // HALT sentinel, so a program that runs off the end of the code stops
+    DecodedInstruction sentinel = { HALT, 0, -1, 0 };
+    program.instructions.push_back(sentinel);
+
+    if (mainByteCodeIndex < 0 || mainByteCodeIndex > codeSize || rawToDecoded[mainByteCodeIndex] == -1) {
+        cout << "[DECODER] Invalid entry point " << mainByteCodeIndex << endl;
+        exit(-1);
+    }
+    program.entryPoint = rawToDecoded[mainByteCodeIndex];
+    return program;
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2020-2021, APT Group, Department of Computer Science,
+ * The University of Manchester.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef DECODER_HPP
+#define DECODER_HPP
+
+#include <vector>
+#include "instruction.hpp"
+#include "bytecodes.hpp"
+
+using namespace std;
+
+/*
+ * Fixed-width record produced by the load-time decode pass. All interpreters (C++ and OpenCL)
+ * execute a stream of these records instead of the raw variable-length bytecode, so the hot loop
+ * never fetches operands with code[ip++]. The layout matches an OpenCL int4:
+ *   x: opcode, y: operand, z: absolute branch target, w: stack effect.
+ */
+struct DecodedInstruction {
+    int opcode;
+    int operand;        // ICONST value, LOAD/STORE slot, heap address, heap number or CALL number of arguments
+    int target;         // index of the branch/call target in the decoded stream (-1 if none)
+    int stackEffect;    // net change of the stack pointer
+};
+
+static_assert(sizeof(DecodedInstruction) == 4 * sizeof(int), "DecodedInstruction must map to an OpenCL int4");
+
+struct DecodedProgram {
+    vector<DecodedInstruction> instructions;
+    int entryPoint;
+};
+
+// Opcode used for any value that is not a valid bytecode. Interpreters report it as an error.
+#define INVALID_OPCODE 0
+
+bool hasBranchTarget(int opcode);
+
+/*
+ * Decode the raw bytecode into fixed-width records. Branch and call targets are translated into
+ * indexes of the decoded stream, and a HALT sentinel is appended at the end of the program.
+ */
+DecodedProgram decodeProgram(vector<int> &code, int mainByteCodeIndex, Instruction* ins);
+
+#endif
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2020-2021, APT Group, Department of Computer Science,
+ * The University of Manchester.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef DIRTY_RANGES_HPP
+#define DIRTY_RANGES_HPP
+
+#include <vector>
+#include <cstddef>
+#include <algorithm>
+
+using namespace std;
+
+// Beyond this number of ranges, the ranges of a heap are merged into one that covers all of them, so an upload
+// never takes more than MAX_DIRTY_RANGES transfers per heap
+#define MAX_DIRTY_RANGES 64
+
+/*
+ * Elements of a heap modified on the host since its last upload to the device, as sorted and disjoint [begin, end)
+ * ranges. Overlapping and adjacent ranges are merged.
+ */
+class DirtyRanges {
+
+    public:
+        void add(size_t begin, size_t end) {
+            if (begin >= end) {
+                return;
+            }
+            vector<pair<size_t, size_t>> merged;
+            bool inserted = false;
+            for (auto &range : ranges) {
+                if (range.second < begin) {
+                    merged.push_back(range);
+                } else if (end < range.first) {
+                    if (!inserted) {
+                        merged.push_back(make_pair(begin, end));
+                        inserted = true;
+                    }
+                    merged.push_back(range);
+                } else {
+                    begin = min(begin, range.first);
+                    end = max(end, range.second);
+                }
+            }
+            if (!inserted) {
+                merged.push_back(make_pair(begin, end));
+            }
+            if (merged.size() > MAX_DIRTY_RANGES) {
+                merged = { make_pair(merged.front().first, merged.back().second) };
+            }
+            ranges = move(merged);
+        }
+
+        // Remove the range if it is one of the ranges. Returns true if it was.
+        bool remove(pair<size_t, size_t> range) {
+            auto found = find(ranges.begin(), ranges.end(), range);
+            if (found == ranges.end()) {
+                return false;
+            }
+            ranges.erase(found);
+            return true;
+        }
+
+        void clear() {
+            ranges.clear();
+        }
+
+        bool empty() {
+            return ranges.empty();
+        }
+
+        const vector<pair<size_t, size_t>> &get() {
+            return ranges;
+        }
+
+    private:
+        vector<pair<size_t, size_t>> ranges;
+};
+
+#endif
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2020-2021, APT Group, Department of Computer Science,
+ * The University of Manchester.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef FLOATING_POINT_HPP
+#define FLOATING_POINT_HPP
+
+#include <cstring>
+#include "bytecodes.hpp"
+
+/*
+ * The stack and the heaps hold ints. Floating-point values are kept there as their bits: a float in one slot, and
+ * a double in two slots, the low word first (the layout of a double in memory on the host and on the devices).
+ * These helpers convert between the values and their bits, for the interpreters and for the programs that pass
+ * floating-point constants (ICONST) and heaps.
+ */
+
+inline int floatToBits(float value) {
+    int bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+inline float bitsToFloat(int bits) {
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+inline int doubleLowBits(double value) {
+    int bits[2];
+    memcpy(bits, &value, sizeof(bits));
+    return bits[0];
+}
+
+inline int doubleHighBits(double value) {
+    int bits[2];
+    memcpy(bits, &value, sizeof(bits));
+    return bits[1];
+}
+
+inline double bitsToDouble(int low, int high) {
+    int bits[2] = { low, high };
+    double value;
+    memcpy(&value, bits, sizeof(value));
+    return value;
+}
+
+// Double in two consecutive slots of the stack or of a heap
+inline double loadDouble(const int* slots) {
+    double value;
+    memcpy(&value, slots, sizeof(value));
+    return value;
+}
+
+inline void storeDouble(int* slots, double value) {
+    memcpy(slots, &value, sizeof(value));
+}
+
+// Bytecodes that operate on floats or doubles
+inline bool isFloatingPointOpcode(int opcode) {
+    return opcode >= FADD && opcode <= PARALLEL_DSTORE_INDEXED;
+}
+
+// Bytecodes that need double precision on the device (cl_khr_fp64)
+inline bool isDoubleOpcode(int opcode) {
+    return opcode >= DADD && opcode <= PARALLEL_DSTORE_INDEXED;
+}
+
+#endif
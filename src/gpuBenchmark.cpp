@@ -20,15 +20,85 @@
 #include <vector>
 #include <chrono>
 #include <algorithm>
+#include <thread>
+#include <memory>
 using namespace std;
 
 #include "bytecodes.hpp"
 #include "vm.hpp"
+#include "jitVM.hpp"
+#include "parallelCPUVM.hpp"
 #include "oclVM.hpp"
 #include "stats.hpp"
 
 int SIZE = 1024;
 
+// Parallel vector multiplication, one work-item per element: heap 2 = heap 0 * heap 1
+static vector<int> vectorMulProgram() {
+    return {
+        THREAD_ID,
+        DUP,
+        PARALLEL_GLOAD_INDEXED, 0,
+        THREAD_ID,
+        PARALLEL_GLOAD_INDEXED, 1,
+        IMUL,
+        PARALLEL_GSTORE_INDEXED, 2,
+        HALT
+    };
+}
+
+double runBenchmarkCplus(vector<int> &program, DispatchMode dispatchMode, int superinstructions) {
+    vector<double> totalTime;
+    for (int i = 0; i < 11; i++) {
+        VM vm(program,  0); 
+        vm.setVMConfig(100, SIZE * 3);
+        vm.setDispatchMode(dispatchMode);
+        vm.setSuperinstructions(superinstructions);
+        vm.initHeap();
+        auto start_time = chrono::high_resolution_clock::now();
+        vm.runInterpreter();
+        auto end_time = chrono::high_resolution_clock::now();
+        double totalSeq = chrono::duration_cast<chrono::nanoseconds>(end_time - start_time).count();
+        totalTime.push_back(totalSeq);
+    }
+    return median(totalTime);
+}
+
+double runBenchmarkJIT(vector<int> &program) {
+    vector<double> totalTime;
+    for (int i = 0; i < 11; i++) {
+        JITVM vm(program,  0); 
+        vm.setVMConfig(100, SIZE * 3);
+        vm.initHeap();
+        vm.compile();
+        auto start_time = chrono::high_resolution_clock::now();
+        vm.runInterpreter();
+        auto end_time = chrono::high_resolution_clock::now();
+        double totalSeq = chrono::duration_cast<chrono::nanoseconds>(end_time - start_time).count();
+        totalTime.push_back(totalSeq);
+    }
+    return median(totalTime);
+}
+
+// The same vector multiplication written in C++, as the reference for the JIT
+double runBenchmarkNative() {
+    vector<double> totalTime;
+    vector<int> data(SIZE * 3);
+    for (int i = 0; i < 11; i++) {
+        for (int j = 0; j < SIZE * 3; j++) {
+            data[j] = j;
+        }
+        auto start_time = chrono::high_resolution_clock::now();
+        for (int j = 0; j < SIZE; j++) {
+            data[j] = data[SIZE + j] * data[SIZE * 2 + j];
+        }
+        auto end_time = chrono::high_resolution_clock::now();
+        double totalSeq = chrono::duration_cast<chrono::nanoseconds>(end_time - start_time).count();
+        totalTime.push_back(totalSeq);
+    }
+    return median(totalTime);
+}
+
 void runBenchmarkCplus() {
     // Vector multiplication in a LOOP
     vector<int> vectorAdd = {
@@ -51,24 +121,62 @@ void runBenchmarkCplus() {
             HALT
     };
 
-    vector<double> totalTime;
+    double medianSwitchTime = runBenchmarkCplus(vectorAdd, SWITCH_DISPATCH, FUSE_NONE);
+    cout << "Median TotalTime (switch): " << medianSwitchTime << endl;
+
+    double medianThreadedTime = runBenchmarkCplus(vectorAdd, THREADED_DISPATCH, FUSE_NONE);
+    cout << "Median TotalTime (threaded): " << medianThreadedTime << endl;
+    cout << "Speedup threaded vs switch: " << (medianSwitchTime / medianThreadedTime) << "x" << endl;
+
+    double medianFusedTime = runBenchmarkCplus(vectorAdd, THREADED_DISPATCH, FUSE_ALL);
+    cout << "Median TotalTime (threaded + superinstructions): " << medianFusedTime << endl;
+    cout << "Speedup threaded + superinstructions vs switch: " << (medianSwitchTime / medianFusedTime) << "x" << endl;
 
+    double medianTOSTime = runBenchmarkCplus(vectorAdd, THREADED_TOS_DISPATCH, FUSE_ALL);
+    cout << "Median TotalTime (threaded + superinstructions + TOS caching): " << medianTOSTime << endl;
+    cout << "Speedup threaded + superinstructions + TOS caching vs switch: " << (medianSwitchTime / medianTOSTime) << "x" << endl;
+
+    double medianJITTime = runBenchmarkJIT(vectorAdd);
+    cout << "Median TotalTime (JIT): " << medianJITTime << endl;
+    cout << "Speedup JIT vs switch: " << (medianSwitchTime / medianJITTime) << "x" << endl;
+
+    double medianNativeTime = runBenchmarkNative();
+    cout << "Median TotalTime (native C++): " << medianNativeTime << endl;
+    cout << "JIT slowdown vs native C++: " << (medianJITTime / medianNativeTime) << "x" << endl;
+}
+
+double runBenchmarkParallelCPU(int numThreads, bool lanes) {
+    int groupSize = 16;
+    vector<double> totalTime;
+    ParallelCPUVM vm(vectorMulProgram(), 0);
+    vm.setVMConfig(100, SIZE);
+    vm.setHeapSizes(SIZE);
+    vm.setNumThreads(numThreads);
+    vm.setLaneExecution(lanes);
     for (int i = 0; i < 11; i++) {
-        VM vm(vectorAdd,  0); 
-        vm.setVMConfig(100, SIZE * 3);
         vm.initHeap();
         auto start_time = chrono::high_resolution_clock::now();
-        vm.runInterpreter();
+        vm.runInterpreter(SIZE, groupSize);
         auto end_time = chrono::high_resolution_clock::now();
         double totalSeq = chrono::duration_cast<chrono::nanoseconds>(end_time - start_time).count();
         totalTime.push_back(totalSeq);
     }
+    return median(totalTime);
+}
 
-    double medianTotalTime = median(totalTime);
-    cout << "Median TotalTime: " << medianTotalTime << endl;
+void runBenchmarkParallelCPU() {
+    int numThreads = thread::hardware_concurrency();
+    double medianSingleTime = runBenchmarkParallelCPU(1, false);
+    cout << "MedianParallelCPU TotalTime (1 thread): " << medianSingleTime << endl;
+    double medianParallelTime = runBenchmarkParallelCPU(numThreads, false);
+    cout << "MedianParallelCPU TotalTime (" << numThreads << " threads): " << medianParallelTime << endl;
+    cout << "Speedup " << numThreads << " threads vs 1 thread: " << (medianSingleTime / medianParallelTime) << "x" << endl;
+    double medianLanesTime = runBenchmarkParallelCPU(numThreads, true);
+    cout << "MedianParallelCPU TotalTime (" << numThreads << " threads, " << laneISAName(detectLaneISA()) << " lanes): " << medianLanesTime << endl;
+    cout << "Speedup lanes vs one work-item at a time: " << (medianParallelTime / medianLanesTime) << "x" << endl;
 }
 
-void runBenchmarkOpenCLSingleThread() {
+double runBenchmarkOpenCLSingleThread(bool specialized) {
     // Vector multiplication in a LOOP
     vector<int> vectorMul = {
             ICONST, 0,
@@ -96,6 +204,9 @@ void runBenchmarkOpenCLSingleThread() {
     OCLVM oclVM(vectorMul, 0);
     oclVM.setVMConfig(100, SIZE * 3);
     oclVM.setPlatform(0);
+    if (specialized) {
+        oclVM.useSpecializedKernel();
+    }
     oclVM.initOpenCL("lib/interpreter.cl", false);
     for (int i = 0; i < 11; i++) {    
         oclVM.initHeap();
@@ -103,28 +214,24 @@ void runBenchmarkOpenCLSingleThread() {
         long kernelTime = oclVM.getKernelTime();
         totalTime.push_back(kernelTime);
     }
-    double medianTotalTime = median(totalTime);
-    cout << "MedianGlobal OpenCLTimer: " << medianTotalTime << endl;
+    return median(totalTime);
+}
+
+void runBenchmarkOpenCLSingleThread() {
+    double medianInterpretedTime = runBenchmarkOpenCLSingleThread(false);
+    cout << "MedianGlobal OpenCLTimer (interpreter): " << medianInterpretedTime << endl;
+    double medianSpecializedTime = runBenchmarkOpenCLSingleThread(true);
+    cout << "MedianGlobal OpenCLTimer (specialized kernel): " << medianSpecializedTime << endl;
+    cout << "Speedup specialized vs interpreter: " << (medianInterpretedTime / medianSpecializedTime) << "x" << endl;
 }
 
 void runOpenCLParallelIntepreter() {
-    vector<int> vectorAdd = {
-            THREAD_ID,
-            DUP,
-            PARALLEL_GLOAD_INDEXED, 0,          
-            THREAD_ID,  
-            PARALLEL_GLOAD_INDEXED, 1,        
-            IMUL,
-            PARALLEL_GSTORE_INDEXED, 2,
-            HALT
-    };
-    
     vector<long> totalTime;
-    OCLVMParallel oclVM(vectorAdd, 0);
+    OCLVMParallel oclVM(vectorMulProgram(), 0);
     oclVM.setVMConfig(100, SIZE);
     oclVM.setHeapSizes(SIZE);
     oclVM.setPlatform(0);
-    oclVM.initOpenCL("lib/interpreterParallel.cl", false);
+    oclVM.initOpenCL("lib/interpreterParallelLoop.cl", false);
     for (int i = 0; i < 11; i++) {    
         oclVM.initHeap();
         oclVM.runInterpreter(SIZE);
@@ -135,25 +242,17 @@ void runOpenCLParallelIntepreter() {
     cout << "MedianParallel OpenCLTimer: " << medianTotalTime << endl;
 }
 
-void runOpenCLParallelIntepreterLoop() {
+double runOpenCLParallelIntepreterLoop(bool specialized) {
     int size = SIZE;
     int groupSize = 16;
-    vector<int> vectorMul = {
-        THREAD_ID,
-        DUP,
-        PARALLEL_GLOAD_INDEXED, 0,          
-        THREAD_ID,  
-        PARALLEL_GLOAD_INDEXED, 1,        
-        IMUL,
-        PARALLEL_GSTORE_INDEXED, 2,
-        HALT
-    };
-
     vector<long> totalTime;
-    OCLVMParallelLoop oclVM(vectorMul, 0);
+    OCLVMParallelLoop oclVM(vectorMulProgram(), 0);
     oclVM.setVMConfig(100, SIZE);
     oclVM.setHeapSizes(SIZE);
     oclVM.setPlatform(0);
+    if (specialized) {
+        oclVM.useSpecializedKernel();
+    }
     oclVM.initOpenCL("lib/interpreterParallelLoop.cl", false);
     for (int i = 0; i < 11; i++) {    
         oclVM.initHeap();
@@ -161,14 +260,380 @@ void runOpenCLParallelIntepreterLoop() {
         long kernelTime = oclVM.getKernelTime();
         totalTime.push_back(kernelTime);
     }
-    double medianTotalTime = median(totalTime);
-    cout << "MedianParallelLoop OpenCLTimer: " << medianTotalTime << endl;
+    return median(totalTime);
+}
+
+// Host time of runInterpreter that is not kernel time (transfers, argument setup and buffer management)
+void runBenchmarkRepeatedLaunch(HeapMode heapMode, bool residentHeaps) {
+    int groupSize = 16;
+    int launches = 1000;
+    vector<double> hostTime;
+    OCLVMParallelLoop oclVM(vectorMulProgram(), 0);
+    oclVM.setVMConfig(100, SIZE);
+    oclVM.setHeapSizes(SIZE);
+    oclVM.setPlatform(0);
+    oclVM.setHeapMode(heapMode);
+    oclVM.setResidentHeaps(residentHeaps);
+    oclVM.initOpenCL("lib/interpreterParallelLoop.cl", false);
+    oclVM.initHeap();
+    for (int i = 0; i < launches; i++) {
+        auto start_time = chrono::high_resolution_clock::now();
+        oclVM.runInterpreter(SIZE, groupSize);
+        auto end_time = chrono::high_resolution_clock::now();
+        double total = chrono::duration_cast<chrono::nanoseconds>(end_time - start_time).count();
+        hostTime.push_back(total - oclVM.getKernelTime());
+    }
+    oclVM.syncHeaps();
+    cout << "MedianParallelLoop host overhead per launch (" << launches << " launches): " << median(hostTime) << endl;
+    cout << "Device buffers created: " << oclVM.getNumBuffersCreated() << endl;
+}
+
+// Wall time of a round of runs of several VMs, one after the other with runInterpreter, and all in flight with
+// runInterpreterAsync: the host enqueues the next VM while the previous ones run, and waits once for all of them.
+double runBenchmarkAsync(bool async) {
+    int groupSize = 16;
+    int numVMs = 4;
+    vector<unique_ptr<OCLVMParallelLoop>> vms;
+    for (int v = 0; v < numVMs; v++) {
+        OCLVMParallelLoop* oclVM = new OCLVMParallelLoop(vectorMulProgram(), 0);
+        oclVM->setVMConfig(100, 1);
+        oclVM->setHeapSizes(SIZE);
+        oclVM->setPlatform(0);
+        oclVM->setHeapMode(COPY_HEAPS);
+        oclVM->initOpenCL("lib/interpreterParallelLoop.cl", false);
+        oclVM->initHeap();
+        vms.push_back(unique_ptr<OCLVMParallelLoop>(oclVM));
+    }
+
+    vector<long> totalTime;
+    for (int i = 0; i < 11; i++) {
+        auto start_time = chrono::high_resolution_clock::now();
+        if (async) {
+            vector<shared_future<void>> runs;
+            for (auto &oclVM : vms) {
+                runs.push_back(oclVM->runInterpreterAsync(SIZE, groupSize));
+            }
+            for (auto &run : runs) {
+                run.wait();
+            }
+        } else {
+            for (auto &oclVM : vms) {
+                oclVM->runInterpreter(SIZE, groupSize);
+            }
+        }
+        auto end_time = chrono::high_resolution_clock::now();
+        totalTime.push_back(chrono::duration_cast<chrono::nanoseconds>(end_time - start_time).count());
+    }
+    return median(totalTime);
+}
+
+void runBenchmarkAsync() {
+    double syncTime = runBenchmarkAsync(false);
+    cout << "MedianParallelLoop round of 4 VMs (runInterpreter): " << syncTime << endl;
+    double asyncTime = runBenchmarkAsync(true);
+    cout << "MedianParallelLoop round of 4 VMs (runInterpreterAsync): " << asyncTime << endl;
+    cout << "Speedup async vs blocking: " << (syncTime / asyncTime) << "x" << endl;
+}
+
+// Wall time of runInterpreter with the heaps copied in one piece and streamed in chunks. With streaming,
+// the transfers of the neighbouring chunks overlap with the kernel of each chunk.
+double runBenchmarkStreaming(size_t chunkSize) {
+    int groupSize = 16;
+    vector<double> totalTime;
+    vector<long> kernelTime;
+    OCLVMParallelLoop oclVM(vectorMulProgram(), 0);
+    oclVM.setVMConfig(100, 1);
+    oclVM.setHeapSizes(SIZE);
+    oclVM.setPlatform(0);
+    oclVM.setHeapMode(COPY_HEAPS);
+    oclVM.setChunkSize(chunkSize);
+    oclVM.initOpenCL("lib/interpreterParallelLoop.cl", false);
+    for (int i = 0; i < 11; i++) {
+        oclVM.initHeap();
+        auto start_time = chrono::high_resolution_clock::now();
+        oclVM.runInterpreter(SIZE, groupSize);
+        auto end_time = chrono::high_resolution_clock::now();
+        totalTime.push_back(chrono::duration_cast<chrono::nanoseconds>(end_time - start_time).count());
+        kernelTime.push_back(oclVM.getKernelTime());
+    }
+    cout << "MedianParallelLoop kernel time (" << oclVM.getNumChunks() << " chunks): " << median(kernelTime) << endl;
+    return median(totalTime);
+}
+
+void runBenchmarkStreaming() {
+    size_t chunkSize = SIZE / 8;
+    if (chunkSize < 16) {
+        return;
+    }
+    double wholeTime = runBenchmarkStreaming(SIZE);
+    cout << "MedianParallelLoop run time (heaps copied in one piece): " << wholeTime << endl;
+    double streamedTime = runBenchmarkStreaming(chunkSize);
+    cout << "MedianParallelLoop run time (heaps streamed): " << streamedTime << endl;
+    cout << "Speedup streamed vs one piece: " << (wholeTime / streamedTime) << "x" << endl;
+}
+
+// Throughput (invocations per second) of many small independent invocations of the same program:
+// one runInterpreter call per invocation vs all of them in one batch launch
+void runBenchmarkBatch() {
+    int numInvocations = SIZE;
+    int numSingleRuns = min(SIZE, 100);
+    vector<int> program = {
+        GLOAD, 0,
+        GLOAD, 1,
+        IMUL,
+        GLOAD, 0,
+        IADD,
+        GSTORE, 2,      // heap[2] = heap[0] * heap[1] + heap[0]
+        HALT
+    };
+
+    OCLVM singleVM(program, 0);
+    singleVM.setVMConfig(100, 3);
+    singleVM.setPlatform(0);
+    singleVM.initOpenCL("lib/interpreter.cl", false);
+    // The batch VM runs the same program: compile its kernel while the single invocations run
+    singleVM.prebuildKernels({"lib/interpreterBatch.cl"});
+    auto start_time = chrono::high_resolution_clock::now();
+    for (int i = 0; i < numSingleRuns; i++) {
+        singleVM.initHeap();
+        singleVM.runInterpreter();
+    }
+    auto end_time = chrono::high_resolution_clock::now();
+    double singleTime = chrono::duration_cast<chrono::nanoseconds>(end_time - start_time).count();
+    double singleThroughput = numSingleRuns / (singleTime * 1e-9);
+
+    vector<double> batchTime;
+    OCLVMBatch batchVM(program, 0);
+    batchVM.setVMConfig(100, 3);
+    batchVM.setPlatform(0);
+    batchVM.initOpenCL("lib/interpreterBatch.cl", false);
+    for (int i = 0; i < numInvocations; i++) {
+        batchVM.addInvocation({i, i + 1});
+    }
+    for (int i = 0; i < 11; i++) {
+        start_time = chrono::high_resolution_clock::now();
+        batchVM.runInterpreter();
+        end_time = chrono::high_resolution_clock::now();
+        batchTime.push_back(chrono::duration_cast<chrono::nanoseconds>(end_time - start_time).count());
+    }
+    double batchThroughput = numInvocations / (median(batchTime) * 1e-9);
+
+    cout << "Invocations/s (one launch per invocation): " << singleThroughput << endl;
+    cout << "Invocations/s (batch of " << numInvocations << "): " << batchThroughput << endl;
+    cout << "Speedup batch vs one launch per invocation: " << (batchThroughput / singleThroughput) << "x" << endl;
+}
+
+// Time of initOpenCL, compiling the interpreter kernel vs loading it from the program cache
+double runBenchmarkStartup(bool programCache) {
+    OCLVMParallelLoop oclVM(vectorMulProgram(), 0);
+    oclVM.setVMConfig(100, 1);
+    oclVM.setPlatform(0);
+    if (!programCache) {
+        oclVM.setProgramCacheDirectory("");
+    }
+    auto start_time = chrono::high_resolution_clock::now();
+    oclVM.initOpenCL("lib/interpreterParallelLoop.cl", false);
+    auto end_time = chrono::high_resolution_clock::now();
+    return chrono::duration_cast<chrono::nanoseconds>(end_time - start_time).count();
+}
+
+void runBenchmarkStartup() {
+    double buildTime = runBenchmarkStartup(false);
+    cout << "initOpenCL time (kernel compiled): " << buildTime << endl;
+    // The first run with the cache stores the program if it is not cached yet
+    runBenchmarkStartup(true);
+    double cachedTime = runBenchmarkStartup(true);
+    cout << "initOpenCL time (program cache): " << cachedTime << endl;
+}
+
+// Kernel time of the parallel loop interpreter built for each work-group size (the local tile has one value per work-item)
+void runBenchmarkWorkGroupSize() {
+    for (int groupSize : {16, 64, 128, 256}) {
+        if (SIZE % groupSize != 0) {
+            continue;
+        }
+        vector<long> kernelTime;
+        OCLVMParallelLoop oclVM(vectorMulProgram(), 0);
+        oclVM.setHeaps({READ_ONLY_HEAP, READ_ONLY_HEAP, WRITE_ONLY_HEAP}, SIZE);
+        oclVM.setVMConfig(100, SIZE);
+        oclVM.setWorkGroupSize(groupSize);
+        oclVM.setPlatform(0);
+        oclVM.initOpenCL("lib/interpreterParallelLoop.cl", false);
+        for (int i = 0; i < 11; i++) {
+            oclVM.initHeap();
+            oclVM.runInterpreter(SIZE, groupSize);
+            kernelTime.push_back(oclVM.getKernelTime());
+        }
+        cout << "MedianParallelLoop OpenCLTimer (work-group size " << groupSize << "): " << median(kernelTime) << endl;
+    }
+}
+
+// Kernel time of the parallel loop interpreter with one work-group per tile and with grid-stride (a few work-groups
+// per compute unit, that loop over the tiles)
+double runBenchmarkGridStride(bool gridStride) {
+    int groupSize = 16;
+    vector<long> kernelTime;
+    OCLVMParallelLoop oclVM(vectorMulProgram(), 0);
+    oclVM.setHeaps({READ_ONLY_HEAP, READ_ONLY_HEAP, WRITE_ONLY_HEAP}, SIZE);
+    oclVM.setVMConfig(100, SIZE);
+    oclVM.setGridStride(gridStride);
+    oclVM.setPlatform(0);
+    oclVM.initOpenCL("lib/interpreterParallelLoop.cl", false);
+    for (int i = 0; i < 11; i++) {
+        oclVM.initHeap();
+        oclVM.runInterpreter(SIZE, groupSize);
+        kernelTime.push_back(oclVM.getKernelTime());
+    }
+    cout << "MedianParallelLoop OpenCLTimer (" << oclVM.getLaunchedWorkItems() << " work-items): " << median(kernelTime) << endl;
+    return median(kernelTime);
+}
+
+void runBenchmarkGridStride() {
+    double rangeTime = runBenchmarkGridStride(false);
+    double gridStrideTime = runBenchmarkGridStride(true);
+    cout << "Speedup grid-stride vs one work-item per element: " << (rangeTime / gridStrideTime) << "x" << endl;
+}
+
+// Kernel time of an irregular program: every work-item loops as many times as its element of heap 0, and a few
+// elements take most of the iterations. With persistent threads, the work-groups take the tiles from a counter.
+double runBenchmarkIrregular(bool gridStride, bool persistentThreads) {
+    int groupSize = 16;
+    vector<int> countDown = {
+        THREAD_ID,
+        THREAD_ID,
+        PARALLEL_GLOAD_INDEXED, 0,      // iterations
+        DUP,
+        ICONST, 0,
+        IEQ,
+        BRT, 15,
+        ICONST, -1,
+        IADD,
+        BR, 4,
+        PARALLEL_GSTORE_INDEXED, 1,
+        HALT
+    };
+
+    vector<long> kernelTime;
+    OCLVMParallelLoop oclVM(countDown, 0);
+    oclVM.setHeaps({READ_ONLY_HEAP, WRITE_ONLY_HEAP}, SIZE);
+    oclVM.setVMConfig(100, SIZE);
+    oclVM.setGridStride(gridStride);
+    oclVM.setPersistentThreads(persistentThreads);
+    oclVM.setPlatform(0);
+    oclVM.initOpenCL("lib/interpreterParallelLoop.cl", false);
+    for (int i = 0; i < 11; i++) {
+        for (int e = 0; e < SIZE; e++) {
+            oclVM.getHeap(0)[e] = (e % 97 == 0) ? 4096 : 1;
+        }
+        oclVM.runInterpreter(SIZE, groupSize);
+        kernelTime.push_back(oclVM.getKernelTime());
+    }
+    return median(kernelTime);
+}
+
+void runBenchmarkIrregular() {
+    double rangeTime = runBenchmarkIrregular(false, false);
+    cout << "MedianParallelLoop OpenCLTimer (irregular, one work-item per element): " << rangeTime << endl;
+    double gridStrideTime = runBenchmarkIrregular(true, false);
+    cout << "MedianParallelLoop OpenCLTimer (irregular, grid-stride): " << gridStrideTime << endl;
+    double persistentTime = runBenchmarkIrregular(false, true);
+    cout << "MedianParallelLoop OpenCLTimer (irregular, persistent threads): " << persistentTime << endl;
+}
+
+// Latency of a short job (a small vector multiplication) that shares the device with a long count-down loop. The
+// short job arrives with the long one: without time slices it waits for the whole loop, with them it runs after the
+// first slice and the long job resumes after it.
+double runBenchmarkTimeSlices(int timeSlice) {
+    vector<int> countDown = {
+        ICONST, SIZE * 4096,
+        DUP,
+        ICONST, 0,
+        IEQ,
+        BRT, 13,
+        ICONST, -1,
+        IADD,
+        BR, 2,
+        POP,
+        HALT
+    };
+    vector<int> vectorMul = {
+            ICONST, 0,
+            DUP,
+            ICONST, 16,
+            IEQ,
+            BRT, 23,
+            DUP,
+            DUP,
+            GLOAD_INDEXED, 16,
+            LOAD, 1,
+            GLOAD_INDEXED, 32,
+            IMUL,
+            GSTORE_INDEXED, 0,
+            ICONST1,
+            IADD,
+            BR, 2,
+            POP,
+            HALT
+    };
+
+    OCLVM longVM(countDown, 0);
+    longVM.setVMConfig(100, 1);
+    longVM.setTimeSlice(timeSlice);
+    longVM.setPlatform(0);
+    longVM.initOpenCL("lib/interpreter.cl", false);
+    OCLVM shortVM(vectorMul, 0);
+    shortVM.setVMConfig(100, 48);
+    shortVM.setPlatform(0);
+    shortVM.initOpenCL("lib/interpreter.cl", false);
+
+    vector<long> latency;
+    for (int i = 0; i < 11; i++) {
+        auto start_time = chrono::high_resolution_clock::now();
+        bool halted = longVM.runSlice();
+        shortVM.initHeap();
+        shortVM.runInterpreter();
+        auto end_time = chrono::high_resolution_clock::now();
+        latency.push_back(chrono::duration_cast<chrono::nanoseconds>(end_time - start_time).count());
+        while (!halted) {
+            halted = longVM.runSlice();
+        }
+    }
+    return median(latency);
+}
+
+void runBenchmarkTimeSlices() {
+    double wholeTime = runBenchmarkTimeSlices(0);
+    cout << "Short job latency (long job in one launch): " << wholeTime << endl;
+    double slicedTime = runBenchmarkTimeSlices(1 << 16);
+    cout << "Short job latency (long job in time slices): " << slicedTime << endl;
+}
+
+void runOpenCLParallelIntepreterLoop() {
+    double medianInterpretedTime = runOpenCLParallelIntepreterLoop(false);
+    cout << "MedianParallelLoop OpenCLTimer (interpreter): " << medianInterpretedTime << endl;
+    double medianSpecializedTime = runOpenCLParallelIntepreterLoop(true);
+    cout << "MedianParallelLoop OpenCLTimer (specialized kernel): " << medianSpecializedTime << endl;
+    cout << "Speedup specialized vs interpreter: " << (medianInterpretedTime / medianSpecializedTime) << "x" << endl;
 }
 
 void runBenchmarks() {
+    runBenchmarkStartup();
     runBenchmarkCplus();
+    runBenchmarkParallelCPU();
     runBenchmarkOpenCLSingleThread();
     runOpenCLParallelIntepreterLoop();
+    runBenchmarkWorkGroupSize();
+    runBenchmarkGridStride();
+    runBenchmarkIrregular();
+    runBenchmarkTimeSlices();
+    // Heaps copied on every launch, kept on the device between launches (only the result is read, once), and the
+    // best heap mode of the device (zero-copy on shared memory devices)
+    runBenchmarkRepeatedLaunch(COPY_HEAPS, false);
+    runBenchmarkRepeatedLaunch(COPY_HEAPS, true);
+    runBenchmarkRepeatedLaunch(AUTO_HEAPS, false);
+    runBenchmarkAsync();
+    runBenchmarkStreaming();
+    runBenchmarkBatch();
 }
 
 void runHelloWorld() {
@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2020-2021, APT Group, Department of Computer Science,
+ * The University of Manchester.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef HEAP_HPP
+#define HEAP_HPP
+
+#include <vector>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <stdlib.h>
+
+using namespace std;
+
+// Heaps are page aligned, so OpenCL drivers can wrap them in CL_MEM_USE_HOST_PTR buffers without a copy
+#define HEAP_ALIGNMENT 4096
+
+// The heap masks of the parallel kernel have one bit per heap
+#define MAX_PARALLEL_HEAPS 32
+
+// Access of a heap of the parallel VMs
+enum HeapAccess {
+    READ_ONLY_HEAP,
+    WRITE_ONLY_HEAP,
+    READ_WRITE_HEAP
+};
+
+/*
+ * Memory that holds the heaps of a VM. Without a HeapMemory, heaps are page-aligned host memory. OCLVM provides
+ * a HeapMemory backed by shared virtual memory (SVM), so the device accesses the heaps directly.
+ */
+class HeapMemory {
+    public:
+        virtual ~HeapMemory() {};
+        virtual void* allocate(size_t bytes) = 0;
+        virtual void release(void* address) = 0;
+};
+
+template <typename T>
+class HeapAllocator {
+
+    public:
+        typedef T value_type;
+        typedef true_type propagate_on_container_move_assignment;
+        typedef true_type propagate_on_container_swap;
+
+        HeapAllocator() {};
+        HeapAllocator(HeapMemory* memory) : memory(memory) {};
+
+        template <typename U>
+        HeapAllocator(const HeapAllocator<U> &other) : memory(other.memory) {};
+
+        T* allocate(size_t n) {
+            size_t bytes = n * sizeof(T);
+            void* address = nullptr;
+            if (memory != nullptr) {
+                address = memory->allocate(bytes);
+            } else if (posix_memalign(&address, HEAP_ALIGNMENT, bytes) != 0) {
+                address = nullptr;
+            }
+            if (address == nullptr) {
+                throw bad_alloc();
+            }
+            return (T*) address;
+        }
+
+        void deallocate(T* address, size_t n) {
+            if (memory != nullptr) {
+                memory->release(address);
+            } else {
+                free(address);
+            }
+        }
+
+        HeapMemory* memory = nullptr;
+};
+
+template <typename T, typename U>
+bool operator==(const HeapAllocator<T> &a, const HeapAllocator<U> &b) {
+    return a.memory == b.memory;
+}
+
+template <typename T, typename U>
+bool operator!=(const HeapAllocator<T> &a, const HeapAllocator<U> &b) {
+    return a.memory != b.memory;
+}
+
+typedef vector<int, HeapAllocator<int>> Heap;
+
+#endif
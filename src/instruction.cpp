@@ -21,18 +21,20 @@
 #include "instruction.hpp"
 using namespace std;
 
-Instruction createInstruction(std::string name, int numArguments) {
+Instruction createInstruction(std::string name, int numArguments, int stackEffect) {
     Instruction ins;
     ins.name = name;
     ins.numOperarands = numArguments;
+    ins.stackEffect = stackEffect;
     return ins;
 }
 
+Instruction createInstruction(std::string name, int numArguments) {
+    return createInstruction(name, numArguments, 0);
+}
+
 Instruction createInstruction(std::string name) {
-    Instruction ins;
-    ins.name = name;
-    ins.numOperarands = 0;
-    return ins;
+    return createInstruction(name, 0, 0);
 }
 
 string print(Instruction ins) {
@@ -42,31 +44,84 @@ string print(Instruction ins) {
 
 Instruction* createAllInstructions() {
     static Instruction instructions[TOTAL_INSTRUCTIONS];
-    instructions[1] = createInstruction("IADD");
-    instructions[2] = createInstruction("ISUB");
-    instructions[3] = createInstruction("IMUL");
-    instructions[4] = createInstruction("ILT");
-    instructions[5] = createInstruction("IEQ");
-    instructions[6] = createInstruction("IBR");
-    instructions[7] = createInstruction("BRT", 1);
-    instructions[8] = createInstruction("BRF", 1);
-    instructions[9] = createInstruction("ICONST", 1);
-    instructions[10] = createInstruction("LOAD", 1);
-    instructions[11] = createInstruction("GLOAD", 1);
-    instructions[12] = createInstruction("STORE", 1);
-    instructions[13] = createInstruction("GSTORE", 1);
-    instructions[14] = createInstruction("PRINT");
-    instructions[15] = createInstruction("POP");
-    instructions[16] = createInstruction("HALT");
-    instructions[17] = createInstruction("CALL", 3);
-    instructions[18] = createInstruction("RET");
-    instructions[19] = createInstruction("DUP");
-    instructions[20] = createInstruction("IDIV");
-    instructions[21] = createInstruction("LSHITF");
-    instructions[22] = createInstruction("RSHIFT");
-    instructions[23] = createInstruction("ICONST1");
-    instructions[24] = createInstruction("GLOAD_INDEXED");
-    instructions[25] = createInstruction("GSTORE_INDEXED");
+    instructions[1] = createInstruction("IADD", 0, -1);
+    instructions[2] = createInstruction("ISUB", 0, -1);
+    instructions[3] = createInstruction("IMUL", 0, -1);
+    instructions[4] = createInstruction("ILT", 0, -1);
+    instructions[5] = createInstruction("IEQ", 0, -1);
+    instructions[6] = createInstruction("BR", 1, 0);
+    instructions[7] = createInstruction("BRT", 1, -1);
+    instructions[8] = createInstruction("BRF", 1, -1);
+    instructions[9] = createInstruction("ICONST", 1, 1);
+    instructions[10] = createInstruction("LOAD", 1, 1);
+    instructions[11] = createInstruction("GLOAD", 1, 1);
+    instructions[12] = createInstruction("STORE", 1, -1);
+    instructions[13] = createInstruction("GSTORE", 1, -1);
+    instructions[14] = createInstruction("PRINT", 0, -1);
+    instructions[15] = createInstruction("POP", 0, -1);
+    instructions[16] = createInstruction("HALT", 0, 0);
+    instructions[17] = createInstruction("CALL", 2, 3);
+    instructions[18] = createInstruction("RET", 0, 0);
+    instructions[19] = createInstruction("DUP", 0, 1);
+    instructions[20] = createInstruction("IDIV", 0, -1);
+    instructions[21] = createInstruction("LSHIFT", 0, 0);
+    instructions[22] = createInstruction("RSHIFT", 0, 0);
+    instructions[23] = createInstruction("ICONST1", 0, 1);
+    instructions[24] = createInstruction("GLOAD_INDEXED", 1, 0);
+    instructions[25] = createInstruction("GSTORE_INDEXED", 1, -2);
+    instructions[26] = createInstruction("THREAD_ID", 0, 1);
+    instructions[27] = createInstruction("PARALLEL_GLOAD_INDEXED", 1, 0);
+    instructions[28] = createInstruction("PARALLEL_GSTORE_INDEXED", 1, -2);
+    instructions[29] = createInstruction("DUP_ICONST_IEQ_BRT", 2, 0);
+    instructions[30] = createInstruction("DUP_GLOAD_INDEXED", 1, 1);
+    instructions[31] = createInstruction("ICONST1_IADD", 0, 0);
+    instructions[32] = createInstruction("THREAD_ID_PARALLEL_GLOAD_INDEXED", 1, 1);
+    instructions[33] = createInstruction("FADD", 0, -1);
+    instructions[34] = createInstruction("FSUB", 0, -1);
+    instructions[35] = createInstruction("FMUL", 0, -1);
+    instructions[36] = createInstruction("FDIV", 0, -1);
+    instructions[37] = createInstruction("FMA", 0, -2);
+    instructions[38] = createInstruction("FLT", 0, -1);
+    instructions[39] = createInstruction("FEQ", 0, -1);
+    instructions[40] = createInstruction("I2F", 0, 0);
+    instructions[41] = createInstruction("F2I", 0, 0);
+    instructions[42] = createInstruction("DADD", 0, -2);
+    instructions[43] = createInstruction("DSUB", 0, -2);
+    instructions[44] = createInstruction("DMUL", 0, -2);
+    instructions[45] = createInstruction("DDIV", 0, -2);
+    instructions[46] = createInstruction("DFMA", 0, -4);
+    instructions[47] = createInstruction("DLT", 0, -3);
+    instructions[48] = createInstruction("DEQ", 0, -3);
+    instructions[49] = createInstruction("I2D", 0, 1);
+    instructions[50] = createInstruction("D2I", 0, -1);
+    instructions[51] = createInstruction("F2D", 0, 1);
+    instructions[52] = createInstruction("D2F", 0, -1);
+    instructions[53] = createInstruction("DLOAD_INDEXED", 1, 1);
+    instructions[54] = createInstruction("DSTORE_INDEXED", 1, -3);
+    instructions[55] = createInstruction("PARALLEL_DLOAD_INDEXED", 1, 1);
+    instructions[56] = createInstruction("PARALLEL_DSTORE_INDEXED", 1, -3);
+    instructions[57] = createInstruction("VLOAD4", 1, 3);
+    instructions[58] = createInstruction("VSTORE4", 1, -5);
+    instructions[59] = createInstruction("VADD4", 0, -4);
+    instructions[60] = createInstruction("VMUL4", 0, -4);
+    instructions[61] = createInstruction("VSUM4", 0, -3);
+    instructions[62] = createInstruction("VFADD4", 0, -4);
+    instructions[63] = createInstruction("VFMUL4", 0, -4);
+    instructions[64] = createInstruction("VFSUM4", 0, -3);
+    instructions[65] = createInstruction("PARALLEL_VLOAD4", 1, 3);
+    instructions[66] = createInstruction("PARALLEL_VSTORE4", 1, -5);
+    instructions[67] = createInstruction("REDUCE_ADD", 1, 0);
+    instructions[68] = createInstruction("REDUCE_MIN", 1, 0);
+    instructions[69] = createInstruction("REDUCE_MAX", 1, 0);
+    instructions[70] = createInstruction("SCAN_ADD", 0, 0);
+    instructions[71] = createInstruction("ATOMIC_ADD", 1, -1);
+    instructions[72] = createInstruction("ATOMIC_MIN", 1, -1);
+    instructions[73] = createInstruction("ATOMIC_MAX", 1, -1);
+    instructions[74] = createInstruction("ATOMIC_CAS", 1, -2);
+    instructions[75] = createInstruction("BARRIER", 0, 0);
+    instructions[76] = createInstruction("LLOAD", 1, 0);
+    instructions[77] = createInstruction("LSTORE", 1, -2);
+    instructions[78] = createInstruction("LLOAD_TILE", 1, -3);
     return instructions;
 } 
 
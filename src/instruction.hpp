@@ -21,13 +21,16 @@
 
 #include <string>
 
-#define TOTAL_INSTRUCTIONS 26
+#define TOTAL_INSTRUCTIONS 79
 
 struct Instruction {
     std::string name;
     int numOperarands;
+    int stackEffect;    // net change of the stack pointer (CALL/RET depend on the frame)
 };
 
+Instruction createInstruction(std::string name, int numArguments, int stackEffect);
+
 Instruction createInstruction(std::string name, int numArguments);
 
 Instruction createInstruction(std::string name);
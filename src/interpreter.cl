@@ -20,6 +20,9 @@
  * OpenCL interpreter for running a subset of Java bytecodes. This version of the interpreter is prepared for running
  * with a single device's thread. It runs the whole application on the device using a single heap and stack stored in
  * global memory.
+ *
+ * The kernel runs the decoded instruction stream built on the host (see decoder.hpp). Each instruction
+ * is an int4: x = opcode, y = operand, z = absolute branch target, w = stack effect.
  */
 
 #define IADD     1
@@ -49,9 +52,78 @@
 #define GLOAD_INDEXED  24  // top_stack <- global[top-stack]
 #define GSTORE_INDEXED 25
 
+// Superinstructions (built by the fusion pass on the host)
+#define DUP_ICONST_IEQ_BRT 29
+#define DUP_GLOAD_INDEXED 30
+#define ICONST1_IADD 31
+#define THREAD_ID_PARALLEL_GLOAD_INDEXED 32
+
+// Floating point: floats and doubles are kept in the stack and the heaps as their bits (as_float/as_double)
+#define FADD    33
+#define FSUB    34
+#define FMUL    35
+#define FDIV    36
+#define FMA     37
+#define FLT     38
+#define FEQ     39
+#define I2F     40
+#define F2I     41
+#define DADD    42
+#define DSUB    43
+#define DMUL    44
+#define DDIV    45
+#define DFMA    46
+#define DLT     47
+#define DEQ     48
+#define I2D     49
+#define D2I     50
+#define F2D     51
+#define D2F     52
+#define DLOAD_INDEXED  53
+#define DSTORE_INDEXED 54
+
+#define VLOAD4  57
+#define VSTORE4 58
+#define VADD4   59
+#define VMUL4   60
+#define VSUM4   61
+#define VFADD4  62
+#define VFMUL4  63
+#define VFSUM4  64
+
 #define TRUE    1
 #define FALSE   0
 
+// Number of stack slots allocated by the host. Recursive programs are built with STACK_BOUNDS_CHECKS and
+// FRAME_SIZE (the largest frame computed by the verifier), so every CALL checks that the callee frame fits
+// in the stack. Programs with a bounded stack depth run without checks.
+#ifndef STACK_SIZE
+#define STACK_SIZE 100
+#endif
+
+// State buffer of the time slices: the registers and the status saved when the kernel exits. Built with
+// TIME_SLICES, the kernel runs at most sliceLength instructions, saves the state and exits, and the next launch
+// resumes from it. The stack is kept in global memory between the launches.
+#define STATE_IP            0
+#define STATE_SP            1
+#define STATE_FP            2
+#define STATE_STATUS        3
+#define STATE_BUFFER_INDEX  4
+
+#define SLICE_FIRST         0
+#define SLICE_PREEMPTED     1
+#define SLICE_HALTED        2
+
+// Double precision bytecodes are only available on devices with cl_khr_fp64. A double takes two stack slots
+// and two heap elements: the low word, then the high word.
+#ifdef cl_khr_fp64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+
+double toDouble(int low, int high) {
+    return as_double((int2)(low, high));
+}
+#endif
+
 /*
  * Transform int to char on the target device.
  */
@@ -88,7 +160,7 @@ int printTrace(int opcode, __global char* buffer, int bufferIndex) {
  */
 __attribute__((num_compute_units(1)))
 __attribute((reqd_work_group_size(1,1,1)))
-__kernel void interpreter(__global int* code, 
+__kernel void interpreter(__global int4* code, 
                           __global int* stack, 
                           __global int* data, 
                           __global char* buffer, 
@@ -96,13 +168,41 @@ __kernel void interpreter(__global int* code,
                           int ip, 
                           int fp, 
                           int sp,
-                          int trace) 
+                          int trace,
+                          __global int* state,
+                          const int sliceLength) 
 {
     char valueString[] = {'[', 'V', 'M', ']', ' ', '=', ' '};
     int bufferIndex = 0;
 
+    // stack[-1] is a guard slot: pushing onto an empty stack spills the cached top there
+    stack = stack + 1;
+
+#ifdef TIME_SLICES
+    // Resume the program where the previous slice stopped
+    if (state[STATE_STATUS] == SLICE_PREEMPTED) {
+        ip = state[STATE_IP];
+        sp = state[STATE_SP];
+        fp = state[STATE_FP];
+        bufferIndex = state[STATE_BUFFER_INDEX];
+    }
+    int budget = sliceLength;
+#endif
+
+    // Top-of-stack caching: tos holds the value of stack[sp], and stack[sp] itself is stale
+    // until the value is spilled (pushes, CALL, LOAD/STORE of frame slots and HALT).
+    int tos = stack[sp];
+
+    int status = SLICE_HALTED;
     while (ip < codeSize) {
-        int opcode = code[ip];
+#ifdef TIME_SLICES
+        if (budget-- == 0) {
+            status = SLICE_PREEMPTED;
+            break;
+        }
+#endif
+        int4 instruction = code[ip];
+        int opcode = instruction.x;
 
         if (trace == 1) {
             bufferIndex = printTrace(opcode, buffer, bufferIndex);       
@@ -110,139 +210,337 @@ __kernel void interpreter(__global int* code,
 
         ip++;
         int a, b, c, address, value, numArgs, offset;
+        int4 v;
+        float4 vf;
+#ifdef cl_khr_fp64
+        double x, y, z;
+        int2 bits;
+#endif
         bool doHalt = false;
 
         switch (opcode) {
             case DUP:
                 // Duplicate the stack
-                a = stack[sp];
-                stack[++sp] = a;
+                stack[sp++] = tos;
                 break;
             case IADD:
-                a = stack[sp--];
-                b = stack[sp--];
-                stack[++sp] = a + b;
+                b = stack[--sp];
+                tos = tos + b;
                 break;
             case ISUB:
-                a = stack[sp--];
-                b = stack[sp--];
-                stack[++sp] = a - b;
+                b = stack[--sp];
+                tos = tos - b;
                 break;    
             case IMUL:
-                a = stack[sp--];
-                b = stack[sp--];
-                stack[++sp] = a * b;
+                b = stack[--sp];
+                tos = tos * b;
                 break;
             case IDIV:
-                a = stack[sp--];
-                b = stack[sp--];
-                stack[++sp] = a / b;
+                b = stack[--sp];
+                tos = tos / b;
                 break;
             case LSHIFT:
-                a = stack[sp--];
-                a = a << 1;
-                stack[++sp] = a;
+                tos = tos << 1;
                 break;
             case RSHIFT:
-                a = stack[sp--];
-                a = a >> 1;
-                stack[++sp] = a;
+                tos = tos >> 1;
                 break;
             case ILT:
-                a = stack[sp--];
-                b = stack[sp--];
-                c = (a < b)? TRUE : FALSE;
-                stack[++sp] = c;
+                b = stack[--sp];
+                tos = (tos < b)? TRUE : FALSE;
                 break;
             case IEQ:
-                a = stack[sp--];
-                b = stack[sp--];
-                c = (a == b)? TRUE : FALSE;
-                stack[++sp] = c;
+                b = stack[--sp];
+                tos = (tos == b)? TRUE : FALSE;
                 break;
             case BR:
-                address = code[ip++];
-                ip = address;
+                ip = instruction.z;
                 break;
             case BRT:
-                address = code[ip++];
-                if (stack[sp--] == TRUE) {
-                    ip = address;
+                a = tos;
+                tos = stack[--sp];
+                if (a == TRUE) {
+                    ip = instruction.z;
                 }
                 break;
             case BRF:
-                address = code[ip++];
-                if (stack[sp--] == FALSE) {
-                    ip = address;
+                a = tos;
+                tos = stack[--sp];
+                if (a == FALSE) {
+                    ip = instruction.z;
                 }
                 break;
             case ICONST:
                 // load constant into the stack
-                c = code[ip++];
-                stack[++sp] = c;
+                stack[sp++] = tos;
+                tos = instruction.y;
                 break;
             case ICONST1:
-                stack[++sp] = 1;
+                stack[sp++] = tos;
+                tos = 1;
                 break;
             case LOAD:
-                address = code[ip++];
-                value = stack[fp + address];
-                stack[++sp] = value;
+                // spill first, the frame slot can be the cached top
+                address = instruction.y;
+                stack[sp++] = tos;
+                tos = stack[fp + address];
                 break;
             case GLOAD:
-                address = code[ip++];
-                value = data[address];
-                stack[++sp] = value;
+                address = instruction.y;
+                stack[sp++] = tos;
+                tos = data[address];
                 break;
             case STORE:
-                value = stack[sp--];
-                address = code[ip++];
+                // reload after the store, the frame slot can be the new top
+                value = tos;
+                address = instruction.y;
+                sp--;
                 stack[fp + address] = value;
+                tos = stack[sp];
                 break;
             case GSTORE:
-                value = stack[sp--];
-                address = code[ip++];
-                data[address] = value;
+                address = instruction.y;
+                data[address] = tos;
+                tos = stack[--sp];
                 break;
             case GLOAD_INDEXED:
-                address = code[ip++];
-                offset = stack[sp--];
-                value = data[(address + offset)];
-                stack[++sp] = value;
+                address = instruction.y;
+                tos = data[(address + tos)];
                 break;
             case GSTORE_INDEXED:
-                value = stack[sp--];
-                offset = stack[sp--];
-                address = code[ip++];
-                data[(address + offset)] = value;
+                address = instruction.y;
+                offset = stack[sp - 1];
+                data[(address + offset)] = tos;
+                sp -= 2;
+                tos = stack[sp];
                 break;
             case PRINT:
-                value = stack[sp--];
+                value = tos;
+                tos = stack[--sp];
                 for (int i = 0; i < 7; i++) {
                     buffer[bufferIndex++] = valueString[i];
                 }
                 bufferIndex = numberToChar(value, buffer, bufferIndex);
                 break;
             case CALL:
-                address = code[ip++];
-                numArgs = code[ip++];  // num arguments
-                stack[++sp] = numArgs;
-                stack[++sp] = fp;
-                stack[++sp] = ip;
+#ifdef STACK_BOUNDS_CHECKS
+                if (sp + 3 + FRAME_SIZE >= STACK_SIZE) {
+                    // stack overflow: stop the program
+                    doHalt = true;
+                    break;
+                }
+#endif
+                // the whole frame goes to memory
+                numArgs = instruction.y;  // num arguments
+                stack[sp] = tos;
+                stack[sp + 1] = numArgs;
+                stack[sp + 2] = fp;
+                stack[sp + 3] = ip;
+                sp += 3;
+                tos = ip;
                 fp = sp;
-                ip = address;
+                ip = instruction.z;
                 break;
             case RET:
-                value = stack[sp--];
-                sp = fp;
-                ip = stack[sp--];
-                fp = stack[sp--];
-                numArgs = stack[sp--];
-                sp -= numArgs;
-                stack[++sp] = value;  // return value on top of the stack
+                value = tos;
+                ip = stack[fp];
+                numArgs = stack[fp - 2];
+                sp = fp - 2 - numArgs;
+                fp = stack[fp - 1];
+                tos = value;  // return value on top of the stack
                 break;
             case POP:
+                tos = stack[--sp];
+                break;
+            case DUP_ICONST_IEQ_BRT:
+                if (tos == instruction.y) {
+                    ip = instruction.z;
+                }
+                break;
+            case DUP_GLOAD_INDEXED:
+                stack[sp++] = tos;
+                tos = data[(instruction.y + tos)];
+                break;
+            case ICONST1_IADD:
+                tos = tos + 1;
+                break;
+            case FADD:
+                b = stack[--sp];
+                tos = as_int(as_float(tos) + as_float(b));
+                break;
+            case FSUB:
+                b = stack[--sp];
+                tos = as_int(as_float(tos) - as_float(b));
+                break;
+            case FMUL:
+                b = stack[--sp];
+                tos = as_int(as_float(tos) * as_float(b));
+                break;
+            case FDIV:
+                b = stack[--sp];
+                tos = as_int(as_float(tos) / as_float(b));
+                break;
+            case FMA:
+                b = stack[sp - 1];
+                c = stack[sp - 2];
+                sp -= 2;
+                tos = as_int(fma(as_float(tos), as_float(b), as_float(c)));
+                break;
+            case FLT:
+                b = stack[--sp];
+                tos = (as_float(tos) < as_float(b))? TRUE : FALSE;
+                break;
+            case FEQ:
+                b = stack[--sp];
+                tos = (as_float(tos) == as_float(b))? TRUE : FALSE;
+                break;
+            case I2F:
+                tos = as_int((float) tos);
+                break;
+            case F2I:
+                tos = (int) as_float(tos);
+                break;
+#ifdef cl_khr_fp64
+            // A double on top of the stack is the cached high word and the low word below it
+            case DADD:
+                x = toDouble(stack[sp - 1], tos);
+                y = toDouble(stack[sp - 3], stack[sp - 2]);
+                sp -= 2;
+                bits = as_int2(x + y);
+                stack[sp - 1] = bits.x;
+                tos = bits.y;
+                break;
+            case DSUB:
+                x = toDouble(stack[sp - 1], tos);
+                y = toDouble(stack[sp - 3], stack[sp - 2]);
+                sp -= 2;
+                bits = as_int2(x - y);
+                stack[sp - 1] = bits.x;
+                tos = bits.y;
+                break;
+            case DMUL:
+                x = toDouble(stack[sp - 1], tos);
+                y = toDouble(stack[sp - 3], stack[sp - 2]);
+                sp -= 2;
+                bits = as_int2(x * y);
+                stack[sp - 1] = bits.x;
+                tos = bits.y;
+                break;
+            case DDIV:
+                x = toDouble(stack[sp - 1], tos);
+                y = toDouble(stack[sp - 3], stack[sp - 2]);
+                sp -= 2;
+                bits = as_int2(x / y);
+                stack[sp - 1] = bits.x;
+                tos = bits.y;
+                break;
+            case DFMA:
+                x = toDouble(stack[sp - 1], tos);
+                y = toDouble(stack[sp - 3], stack[sp - 2]);
+                z = toDouble(stack[sp - 5], stack[sp - 4]);
+                sp -= 4;
+                bits = as_int2(fma(x, y, z));
+                stack[sp - 1] = bits.x;
+                tos = bits.y;
+                break;
+            case DLT:
+                x = toDouble(stack[sp - 1], tos);
+                y = toDouble(stack[sp - 3], stack[sp - 2]);
+                sp -= 3;
+                tos = (x < y)? TRUE : FALSE;
+                break;
+            case DEQ:
+                x = toDouble(stack[sp - 1], tos);
+                y = toDouble(stack[sp - 3], stack[sp - 2]);
+                sp -= 3;
+                tos = (x == y)? TRUE : FALSE;
+                break;
+            case I2D:
+                bits = as_int2((double) tos);
+                stack[sp++] = bits.x;
+                tos = bits.y;
+                break;
+            case D2I:
+                x = toDouble(stack[sp - 1], tos);
                 sp--;
+                tos = (int) x;
+                break;
+            case F2D:
+                bits = as_int2((double) as_float(tos));
+                stack[sp++] = bits.x;
+                tos = bits.y;
+                break;
+            case D2F:
+                x = toDouble(stack[sp - 1], tos);
+                sp--;
+                tos = as_int((float) x);
+                break;
+            case DLOAD_INDEXED:
+                address = instruction.y + 2 * tos;
+                stack[sp++] = data[address];
+                tos = data[address + 1];
+                break;
+            case DSTORE_INDEXED:
+                address = instruction.y + 2 * stack[sp - 2];
+                data[address] = stack[sp - 1];
+                data[address + 1] = tos;
+                sp -= 3;
+                tos = stack[sp];
+                break;
+#endif
+            case VLOAD4:
+                // Four heap elements per vector. The last element is cached in tos
+                v = vload4(0, &data[instruction.y + 4 * tos]);
+                vstore4(v, 0, &stack[sp]);
+                sp += 3;
+                tos = v.w;
+                break;
+            case VSTORE4:
+                stack[sp] = tos;
+                address = instruction.y + 4 * stack[sp - 4];
+                vstore4(vload4(0, &stack[sp - 3]), 0, &data[address]);
+                sp -= 5;
+                tos = stack[sp];
+                break;
+            case VADD4:
+                stack[sp] = tos;
+                v = vload4(0, &stack[sp - 3]) + vload4(0, &stack[sp - 7]);
+                sp -= 4;
+                vstore4(v, 0, &stack[sp - 3]);
+                tos = v.w;
+                break;
+            case VMUL4:
+                stack[sp] = tos;
+                v = vload4(0, &stack[sp - 3]) * vload4(0, &stack[sp - 7]);
+                sp -= 4;
+                vstore4(v, 0, &stack[sp - 3]);
+                tos = v.w;
+                break;
+            case VSUM4:
+                stack[sp] = tos;
+                v = vload4(0, &stack[sp - 3]);
+                sp -= 3;
+                tos = v.x + v.y + v.z + v.w;
+                break;
+            case VFADD4:
+                stack[sp] = tos;
+                v = as_int4(as_float4(vload4(0, &stack[sp - 3])) + as_float4(vload4(0, &stack[sp - 7])));
+                sp -= 4;
+                vstore4(v, 0, &stack[sp - 3]);
+                tos = v.w;
+                break;
+            case VFMUL4:
+                stack[sp] = tos;
+                v = as_int4(as_float4(vload4(0, &stack[sp - 3])) * as_float4(vload4(0, &stack[sp - 7])));
+                sp -= 4;
+                vstore4(v, 0, &stack[sp - 3]);
+                tos = v.w;
+                break;
+            case VFSUM4:
+                stack[sp] = tos;
+                vf = as_float4(vload4(0, &stack[sp - 3]));
+                sp -= 3;
+                tos = as_int(vf.x + vf.y + vf.z + vf.w);
                 break;
             case HALT:
                 doHalt = true;
@@ -255,4 +553,12 @@ __kernel void interpreter(__global int* code,
             break;
         }
     }
+    stack[sp] = tos;
+
+    // Save the state for the host, and for the next slice if the program has not halted
+    state[STATE_IP] = ip;
+    state[STATE_SP] = sp;
+    state[STATE_FP] = fp;
+    state[STATE_STATUS] = status;
+    state[STATE_BUFFER_INDEX] = bufferIndex;
 }
\ No newline at end of file
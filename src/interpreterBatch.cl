@@ -0,0 +1,488 @@
+/*
+ * Copyright (c) 2020-2021, APT Group, Department of Computer Science,
+ * The University of Manchester.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/**
+ * OpenCL batch interpreter for running a subset of Java bytecodes. It runs many independent invocations of the same
+ * program with one launch: each work-item runs one invocation with its own stack in private memory and its own heap.
+ * The heaps of all invocations are packed in one buffer. The descriptor of each invocation is an int4:
+ * x = offset of its heap in the packed buffer, y = initial ip, z = initial sp, w = initial fp.
+ *
+ * PRINT discards the value: the results of the invocations are in their heaps.
+ *
+ * The kernel runs the decoded instruction stream built on the host (see decoder.hpp). Each instruction
+ * is an int4: x = opcode, y = operand, z = absolute branch target, w = stack effect.
+ */
+
+#define IADD     1
+#define ISUB     2
+#define IMUL     3
+#define ILT      4
+#define IEQ      5
+#define BR       6
+#define BRT      7   // branch if true
+#define BRF      8   // branch if false
+#define ICONST   9
+#define LOAD    10
+#define GLOAD   11
+#define STORE   12
+#define GSTORE  13
+#define PRINT   14
+#define POP     15
+#define HALT    16
+#define CALL    17
+#define RET     18
+#define DUP     19   // duplicate the top of the stack
+#define IDIV    20   // integer division
+#define LSHIFT  21   // shift to the left (multiply by two)
+#define RSHIFT  22   // shift to the left (multiply by two)
+#define ICONST1 23   // load constant 1 into the stack
+
+#define GLOAD_INDEXED  24  // top_stack <- global[top-stack]
+#define GSTORE_INDEXED 25
+
+// Superinstructions (built by the fusion pass on the host)
+#define DUP_ICONST_IEQ_BRT 29
+#define DUP_GLOAD_INDEXED 30
+#define ICONST1_IADD 31
+#define THREAD_ID_PARALLEL_GLOAD_INDEXED 32
+
+// Floating point: floats and doubles are kept in the stack and the heaps as their bits (as_float/as_double)
+#define FADD    33
+#define FSUB    34
+#define FMUL    35
+#define FDIV    36
+#define FMA     37
+#define FLT     38
+#define FEQ     39
+#define I2F     40
+#define F2I     41
+#define DADD    42
+#define DSUB    43
+#define DMUL    44
+#define DDIV    45
+#define DFMA    46
+#define DLT     47
+#define DEQ     48
+#define I2D     49
+#define D2I     50
+#define F2D     51
+#define D2F     52
+#define DLOAD_INDEXED  53
+#define DSTORE_INDEXED 54
+
+#define VLOAD4  57
+#define VSTORE4 58
+#define VADD4   59
+#define VMUL4   60
+#define VSUM4   61
+#define VFADD4  62
+#define VFMUL4  63
+#define VFSUM4  64
+
+#define TRUE    1
+#define FALSE   0
+
+// Number of stack slots. The host builds the kernel with the exact depth computed by the verifier.
+// Recursive programs are built with STACK_BOUNDS_CHECKS and FRAME_SIZE (the largest frame), so
+// every CALL checks that the callee frame fits in the stack.
+#ifndef STACK_SIZE
+#define STACK_SIZE 100
+#endif
+
+// Double precision bytecodes are only available on devices with cl_khr_fp64. A double takes two stack slots
+// and two heap elements: the low word, then the high word.
+#ifdef cl_khr_fp64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+
+double toDouble(int low, int high) {
+    return as_double((int2)(low, high));
+}
+#endif
+
+/**
+ * OpenCL code for the batch interpreter: one work-item per invocation
+ */
+__kernel void interpreter(__constant int4* code, 
+                          __global int* heaps, 
+                          __global const int4* invocations, 
+                          const int numInvocations, 
+                          const int codeSize) 
+{
+    int invocation = get_global_id(0);
+    if (invocation >= numInvocations) {
+        return;
+    }
+
+    int4 descriptor = invocations[invocation];
+    __global int* data = heaps + descriptor.x;
+    int ip = descriptor.y;
+    int sp = descriptor.z;
+    int fp = descriptor.w;
+
+    // stack[-1] is a guard slot: pushing onto an empty stack spills the cached top there
+    __private int stackSlots[STACK_SIZE + 1];
+    __private int* stack = stackSlots + 1;
+
+    // Top-of-stack caching: tos holds the value of stack[sp], and stack[sp] itself is stale
+    // until the value is spilled (pushes, CALL, LOAD/STORE of frame slots and HALT).
+    int tos = stack[sp];
+
+    while (ip < codeSize) {
+        int4 instruction = code[ip];
+        int opcode = instruction.x;
+        ip++;
+        int a, b, c, address, value, numArgs, offset;
+        int4 v;
+        float4 vf;
+#ifdef cl_khr_fp64
+        double x, y, z;
+        int2 bits;
+#endif
+        bool doHalt = false;
+
+        switch (opcode) {
+            case DUP:
+                // Duplicate the stack
+                stack[sp++] = tos;
+                break;
+            case IADD:
+                b = stack[--sp];
+                tos = tos + b;
+                break;
+            case ISUB:
+                b = stack[--sp];
+                tos = tos - b;
+                break;    
+            case IMUL:
+                b = stack[--sp];
+                tos = tos * b;
+                break;
+            case IDIV:
+                b = stack[--sp];
+                tos = tos / b;
+                break;
+            case LSHIFT:
+                tos = tos << 1;
+                break;
+            case RSHIFT:
+                tos = tos >> 1;
+                break;
+            case ILT:
+                b = stack[--sp];
+                tos = (tos < b)? TRUE : FALSE;
+                break;
+            case IEQ:
+                b = stack[--sp];
+                tos = (tos == b)? TRUE : FALSE;
+                break;
+            case BR:
+                ip = instruction.z;
+                break;
+            case BRT:
+                a = tos;
+                tos = stack[--sp];
+                if (a == TRUE) {
+                    ip = instruction.z;
+                }
+                break;
+            case BRF:
+                a = tos;
+                tos = stack[--sp];
+                if (a == FALSE) {
+                    ip = instruction.z;
+                }
+                break;
+            case ICONST:
+                // load constant into the stack
+                stack[sp++] = tos;
+                tos = instruction.y;
+                break;
+            case ICONST1:
+                stack[sp++] = tos;
+                tos = 1;
+                break;
+            case LOAD:
+                // spill first, the frame slot can be the cached top
+                address = instruction.y;
+                stack[sp++] = tos;
+                tos = stack[fp + address];
+                break;
+            case GLOAD:
+                address = instruction.y;
+                stack[sp++] = tos;
+                tos = data[address];
+                break;
+            case STORE:
+                // reload after the store, the frame slot can be the new top
+                value = tos;
+                address = instruction.y;
+                sp--;
+                stack[fp + address] = value;
+                tos = stack[sp];
+                break;
+            case GSTORE:
+                address = instruction.y;
+                data[address] = tos;
+                tos = stack[--sp];
+                break;
+            case GLOAD_INDEXED:
+                address = instruction.y;
+                tos = data[(address + tos)];
+                break;
+            case GSTORE_INDEXED:
+                address = instruction.y;
+                offset = stack[sp - 1];
+                data[(address + offset)] = tos;
+                sp -= 2;
+                tos = stack[sp];
+                break;
+            case PRINT:
+                tos = stack[--sp];
+                break;
+            case CALL:
+#ifdef STACK_BOUNDS_CHECKS
+                if (sp + 3 + FRAME_SIZE >= STACK_SIZE) {
+                    // stack overflow: stop the program
+                    doHalt = true;
+                    break;
+                }
+#endif
+                // the whole frame goes to memory
+                numArgs = instruction.y;  // num arguments
+                stack[sp] = tos;
+                stack[sp + 1] = numArgs;
+                stack[sp + 2] = fp;
+                stack[sp + 3] = ip;
+                sp += 3;
+                tos = ip;
+                fp = sp;
+                ip = instruction.z;
+                break;
+            case RET:
+                value = tos;
+                ip = stack[fp];
+                numArgs = stack[fp - 2];
+                sp = fp - 2 - numArgs;
+                fp = stack[fp - 1];
+                tos = value;  // return value on top of the stack
+                break;
+            case POP:
+                tos = stack[--sp];
+                break;
+            case DUP_ICONST_IEQ_BRT:
+                if (tos == instruction.y) {
+                    ip = instruction.z;
+                }
+                break;
+            case DUP_GLOAD_INDEXED:
+                stack[sp++] = tos;
+                tos = data[(instruction.y + tos)];
+                break;
+            case ICONST1_IADD:
+                tos = tos + 1;
+                break;
+            case FADD:
+                b = stack[--sp];
+                tos = as_int(as_float(tos) + as_float(b));
+                break;
+            case FSUB:
+                b = stack[--sp];
+                tos = as_int(as_float(tos) - as_float(b));
+                break;
+            case FMUL:
+                b = stack[--sp];
+                tos = as_int(as_float(tos) * as_float(b));
+                break;
+            case FDIV:
+                b = stack[--sp];
+                tos = as_int(as_float(tos) / as_float(b));
+                break;
+            case FMA:
+                b = stack[sp - 1];
+                c = stack[sp - 2];
+                sp -= 2;
+                tos = as_int(fma(as_float(tos), as_float(b), as_float(c)));
+                break;
+            case FLT:
+                b = stack[--sp];
+                tos = (as_float(tos) < as_float(b))? TRUE : FALSE;
+                break;
+            case FEQ:
+                b = stack[--sp];
+                tos = (as_float(tos) == as_float(b))? TRUE : FALSE;
+                break;
+            case I2F:
+                tos = as_int((float) tos);
+                break;
+            case F2I:
+                tos = (int) as_float(tos);
+                break;
+#ifdef cl_khr_fp64
+            // A double on top of the stack is the cached high word and the low word below it
+            case DADD:
+                x = toDouble(stack[sp - 1], tos);
+                y = toDouble(stack[sp - 3], stack[sp - 2]);
+                sp -= 2;
+                bits = as_int2(x + y);
+                stack[sp - 1] = bits.x;
+                tos = bits.y;
+                break;
+            case DSUB:
+                x = toDouble(stack[sp - 1], tos);
+                y = toDouble(stack[sp - 3], stack[sp - 2]);
+                sp -= 2;
+                bits = as_int2(x - y);
+                stack[sp - 1] = bits.x;
+                tos = bits.y;
+                break;
+            case DMUL:
+                x = toDouble(stack[sp - 1], tos);
+                y = toDouble(stack[sp - 3], stack[sp - 2]);
+                sp -= 2;
+                bits = as_int2(x * y);
+                stack[sp - 1] = bits.x;
+                tos = bits.y;
+                break;
+            case DDIV:
+                x = toDouble(stack[sp - 1], tos);
+                y = toDouble(stack[sp - 3], stack[sp - 2]);
+                sp -= 2;
+                bits = as_int2(x / y);
+                stack[sp - 1] = bits.x;
+                tos = bits.y;
+                break;
+            case DFMA:
+                x = toDouble(stack[sp - 1], tos);
+                y = toDouble(stack[sp - 3], stack[sp - 2]);
+                z = toDouble(stack[sp - 5], stack[sp - 4]);
+                sp -= 4;
+                bits = as_int2(fma(x, y, z));
+                stack[sp - 1] = bits.x;
+                tos = bits.y;
+                break;
+            case DLT:
+                x = toDouble(stack[sp - 1], tos);
+                y = toDouble(stack[sp - 3], stack[sp - 2]);
+                sp -= 3;
+                tos = (x < y)? TRUE : FALSE;
+                break;
+            case DEQ:
+                x = toDouble(stack[sp - 1], tos);
+                y = toDouble(stack[sp - 3], stack[sp - 2]);
+                sp -= 3;
+                tos = (x == y)? TRUE : FALSE;
+                break;
+            case I2D:
+                bits = as_int2((double) tos);
+                stack[sp++] = bits.x;
+                tos = bits.y;
+                break;
+            case D2I:
+                x = toDouble(stack[sp - 1], tos);
+                sp--;
+                tos = (int) x;
+                break;
+            case F2D:
+                bits = as_int2((double) as_float(tos));
+                stack[sp++] = bits.x;
+                tos = bits.y;
+                break;
+            case D2F:
+                x = toDouble(stack[sp - 1], tos);
+                sp--;
+                tos = as_int((float) x);
+                break;
+            case DLOAD_INDEXED:
+                address = instruction.y + 2 * tos;
+                stack[sp++] = data[address];
+                tos = data[address + 1];
+                break;
+            case DSTORE_INDEXED:
+                address = instruction.y + 2 * stack[sp - 2];
+                data[address] = stack[sp - 1];
+                data[address + 1] = tos;
+                sp -= 3;
+                tos = stack[sp];
+                break;
+#endif
+            case VLOAD4:
+                // Four heap elements per vector. The last element is cached in tos
+                v = vload4(0, &data[instruction.y + 4 * tos]);
+                vstore4(v, 0, &stack[sp]);
+                sp += 3;
+                tos = v.w;
+                break;
+            case VSTORE4:
+                stack[sp] = tos;
+                address = instruction.y + 4 * stack[sp - 4];
+                vstore4(vload4(0, &stack[sp - 3]), 0, &data[address]);
+                sp -= 5;
+                tos = stack[sp];
+                break;
+            case VADD4:
+                stack[sp] = tos;
+                v = vload4(0, &stack[sp - 3]) + vload4(0, &stack[sp - 7]);
+                sp -= 4;
+                vstore4(v, 0, &stack[sp - 3]);
+                tos = v.w;
+                break;
+            case VMUL4:
+                stack[sp] = tos;
+                v = vload4(0, &stack[sp - 3]) * vload4(0, &stack[sp - 7]);
+                sp -= 4;
+                vstore4(v, 0, &stack[sp - 3]);
+                tos = v.w;
+                break;
+            case VSUM4:
+                stack[sp] = tos;
+                v = vload4(0, &stack[sp - 3]);
+                sp -= 3;
+                tos = v.x + v.y + v.z + v.w;
+                break;
+            case VFADD4:
+                stack[sp] = tos;
+                v = as_int4(as_float4(vload4(0, &stack[sp - 3])) + as_float4(vload4(0, &stack[sp - 7])));
+                sp -= 4;
+                vstore4(v, 0, &stack[sp - 3]);
+                tos = v.w;
+                break;
+            case VFMUL4:
+                stack[sp] = tos;
+                v = as_int4(as_float4(vload4(0, &stack[sp - 3])) * as_float4(vload4(0, &stack[sp - 7])));
+                sp -= 4;
+                vstore4(v, 0, &stack[sp - 3]);
+                tos = v.w;
+                break;
+            case VFSUM4:
+                stack[sp] = tos;
+                vf = as_float4(vload4(0, &stack[sp - 3]));
+                sp -= 3;
+                tos = as_int(vf.x + vf.y + vf.z + vf.w);
+                break;
+            case HALT:
+                doHalt = true;
+                break;
+            default:
+                doHalt = true;
+                break;
+        }
+        if (doHalt) {
+            break;
+        }
+    }
+}
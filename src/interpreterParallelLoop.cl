@@ -21,11 +21,33 @@
  * with a multi-thread bytecode interpreter exploiting data parallelization. Each thread has its own stack and it performs
  * exactly the same computation across threads. The OpenCL kernel is programmed to do the work per thread.
  *
- * Furthermore, this version uses a multi-heap (3 in this case), that allows accessing data in parallel. There are two
- * heaps dedicated to read-only and one for write-only.
+ * Furthermore, this version uses a multi-heap (NUM_HEAPS heaps, 3 by default), that allows accessing data in parallel.
+ * The heaps are packed in one buffer: heap h starts at h * heapSize. Every work-group copies a tile of TILE_SIZE
+ * elements of each heap to local memory, and PARALLEL_GLOAD_INDEXED/PARALLEL_GSTORE_INDEXED h access the tile of
+ * heap h. Only the heaps in HEAP_READ_MASK are copied in, and only the heaps in HEAP_WRITE_MASK are copied back.
+ * Heaps of doubles (PARALLEL_DLOAD_INDEXED/PARALLEL_DSTORE_INDEXED h) take two elements per double, and heaps of
+ * vectors (PARALLEL_VLOAD4/PARALLEL_VSTORE4 h) four elements per vector. They are accessed in global memory.
+ *
+ * REDUCE_ADD/REDUCE_MIN/REDUCE_MAX r reduce a value over the work-group in local memory, and store the result of
+ * every group in partials[r * numGroups + group]. SCAN_ADD is an exclusive prefix sum over the work-group.
+ *
+ * ATOMIC_ADD/ATOMIC_MIN/ATOMIC_MAX/ATOMIC_CAS h update an element of the whole heap h with atomic_* in global memory.
+ * With LOCAL_ATOMICS_SIZE, the updates of the first LOCAL_ATOMICS_SIZE elements of heap LOCAL_ATOMICS_HEAP (all with
+ * the operation LOCAL_ATOMICS_OPCODE) go to a copy in local memory, that the work-group adds to the heap at the end.
+ *
+ * With SCRATCHPAD_SIZE, every work-group has a scratchpad of SCRATCHPAD_SIZE ints in local memory: LLOAD/LSTORE k access
+ * element k + offset, LLOAD_TILE h copies elements of heap h (relative to the work-group) into it with all the
+ * work-items of the group, and BARRIER synchronizes the work-items.
+ *
+ * Grid-stride: work-group g runs the program on the tiles g, g + numGroups, ... below numTiles, so a launch with fewer
+ * work-groups than tiles covers the whole range. The reductions of all the tiles of a group are combined in its
+ * partial results. With DYNAMIC_TILES (persistent threads), a work-group that finishes a tile takes the next one
+ * from the counter tileCounter in global memory, so work-groups with slow tiles run fewer of them.
  *
  * The stack is stored in private memory and the heaps are accessed using local memory.
  *
+ * The kernel runs the decoded instruction stream built on the host (see decoder.hpp). Each instruction
+ * is an int4: x = opcode, y = operand, z = absolute branch target, w = stack effect.
  */
 
 #define IADD     1
@@ -59,223 +81,746 @@
 #define PARALLEL_GLOAD_INDEXED 27
 #define PARALLEL_GSTORE_INDEXED 28
 
+// Superinstructions (built by the fusion pass on the host)
+#define DUP_ICONST_IEQ_BRT 29
+#define DUP_GLOAD_INDEXED 30
+#define ICONST1_IADD 31
+#define THREAD_ID_PARALLEL_GLOAD_INDEXED 32
+
+// Floating point: floats and doubles are kept in the stack and the heaps as their bits (as_float/as_double)
+#define FADD    33
+#define FSUB    34
+#define FMUL    35
+#define FDIV    36
+#define FMA     37
+#define FLT     38
+#define FEQ     39
+#define I2F     40
+#define F2I     41
+#define DADD    42
+#define DSUB    43
+#define DMUL    44
+#define DDIV    45
+#define DFMA    46
+#define DLT     47
+#define DEQ     48
+#define I2D     49
+#define D2I     50
+#define F2D     51
+#define D2F     52
+#define DLOAD_INDEXED  53
+#define DSTORE_INDEXED 54
+#define PARALLEL_DLOAD_INDEXED  55
+#define PARALLEL_DSTORE_INDEXED 56
+
+#define VLOAD4  57
+#define VSTORE4 58
+#define VADD4   59
+#define VMUL4   60
+#define VSUM4   61
+#define VFADD4  62
+#define VFMUL4  63
+#define VFSUM4  64
+#define PARALLEL_VLOAD4  65
+#define PARALLEL_VSTORE4 66
+#define REDUCE_ADD 67
+#define REDUCE_MIN 68
+#define REDUCE_MAX 69
+#define SCAN_ADD   70
+#define ATOMIC_ADD 71
+#define ATOMIC_MIN 72
+#define ATOMIC_MAX 73
+#define ATOMIC_CAS 74
+#define BARRIER    75
+#define LLOAD      76
+#define LSTORE     77
+#define LLOAD_TILE 78
+
 #define TRUE    1
 #define FALSE   0
 
- __attribute__((reqd_work_group_size(16,1,1)))
-__kernel void interpreter(__constant int* code, 
-                          __global int* data1, 
-                          __global int* data2, 
-                          __global int* data3, 
+// Number of stack slots. The host builds the kernel with the exact depth computed by the verifier.
+// Recursive programs are built with STACK_BOUNDS_CHECKS and FRAME_SIZE (the largest frame), so
+// every CALL checks that the callee frame fits in the stack.
+#ifndef STACK_SIZE
+#define STACK_SIZE 100
+#endif
+
+// Double precision bytecodes are only available on devices with cl_khr_fp64. A double takes two stack slots
+// and two heap elements: the low word, then the high word.
+#ifdef cl_khr_fp64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+
+double toDouble(int low, int high) {
+    return as_double((int2)(low, high));
+}
+#endif
+
+// Heap configuration of the program, set by the host at build time
+#ifndef NUM_HEAPS
+#define NUM_HEAPS 3
+#endif
+#ifndef WORK_GROUP_SIZE
+#define WORK_GROUP_SIZE 16
+#endif
+// Elements of each heap per work-group (a multiple of WORK_GROUP_SIZE)
+#ifndef TILE_SIZE
+#define TILE_SIZE WORK_GROUP_SIZE
+#endif
+#ifndef HEAP_READ_MASK
+#define HEAP_READ_MASK ((1 << NUM_HEAPS) - 1)
+#endif
+#ifndef HEAP_WRITE_MASK
+#define HEAP_WRITE_MASK ((1 << NUM_HEAPS) - 1)
+#endif
+
+/*
+ * Work-group collectives. All the work-items of the work-group call them, with the scratch array in local memory.
+ */
+int combineReduction(int opcode, int a, int b) {
+    switch (opcode) {
+        case REDUCE_MIN:
+            return min(a, b);
+        case REDUCE_MAX:
+            return max(a, b);
+        default:
+            return a + b;
+    }
+}
+
+// Tree reduction of `value` over the work-group
+int reduceWorkGroup(int opcode, int value, __local int* scratch) {
+    int lid = get_local_id(0);
+    scratch[lid] = value;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    int stride = 1;
+    while (stride * 2 < WORK_GROUP_SIZE) {
+        stride *= 2;
+    }
+    for (; stride > 0; stride >>= 1) {
+        if (lid < stride && lid + stride < WORK_GROUP_SIZE) {
+            scratch[lid] = combineReduction(opcode, scratch[lid], scratch[lid + stride]);
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    int result = scratch[0];
+    // The scratch array is reused by the next collective
+    barrier(CLK_LOCAL_MEM_FENCE);
+    return result;
+}
+
+// Exclusive prefix sum of `value` over the work-group
+int scanWorkGroup(int value, __local int* scratch) {
+    int lid = get_local_id(0);
+    scratch[lid] = value;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (int offset = 1; offset < WORK_GROUP_SIZE; offset <<= 1) {
+        int other = (lid >= offset) ? scratch[lid - offset] : 0;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        scratch[lid] += other;
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    int result = scratch[lid] - value;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    return result;
+}
+
+/*
+ * Atomic updates of the heaps. They return the value of the element before the update.
+ */
+int atomicGlobal(int opcode, volatile __global int* address, int value) {
+    switch (opcode) {
+        case ATOMIC_MIN:
+            return atomic_min(address, value);
+        case ATOMIC_MAX:
+            return atomic_max(address, value);
+        default:
+            return atomic_add(address, value);
+    }
+}
+
+#ifdef LOCAL_ATOMICS_SIZE
+int atomicLocal(int opcode, volatile __local int* address, int value) {
+    switch (opcode) {
+        case ATOMIC_MIN:
+            return atomic_min(address, value);
+        case ATOMIC_MAX:
+            return atomic_max(address, value);
+        default:
+            return atomic_add(address, value);
+    }
+}
+
+// Initial value of the elements of the local copy
+#if LOCAL_ATOMICS_OPCODE == ATOMIC_MIN
+#define LOCAL_ATOMICS_IDENTITY INT_MAX
+#elif LOCAL_ATOMICS_OPCODE == ATOMIC_MAX
+#define LOCAL_ATOMICS_IDENTITY INT_MIN
+#else
+#define LOCAL_ATOMICS_IDENTITY 0
+#endif
+#endif
+
+#ifdef SCRATCHPAD_SIZE
+// LLOAD_TILE: all the work-items of the group copy `count` elements from `heap` (from element `first`) to the scratchpad.
+// Elements outside of the heap are 0. The barriers protect the values that the work-items still read from the scratchpad,
+// and make the tile visible to all of them.
+void loadTile(__global int* heap, int heapSize, int first, __local int* scratchpad, int count) {
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (int i = get_local_id(0); i < count; i += WORK_GROUP_SIZE) {
+        int element = first + i;
+        scratchpad[i] = (element >= 0 && element < heapSize) ? heap[element] : 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+}
+#endif
+
+__attribute__((reqd_work_group_size(WORK_GROUP_SIZE,1,1)))
+__kernel void interpreter(__constant int4* code, 
+                          __global int* heaps, 
+                          const int heapSize, 
                           __global char* buffer, 
                           const int codeSize, 
                           int ip, 
                           int fp, 
                           int sp,
-                          int trace) 
+                          int trace,
+                          __global int* partials,
+                          const int numTiles,
+                          __global int* tileCounter) 
 {
 
-    int idx = get_global_id(0);
+    // Stack in private memory. stack[-1] is a guard slot: pushing onto an empty stack spills the cached top there
+    __private int stackSlots[STACK_SIZE + 1];
+    __private int* stack = stackSlots + 1;
 
-    // Stack in private memory
-    __private int stack[100];
+    // Heaps in local memory: a tile of every heap
+    __local int localHeaps[NUM_HEAPS * TILE_SIZE];
 
-    // Heaps in local memory
-    __local int localHeap1[16];
-    __local int localHeap2[16];
-    __local int localHeap3[16];
+    // Values of the work-items for REDUCE_* and SCAN_ADD
+    __local int scratch[WORK_GROUP_SIZE];
 
     int lid = get_local_id(0);
+#ifdef SCRATCHPAD_SIZE
+    __local int scratchpad[SCRATCHPAD_SIZE];
+#endif
 
-    localHeap1[lid] = data1[idx];
-    localHeap2[lid] = data2[idx];
-    localHeap3[lid] = data3[idx];
-    // Wait for all threads within the workwroup
-    barrier(CLK_LOCAL_MEM_FENCE);
+#ifdef LOCAL_ATOMICS_SIZE
+    // Work-group copy of the atomics
+    __local int localAtomics[LOCAL_ATOMICS_SIZE];
+    for (int i = lid; i < LOCAL_ATOMICS_SIZE; i += WORK_GROUP_SIZE) {
+        localAtomics[i] = LOCAL_ATOMICS_IDENTITY;
+    }
+#endif
 
-    while (ip < codeSize) {
-        int opcode = code[ip];
-        ip++;
-        int a, b, c, address, value, numArgs, offset, heapNumber;
-        bool doHalt = false;
-        switch (opcode) {
-            case DUP:
-                // Duplicate the stack
-                a = stack[sp];
-                stack[++sp] = a;
-                break;
-            case IADD:
-                a = stack[sp--];
-                b = stack[sp--];
-                stack[++sp] = a + b;
-                break;
-            case ISUB:
-                a = stack[sp--];
-                b = stack[sp--];
-                stack[++sp] = a - b;
-                break;    
-            case IMUL:
-                a = stack[sp--];
-                b = stack[sp--];
-                stack[++sp] = a * b;
-                break;
-            case IDIV:
-                a = stack[sp--];
-                b = stack[sp--];
-                stack[++sp] = a / b;
-                break;
-            case LSHIFT:
-                a = stack[sp--];
-                a = a << 1;
-                stack[++sp] = a;
-                break;
-            case RSHIFT:
-                a = stack[sp--];
-                a = a >> 1;
-                stack[++sp] = a;
-                break;
-            case ILT:
-                a = stack[sp--];
-                b = stack[sp--];
-                c = (a < b)? TRUE : FALSE;
-                stack[++sp] = c;
-                break;
-            case IEQ:
-                a = stack[sp--];
-                b = stack[sp--];
-                c = (a == b)? TRUE : FALSE;
-                stack[++sp] = c;
-                break;
-            case BR:
-                address = code[ip++];
-                ip = address;
-                break;
-            case BRT:
-                address = code[ip++];
-                if (stack[sp--] == TRUE) {
-                    ip = address;
-                }
-                break;
-            case BRF:
-                address = code[ip++];
-                if (stack[sp--] == FALSE) {
-                    ip = address;
+    // Grid-stride: every work-group runs the program on the tiles group, group + numGroups, ... below numTiles,
+    // from the same entry state. With DYNAMIC_TILES, the next tile is taken from tileCounter instead.
+#ifdef DYNAMIC_TILES
+    __local int nextTile;
+#endif
+    int entryIp = ip;
+    int entryFp = fp;
+    int entrySp = sp;
+    int tile = get_group_id(0);
+    while (tile < numTiles) {
+        ip = entryIp;
+        fp = entryFp;
+        sp = entrySp;
+
+        // First element of the tile. The group id does not include the global offset of streamed runs, so the
+        // tiles are relative to the heap buffers of the launch.
+        int base = tile * TILE_SIZE;
+        for (int h = 0; h < NUM_HEAPS; h++) {
+            if (HEAP_READ_MASK & (1 << h)) {
+                for (int i = lid; i < TILE_SIZE && base + i < heapSize; i += WORK_GROUP_SIZE) {
+                    localHeaps[h * TILE_SIZE + i] = heaps[h * heapSize + base + i];
                 }
-                break;
-            case ICONST:
-                // load constant into the stack
-                c = code[ip++];
-                stack[++sp] = c;
-                break;
-            case ICONST1:
-                stack[++sp] = 1;
-                break;
-            case LOAD:
-                address = code[ip++];
-                value = stack[fp + address];
-                stack[++sp] = value;
-                break;
-            case GLOAD:
-                address = code[ip++];
-                value = data1[address];
-                stack[++sp] = value;
-                break;
-            case STORE:
-                value = stack[sp--];
-                address = code[ip++];
-                stack[fp + address] = value;
-                break;
-            case GSTORE:
-                value = stack[sp--];
-                address = code[ip++];
-                data1[address] = value;
-                break;
-            case GLOAD_INDEXED:
-                address = code[ip++];
-                offset = stack[sp--];
-                value = data1[(address + offset)];
-                stack[++sp] = value;
-                break;
-            case PARALLEL_GLOAD_INDEXED:
-                heapNumber = code[ip++];
-                offset = stack[sp--];
-                switch (heapNumber) {
-                    case 0:
-                        value = localHeap1[offset];
-                        break;
-                    case 1:
-                        value = localHeap2[offset];
+            }
+        }
+        // Wait for all threads within the workwroup
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        // Top-of-stack caching: tos holds the value of stack[sp], and stack[sp] itself is stale
+        // until the value is spilled (pushes, CALL, LOAD/STORE of frame slots and HALT).
+        int tos = stack[sp];
+
+        while (ip < codeSize) {
+            int4 instruction = code[ip];
+            int opcode = instruction.x;
+            ip++;
+            int a, b, c, address, value, numArgs, offset, heapNumber;
+            int4 v;
+            float4 vf;
+#ifdef cl_khr_fp64
+            double x, y, z;
+            int2 bits;
+#endif
+            bool doHalt = false;
+
+            switch (opcode) {
+                case DUP:
+                    // Duplicate the stack
+                    stack[sp++] = tos;
+                    break;
+                case IADD:
+                    b = stack[--sp];
+                    tos = tos + b;
+                    break;
+                case ISUB:
+                    b = stack[--sp];
+                    tos = tos - b;
+                    break;    
+                case IMUL:
+                    b = stack[--sp];
+                    tos = tos * b;
+                    break;
+                case IDIV:
+                    b = stack[--sp];
+                    tos = tos / b;
+                    break;
+                case LSHIFT:
+                    tos = tos << 1;
+                    break;
+                case RSHIFT:
+                    tos = tos >> 1;
+                    break;
+                case ILT:
+                    b = stack[--sp];
+                    tos = (tos < b)? TRUE : FALSE;
+                    break;
+                case IEQ:
+                    b = stack[--sp];
+                    tos = (tos == b)? TRUE : FALSE;
+                    break;
+                case BR:
+                    ip = instruction.z;
+                    break;
+                case BRT:
+                    a = tos;
+                    tos = stack[--sp];
+                    if (a == TRUE) {
+                        ip = instruction.z;
+                    }
+                    break;
+                case BRF:
+                    a = tos;
+                    tos = stack[--sp];
+                    if (a == FALSE) {
+                        ip = instruction.z;
+                    }
+                    break;
+                case ICONST:
+                    // load constant into the stack
+                    stack[sp++] = tos;
+                    tos = instruction.y;
+                    break;
+                case ICONST1:
+                    stack[sp++] = tos;
+                    tos = 1;
+                    break;
+                case LOAD:
+                    // spill first, the frame slot can be the cached top
+                    address = instruction.y;
+                    stack[sp++] = tos;
+                    tos = stack[fp + address];
+                    break;
+                case GLOAD:
+                    address = instruction.y;
+                    stack[sp++] = tos;
+                    tos = heaps[address];
+                    break;
+                case STORE:
+                    // reload after the store, the frame slot can be the new top
+                    value = tos;
+                    address = instruction.y;
+                    sp--;
+                    stack[fp + address] = value;
+                    tos = stack[sp];
+                    break;
+                case GSTORE:
+                    address = instruction.y;
+                    heaps[address] = tos;
+                    tos = stack[--sp];
+                    break;
+                case GLOAD_INDEXED:
+                    address = instruction.y;
+                    tos = heaps[(address + tos)];
+                    break;
+                case GSTORE_INDEXED:
+                    address = instruction.y;
+                    offset = stack[sp - 1];
+                    heaps[(address + offset)] = tos;
+                    sp -= 2;
+                    tos = stack[sp];
+                    break;
+                case PARALLEL_GLOAD_INDEXED:
+                    heapNumber = instruction.y;
+                    offset = tos;
+                    tos = localHeaps[heapNumber * TILE_SIZE + offset];
+                    break;
+                case PARALLEL_GSTORE_INDEXED:
+                    value = tos;
+                    offset = stack[sp - 1];
+                    heapNumber = instruction.y;
+                    localHeaps[heapNumber * TILE_SIZE + offset] = value;
+                    sp -= 2;
+                    tos = stack[sp];
+                    break;
+                case PRINT:
+                    value = tos;
+                    tos = stack[--sp];
+                    break;
+                case CALL:
+#ifdef STACK_BOUNDS_CHECKS
+                    if (sp + 3 + FRAME_SIZE >= STACK_SIZE) {
+                        // stack overflow: stop the program
+                        doHalt = true;
                         break;
-                    case 2:
-                        value = localHeap3[offset];
+                    }
+#endif
+                    // the whole frame goes to memory
+                    numArgs = instruction.y;  // num arguments
+                    stack[sp] = tos;
+                    stack[sp + 1] = numArgs;
+                    stack[sp + 2] = fp;
+                    stack[sp + 3] = ip;
+                    sp += 3;
+                    tos = ip;
+                    fp = sp;
+                    ip = instruction.z;
+                    break;
+                case RET:
+                    value = tos;
+                    ip = stack[fp];
+                    numArgs = stack[fp - 2];
+                    sp = fp - 2 - numArgs;
+                    fp = stack[fp - 1];
+                    tos = value;  // return value on top of the stack
+                    break;
+                case THREAD_ID:
+                    stack[sp++] = tos;
+                    tos = get_local_id(0);
+                    break;
+                case POP:
+                    tos = stack[--sp];
+                    break;
+                case DUP_ICONST_IEQ_BRT:
+                    if (tos == instruction.y) {
+                        ip = instruction.z;
+                    }
+                    break;
+                case DUP_GLOAD_INDEXED:
+                    stack[sp++] = tos;
+                    tos = heaps[(instruction.y + tos)];
+                    break;
+                case ICONST1_IADD:
+                    tos = tos + 1;
+                    break;
+                case THREAD_ID_PARALLEL_GLOAD_INDEXED:
+                    heapNumber = instruction.y;
+                    offset = get_local_id(0);
+                    stack[sp++] = tos;
+                    tos = localHeaps[heapNumber * TILE_SIZE + offset];
+                    break;
+                case FADD:
+                    b = stack[--sp];
+                    tos = as_int(as_float(tos) + as_float(b));
+                    break;
+                case FSUB:
+                    b = stack[--sp];
+                    tos = as_int(as_float(tos) - as_float(b));
+                    break;
+                case FMUL:
+                    b = stack[--sp];
+                    tos = as_int(as_float(tos) * as_float(b));
+                    break;
+                case FDIV:
+                    b = stack[--sp];
+                    tos = as_int(as_float(tos) / as_float(b));
+                    break;
+                case FMA:
+                    b = stack[sp - 1];
+                    c = stack[sp - 2];
+                    sp -= 2;
+                    tos = as_int(fma(as_float(tos), as_float(b), as_float(c)));
+                    break;
+                case FLT:
+                    b = stack[--sp];
+                    tos = (as_float(tos) < as_float(b))? TRUE : FALSE;
+                    break;
+                case FEQ:
+                    b = stack[--sp];
+                    tos = (as_float(tos) == as_float(b))? TRUE : FALSE;
+                    break;
+                case I2F:
+                    tos = as_int((float) tos);
+                    break;
+                case F2I:
+                    tos = (int) as_float(tos);
+                    break;
+#ifdef cl_khr_fp64
+                // A double on top of the stack is the cached high word and the low word below it
+                case DADD:
+                    x = toDouble(stack[sp - 1], tos);
+                    y = toDouble(stack[sp - 3], stack[sp - 2]);
+                    sp -= 2;
+                    bits = as_int2(x + y);
+                    stack[sp - 1] = bits.x;
+                    tos = bits.y;
+                    break;
+                case DSUB:
+                    x = toDouble(stack[sp - 1], tos);
+                    y = toDouble(stack[sp - 3], stack[sp - 2]);
+                    sp -= 2;
+                    bits = as_int2(x - y);
+                    stack[sp - 1] = bits.x;
+                    tos = bits.y;
+                    break;
+                case DMUL:
+                    x = toDouble(stack[sp - 1], tos);
+                    y = toDouble(stack[sp - 3], stack[sp - 2]);
+                    sp -= 2;
+                    bits = as_int2(x * y);
+                    stack[sp - 1] = bits.x;
+                    tos = bits.y;
+                    break;
+                case DDIV:
+                    x = toDouble(stack[sp - 1], tos);
+                    y = toDouble(stack[sp - 3], stack[sp - 2]);
+                    sp -= 2;
+                    bits = as_int2(x / y);
+                    stack[sp - 1] = bits.x;
+                    tos = bits.y;
+                    break;
+                case DFMA:
+                    x = toDouble(stack[sp - 1], tos);
+                    y = toDouble(stack[sp - 3], stack[sp - 2]);
+                    z = toDouble(stack[sp - 5], stack[sp - 4]);
+                    sp -= 4;
+                    bits = as_int2(fma(x, y, z));
+                    stack[sp - 1] = bits.x;
+                    tos = bits.y;
+                    break;
+                case DLT:
+                    x = toDouble(stack[sp - 1], tos);
+                    y = toDouble(stack[sp - 3], stack[sp - 2]);
+                    sp -= 3;
+                    tos = (x < y)? TRUE : FALSE;
+                    break;
+                case DEQ:
+                    x = toDouble(stack[sp - 1], tos);
+                    y = toDouble(stack[sp - 3], stack[sp - 2]);
+                    sp -= 3;
+                    tos = (x == y)? TRUE : FALSE;
+                    break;
+                case I2D:
+                    bits = as_int2((double) tos);
+                    stack[sp++] = bits.x;
+                    tos = bits.y;
+                    break;
+                case D2I:
+                    x = toDouble(stack[sp - 1], tos);
+                    sp--;
+                    tos = (int) x;
+                    break;
+                case F2D:
+                    bits = as_int2((double) as_float(tos));
+                    stack[sp++] = bits.x;
+                    tos = bits.y;
+                    break;
+                case D2F:
+                    x = toDouble(stack[sp - 1], tos);
+                    sp--;
+                    tos = as_int((float) x);
+                    break;
+                case DLOAD_INDEXED:
+                    address = instruction.y + 2 * tos;
+                    stack[sp++] = heaps[address];
+                    tos = heaps[address + 1];
+                    break;
+                case DSTORE_INDEXED:
+                    address = instruction.y + 2 * stack[sp - 2];
+                    heaps[address] = stack[sp - 1];
+                    heaps[address + 1] = tos;
+                    sp -= 3;
+                    tos = stack[sp];
+                    break;
+                case PARALLEL_DLOAD_INDEXED:
+                    // Heaps of doubles are not tiled: element base + offset of heap h in global memory
+                    address = instruction.y * heapSize + 2 * (base + tos);
+                    stack[sp++] = heaps[address];
+                    tos = heaps[address + 1];
+                    break;
+                case PARALLEL_DSTORE_INDEXED:
+                    address = instruction.y * heapSize + 2 * (base + stack[sp - 2]);
+                    heaps[address] = stack[sp - 1];
+                    heaps[address + 1] = tos;
+                    sp -= 3;
+                    tos = stack[sp];
+                    break;
+#endif
+                case VLOAD4:
+                    // Four heap elements per vector. The last element is cached in tos
+                    v = vload4(0, &heaps[instruction.y + 4 * tos]);
+                    vstore4(v, 0, &stack[sp]);
+                    sp += 3;
+                    tos = v.w;
+                    break;
+                case VSTORE4:
+                    stack[sp] = tos;
+                    address = instruction.y + 4 * stack[sp - 4];
+                    vstore4(vload4(0, &stack[sp - 3]), 0, &heaps[address]);
+                    sp -= 5;
+                    tos = stack[sp];
+                    break;
+                case VADD4:
+                    stack[sp] = tos;
+                    v = vload4(0, &stack[sp - 3]) + vload4(0, &stack[sp - 7]);
+                    sp -= 4;
+                    vstore4(v, 0, &stack[sp - 3]);
+                    tos = v.w;
+                    break;
+                case VMUL4:
+                    stack[sp] = tos;
+                    v = vload4(0, &stack[sp - 3]) * vload4(0, &stack[sp - 7]);
+                    sp -= 4;
+                    vstore4(v, 0, &stack[sp - 3]);
+                    tos = v.w;
+                    break;
+                case VSUM4:
+                    stack[sp] = tos;
+                    v = vload4(0, &stack[sp - 3]);
+                    sp -= 3;
+                    tos = v.x + v.y + v.z + v.w;
+                    break;
+                case VFADD4:
+                    stack[sp] = tos;
+                    v = as_int4(as_float4(vload4(0, &stack[sp - 3])) + as_float4(vload4(0, &stack[sp - 7])));
+                    sp -= 4;
+                    vstore4(v, 0, &stack[sp - 3]);
+                    tos = v.w;
+                    break;
+                case VFMUL4:
+                    stack[sp] = tos;
+                    v = as_int4(as_float4(vload4(0, &stack[sp - 3])) * as_float4(vload4(0, &stack[sp - 7])));
+                    sp -= 4;
+                    vstore4(v, 0, &stack[sp - 3]);
+                    tos = v.w;
+                    break;
+                case VFSUM4:
+                    stack[sp] = tos;
+                    vf = as_float4(vload4(0, &stack[sp - 3]));
+                    sp -= 3;
+                    tos = as_int(vf.x + vf.y + vf.z + vf.w);
+                    break;
+                case PARALLEL_VLOAD4:
+                    // Heaps of vectors are not tiled: vector base + offset of heap h in global memory
+                    v = vload4(base + tos, &heaps[instruction.y * heapSize]);
+                    vstore4(v, 0, &stack[sp]);
+                    sp += 3;
+                    tos = v.w;
+                    break;
+                case PARALLEL_VSTORE4:
+                    stack[sp] = tos;
+                    vstore4(vload4(0, &stack[sp - 3]), base + stack[sp - 4], &heaps[instruction.y * heapSize]);
+                    sp -= 5;
+                    tos = stack[sp];
+                    break;
+                case REDUCE_ADD:
+                case REDUCE_MIN:
+                case REDUCE_MAX:
+                    // The work-item 0 combines the result of the tile with the partial result of the group (the
+                    // identity before the first tile), that the host combines after the run
+                    tos = reduceWorkGroup(opcode, tos, scratch);
+                    if (lid == 0) {
+                        address = instruction.y * get_num_groups(0) + get_group_id(0);
+                        partials[address] = combineReduction(opcode, partials[address], tos);
+                    }
+                    break;
+                case SCAN_ADD:
+                    tos = scanWorkGroup(tos, scratch);
+                    break;
+                case ATOMIC_ADD:
+                case ATOMIC_MIN:
+                case ATOMIC_MAX:
+                    // The index (below the value) is an element of the whole heap, not of the tile
+                    address = stack[--sp];
+#ifdef LOCAL_ATOMICS_SIZE
+                    if (instruction.y == LOCAL_ATOMICS_HEAP && address >= 0 && address < LOCAL_ATOMICS_SIZE) {
+                        tos = atomicLocal(opcode, &localAtomics[address], tos);
                         break;
-                }
-                stack[++sp] = value;
-                break;
-            case GSTORE_INDEXED:
-                value = stack[sp--];
-                offset = stack[sp--];
-                address = code[ip++];
-                data1[(address + offset)] = value;
+                    }
+#endif
+                    tos = atomicGlobal(opcode, &heaps[instruction.y * heapSize + address], tos);
+                    break;
+                case ATOMIC_CAS:
+                    b = stack[--sp];
+                    address = stack[--sp];
+                    tos = atomic_cmpxchg(&heaps[instruction.y * heapSize + address], b, tos);
+                    break;
+                case BARRIER:
+                    barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+                    break;
+#ifdef SCRATCHPAD_SIZE
+                case LLOAD:
+                    tos = scratchpad[instruction.y + tos];
+                    break;
+                case LSTORE:
+                    offset = stack[sp - 1];
+                    scratchpad[instruction.y + offset] = tos;
+                    sp -= 2;
+                    tos = stack[sp];
+                    break;
+                case LLOAD_TILE:
+                    // Stack: heap index relative to the work-group, scratchpad offset, count on top
+                    a = stack[sp - 2];
+                    b = stack[sp - 1];
+                    loadTile(&heaps[instruction.y * heapSize], heapSize, base + a, &scratchpad[b], tos);
+                    sp -= 3;
+                    tos = stack[sp];
+                    break;
+#endif
+                case HALT:
+                    doHalt = true;
+                    break;
+                default:
+                    doHalt = true;
+                    break;
+            }
+            if (doHalt) {
                 break;
-            case PARALLEL_GSTORE_INDEXED:
-                value = stack[sp--];
-                offset = stack[sp--];
-                heapNumber = code[ip++];
-                switch (heapNumber) {
-                    case 0:
-                        localHeap1[offset] = value;
-                        break;
-                    case 1:
-                        localHeap2[offset] = value;
-                        break;
-                    case 2:
-                        localHeap3[offset] = value;
-                        break;
+            }
+        }
+        stack[sp] = tos;
+
+        // Copy to global memory, once all the work-items of the group have written their tiles. The tile is
+        // kept until all of them have copied it, before the next tile is loaded.
+        barrier(CLK_LOCAL_MEM_FENCE);
+        for (int h = 0; h < NUM_HEAPS; h++) {
+            if (HEAP_WRITE_MASK & (1 << h)) {
+                for (int i = lid; i < TILE_SIZE && base + i < heapSize; i += WORK_GROUP_SIZE) {
+                    heaps[h * heapSize + base + i] = localHeaps[h * TILE_SIZE + i];
                 }
-                break;
-            case PRINT:
-                value = stack[sp--];
-                break;
-            case CALL:
-                address = code[ip++];
-                numArgs = code[ip++];  // num arguments
-                stack[++sp] = numArgs;
-                stack[++sp] = fp;
-                stack[++sp] = ip;
-                fp = sp;
-                ip = address;
-                break;
-            case RET:
-                value = stack[sp--];
-                sp = fp;
-                ip = stack[sp--];
-                fp = stack[sp--];
-                numArgs = stack[sp--];
-                sp -= numArgs;
-                stack[++sp] = value;  // return value on top of the stack
-                break;
-            case THREAD_ID:
-                value = get_local_id(0);
-                stack[++sp] = value;
-                break;
-            case POP:
-                sp--;
-                break;
-            case HALT:
-                doHalt = true;
-                break;
-            default:
-                doHalt = true;
-                break;
+            }
         }
-        if (doHalt) {
-            break;
+#ifdef DYNAMIC_TILES
+        // The first tile of every group is its group id, the counter hands out the next ones
+        if (lid == 0) {
+            nextTile = get_num_groups(0) + atomic_inc(tileCounter);
         }
+        barrier(CLK_LOCAL_MEM_FENCE);
+        tile = nextTile;
+#else
+        barrier(CLK_LOCAL_MEM_FENCE);
+        tile += get_num_groups(0);
+#endif
     }
 
-    // Copy to global memory
-    data1[idx] = localHeap1[lid];
-    data2[idx] = localHeap2[lid];
-    data3[idx] = localHeap3[lid];
-}   
\ No newline at end of file
+#ifdef LOCAL_ATOMICS_SIZE
+    for (int i = lid; i < LOCAL_ATOMICS_SIZE && i < heapSize; i += WORK_GROUP_SIZE) {
+        if (localAtomics[i] != LOCAL_ATOMICS_IDENTITY) {
+            atomicGlobal(LOCAL_ATOMICS_OPCODE, &heaps[LOCAL_ATOMICS_HEAP * heapSize + i], localAtomics[i]);
+        }
+    }
+#endif
+}
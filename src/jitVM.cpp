@@ -0,0 +1,557 @@
+/*
+ * Copyright (c) 2020-2021, APT Group, Department of Computer Science,
+ * The University of Manchester.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <string.h>
+#include <stdint.h>
+#include "jitVM.hpp"
+#include "floatingPoint.hpp"
+#include "shortVector.hpp"
+#include "reduction.hpp"
+#include "scratchpad.hpp"
+
+#ifdef VM_JIT_X86_64
+    #include <sys/mman.h>
+    #include <unistd.h>
+#endif
+
+using namespace std;
+
+JITVM::JITVM(vector<int> code, int mainByteCodeIndex) : VM(code, mainByteCodeIndex) {
+}
+
+JITVM::~JITVM() {
+    releaseCode();
+}
+
+#ifdef VM_JIT_X86_64
+
+// Helpers called from the compiled code (System V calling convention)
+static void jitPrint(int value) {
+    std::cout << "[VM] " << value << std::endl;
+}
+
+static void jitStackOverflow() {
+    cout << "[VM] Stack overflow" << endl;
+}
+
+// x86-64 registers
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RSP 4
+#define RBP 5
+#define RSI 6
+#define RDI 7
+#define R12 12
+#define R13 13
+#define R14 14
+#define R15 15
+#define NO_INDEX -1
+
+/*
+ * Register assignment of the compiled code. All of them are callee-saved, so calls to the helpers keep them.
+ *   rbx: stack base (stack[-1] is the guard slot of the top-of-stack cache)
+ *   r12: heap base
+ *   r13: sp (element index, 64 bits)
+ *   r14: fp (element index, 64 bits)
+ *   r15d: top of the stack. stack[sp] in memory is stale while it is cached.
+ *   rbp: JITState
+ */
+#define STACK_BASE RBX
+#define HEAP_BASE R12
+#define SP R13
+#define FP R14
+#define TOS R15
+#define STATE RBP
+
+// Minimal x86-64 encoder for the instruction forms used by the templates
+class Assembler {
+
+    public:
+        vector<unsigned char> code;
+
+        int position() {
+            return code.size();
+        }
+
+        void byte(int value) {
+            code.push_back((unsigned char) value);
+        }
+
+        void dword(int value) {
+            for (int i = 0; i < 4; i++) {
+                byte((value >> (8 * i)) & 0xFF);
+            }
+        }
+
+        void qword(uint64_t value) {
+            for (int i = 0; i < 8; i++) {
+                byte((value >> (8 * i)) & 0xFF);
+            }
+        }
+
+        void patchDword(int at, int value) {
+            for (int i = 0; i < 4; i++) {
+                code[at + i] = (value >> (8 * i)) & 0xFF;
+            }
+        }
+
+        // op reg, [base + index * (1 << scale) + disp]. Always encoded with a SIB byte and a 32-bit displacement.
+        void memory(vector<int> opcode, bool wide, int reg, int base, int index, int scale, int disp) {
+            int indexReg = (index == NO_INDEX) ? RSP : index;
+            rex(wide, reg, (index == NO_INDEX) ? 0 : index, base);
+            for (int b : opcode) {
+                byte(b);
+            }
+            byte(0x80 | ((reg & 7) << 3) | 4);
+            byte((scale << 6) | ((indexReg & 7) << 3) | (base & 7));
+            dword(disp);
+        }
+
+        // op rm, reg (register direct)
+        void registers(vector<int> opcode, bool wide, int reg, int rm) {
+            rex(wide, reg, 0, rm);
+            for (int b : opcode) {
+                byte(b);
+            }
+            byte(0xC0 | ((reg & 7) << 3) | (rm & 7));
+        }
+
+        void movImmediate(int reg, int value) {
+            rex(false, 0, 0, reg);
+            byte(0xB8 + (reg & 7));
+            dword(value);
+        }
+
+        void movImmediate64(int reg, uint64_t value) {
+            rex(true, 0, 0, reg);
+            byte(0xB8 + (reg & 7));
+            qword(value);
+        }
+
+        void push(int reg) {
+            rex(false, 0, 0, reg);
+            byte(0x50 + (reg & 7));
+        }
+
+        void pop(int reg) {
+            rex(false, 0, 0, reg);
+            byte(0x58 + (reg & 7));
+        }
+
+        // Branches with a 32-bit displacement. Return the position of the displacement, patched later.
+        int jump() {
+            byte(0xE9);
+            dword(0);
+            return position() - 4;
+        }
+
+        int jumpIf(int condition) {
+            byte(0x0F);
+            byte(0x80 + condition);
+            dword(0);
+            return position() - 4;
+        }
+
+    private:
+        void rex(bool wide, int reg, int index, int base) {
+            int prefix = 0x40 | (wide << 3) | (((reg >> 3) & 1) << 2) | (((index >> 3) & 1) << 1) | ((base >> 3) & 1);
+            if (prefix != 0x40) {
+                byte(prefix);
+            }
+        }
+};
+
+// Condition codes
+#define CC_EQUAL 0x4
+#define CC_GREATER_EQUAL 0xD
+
+// Frequent forms of the templates
+#define STACK_SLOT(k)   STACK_BASE, SP, 2, 4 * (k)     // stack[sp + k]
+#define FRAME_SLOT(k)   STACK_BASE, FP, 2, 4 * (k)     // stack[fp + k]
+#define HEAP(address)   HEAP_BASE, NO_INDEX, 0, 4 * (address)
+#define HEAP_INDEXED(address) HEAP_BASE, RAX, 2, 4 * (address)
+
+struct BranchFixup {
+    int position;
+    int target;
+};
+
+static void incrementSP(Assembler &as, int value) {
+    as.registers({ 0x83 }, true, 0, SP);
+    as.byte(value);
+}
+
+static void decrementSP(Assembler &as, int value) {
+    as.registers({ 0x83 }, true, 5, SP);
+    as.byte(value);
+}
+
+// stack[sp++] = tos
+static void spillTOS(Assembler &as) {
+    as.memory({ 0x89 }, false, TOS, STACK_SLOT(0));
+    incrementSP(as, 1);
+}
+
+// tos = stack[--sp]
+static void popTOS(Assembler &as) {
+    decrementSP(as, 1);
+    as.memory({ 0x8B }, false, TOS, STACK_SLOT(0));
+}
+
+// tos = tos <op> stack[--sp]
+static void binaryOperation(Assembler &as, vector<int> opcode) {
+    decrementSP(as, 1);
+    as.memory(opcode, false, TOS, STACK_SLOT(0));
+}
+
+// tos = (tos <condition> stack[--sp]) ? TRUE : FALSE
+static void compareOperation(Assembler &as, int setcc) {
+    decrementSP(as, 1);
+    as.memory({ 0x3B }, false, TOS, STACK_SLOT(0));
+    as.registers({ 0x0F, setcc }, false, 0, RAX);
+    as.registers({ 0x0F, 0xB6 }, false, TOS, RAX);
+}
+
+// Fall back to the interpreter for the bytecodes that the CPU VM does not implement, for floating point and vectors,
+// and for the work-group collectives and the scratchpad
+static bool isCompilable(int opcode) {
+    switch (opcode) {
+        case INVALID_OPCODE:
+        case THREAD_ID:
+        case PARALLEL_GLOAD_INDEXED:
+        case PARALLEL_GSTORE_INDEXED:
+        case THREAD_ID_PARALLEL_GLOAD_INDEXED:
+        case ATOMIC_ADD:
+        case ATOMIC_MIN:
+        case ATOMIC_MAX:
+        case ATOMIC_CAS:
+            return false;
+        default:
+            return opcode > 0 && opcode < TOTAL_INSTRUCTIONS && !isFloatingPointOpcode(opcode) && !isVectorOpcode(opcode)
+                && !isCollectiveOpcode(opcode) && !isScratchpadOpcode(opcode);
+    }
+}
+
+bool JITVM::compile() {
+    releaseCode();
+    compiledProgram = decodedCode;
+    if (!vmAllocated) {
+        return false;
+    }
+    for (auto &instruction : decodedCode) {
+        if (!isCompilable(instruction.opcode)) {
+            return false;
+        }
+    }
+
+    Assembler as;
+    vector<int> offsets(decodedSize);
+    vector<BranchFixup> fixups;
+    vector<int> haltJumps;
+    vector<int> overflowJumps;
+    vector<int> tablePatches;
+
+    // Prologue: save the callee-saved registers (six pushes and 8 bytes keep rsp 16-byte aligned for the helpers)
+    as.push(RBX);
+    as.push(RBP);
+    as.push(R12);
+    as.push(R13);
+    as.push(R14);
+    as.push(R15);
+    as.registers({ 0x83 }, true, 5, RSP);
+    as.byte(8);
+    as.registers({ 0x89 }, true, RDI, STATE);                                   // rbp = state
+    as.memory({ 0x8B }, true, STACK_BASE, STATE, NO_INDEX, 0, 0);               // rbx = state->stack
+    as.memory({ 0x8B }, true, HEAP_BASE, STATE, NO_INDEX, 0, 8);                // r12 = state->data
+    as.memory({ 0x63 }, true, SP, STATE, NO_INDEX, 0, 16);                      // r13 = state->sp
+    as.memory({ 0x63 }, true, FP, STATE, NO_INDEX, 0, 20);                      // r14 = state->fp
+    as.memory({ 0x8B }, false, TOS, STACK_SLOT(0));                             // tos = stack[sp]
+    as.memory({ 0x63 }, true, RAX, STATE, NO_INDEX, 0, 24);                     // rax = state->ip
+    // Enter through the address table, like RET
+    as.movImmediate64(RCX, 0);
+    tablePatches.push_back(as.position() - 8);
+    as.memory({ 0xFF }, false, 4, RCX, RAX, 3, 0);                             // jmp [rcx + rax * 8]
+
+    for (int ip = 0; ip < decodedSize; ip++) {
+        DecodedInstruction &instruction = decodedCode[ip];
+        int operand = instruction.operand;
+        offsets[ip] = as.position();
+
+        switch (instruction.opcode) {
+            case DUP:
+                spillTOS(as);
+                break;
+            case IADD:
+                binaryOperation(as, { 0x03 });
+                break;
+            case ISUB:
+                binaryOperation(as, { 0x2B });
+                break;
+            case IMUL:
+                binaryOperation(as, { 0x0F, 0xAF });
+                break;
+            case IDIV:
+                // tos = tos / stack[--sp]
+                decrementSP(as, 1);
+                as.registers({ 0x89 }, false, TOS, RAX);
+                as.byte(0x99);                                                  // cdq
+                as.memory({ 0xF7 }, false, 7, STACK_SLOT(0));                   // idiv
+                as.registers({ 0x89 }, false, RAX, TOS);
+                break;
+            case LSHIFT:
+                as.registers({ 0xD1 }, false, 4, TOS);
+                break;
+            case RSHIFT:
+                as.registers({ 0xD1 }, false, 7, TOS);
+                break;
+            case ILT:
+                compareOperation(as, 0x9C);
+                break;
+            case IEQ:
+                compareOperation(as, 0x94);
+                break;
+            case BR:
+                fixups.push_back({ as.jump(), instruction.target });
+                break;
+            case BRT:
+            case BRF:
+                as.registers({ 0x89 }, false, TOS, RAX);
+                popTOS(as);
+                as.registers({ 0x81 }, false, 7, RAX);
+                as.dword(instruction.opcode == BRT ? TRUE : FALSE);
+                fixups.push_back({ as.jumpIf(CC_EQUAL), instruction.target });
+                break;
+            case ICONST:
+            case ICONST1:
+                spillTOS(as);
+                as.movImmediate(TOS, instruction.opcode == ICONST ? operand : 1);
+                break;
+            case LOAD:
+                // Spill first: the frame slot can be the cached top
+                spillTOS(as);
+                as.memory({ 0x8B }, false, TOS, FRAME_SLOT(operand));
+                break;
+            case GLOAD:
+                spillTOS(as);
+                as.memory({ 0x8B }, false, TOS, HEAP(operand));
+                break;
+            case STORE:
+                // Reload after the store: the frame slot can be the new top
+                decrementSP(as, 1);
+                as.memory({ 0x89 }, false, TOS, FRAME_SLOT(operand));
+                as.memory({ 0x8B }, false, TOS, STACK_SLOT(0));
+                break;
+            case GSTORE:
+                as.memory({ 0x89 }, false, TOS, HEAP(operand));
+                popTOS(as);
+                break;
+            case GLOAD_INDEXED:
+                as.registers({ 0x63 }, true, RAX, TOS);                         // movsxd rax, tos
+                as.memory({ 0x8B }, false, TOS, HEAP_INDEXED(operand));
+                break;
+            case GSTORE_INDEXED:
+                as.memory({ 0x63 }, true, RAX, STACK_SLOT(-1));                 // offset = stack[sp - 1]
+                as.memory({ 0x89 }, false, TOS, HEAP_INDEXED(operand));
+                decrementSP(as, 2);
+                as.memory({ 0x8B }, false, TOS, STACK_SLOT(0));
+                break;
+            case PRINT:
+                as.registers({ 0x89 }, false, TOS, RDI);
+                as.movImmediate64(RAX, (uint64_t) &jitPrint);
+                as.registers({ 0xFF }, false, 2, RAX);                          // call rax
+                popTOS(as);
+                break;
+            case POP:
+                popTOS(as);
+                break;
+            case CALL:
+                as.movImmediate(RAX, ip + 1);
+                if (checkStackBounds) {
+                    // The callee frame must fit in the stack: sp + 3 + frameDepth < stackSize
+                    as.memory({ 0x8D }, true, RCX, SP, NO_INDEX, 0, 3 + frameDepth);
+                    as.registers({ 0x81 }, true, 7, RCX);
+                    as.dword(stackSize);
+                    overflowJumps.push_back(as.jumpIf(CC_GREATER_EQUAL));
+                }
+                // The whole frame goes to memory, so RET and LOAD/STORE find it there
+                as.memory({ 0x89 }, false, TOS, STACK_SLOT(0));
+                as.memory({ 0xC7 }, false, 0, STACK_SLOT(1));
+                as.dword(operand);                                              // numArgs
+                as.memory({ 0x89 }, false, FP, STACK_SLOT(2));                  // fp
+                as.memory({ 0x89 }, false, RAX, STACK_SLOT(3));                 // return ip
+                incrementSP(as, 3);
+                as.registers({ 0x89 }, false, RAX, TOS);                        // tos = return ip
+                as.registers({ 0x89 }, true, SP, FP);                           // fp = sp
+                fixups.push_back({ as.jump(), instruction.target });
+                break;
+            case RET:
+                // The return value stays in tos
+                as.memory({ 0x63 }, true, RAX, FRAME_SLOT(0));                  // ip = stack[fp]
+                as.memory({ 0x63 }, true, RCX, FRAME_SLOT(-2));                 // numArgs = stack[fp - 2]
+                as.memory({ 0x8D }, true, SP, FP, NO_INDEX, 0, -2);             // sp = fp - 2 - numArgs
+                as.registers({ 0x29 }, true, RCX, SP);
+                as.memory({ 0x63 }, true, FP, FRAME_SLOT(-1));                  // fp = stack[fp - 1]
+                as.movImmediate64(RCX, 0);
+                tablePatches.push_back(as.position() - 8);
+                as.memory({ 0xFF }, false, 4, RCX, RAX, 3, 0);                 // jmp [rcx + rax * 8]
+                break;
+            case DUP_ICONST_IEQ_BRT:
+                as.registers({ 0x81 }, false, 7, TOS);
+                as.dword(operand);
+                fixups.push_back({ as.jumpIf(CC_EQUAL), instruction.target });
+                break;
+            case DUP_GLOAD_INDEXED:
+                spillTOS(as);
+                as.registers({ 0x63 }, true, RAX, TOS);
+                as.memory({ 0x8B }, false, TOS, HEAP_INDEXED(operand));
+                break;
+            case ICONST1_IADD:
+                as.registers({ 0x83 }, false, 0, TOS);
+                as.byte(1);
+                break;
+            case HALT:
+                as.movImmediate(RAX, ip + 1);
+                haltJumps.push_back(as.jump());
+                break;
+        }
+    }
+
+    // Stack overflow: report it and halt with the ip of the instruction after the CALL (in eax)
+    int overflowOffset = as.position();
+    as.memory({ 0x89 }, false, RAX, STATE, NO_INDEX, 0, 24);
+    as.movImmediate64(RAX, (uint64_t) &jitStackOverflow);
+    as.registers({ 0xFF }, false, 2, RAX);
+    int overflowToExit = as.jump();
+
+    // Halt: spill the top of the stack, write the state back and restore the registers
+    int haltOffset = as.position();
+    as.memory({ 0x89 }, false, RAX, STATE, NO_INDEX, 0, 24);                    // state->ip
+    int exitOffset = as.position();
+    as.memory({ 0x89 }, false, TOS, STACK_SLOT(0));                             // stack[sp] = tos
+    as.memory({ 0x89 }, false, SP, STATE, NO_INDEX, 0, 16);                     // state->sp
+    as.memory({ 0x89 }, false, FP, STATE, NO_INDEX, 0, 20);                     // state->fp
+    as.registers({ 0x83 }, true, 0, RSP);
+    as.byte(8);
+    as.pop(R15);
+    as.pop(R14);
+    as.pop(R13);
+    as.pop(R12);
+    as.pop(RBP);
+    as.pop(RBX);
+    as.byte(0xC3);                                                              // ret
+
+    // Resolve the branches
+    for (auto &fixup : fixups) {
+        as.patchDword(fixup.position, offsets[fixup.target] - (fixup.position + 4));
+    }
+    for (int position : haltJumps) {
+        as.patchDword(position, haltOffset - (position + 4));
+    }
+    for (int position : overflowJumps) {
+        as.patchDword(position, overflowOffset - (position + 4));
+    }
+    as.patchDword(overflowToExit, exitOffset - (overflowToExit + 4));
+
+    // Copy the code into executable memory. The pages are never writable and executable at the same time.
+    long pageSize = sysconf(_SC_PAGESIZE);
+    size_t size = ((as.code.size() + pageSize - 1) / pageSize) * pageSize;
+    void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        cout << "[JIT] mmap failed. Using the interpreter" << endl;
+        return false;
+    }
+    nativeAddresses.resize(decodedSize);
+    for (int ip = 0; ip < decodedSize; ip++) {
+        nativeAddresses[ip] = (unsigned char*) memory + offsets[ip];
+    }
+    for (int position : tablePatches) {
+        uint64_t table = (uint64_t) nativeAddresses.data();
+        for (int i = 0; i < 8; i++) {
+            as.code[position + i] = (table >> (8 * i)) & 0xFF;
+        }
+    }
+    memcpy(memory, as.code.data(), as.code.size());
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+        cout << "[JIT] mprotect failed. Using the interpreter" << endl;
+        munmap(memory, size);
+        return false;
+    }
+    nativeCode = memory;
+    nativeCodeSize = size;
+    compiled = true;
+    return true;
+}
+
+void JITVM::releaseCode() {
+    if (nativeCode != nullptr) {
+        munmap(nativeCode, nativeCodeSize);
+    }
+    nativeCode = nullptr;
+    nativeCodeSize = 0;
+    compiled = false;
+}
+
+void JITVM::runInterpreter() {
+    // Tracing and profiling are only implemented by the interpreter
+    if (trace || profile) {
+        VM::runInterpreter();
+        return;
+    }
+    // Compile on the first run, and again if the program was decoded again (e.g., setSuperinstructions)
+    if (!compiled || compiledProgram.size() != decodedCode.size()
+            || memcmp(compiledProgram.data(), decodedCode.data(), decodedCode.size() * sizeof(DecodedInstruction)) != 0) {
+        if (!compile()) {
+            VM::runInterpreter();
+            return;
+        }
+    }
+
+    // stack[-1] is the guard slot of the top-of-stack cache (AbstractVM::stackSlots)
+    JITState state;
+    state.stack = stack;
+    state.data = this->data.data();
+    state.sp = sp;
+    state.fp = fp;
+    state.ip = ip;
+
+    ((void (*)(JITState*)) nativeCode)(&state);
+
+    this->sp = state.sp;
+    this->fp = state.fp;
+    this->ip = state.ip;
+}
+
+#else
+
+bool JITVM::compile() {
+    return false;
+}
+
+void JITVM::releaseCode() {
+}
+
+void JITVM::runInterpreter() {
+    VM::runInterpreter();
+}
+
+#endif
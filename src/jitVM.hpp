@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2020-2021, APT Group, Department of Computer Science,
+ * The University of Manchester.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef JIT_VM_HPP
+#define JIT_VM_HPP
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include "instruction.hpp"
+#include "bytecodes.hpp"
+#include "vm.hpp"
+
+using namespace std;
+
+// The JIT emits x86-64 code and needs mmap/mprotect. Everywhere else JITVM runs the VM interpreter.
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+    #define VM_JIT_X86_64 1
+#endif
+
+/*
+ * VM state shared with the compiled code. The compiled function loads it on entry and writes sp, fp and
+ * ip back when the program halts.
+ */
+struct JITState {
+    int* stack;
+    int* data;
+    int sp;
+    int fp;
+    int ip;
+};
+
+/*
+ * Template JIT for x86-64. The decoded program is translated into native code, one template per bytecode, with
+ * sp, fp and the top of the stack in registers and every branch resolved at compile time. CALL pushes the same
+ * frame as the interpreters, and RET jumps through a table with the native address of every decoded instruction.
+ *
+ * Programs that use bytecodes the CPU VM does not implement (THREAD_ID, the parallel heap accesses and the atomics), programs
+ * with floating-point or vector bytecodes (the templates only use the integer registers), programs with work-group
+ * collectives (REDUCE_*, SCAN_ADD, BARRIER) or the scratchpad (LLOAD/LSTORE), and runs with trace or profiling enabled,
+ * fall back to the VM interpreter.
+ */
+class JITVM : public VM {
+
+    public:
+        JITVM(vector<int> code, int mainByteCodeIndex);
+
+        ~JITVM();
+
+        // Compile the decoded program. Returns false if the program has to run on the interpreter.
+        bool compile();
+
+        void runInterpreter();
+
+    private:
+        void releaseCode();
+
+        void* nativeCode = nullptr;
+        size_t nativeCodeSize = 0;
+        vector<void*> nativeAddresses;      // native address of every decoded instruction, used by RET
+        vector<DecodedInstruction> compiledProgram;
+        bool compiled = false;
+};
+
+#endif
@@ -0,0 +1,625 @@
+/*
+ * Copyright (c) 2020-2021, APT Group, Department of Computer Science,
+ * The University of Manchester.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "kernelGenerator.hpp"
+#include "floatingPoint.hpp"
+#include "reduction.hpp"
+#include "atomics.hpp"
+#include "scratchpad.hpp"
+
+using namespace std;
+
+// Name of the local variable that holds stack slot `index`
+static string slot(int index) {
+    return "s" + to_string(index);
+}
+
+static string label(int index) {
+    return "L" + to_string(index);
+}
+
+// PARALLEL_GLOAD_INDEXED/PARALLEL_GSTORE_INDEXED access the tile of the heap in local memory
+static string parallelHeapAccess(int heapNumber, string index) {
+    return "localHeaps[" + to_string(heapNumber) + " * TILE_SIZE + " + index + "]";
+}
+
+// GLOAD/GSTORE address heap 0 directly in global memory (the first heap of the packed heaps in the parallel layout)
+static string globalHeapAccess(KernelLayout layout, string index) {
+    if (layout == PARALLEL_LOOP_LAYOUT) {
+        return "heaps[" + index + "]";
+    }
+    return "data[" + index + "]";
+}
+
+// Double held in slots low and low + 1 (the low word first, as in the interpreter kernels)
+static string slotDouble(int low) {
+    return "toDouble(" + slot(low) + ", " + slot(low + 1) + ")";
+}
+
+// Store the double `value` in slots low and low + 1
+static string storeSlotDouble(int low, string value) {
+    return "{ int2 bits = as_int2(" + value + "); " + slot(low) + " = bits.x; " + slot(low + 1) + " = bits.y; }";
+}
+
+// Vector held in slots first to first + 3 (the first element deepest, as in the interpreter kernels)
+static string slotVector(int first) {
+    return "(int4)(" + slot(first) + ", " + slot(first + 1) + ", " + slot(first + 2) + ", " + slot(first + 3) + ")";
+}
+
+// Store the vector `value` in slots first to first + 3
+static string storeSlotVector(int first, string value) {
+    return "{ int4 v = " + value + "; " + slot(first) + " = v.x; " + slot(first + 1) + " = v.y; " + slot(first + 2) + " = v.z; "
+        + slot(first + 3) + " = v.w; }";
+}
+
+// Kernel signature and prologue, copied from the interpreter kernel of each layout
+static string kernelHeader(KernelLayout layout) {
+    string header;
+    switch (layout) {
+        case GLOBAL_STACK_LAYOUT:
+            header += "__attribute__((num_compute_units(1)))\n";
+            header += "__attribute((reqd_work_group_size(1,1,1)))\n";
+            header += "__kernel void interpreter(__global int4* code, __global int* stack, __global int* data, __global char* buffer,\n";
+            header += "                          const int codeSize, int ip, int fp, int sp, int trace,\n";
+            header += "                          __global int* state, const int sliceLength) {\n";
+            header += "    int bufferIndex = 0;\n";
+            break;
+        case PRIVATE_STACK_LAYOUT:
+            header += "__attribute__((num_compute_units(1)))\n";
+            header += "__attribute((reqd_work_group_size(1,1,1)))\n";
+            header += "__kernel void interpreter(__constant int4* code, __global int* data, __global char* buffer,\n";
+            header += "                          const int codeSize, int ip, int fp, int sp, int trace,\n";
+            header += "                          __global int* state, const int sliceLength) {\n";
+            header += "    int bufferIndex = 0;\n";
+            break;
+        case PARALLEL_LOOP_LAYOUT:
+            // NUM_HEAPS, WORK_GROUP_SIZE, TILE_SIZE and the heap masks are set by the build options of the VM
+            header += "__attribute__((reqd_work_group_size(WORK_GROUP_SIZE,1,1)))\n";
+            header += "__kernel void interpreter(__constant int4* code, __global int* heaps, const int heapSize,\n";
+            header += "                          __global char* buffer, const int codeSize, int ip, int fp, int sp, int trace,\n";
+            header += "                          __global int* partials, const int numTiles, __global int* tileCounter) {\n";
+            header += "    int lid = get_local_id(0);\n";
+            header += "    __local int localHeaps[NUM_HEAPS * TILE_SIZE];\n";
+            header += "    __local int scratch[WORK_GROUP_SIZE];\n";
+            header += "#ifdef SCRATCHPAD_SIZE\n";
+            header += "    __local int scratchpad[SCRATCHPAD_SIZE];\n";
+            header += "#endif\n";
+            header += "#ifdef LOCAL_ATOMICS_SIZE\n";
+            header += "    __local int localAtomics[LOCAL_ATOMICS_SIZE];\n";
+            header += "    for (int i = lid; i < LOCAL_ATOMICS_SIZE; i += WORK_GROUP_SIZE) {\n";
+            header += "        localAtomics[i] = LOCAL_ATOMICS_IDENTITY;\n";
+            header += "    }\n";
+            header += "#endif\n";
+            // Grid-stride loop over the tiles, closed by the epilogue
+            header += "#ifdef DYNAMIC_TILES\n";
+            header += "    __local int nextTile;\n";
+            header += "#endif\n";
+            header += "    int tile = get_group_id(0);\n";
+            header += "    while (tile < numTiles) {\n";
+            header += "    int base = tile * TILE_SIZE;\n";
+            header += "    for (int h = 0; h < NUM_HEAPS; h++) {\n";
+            header += "        if (HEAP_READ_MASK & (1 << h)) {\n";
+            header += "            for (int i = lid; i < TILE_SIZE && base + i < heapSize; i += WORK_GROUP_SIZE) {\n";
+            header += "                localHeaps[h * TILE_SIZE + i] = heaps[h * heapSize + base + i];\n";
+            header += "            }\n";
+            header += "        }\n";
+            header += "    }\n";
+            header += "    barrier(CLK_LOCAL_MEM_FENCE);\n";
+            break;
+        default:
+            break;
+    }
+    return header;
+}
+
+static string kernelEpilogue(KernelLayout layout) {
+    string epilogue = "halt:\n";
+    if (layout == PARALLEL_LOOP_LAYOUT) {
+        epilogue += "    barrier(CLK_LOCAL_MEM_FENCE);\n";
+        epilogue += "    for (int h = 0; h < NUM_HEAPS; h++) {\n";
+        epilogue += "        if (HEAP_WRITE_MASK & (1 << h)) {\n";
+        epilogue += "            for (int i = lid; i < TILE_SIZE && base + i < heapSize; i += WORK_GROUP_SIZE) {\n";
+        epilogue += "                heaps[h * heapSize + base + i] = localHeaps[h * TILE_SIZE + i];\n";
+        epilogue += "            }\n";
+        epilogue += "        }\n";
+        epilogue += "    }\n";
+        epilogue += "#ifdef DYNAMIC_TILES\n";
+        epilogue += "    if (lid == 0) nextTile = get_num_groups(0) + atomic_inc(tileCounter);\n";
+        epilogue += "    barrier(CLK_LOCAL_MEM_FENCE);\n";
+        epilogue += "    tile = nextTile;\n";
+        epilogue += "#else\n";
+        epilogue += "    barrier(CLK_LOCAL_MEM_FENCE);\n";
+        epilogue += "    tile += get_num_groups(0);\n";
+        epilogue += "#endif\n";
+        epilogue += "    }\n";
+        epilogue += "#ifdef LOCAL_ATOMICS_SIZE\n";
+        epilogue += "    for (int i = lid; i < LOCAL_ATOMICS_SIZE && i < heapSize; i += WORK_GROUP_SIZE) {\n";
+        epilogue += "        if (localAtomics[i] != LOCAL_ATOMICS_IDENTITY) {\n";
+        epilogue += "            atomicGlobal(LOCAL_ATOMICS_OPCODE, &heaps[LOCAL_ATOMICS_HEAP * heapSize + i], localAtomics[i]);\n";
+        epilogue += "        }\n";
+        epilogue += "    }\n";
+        epilogue += "#endif\n";
+    } else {
+        // The specialized kernel runs the whole program in one launch: it only reports that the program
+        // has halted (state[STATE_STATUS] = SLICE_HALTED in interpreter.cl)
+        epilogue += "    state[3] = 2;\n";
+    }
+    epilogue += "}\n";
+    return epilogue;
+}
+
+// Double precision bytecodes: the host checks for cl_khr_fp64 before it builds the kernel
+static string doubleHelper() {
+    return
+        "#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n\n"
+        "double toDouble(int low, int high) {\n"
+        "    return as_double((int2)(low, high));\n"
+        "}\n\n";
+}
+
+// Work-group collectives, as in interpreterParallelLoop.cl
+static string collectiveHelper() {
+    return
+        "int combineReduction(int opcode, int a, int b) {\n"
+        "    switch (opcode) {\n"
+        "        case " + to_string(REDUCE_MIN) + ": return min(a, b);\n"
+        "        case " + to_string(REDUCE_MAX) + ": return max(a, b);\n"
+        "        default: return a + b;\n"
+        "    }\n"
+        "}\n\n"
+        "int reduceWorkGroup(int opcode, int value, __local int* scratch) {\n"
+        "    int lid = get_local_id(0);\n"
+        "    scratch[lid] = value;\n"
+        "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+        "    int stride = 1;\n"
+        "    while (stride * 2 < WORK_GROUP_SIZE) {\n"
+        "        stride *= 2;\n"
+        "    }\n"
+        "    for (; stride > 0; stride >>= 1) {\n"
+        "        if (lid < stride && lid + stride < WORK_GROUP_SIZE) {\n"
+        "            scratch[lid] = combineReduction(opcode, scratch[lid], scratch[lid + stride]);\n"
+        "        }\n"
+        "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+        "    }\n"
+        "    int result = scratch[0];\n"
+        "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+        "    return result;\n"
+        "}\n\n"
+        "int scanWorkGroup(int value, __local int* scratch) {\n"
+        "    int lid = get_local_id(0);\n"
+        "    scratch[lid] = value;\n"
+        "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+        "    for (int offset = 1; offset < WORK_GROUP_SIZE; offset <<= 1) {\n"
+        "        int other = (lid >= offset) ? scratch[lid - offset] : 0;\n"
+        "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+        "        scratch[lid] += other;\n"
+        "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+        "    }\n"
+        "    int result = scratch[lid] - value;\n"
+        "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+        "    return result;\n"
+        "}\n\n";
+}
+
+// Atomic updates of the heaps, and the work-group copy of LOCAL_ATOMICS_SIZE elements, as in interpreterParallelLoop.cl
+static string atomicHelper() {
+    string helper;
+    for (string space : { "__global", "__local" }) {
+        string name = (space == "__global") ? "atomicGlobal" : "atomicLocal";
+        helper +=
+            "int " + name + "(int opcode, volatile " + space + " int* address, int value) {\n"
+            "    switch (opcode) {\n"
+            "        case " + to_string(ATOMIC_MIN) + ": return atomic_min(address, value);\n"
+            "        case " + to_string(ATOMIC_MAX) + ": return atomic_max(address, value);\n"
+            "        default: return atomic_add(address, value);\n"
+            "    }\n"
+            "}\n\n";
+    }
+    helper +=
+        "#if LOCAL_ATOMICS_OPCODE == " + to_string(ATOMIC_MIN) + "\n"
+        "#define LOCAL_ATOMICS_IDENTITY INT_MAX\n"
+        "#elif LOCAL_ATOMICS_OPCODE == " + to_string(ATOMIC_MAX) + "\n"
+        "#define LOCAL_ATOMICS_IDENTITY INT_MIN\n"
+        "#else\n"
+        "#define LOCAL_ATOMICS_IDENTITY 0\n"
+        "#endif\n\n";
+    return helper;
+}
+
+// Same output format as PRINT in the sequential interpreter kernels: "[VM] = value\n"
+static string printHelper() {
+    return
+        "int printValue(int number, __global char* buffer, int bufferIndex) {\n"
+        "    char valueString[] = {'[', 'V', 'M', ']', ' ', '=', ' '};\n"
+        "    for (int i = 0; i < 7; i++) {\n"
+        "        buffer[bufferIndex++] = valueString[i];\n"
+        "    }\n"
+        "    int digits[10];\n"
+        "    int counter = 0;\n"
+        "    while (number > 0) {\n"
+        "        digits[counter++] = number % 10;\n"
+        "        number = number / 10;\n"
+        "    }\n"
+        "    for (int i = counter - 1; i >= 0; i--) {\n"
+        "        buffer[bufferIndex++] = '0' + digits[i];\n"
+        "    }\n"
+        "    buffer[bufferIndex++] = '\\n';\n"
+        "    return bufferIndex;\n"
+        "}\n\n";
+}
+
+// LLOAD_TILE copies a tile of a heap to the scratchpad with all the work-items of the group, as in interpreterParallelLoop.cl
+static string scratchpadHelper() {
+    return
+        "void loadTile(__global int* heap, int heapSize, int first, __local int* scratchpad, int count) {\n"
+        "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+        "    for (int i = get_local_id(0); i < count; i += WORK_GROUP_SIZE) {\n"
+        "        int element = first + i;\n"
+        "        scratchpad[i] = (element >= 0 && element < heapSize) ? heap[element] : 0;\n"
+        "    }\n"
+        "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+        "}\n\n";
+}
+
+// Translate one instruction. `depth` is the stack depth before it runs, so the top of the stack is slot depth - 1.
+static bool generateInstruction(DecodedInstruction &instruction, int depth, KernelLayout layout, string &out) {
+    string top = (depth > 0) ? slot(depth - 1) : "";
+    string second = (depth > 1) ? slot(depth - 2) : "";
+    string third = (depth > 2) ? slot(depth - 3) : "";
+    string push = slot(depth);
+    bool parallel = layout == PARALLEL_LOOP_LAYOUT;
+    string operand = to_string(instruction.operand);
+
+    switch (instruction.opcode) {
+        case IADD:
+            out += second + " = " + top + " + " + second + ";";
+            break;
+        case ISUB:
+            out += second + " = " + top + " - " + second + ";";
+            break;
+        case IMUL:
+            out += second + " = " + top + " * " + second + ";";
+            break;
+        case IDIV:
+            out += second + " = " + top + " / " + second + ";";
+            break;
+        case ILT:
+            out += second + " = (" + top + " < " + second + ") ? 1 : 0;";
+            break;
+        case IEQ:
+            out += second + " = (" + top + " == " + second + ") ? 1 : 0;";
+            break;
+        case LSHIFT:
+            out += top + " = " + top + " << 1;";
+            break;
+        case RSHIFT:
+            out += top + " = " + top + " >> 1;";
+            break;
+        case BR:
+            out += "goto " + label(instruction.target) + ";";
+            break;
+        case BRT:
+            out += "if (" + top + " == 1) goto " + label(instruction.target) + ";";
+            break;
+        case BRF:
+            out += "if (" + top + " == 0) goto " + label(instruction.target) + ";";
+            break;
+        case ICONST:
+            out += push + " = " + operand + ";";
+            break;
+        case ICONST1:
+            out += push + " = 1;";
+            break;
+        case DUP:
+            out += push + " = " + top + ";";
+            break;
+        case LOAD:
+            // The verifier only accepts frame slots that are on the stack
+            out += push + " = " + slot(instruction.operand) + ";";
+            break;
+        case STORE:
+            out += slot(instruction.operand) + " = " + top + ";";
+            break;
+        case GLOAD:
+            out += push + " = " + globalHeapAccess(layout, operand) + ";";
+            break;
+        case GSTORE:
+            out += globalHeapAccess(layout, operand) + " = " + top + ";";
+            break;
+        case GLOAD_INDEXED:
+            out += top + " = " + globalHeapAccess(layout, operand + " + " + top) + ";";
+            break;
+        case GSTORE_INDEXED:
+            out += globalHeapAccess(layout, operand + " + " + second) + " = " + top + ";";
+            break;
+        case DUP_GLOAD_INDEXED:
+            out += push + " = " + globalHeapAccess(layout, operand + " + " + top) + ";";
+            break;
+        case DUP_ICONST_IEQ_BRT:
+            out += "if (" + top + " == " + operand + ") goto " + label(instruction.target) + ";";
+            break;
+        case ICONST1_IADD:
+            out += top + " = " + top + " + 1;";
+            break;
+        case PRINT:
+            // The parallel interpreter discards printed values
+            out += parallel ? ";" : "bufferIndex = printValue(" + top + ", buffer, bufferIndex);";
+            break;
+        case POP:
+            out += ";";
+            break;
+        case HALT:
+            out += "goto halt;";
+            break;
+        case THREAD_ID:
+            if (!parallel) return false;
+            out += push + " = get_local_id(0);";
+            break;
+        case PARALLEL_GLOAD_INDEXED:
+            if (!parallel) return false;
+            out += top + " = " + parallelHeapAccess(instruction.operand, top) + ";";
+            break;
+        case PARALLEL_GSTORE_INDEXED:
+            if (!parallel) return false;
+            out += parallelHeapAccess(instruction.operand, second) + " = " + top + ";";
+            break;
+        case THREAD_ID_PARALLEL_GLOAD_INDEXED:
+            if (!parallel) return false;
+            out += push + " = " + parallelHeapAccess(instruction.operand, "get_local_id(0)") + ";";
+            break;
+        case FADD:
+            out += second + " = as_int(as_float(" + top + ") + as_float(" + second + "));";
+            break;
+        case FSUB:
+            out += second + " = as_int(as_float(" + top + ") - as_float(" + second + "));";
+            break;
+        case FMUL:
+            out += second + " = as_int(as_float(" + top + ") * as_float(" + second + "));";
+            break;
+        case FDIV:
+            out += second + " = as_int(as_float(" + top + ") / as_float(" + second + "));";
+            break;
+        case FMA:
+            out += third + " = as_int(fma(as_float(" + top + "), as_float(" + second + "), as_float(" + third + ")));";
+            break;
+        case FLT:
+            out += second + " = (as_float(" + top + ") < as_float(" + second + ")) ? 1 : 0;";
+            break;
+        case FEQ:
+            out += second + " = (as_float(" + top + ") == as_float(" + second + ")) ? 1 : 0;";
+            break;
+        case I2F:
+            out += top + " = as_int((float) " + top + ");";
+            break;
+        case F2I:
+            out += top + " = (int) as_float(" + top + ");";
+            break;
+        case DADD:
+            out += storeSlotDouble(depth - 4, slotDouble(depth - 2) + " + " + slotDouble(depth - 4));
+            break;
+        case DSUB:
+            out += storeSlotDouble(depth - 4, slotDouble(depth - 2) + " - " + slotDouble(depth - 4));
+            break;
+        case DMUL:
+            out += storeSlotDouble(depth - 4, slotDouble(depth - 2) + " * " + slotDouble(depth - 4));
+            break;
+        case DDIV:
+            out += storeSlotDouble(depth - 4, slotDouble(depth - 2) + " / " + slotDouble(depth - 4));
+            break;
+        case DFMA:
+            out += storeSlotDouble(depth - 6, "fma(" + slotDouble(depth - 2) + ", " + slotDouble(depth - 4) + ", " + slotDouble(depth - 6) + ")");
+            break;
+        case DLT:
+            out += slot(depth - 4) + " = (" + slotDouble(depth - 2) + " < " + slotDouble(depth - 4) + ") ? 1 : 0;";
+            break;
+        case DEQ:
+            out += slot(depth - 4) + " = (" + slotDouble(depth - 2) + " == " + slotDouble(depth - 4) + ") ? 1 : 0;";
+            break;
+        case I2D:
+            out += storeSlotDouble(depth - 1, "(double) " + top);
+            break;
+        case D2I:
+            out += slot(depth - 2) + " = (int) " + slotDouble(depth - 2) + ";";
+            break;
+        case F2D:
+            out += storeSlotDouble(depth - 1, "(double) as_float(" + top + ")");
+            break;
+        case D2F:
+            out += slot(depth - 2) + " = as_int((float) " + slotDouble(depth - 2) + ");";
+            break;
+        case DLOAD_INDEXED:
+            out += "{ int address = " + operand + " + 2 * " + top + "; " + top + " = " + globalHeapAccess(layout, "address") + "; "
+                + push + " = " + globalHeapAccess(layout, "address + 1") + "; }";
+            break;
+        case DSTORE_INDEXED:
+            out += "{ int address = " + operand + " + 2 * " + third + "; " + globalHeapAccess(layout, "address") + " = " + second + "; "
+                + globalHeapAccess(layout, "address + 1") + " = " + top + "; }";
+            break;
+        case PARALLEL_DLOAD_INDEXED:
+            // Heaps of doubles are accessed in global memory
+            if (!parallel) return false;
+            out += "{ int address = " + operand + " * heapSize + 2 * (base + " + top + "); " + top + " = heaps[address]; "
+                + push + " = heaps[address + 1]; }";
+            break;
+        case PARALLEL_DSTORE_INDEXED:
+            if (!parallel) return false;
+            out += "{ int address = " + operand + " * heapSize + 2 * (base + " + third + "); heaps[address] = " + second + "; "
+                + "heaps[address + 1] = " + top + "; }";
+            break;
+        case VLOAD4:
+            out += storeSlotVector(depth - 1, "vload4(0, &" + globalHeapAccess(layout, operand + " + 4 * " + top) + ")");
+            break;
+        case VSTORE4:
+            out += "vstore4(" + slotVector(depth - 4) + ", 0, &" + globalHeapAccess(layout, operand + " + 4 * " + slot(depth - 5)) + ");";
+            break;
+        case VADD4:
+            out += storeSlotVector(depth - 8, slotVector(depth - 4) + " + " + slotVector(depth - 8));
+            break;
+        case VMUL4:
+            out += storeSlotVector(depth - 8, slotVector(depth - 4) + " * " + slotVector(depth - 8));
+            break;
+        case VSUM4:
+            out += slot(depth - 4) + " = " + slot(depth - 4) + " + " + slot(depth - 3) + " + " + slot(depth - 2) + " + " + top + ";";
+            break;
+        case VFADD4:
+            out += storeSlotVector(depth - 8, "as_int4(as_float4(" + slotVector(depth - 4) + ") + as_float4(" + slotVector(depth - 8) + "))");
+            break;
+        case VFMUL4:
+            out += storeSlotVector(depth - 8, "as_int4(as_float4(" + slotVector(depth - 4) + ") * as_float4(" + slotVector(depth - 8) + "))");
+            break;
+        case VFSUM4:
+            out += slot(depth - 4) + " = as_int(as_float(" + slot(depth - 4) + ") + as_float(" + slot(depth - 3) + ") + as_float("
+                + slot(depth - 2) + ") + as_float(" + top + "));";
+            break;
+        case PARALLEL_VLOAD4:
+            // Heaps of vectors are accessed in global memory
+            if (!parallel) return false;
+            out += storeSlotVector(depth - 1, "vload4(base + " + top + ", &heaps[" + operand + " * heapSize])");
+            break;
+        case PARALLEL_VSTORE4:
+            if (!parallel) return false;
+            out += "vstore4(" + slotVector(depth - 4) + ", base + " + slot(depth - 5) + ", &heaps[" + operand + " * heapSize]);";
+            break;
+        case REDUCE_ADD:
+        case REDUCE_MIN:
+        case REDUCE_MAX:
+            if (!parallel) return false;
+            out += top + " = reduceWorkGroup(" + to_string(instruction.opcode) + ", " + top + ", scratch); "
+                + "if (lid == 0) { int p = " + operand + " * get_num_groups(0) + get_group_id(0); "
+                + "partials[p] = combineReduction(" + to_string(instruction.opcode) + ", partials[p], " + top + "); }";
+            break;
+        case SCAN_ADD:
+            if (!parallel) return false;
+            out += top + " = scanWorkGroup(" + top + ", scratch);";
+            break;
+        case ATOMIC_ADD:
+        case ATOMIC_MIN:
+        case ATOMIC_MAX: {
+            // The index is an element of the whole heap
+            if (!parallel) return false;
+            string opcode = to_string(instruction.opcode);
+            string global = "atomicGlobal(" + opcode + ", &heaps[" + operand + " * heapSize + " + second + "], " + top + ")";
+            out += "\n#ifdef LOCAL_ATOMICS_SIZE\n";
+            out += "    if (" + operand + " == LOCAL_ATOMICS_HEAP && " + second + " >= 0 && " + second + " < LOCAL_ATOMICS_SIZE) "
+                + second + " = atomicLocal(" + opcode + ", &localAtomics[" + second + "], " + top + "); else\n";
+            out += "#endif\n";
+            out += "    " + second + " = " + global + ";";
+            break;
+        }
+        case ATOMIC_CAS:
+            if (!parallel) return false;
+            out += third + " = atomic_cmpxchg(&heaps[" + operand + " * heapSize + " + third + "], " + second + ", " + top + ");";
+            break;
+        case BARRIER:
+            if (!parallel) return false;
+            out += "barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);";
+            break;
+        case LLOAD:
+            if (!parallel) return false;
+            out += top + " = scratchpad[" + operand + " + " + top + "];";
+            break;
+        case LSTORE:
+            if (!parallel) return false;
+            out += "scratchpad[" + operand + " + " + second + "] = " + top + ";";
+            break;
+        case LLOAD_TILE:
+            // Stack: heap index relative to the work-group, scratchpad offset, count on top
+            if (!parallel) return false;
+            out += "loadTile(&heaps[" + operand + " * heapSize], heapSize, base + " + third + ", &scratchpad[" + second + "], " + top + ");";
+            break;
+        default:
+            // CALL, RET and invalid opcodes
+            return false;
+    }
+    return true;
+}
+
+string generateKernel(vector<DecodedInstruction> &code, int entryPoint, vector<int> &stackDepths, KernelLayout layout) {
+    if (layout == NO_KERNEL_LAYOUT || stackDepths.size() != code.size()) {
+        return "";
+    }
+
+    // Only branch targets need a label
+    vector<bool> isTarget(code.size(), false);
+    isTarget[entryPoint] = true;
+    int numSlots = 0;
+    bool doubles = false;
+    bool collectives = false;
+    bool atomics = false;
+    bool tiles = false;
+    for (int i = 0; i < (int) code.size(); i++) {
+        if (stackDepths[i] == -1) {
+            continue;
+        }
+        doubles = doubles || isDoubleOpcode(code[i].opcode);
+        collectives = collectives || isCollectiveOpcode(code[i].opcode);
+        atomics = atomics || isAtomicOpcode(code[i].opcode);
+        tiles = tiles || code[i].opcode == LLOAD_TILE;
+        if (hasBranchTarget(code[i].opcode)) {
+            isTarget[code[i].target] = true;
+        }
+        numSlots = max(numSlots, max(stackDepths[i], stackDepths[i] + code[i].stackEffect));
+    }
+
+    string body;
+    for (int i = 0; i < (int) code.size(); i++) {
+        if (stackDepths[i] == -1) {
+            continue;
+        }
+        if (isTarget[i]) {
+            body += label(i) + ":\n";
+        }
+        body += "    ";
+        if (!generateInstruction(code[i], stackDepths[i], layout, body)) {
+            return "";
+        }
+        body += "\n";
+    }
+
+    string kernel = "// Kernel generated by ProtonVM from the bytecode program (see kernelGenerator.hpp)\n\n";
+    if (doubles) {
+        kernel += doubleHelper();
+    }
+    if (layout != PARALLEL_LOOP_LAYOUT) {
+        kernel += printHelper();
+    } else {
+        if (collectives) {
+            kernel += collectiveHelper();
+        }
+        if (atomics) {
+            kernel += atomicHelper();
+        }
+        if (tiles) {
+            kernel += scratchpadHelper();
+        }
+    }
+    kernel += kernelHeader(layout);
+    if (numSlots > 0) {
+        kernel += "    int ";
+        for (int i = 0; i < numSlots; i++) {
+            kernel += slot(i) + ((i < numSlots - 1) ? ", " : ";\n");
+        }
+    }
+    kernel += "    goto " + label(entryPoint) + ";\n";
+    kernel += body;
+    kernel += kernelEpilogue(layout);
+    return kernel;
+}
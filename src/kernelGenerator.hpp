@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2020-2021, APT Group, Department of Computer Science,
+ * The University of Manchester.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef KERNEL_GENERATOR_HPP
+#define KERNEL_GENERATOR_HPP
+
+#include <string>
+#include <vector>
+#include "bytecodes.hpp"
+#include "decoder.hpp"
+
+using namespace std;
+
+/*
+ * Argument layout and heap model of the interpreter kernel that a specialized kernel replaces:
+ *  - GLOBAL_STACK_LAYOUT: interpreter.cl (OCLVM)
+ *  - PRIVATE_STACK_LAYOUT: interpreterPrivate.cl (OCLVMPrivate)
+ *  - PARALLEL_LOOP_LAYOUT: interpreterParallelLoop.cl (OCLVMParallelLoop)
+ */
+enum KernelLayout {
+    NO_KERNEL_LAYOUT,
+    GLOBAL_STACK_LAYOUT,
+    PRIVATE_STACK_LAYOUT,
+    PARALLEL_LOOP_LAYOUT
+};
+
+/*
+ * Partial evaluation of the interpreter kernel for one program. The decoded program is translated into OpenCL C
+ * with one statement per bytecode and a label per branch target, and every stack slot becomes a local variable
+ * (s0, s1, ...), using the stack depth of each instruction computed by the verifier. The result is an `interpreter`
+ * kernel with the same arguments as the kernel of `layout`, so the VM launches it without any other change.
+ *
+ * Returns an empty string if the program can not be specialized: CALL/RET need a stack in memory, and the
+ * parallel bytecodes are only available in the parallel layout.
+ */
+string generateKernel(vector<DecodedInstruction> &code, int entryPoint, vector<int> &stackDepths, KernelLayout layout);
+
+#endif
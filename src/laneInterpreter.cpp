@@ -0,0 +1,366 @@
+/*
+ * Copyright (c) 2020-2021, APT Group, Department of Computer Science,
+ * The University of Manchester.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <climits>
+#include <string.h>
+#include <algorithm>
+#include "laneInterpreter.hpp"
+#include "floatingPoint.hpp"
+#include "shortVector.hpp"
+#include "reduction.hpp"
+#include "atomics.hpp"
+#include "scratchpad.hpp"
+
+using namespace std;
+
+// AVX2/AVX-512 versions of the lane interpreter are compiled with function target attributes and selected at runtime
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    #define LANES_X86_64 1
+#endif
+
+#define LANE_HALTED INT_MAX
+
+LaneISA detectLaneISA() {
+#ifdef LANES_X86_64
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return LANES_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return LANES_AVX2;
+    }
+#endif
+    return LANES_NONE;
+}
+
+int laneWidth(LaneISA isa) {
+    switch (isa) {
+        case LANES_AVX512:
+            return 16;
+        case LANES_AVX2:
+            return 8;
+        default:
+            return 1;
+    }
+}
+
+const char* laneISAName(LaneISA isa) {
+    switch (isa) {
+        case LANES_AVX512:
+            return "AVX-512";
+        case LANES_AVX2:
+            return "AVX2";
+        default:
+            return "none";
+    }
+}
+
+bool isLaneProgram(vector<DecodedInstruction> &code, vector<int> &stackDepths) {
+    if (stackDepths.size() != code.size()) {
+        return false;
+    }
+    for (int i = 0; i < code.size(); i++) {
+        if (stackDepths[i] != -1 && (code[i].opcode == CALL || code[i].opcode == RET || isFloatingPointOpcode(code[i].opcode)
+                || isVectorOpcode(code[i].opcode) || isCollectiveOpcode(code[i].opcode) || isAtomicOpcode(code[i].opcode)
+                || isScratchpadOpcode(code[i].opcode))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// GCC/Clang vector of W ints: one stack row, the ips or the active mask of a lane group
+template <int W>
+struct LaneVector {
+    typedef int type __attribute__((vector_size(W * sizeof(int))));
+};
+
+template <typename V>
+static inline __attribute__((always_inline)) void loadRow(V &row, const int* address) {
+    memcpy(&row, address, sizeof(V));
+}
+
+template <typename V>
+static inline __attribute__((always_inline)) void storeRow(int* address, const V &row) {
+    memcpy(address, &row, sizeof(V));
+}
+
+/*
+ * Lane interpreter for W lanes. Row r of the stack is stack[r * W .. r * W + W - 1]. All the lanes at the same ip
+ * have the same stack depth, so the rows touched by an instruction are known from its ip. Rows are processed as
+ * vectors, and the result is blended with the active mask, so inactive lanes keep their values. Heap loads read
+ * every lane (inactive lanes read the first element of the heap), while stores and divisions only run on the
+ * active lanes.
+ *
+ * While all the live lanes run the same ip (converged), the mask is fixed and only branches update the per-lane ips.
+ * After a branch or a HALT, the group picks the lowest ip of its lanes, and it is converged again once all the live
+ * lanes are at that ip. Between branches the lowest ip is always the next instruction, so no search is needed.
+ */
+template <int W>
+static inline __attribute__((always_inline)) void runLanes(const LaneProgram &program, int* stack, int groupBase, int firstLocalId, int numLanes) {
+    typedef typename LaneVector<W>::type Lanes;
+    const DecodedInstruction* code = program.code;
+    int* data = program.heaps[0];
+    Lanes zero = {};
+    Lanes laneIds;
+    for (int l = 0; l < W; l++) {
+        laneIds[l] = l;
+    }
+    Lanes halted = zero + LANE_HALTED;
+    Lanes active = laneIds < numLanes;
+    Lanes laneIp = active ? zero + program.entryPoint : halted;
+    int liveLanes = numLanes;
+    int ip = program.entryPoint;
+    bool converged = true;
+    bool rescan = false;
+
+    while (true) {
+        if (rescan) {
+            ip = LANE_HALTED;
+            for (int l = 0; l < W; l++) {
+                ip = min(ip, (int) laneIp[l]);
+            }
+            if (ip == LANE_HALTED) {
+                return;
+            }
+            active = laneIp == ip;
+            int activeLanes = 0;
+            for (int l = 0; l < W; l++) {
+                activeLanes -= active[l];
+            }
+            converged = activeLanes == liveLanes;
+            rescan = false;
+        }
+
+        const DecodedInstruction &instruction = code[ip];
+        int* top = stack + (program.stackDepths[ip] - 1) * W;
+        int* below = top - W;
+        int* push = top + W;
+        int next = ip + 1;
+        Lanes a, b, c;
+        int* heap;
+        int* address;
+
+        switch (instruction.opcode) {
+            case DUP:
+                loadRow(a, top);
+                loadRow(c, push);
+                storeRow(push, active ? a : c);
+                break;
+            case IADD:
+                loadRow(a, top);
+                loadRow(b, below);
+                storeRow(below, active ? a + b : b);
+                break;
+            case ISUB:
+                loadRow(a, top);
+                loadRow(b, below);
+                storeRow(below, active ? a - b : b);
+                break;
+            case IMUL:
+                loadRow(a, top);
+                loadRow(b, below);
+                storeRow(below, active ? a * b : b);
+                break;
+            case IDIV:
+                for (int l = 0; l < W; l++) {
+                    if (active[l]) {
+                        below[l] = top[l] / below[l];
+                    }
+                }
+                break;
+            case LSHIFT:
+                loadRow(a, top);
+                storeRow(top, active ? a << 1 : a);
+                break;
+            case RSHIFT:
+                loadRow(a, top);
+                storeRow(top, active ? a >> 1 : a);
+                break;
+            case ILT:
+                loadRow(a, top);
+                loadRow(b, below);
+                storeRow(below, active ? (a < b) & TRUE : b);
+                break;
+            case IEQ:
+                loadRow(a, top);
+                loadRow(b, below);
+                storeRow(below, active ? (a == b) & TRUE : b);
+                break;
+            case BR:
+                laneIp = active ? zero + instruction.target : laneIp;
+                converged = false;
+                rescan = true;
+                continue;
+            case BRT:
+                loadRow(a, top);
+                laneIp = active ? (a == TRUE ? zero + instruction.target : zero + next) : laneIp;
+                converged = false;
+                rescan = true;
+                continue;
+            case BRF:
+                loadRow(a, top);
+                laneIp = active ? (a == FALSE ? zero + instruction.target : zero + next) : laneIp;
+                converged = false;
+                rescan = true;
+                continue;
+            case ICONST:
+                loadRow(c, push);
+                storeRow(push, active ? zero + instruction.operand : c);
+                break;
+            case ICONST1:
+                loadRow(c, push);
+                storeRow(push, active ? zero + 1 : c);
+                break;
+            case LOAD:
+                loadRow(a, stack + instruction.operand * W);
+                loadRow(c, push);
+                storeRow(push, active ? a : c);
+                break;
+            case STORE:
+                address = stack + instruction.operand * W;
+                loadRow(a, top);
+                loadRow(b, address);
+                storeRow(address, active ? a : b);
+                break;
+            case GLOAD:
+                loadRow(c, push);
+                storeRow(push, active ? zero + data[instruction.operand] : c);
+                break;
+            case GSTORE:
+                for (int l = 0; l < W; l++) {
+                    if (active[l]) {
+                        data[instruction.operand] = top[l];
+                    }
+                }
+                break;
+            case GLOAD_INDEXED:
+                loadRow(a, top);
+                b = active ? a + instruction.operand : zero;
+                for (int l = 0; l < W; l++) {
+                    c[l] = data[b[l]];
+                }
+                storeRow(top, active ? c : a);
+                break;
+            case GSTORE_INDEXED:
+                for (int l = 0; l < W; l++) {
+                    if (active[l]) {
+                        data[instruction.operand + below[l]] = top[l];
+                    }
+                }
+                break;
+            case PRINT:
+            case POP:
+                // PRINT discards the value, as in the parallel OpenCL kernel
+                break;
+            case THREAD_ID:
+                loadRow(c, push);
+                storeRow(push, active ? laneIds + firstLocalId : c);
+                break;
+            case PARALLEL_GLOAD_INDEXED:
+                heap = program.heaps[instruction.operand] + groupBase;
+                loadRow(a, top);
+                b = active ? a : zero;
+                for (int l = 0; l < W; l++) {
+                    c[l] = heap[b[l]];
+                }
+                storeRow(top, active ? c : a);
+                break;
+            case PARALLEL_GSTORE_INDEXED:
+                heap = program.heaps[instruction.operand] + groupBase;
+                for (int l = 0; l < W; l++) {
+                    if (active[l]) {
+                        heap[below[l]] = top[l];
+                    }
+                }
+                break;
+            case DUP_ICONST_IEQ_BRT:
+                loadRow(a, top);
+                laneIp = active ? (a == instruction.operand ? zero + instruction.target : zero + next) : laneIp;
+                converged = false;
+                rescan = true;
+                continue;
+            case DUP_GLOAD_INDEXED:
+                loadRow(a, top);
+                loadRow(c, push);
+                b = active ? a + instruction.operand : zero;
+                for (int l = 0; l < W; l++) {
+                    a[l] = data[b[l]];
+                }
+                storeRow(push, active ? a : c);
+                break;
+            case ICONST1_IADD:
+                loadRow(a, top);
+                storeRow(top, active ? a + 1 : a);
+                break;
+            case THREAD_ID_PARALLEL_GLOAD_INDEXED:
+                heap = program.heaps[instruction.operand] + groupBase + firstLocalId;
+                loadRow(c, push);
+                b = active ? laneIds : zero;
+                for (int l = 0; l < W; l++) {
+                    a[l] = heap[b[l]];
+                }
+                storeRow(push, active ? a : c);
+                break;
+            default:
+                // HALT, and CALL/RET which isLaneProgram excludes: the active lanes stop
+                if (converged) {
+                    return;
+                }
+                for (int l = 0; l < W; l++) {
+                    liveLanes += active[l];
+                }
+                laneIp = active ? halted : laneIp;
+                rescan = true;
+                continue;
+        }
+        ip = next;
+        if (!converged) {
+            // The active lanes move to the next ip, which is still the lowest one; lanes waiting there join them
+            laneIp = active ? zero + next : laneIp;
+            active = laneIp == ip;
+        }
+    }
+}
+
+#ifdef LANES_X86_64
+__attribute__((target("avx512f")))
+static void runLanesAVX512(const LaneProgram &program, int* stack, int groupBase, int firstLocalId, int numLanes) {
+    runLanes<16>(program, stack, groupBase, firstLocalId, numLanes);
+}
+
+__attribute__((target("avx2")))
+static void runLanesAVX2(const LaneProgram &program, int* stack, int groupBase, int firstLocalId, int numLanes) {
+    runLanes<8>(program, stack, groupBase, firstLocalId, numLanes);
+}
+#endif
+
+void runLaneGroup(LaneISA isa, const LaneProgram &program, int* stack, int groupBase, int firstLocalId, int numLanes) {
+    switch (isa) {
+#ifdef LANES_X86_64
+        case LANES_AVX512:
+            runLanesAVX512(program, stack, groupBase, firstLocalId, numLanes);
+            break;
+        case LANES_AVX2:
+            runLanesAVX2(program, stack, groupBase, firstLocalId, numLanes);
+            break;
+#endif
+        default:
+            break;
+    }
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2020-2021, APT Group, Department of Computer Science,
+ * The University of Manchester.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef LANE_INTERPRETER_HPP
+#define LANE_INTERPRETER_HPP
+
+#include <vector>
+#include "bytecodes.hpp"
+#include "decoder.hpp"
+
+using namespace std;
+
+/*
+ * Vector ISA used by the lane interpreter. It is detected at runtime, and it sets the number of work-items
+ * (lanes) that run together: 16 with AVX-512 and 8 with AVX2. Without them (LANES_NONE), the work-items run one
+ * at a time: 128-bit lane groups are slower than the scalar interpreter.
+ */
+enum LaneISA {
+    LANES_NONE,
+    LANES_AVX2,
+    LANES_AVX512
+};
+
+LaneISA detectLaneISA();
+
+int laneWidth(LaneISA isa);
+
+const char* laneISAName(LaneISA isa);
+
+/*
+ * Program and heaps shared by all the lane groups of a parallel run.
+ */
+struct LaneProgram {
+    const DecodedInstruction* code;
+    const int* stackDepths;     // stack depth before each instruction, from the verifier
+    int entryPoint;
+    int** heaps;                // start of every heap (GLOAD/GSTORE use heap 0)
+    int numHeaps;
+};
+
+/*
+ * The lane interpreter needs the stack depth of every instruction to be known statically, so it runs programs
+ * whose reachable code has no CALL/RET. The lanes hold ints, so programs with floating-point or vector bytecodes run
+ * one work-item at a time. Work-group collectives (REDUCE_*, SCAN_ADD) span all the lane groups of a work-group, and
+ * atomics (ATOMIC_*) update one element per work-item, so these programs do not run in lanes either. Neither do
+ * programs that use the scratchpad of the work-group (LLOAD/LSTORE).
+ */
+bool isLaneProgram(vector<DecodedInstruction> &code, vector<int> &stackDepths);
+
+/*
+ * Run `numLanes` consecutive work-items of a work-group (local ids firstLocalId..) as one lane group. Every bytecode
+ * is dispatched once for the whole group and runs as a vector operation over the lanes. The stack is a matrix with
+ * one row per slot and one column per lane (`stack` holds stackSize * laneWidth(isa) ints).
+ *
+ * Every lane has its own ip. Divergent branches are handled with an active-lane mask: the group always runs the
+ * lowest ip among its lanes, with the lanes that are at that ip, so lanes reconverge at the join point. Work-groups
+ * should be a multiple of the lane width, otherwise the last lane group of every work-group runs with idle lanes.
+ */
+void runLaneGroup(LaneISA isa, const LaneProgram &program, int* stack, int groupBase, int firstLocalId, int numLanes);
+
+#endif
@@ -23,7 +23,10 @@ using namespace std;
 
 #include "bytecodes.hpp"
 #include "vm.hpp"
+#include "jitVM.hpp"
+#include "parallelCPUVM.hpp"
 #include "oclVM.hpp"
+#include "floatingPoint.hpp"
 
 /// ***************************************************************************************************************************
 /// Run the hello world program.
@@ -107,6 +110,38 @@ void testFunction() {
     vm.runInterpreter();
 }
 
+/// ***************************************************************************************************************************
+/// Test a recursive function (factorial) for the sequential C++ BC interpreter on CPU.
+/// The verifier can not bound the stack depth of a recursive program, so this program runs with the
+/// configured stack size and every CALL checks that the new frame fits in the stack.
+/// ***************************************************************************************************************************
+void testRecursion() {
+    vector<int> factorial = {
+        // Instruction    address
+        LOAD, -3,		// 0  -- factorial(n)
+        ICONST, 1,		// 2
+        ILT,			// 4  1 < n
+        BRF, 19,		// 5
+        LOAD, -3,		// 7
+        ICONST, 1,		// 9
+        LOAD, -3,		// 11
+        ISUB,			// 13 n - 1
+        CALL, 0, 1,		// 14
+        IMUL,			// 17 n * factorial(n - 1)
+        RET,			// 18
+        ICONST, 1,		// 19
+        RET,			// 21
+
+        ICONST, 5,		// 22 -- this is the main
+        CALL, 0, 1,		// 24
+        PRINT,			// 27
+        HALT			// 28
+    };
+    VM vm(factorial,  22); // Start address is 22
+    vm.setVMConfig(100, 100);
+    vm.runInterpreter();
+}
+
 /// ***************************************************************************************************************************
 /// Test the vector addition on CPU using the sequential C++ BC interpreter.
 /// ***************************************************************************************************************************
@@ -140,6 +175,284 @@ void testVectorAddition() {
     cout << endl;
 }
 
+/// ***************************************************************************************************************************
+/// Test the vector addition with the vector bytecodes on the sequential C++ BC interpreter. Every iteration adds
+/// four elements: VLOAD4 pushes the four elements as four stack slots.
+/// ***************************************************************************************************************************
+void testVectorAddition4() {
+    vector<int> vectorAdd = {
+            ICONST, 0,
+            DUP,
+            ICONST, 2,
+            IEQ,
+            BRT, 23,
+            DUP,    // offset of the vector to store
+            DUP,
+            VLOAD4, 16,
+            LOAD, 1,
+            VLOAD4, 32,
+            VADD4,
+            VSTORE4, 0,
+            ICONST1,
+            IADD,
+            BR, 2,
+            POP,
+            HALT
+    };
+    VM vm(vectorAdd,  0);
+    vm.setVMConfig(100, 100);
+    vm.initHeap();
+    vm.runInterpreter();
+    vm.printHeap();
+    cout << endl;
+}
+
+/// ***************************************************************************************************************************
+/// Test the floating-point bytecodes on the sequential C++ BC interpreter. Floats are pushed with ICONST and the bits of
+/// the float; doubles take two stack slots.
+/// ***************************************************************************************************************************
+void testFloatingPoint() {
+    vector<int> program = {
+        ICONST, floatToBits(0.5f),
+        ICONST, floatToBits(4.0f),
+        ICONST, floatToBits(1.5f),
+        FMA,                // 1.5 * 4.0 + 0.5
+        F2I,
+        PRINT,              // 6
+        ICONST, 3,
+        I2D,
+        ICONST, 3,
+        I2D,
+        ICONST, 1,
+        I2D,
+        DDIV,               // 1.0 / 3.0
+        DMUL,               // (1.0 / 3.0) * 3.0
+        ICONST, 1,
+        I2D,
+        DEQ,
+        PRINT,              // 1
+        HALT
+    };
+    VM vm(program, 0);
+    vm.setVMConfig(100, 100);
+    vm.runInterpreter();
+}
+
+/// ***************************************************************************************************************************
+/// Test the vector addition and a recursive function on CPU using the x86-64 JIT. Programs that the JIT
+/// can not compile run on the sequential C++ BC interpreter.
+/// ***************************************************************************************************************************
+void testJIT() {
+    vector<int> vectorAdd = {
+            ICONST, 0,
+            DUP,
+            ICONST, 10,
+            IEQ,
+            BRT, 23,
+            DUP,    // offset for each array to load
+            DUP,    // offset for each array to load
+            GLOAD_INDEXED, 10,
+            LOAD, 1,   // load from position 1
+            GLOAD_INDEXED, 20,
+            IADD,
+            GSTORE_INDEXED, 0,
+            ICONST1,
+            IADD,
+            BR, 2,
+            POP,
+            HALT
+    };
+    JITVM vm(vectorAdd, 0);
+    vm.setVMConfig(100, 100);
+    vm.initHeap();
+    if (!vm.compile()) {
+        cout << "[JIT] Program not compiled. Running the interpreter" << endl;
+    }
+    vm.runInterpreter();
+    vm.printHeap();
+    cout << endl;
+
+    vector<int> factorial = {
+        LOAD, -3,		// 0  -- factorial(n)
+        ICONST, 1,		// 2
+        ILT,			// 4  1 < n
+        BRF, 19,		// 5
+        LOAD, -3,		// 7
+        ICONST, 1,		// 9
+        LOAD, -3,		// 11
+        ISUB,			// 13 n - 1
+        CALL, 0, 1,		// 14
+        IMUL,			// 17 n * factorial(n - 1)
+        RET,			// 18
+        ICONST, 1,		// 19
+        RET,			// 21
+
+        ICONST, 5,		// 22 -- this is the main
+        CALL, 0, 1,		// 24
+        PRINT,			// 27
+        HALT			// 28
+    };
+    JITVM jit(factorial, 22);
+    jit.setVMConfig(100, 100);
+    jit.runInterpreter();
+}
+
+/// ***************************************************************************************************************************
+/// Test the parallel vector multiplication on the CPU. ParallelCPUVM runs the program once per work-item, as the
+/// OpenCL kernel of OCLVMParallelLoop does, and distributes the work-groups over all the CPU cores.
+/// ***************************************************************************************************************************
+void testParallelCPU() {
+    int size = 64;
+    int groupSize = 16;
+    vector<int> vectorMul = {
+        THREAD_ID,
+        DUP,
+        PARALLEL_GLOAD_INDEXED, 0,
+        THREAD_ID,
+        PARALLEL_GLOAD_INDEXED, 1,
+        IMUL,
+        PARALLEL_GSTORE_INDEXED, 2,
+        HALT
+    };
+    ParallelCPUVM vm(vectorMul, 0);
+    vm.setVMConfig(100, size);
+    vm.setHeapSizes(size);
+    vm.initHeap();
+    vm.runInterpreter(size, groupSize);
+    vm.printHeaps();
+}
+
+/// ***************************************************************************************************************************
+/// Test the work-group collectives on the CPU: the prefix sum of heap 0 within every work-group, and the dot product
+/// of heaps 0 and 1 with REDUCE_ADD. The work-groups compute partial sums that the VM combines after the run.
+/// ***************************************************************************************************************************
+void testReductionCPU() {
+    int size = 64;
+    int groupSize = 16;
+    vector<int> dotProduct = {
+        THREAD_ID,
+        THREAD_ID,
+        PARALLEL_GLOAD_INDEXED, 0,
+        SCAN_ADD,
+        PARALLEL_GSTORE_INDEXED, 2,
+        THREAD_ID,
+        PARALLEL_GLOAD_INDEXED, 0,
+        THREAD_ID,
+        PARALLEL_GLOAD_INDEXED, 1,
+        IMUL,
+        REDUCE_ADD, 0,
+        POP,
+        HALT
+    };
+    ParallelCPUVM vm(dotProduct, 0);
+    vm.setVMConfig(100, size);
+    vm.setHeapSizes(size);
+    vm.initHeap();
+    vm.runInterpreter(size, groupSize);
+    vm.printHeaps();
+    cout << "DOT PRODUCT: " << vm.getReduction(0) << endl;
+}
+
+/// ***************************************************************************************************************************
+/// Test a histogram on the CPU: every work-item adds 1 to the bin of its local id / 2 in heap 2 with ATOMIC_ADD. The
+/// bins are accumulated in a copy per work-group, and added to the heap once per group.
+/// ***************************************************************************************************************************
+void testHistogramCPU() {
+    int size = 64;
+    int groupSize = 16;
+    vector<int> histogram = {
+        THREAD_ID,
+        RSHIFT,
+        ICONST, 1,
+        ATOMIC_ADD, 2,
+        POP,
+        HALT
+    };
+    ParallelCPUVM vm(histogram, 0);
+    vm.setVMConfig(100, size);
+    vm.setHeapSizes(size);
+    vm.setLocalAtomics(2, groupSize / 2);
+    vm.initHeap();
+    vm.runInterpreter(size, groupSize);
+    vm.printHeaps();
+}
+
+/// ***************************************************************************************************************************
+/// Test a 3-point stencil on the CPU: every work-group copies its tile of heap 0 and one element on each side to the
+/// scratchpad with LLOAD_TILE, and every work-item adds its three neighbours from the scratchpad into heap 2.
+/// ***************************************************************************************************************************
+void testStencilCPU() {
+    int size = 64;
+    int groupSize = 16;
+    vector<int> stencil = {
+        ICONST, -1,                 // first element of the tile: one before the group
+        ICONST, 0,                  // scratchpad offset
+        ICONST, groupSize + 2,      // elements
+        LLOAD_TILE, 0,
+        THREAD_ID,
+        THREAD_ID,
+        LLOAD, 0,                   // element - 1
+        THREAD_ID,
+        LLOAD, 1,                   // element
+        IADD,
+        THREAD_ID,
+        LLOAD, 2,                   // element + 1
+        IADD,
+        PARALLEL_GSTORE_INDEXED, 2,
+        HALT
+    };
+    ParallelCPUVM vm(stencil, 0);
+    vm.setScratchpadSize(groupSize + 2);
+    vm.setVMConfig(100, size);
+    vm.setHeapSizes(size);
+    vm.initHeap();
+    vm.runInterpreter(size, groupSize);
+    vm.printHeaps();
+}
+
+/// ***************************************************************************************************************************
+/// Profile the pairs of bytecodes executed by the vector addition, and fuse the hottest ones into superinstructions.
+/// ***************************************************************************************************************************
+void testSuperinstructions() {
+    vector<int> vectorAdd = {
+            ICONST, 0,
+            DUP,
+            ICONST, 10,
+            IEQ,
+            BRT, 23,
+            DUP,    // offset for each array to load
+            DUP,    // offset for each array to load
+            GLOAD_INDEXED, 10,
+            LOAD, 1,   // load from position 1
+            GLOAD_INDEXED, 20,
+            IADD,
+            GSTORE_INDEXED, 0,
+            ICONST1,
+            IADD,
+            BR, 2,
+            POP,
+            HALT
+    };
+    VM profiler(vectorAdd, 0);
+    profiler.setVMConfig(100, 100);
+    profiler.setSuperinstructions(FUSE_NONE);
+    profiler.enableProfiling();
+    profiler.initHeap();
+    profiler.runInterpreter();
+    profiler.printProfile(5);
+
+    // Fuse the sequences whose leading pair is, at least, 5% of the executed pairs
+    vector<long> pairProfile = profiler.getPairProfile();
+    VM vm(vectorAdd, 0);
+    vm.setVMConfig(100, 100);
+    vm.setSuperinstructions(selectSuperinstructions(pairProfile, 0.05));
+    vm.setTrace();
+    vm.initHeap();
+    vm.runInterpreter();
+    vm.printHeap();
+    cout << endl;
+}
+
 /// ***************************************************************************************************************************
 /// Test for running vector addition with OpenCL on any heterogeneous device (e.g., a GPU).
 /// OCLVM runs a sequential BC interpreter on the GPU. This means that ProtoVM launches a single
@@ -225,6 +538,32 @@ void testOpenCLInterpreterPrivate() {
     oclVM.runInterpreter();
 }
 
+/// ***************************************************************************************************************************
+/// Test for running many independent invocations of the same program with one launch of the OpenCL batch interpreter.
+/// Each invocation has its own heap with its input, and runs on its own device thread. The results are read back
+/// from the heaps of the invocations.
+/// ***************************************************************************************************************************
+void testOpenCLBatch() {
+    vector<int> program = {
+        GLOAD, 0,
+        GLOAD, 1,
+        IMUL,
+        GSTORE, 2,      // heap[2] = heap[0] * heap[1]
+        HALT
+    };
+    OCLVMBatch oclVM(program, 0);
+    oclVM.setVMConfig(100, 3);
+    oclVM.setPlatform(0);
+    oclVM.initOpenCL("lib/interpreterBatch.cl", false);
+    for (int i = 0; i < 1024; i++) {
+        oclVM.addInvocation({i, 2});
+    }
+    oclVM.runInterpreter();
+    for (int i = 0; i < 8; i++) {
+        cout << "Invocation " << i << ": " << oclVM.getInvocationHeap(i)[2] << endl;
+    }
+}
+
 /// ***************************************************************************************************************************
 /// Parallel BC Interpreter
 /// ***************************************************************************************************************************1
@@ -260,6 +599,216 @@ void runOpenCLParallelIntepreterLoop() {
     oclVM.runInterpreter(1024, groupSize);
 }
 
+/// ***************************************************************************************************************************
+/// Test a parallel program with four heaps (d = a * b + c) on the OpenCL parallel loop interpreter. The heaps are declared with
+/// their access, so only a, b and c are copied to the device and only d is copied back, and the kernel is built for work-groups
+/// of 64 threads.
+/// ***************************************************************************************************************************
+void testOpenCLParallelHeaps() {
+    int size = 1024;
+    int groupSize = 64;
+    vector<int> multiplyAdd = {
+        THREAD_ID,
+        DUP,
+        PARALLEL_GLOAD_INDEXED, 0,
+        THREAD_ID,
+        PARALLEL_GLOAD_INDEXED, 1,
+        IMUL,
+        THREAD_ID,
+        PARALLEL_GLOAD_INDEXED, 2,
+        IADD,
+        PARALLEL_GSTORE_INDEXED, 3,
+        HALT
+    };
+    OCLVMParallelLoop oclVM(multiplyAdd, 0);
+    oclVM.setHeaps({READ_ONLY_HEAP, READ_ONLY_HEAP, READ_ONLY_HEAP, WRITE_ONLY_HEAP}, size);
+    oclVM.setVMConfig(100, size);
+    oclVM.setWorkGroupSize(groupSize);
+    oclVM.setPlatform(0);
+    oclVM.initOpenCL("lib/interpreterParallelLoop.cl", false);
+    oclVM.initHeap();
+    oclVM.runInterpreter(size, groupSize);
+    for (int i = 0; i < 8; i++) {
+        cout << oclVM.getHeap(3)[i] << ' ';
+    }
+    cout << endl;
+}
+
+/// ***************************************************************************************************************************
+/// Test the parallel vector multiplication with the vector bytecodes on the OpenCL parallel loop interpreter. Every
+/// work-item multiplies four elements (vload4/int4 in the kernel).
+/// ***************************************************************************************************************************
+void testOpenCLVectorMultiplication4() {
+    int size = 1024;
+    int groupSize = 64;
+    vector<int> vectorMul = {
+        THREAD_ID,
+        THREAD_ID,
+        PARALLEL_VLOAD4, 0,
+        THREAD_ID,
+        PARALLEL_VLOAD4, 1,
+        VMUL4,
+        PARALLEL_VSTORE4, 2,
+        HALT
+    };
+    OCLVMParallelLoop oclVM(vectorMul, 0);
+    oclVM.setHeaps({READ_ONLY_HEAP, READ_ONLY_HEAP, WRITE_ONLY_HEAP}, 4 * size);
+    oclVM.setVMConfig(100, size);
+    oclVM.setWorkGroupSize(groupSize);
+    oclVM.setPlatform(0);
+    oclVM.initOpenCL("lib/interpreterParallelLoop.cl", false);
+    for (int i = 0; i < 4 * size; i++) {
+        oclVM.getHeap(0)[i] = i;
+        oclVM.getHeap(1)[i] = 2;
+    }
+    oclVM.runInterpreter(size, groupSize);
+    for (int i = 0; i < 8; i++) {
+        cout << oclVM.getHeap(2)[i] << ' ';
+    }
+    cout << endl;
+}
+
+/// ***************************************************************************************************************************
+/// Test SAXPY (y = a * x + y) in single precision on the OpenCL parallel loop interpreter. The heaps hold the bits of the floats.
+/// ***************************************************************************************************************************
+void testOpenCLSaxpy() {
+    int size = 1024;
+    int groupSize = 64;
+    float a = 2.0f;
+    vector<int> saxpy = {
+        THREAD_ID,
+        THREAD_ID,
+        PARALLEL_GLOAD_INDEXED, 1,  // y[i]
+        THREAD_ID,
+        PARALLEL_GLOAD_INDEXED, 0,  // x[i]
+        ICONST, floatToBits(a),
+        FMA,                        // a * x[i] + y[i]
+        PARALLEL_GSTORE_INDEXED, 1,
+        HALT
+    };
+    OCLVMParallelLoop oclVM(saxpy, 0);
+    oclVM.setHeaps({READ_ONLY_HEAP, READ_WRITE_HEAP}, size);
+    oclVM.setVMConfig(100, size);
+    oclVM.setWorkGroupSize(groupSize);
+    oclVM.setPlatform(0);
+    oclVM.initOpenCL("lib/interpreterParallelLoop.cl", false);
+    for (int i = 0; i < size; i++) {
+        oclVM.getHeap(0)[i] = floatToBits(i);
+        oclVM.getHeap(1)[i] = floatToBits(1.0f);
+    }
+    oclVM.runInterpreter(size, groupSize);
+    for (int i = 0; i < 8; i++) {
+        cout << bitsToFloat(oclVM.getHeap(1)[i]) << ' ';
+    }
+    cout << endl;
+}
+
+/// ***************************************************************************************************************************
+/// Test the dot product of two vectors on the OpenCL parallel loop interpreter. Every work-group reduces its products
+/// in local memory, and the host combines the partial sums of the work-groups.
+/// ***************************************************************************************************************************
+void testOpenCLDotProduct() {
+    int size = 1024;
+    int groupSize = 64;
+    vector<int> dotProduct = {
+        THREAD_ID,
+        PARALLEL_GLOAD_INDEXED, 0,
+        THREAD_ID,
+        PARALLEL_GLOAD_INDEXED, 1,
+        IMUL,
+        REDUCE_ADD, 0,
+        POP,
+        HALT
+    };
+    OCLVMParallelLoop oclVM(dotProduct, 0);
+    oclVM.setHeaps({READ_ONLY_HEAP, READ_ONLY_HEAP}, size);
+    oclVM.setVMConfig(100, size);
+    oclVM.setWorkGroupSize(groupSize);
+    oclVM.setPlatform(0);
+    oclVM.initOpenCL("lib/interpreterParallelLoop.cl", false);
+    for (int i = 0; i < size; i++) {
+        oclVM.getHeap(0)[i] = i;
+        oclVM.getHeap(1)[i] = 2;
+    }
+    oclVM.runInterpreter(size, groupSize);
+    cout << "DOT PRODUCT: " << oclVM.getReduction(0) << endl;
+}
+
+/// ***************************************************************************************************************************
+/// Test a histogram of 16 bins on the OpenCL parallel loop interpreter. The work-items update the bins with ATOMIC_ADD
+/// in local memory, and every work-group adds its bins to heap 1 at the end.
+/// ***************************************************************************************************************************
+void testOpenCLHistogram() {
+    int size = 1024;
+    int groupSize = 64;
+    int numBins = 16;
+    vector<int> histogram = {
+        THREAD_ID,
+        PARALLEL_GLOAD_INDEXED, 0,  // bin
+        ICONST, 1,
+        ATOMIC_ADD, 1,
+        POP,
+        HALT
+    };
+    OCLVMParallelLoop oclVM(histogram, 0);
+    oclVM.setHeaps({READ_ONLY_HEAP, READ_WRITE_HEAP}, size);
+    oclVM.setVMConfig(100, size);
+    oclVM.setWorkGroupSize(groupSize);
+    oclVM.setLocalAtomics(1, numBins);
+    oclVM.setPlatform(0);
+    oclVM.initOpenCL("lib/interpreterParallelLoop.cl", false);
+    for (int i = 0; i < size; i++) {
+        oclVM.getHeap(0)[i] = (i * 7) % numBins;
+        oclVM.getHeap(1)[i] = 0;
+    }
+    oclVM.runInterpreter(size, groupSize);
+    for (int i = 0; i < numBins; i++) {
+        cout << oclVM.getHeap(1)[i] << ' ';
+    }
+    cout << endl;
+}
+
+/// ***************************************************************************************************************************
+/// Test a 3-point stencil on the OpenCL parallel loop interpreter. Every work-group loads its tile of heap 0 and the
+/// elements on both sides to the scratchpad in local memory once, and the work-items read their neighbours from it.
+/// ***************************************************************************************************************************
+void testOpenCLStencil() {
+    int size = 1024;
+    int groupSize = 64;
+    vector<int> stencil = {
+        ICONST, -1,
+        ICONST, 0,
+        ICONST, groupSize + 2,
+        LLOAD_TILE, 0,
+        THREAD_ID,
+        THREAD_ID,
+        LLOAD, 0,
+        THREAD_ID,
+        LLOAD, 1,
+        IADD,
+        THREAD_ID,
+        LLOAD, 2,
+        IADD,
+        PARALLEL_GSTORE_INDEXED, 1,
+        HALT
+    };
+    OCLVMParallelLoop oclVM(stencil, 0);
+    oclVM.setHeaps({READ_ONLY_HEAP, WRITE_ONLY_HEAP}, size);
+    oclVM.setScratchpadSize(groupSize + 2);
+    oclVM.setVMConfig(100, size);
+    oclVM.setWorkGroupSize(groupSize);
+    oclVM.setPlatform(0);
+    oclVM.initOpenCL("lib/interpreterParallelLoop.cl", false);
+    for (int i = 0; i < size; i++) {
+        oclVM.getHeap(0)[i] = i;
+    }
+    oclVM.runInterpreter(size, groupSize);
+    for (int i = 0; i < 8; i++) {
+        cout << oclVM.getHeap(1)[i] << ' ';
+    }
+    cout << endl;
+}
+
 void runTests() {
     std::cout << "----" << endl;
     testHello();
@@ -270,10 +819,42 @@ void runTests() {
     std::cout << "----" << endl;
     testFunction();
     std::cout << "----" << endl;
+    testRecursion();
+    std::cout << "----" << endl;
     testVectorAddition();    
+    std::cout << "----" << endl;
+    testSuperinstructions();
+    std::cout << "----" << endl;
+    testJIT();
+    std::cout << "----" << endl;
+    testFloatingPoint();
+    std::cout << "----" << endl;
+    testVectorAddition4();
+    std::cout << "----" << endl;
+    testParallelCPU();
+    std::cout << "----" << endl;
+    testReductionCPU();
+    std::cout << "----" << endl;
+    testHistogramCPU();
+    std::cout << "----" << endl;
+    testStencilCPU();
 
     // OpenCL Interpreter
     testOpenCLInterpreter();
+    std::cout << "----" << endl;
+    testOpenCLBatch();
+    std::cout << "----" << endl;
+    testOpenCLParallelHeaps();
+    std::cout << "----" << endl;
+    testOpenCLVectorMultiplication4();
+    std::cout << "----" << endl;
+    testOpenCLSaxpy();
+    std::cout << "----" << endl;
+    testOpenCLDotProduct();
+    std::cout << "----" << endl;
+    testOpenCLHistogram();
+    std::cout << "----" << endl;
+    testOpenCLStencil();
 }
 
 int main(int argc, char** argv) {
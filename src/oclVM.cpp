@@ -19,41 +19,78 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <thread>
 #include "instruction.hpp"
 #include "oclVM.hpp"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 using namespace std;
 
-#define DEBUG 1
+// Dump the heaps after every run. gpuBenchmark is built with DEBUG=0
+#ifndef DEBUG
+    #define DEBUG 1
+#endif
+
+#ifdef CL_VERSION_2_0
+SVMHeapMemory::SVMHeapMemory(cl_context context, cl_command_queue commandQueue) {
+    this->context = context;
+    this->commandQueue = commandQueue;
+}
+
+void* SVMHeapMemory::allocate(size_t bytes) {
+    void* address = clSVMAlloc(context, CL_MEM_READ_WRITE, bytes, HEAP_ALIGNMENT);
+    if (address != nullptr) {
+        clEnqueueSVMMap(commandQueue, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, address, bytes, 0, NULL, NULL);
+    }
+    return address;
+}
+
+void SVMHeapMemory::release(void* address) {
+    clEnqueueSVMUnmap(commandQueue, address, 0, NULL, NULL);
+    clFinish(commandQueue);
+    clSVMFree(context, address);
+}
+#endif
 
 OCLVM::OCLVM(vector<int> code, int mainByteCodeIndex) {
     this->code = code;
     this->codeSize = code.size();
-    this->ip = mainByteCodeIndex;
     this->ins = createAllInstructions();
+    decodeProgram(mainByteCodeIndex);
 }
 
 OCLVM::~OCLVM() {
     if (vmAllocated) {
-        this->stack.clear();
+        this->stackSlots.clear();
         this->data.clear();
+    }
+    delete[] buffer;
 
-        // Release OpenCL objects
-        // clReleaseKernel(kernel1);
-        // clReleaseProgram(program);  
-        // clReleaseCommandQueue(commandQueue);
-        // clReleaseMemObject(d_buffer);
-        // clReleaseMemObject(d_code);
-        // clReleaseMemObject(d_stack);
-        // clReleaseMemObject(d_data);
-        // clReleaseContext(context);
-        // free(source);
-        // free(platforms);
-        // free(devices);
+    // Release OpenCL objects. The buffers and heaps of the subclasses are already released.
+    if (openCLInitialized) {
+        waitAsync();
+        releaseKernelEvent();
+        d_code.reset();
+        d_stack.reset();
+        releaseDeviceHeap(d_data);
+        d_buffer.reset();
+        d_state.reset();
+        data = Heap();
+        delete svmMemory;
+        delete bufferPool;
+        // Wait for the background builds before the context is released
+        delete programCache;
+        clReleaseKernel(kernel1);
+        clReleaseProgram(program);
+        clReleaseCommandQueue(commandQueue);
+        clReleaseContext(context);
     }
+    free(source);
+    free(platforms);
+    free(devices);
 }
 
 void OCLVM::setPlatform(int numPlatform) {
@@ -68,6 +105,66 @@ void OCLVM::usePrivateMemory() {
     this->usePrivate = true;
 }
 
+void OCLVM::useSpecializedKernel() {
+    this->specialize = true;
+}
+
+void OCLVM::setTimeSlice(int instructions) {
+    this->timeSlice = max(instructions, 0);
+}
+
+int OCLVM::getNumSlices() {
+    return numSlices;
+}
+
+KernelLayout OCLVM::kernelLayout() {
+    return GLOBAL_STACK_LAYOUT;
+}
+
+void OCLVM::setHeapMode(HeapMode mode) {
+    this->heapMode = mode;
+}
+
+HeapMode OCLVM::getHeapMode() {
+    return heapMode;
+}
+
+void OCLVM::setProgramCacheDirectory(string directory) {
+    this->programCacheDirectory = directory;
+}
+
+void OCLVM::prebuildKernels(vector<string> kernelFilenames) {
+    if (programCache == nullptr) {
+        return;
+    }
+    vector<pair<string, string>> programs;
+    string options = buildOptions();
+    for (string &filename : kernelFilenames) {
+        char* kernelSource = readSource(filename.c_str());
+        programs.push_back(make_pair(string(kernelSource), options));
+        free(kernelSource);
+    }
+    programCache->buildInBackground(programs);
+}
+
+vector<Heap*> OCLVM::heaps() {
+    return { &data };
+}
+
+char* OCLVM::specializedSource() {
+    string kernel;
+    if (vmAllocated) {
+        kernel = generateKernel(decodedCode, entryPoint, stackDepths, kernelLayout());
+    }
+    if (kernel.empty()) {
+        cout << "[SPECIALIZER] The program can not be specialized. Using the interpreter kernel" << endl;
+        return nullptr;
+    }
+    char* source = (char*) malloc(kernel.size() + 1);
+    strcpy(source, kernel.c_str());
+    return source;
+}
+
 long OCLVM::getKernelTime() {
     if (kernelEvent != nullptr) {
         return OCLVM::getTime(kernelEvent);
@@ -75,6 +172,13 @@ long OCLVM::getKernelTime() {
     return 0;
 }
 
+int OCLVM::getNumBuffersCreated() {
+    if (bufferPool == nullptr) {
+        return 0;
+    }
+    return bufferPool->getNumCreated();
+}
+
 int OCLVM::initOpenCL(string kernelFilename, bool loadBinary) {
     cl_int status;	
 	cl_uint numPlatforms = 0;
@@ -127,6 +231,14 @@ int OCLVM::initOpenCL(string kernelFilename, bool loadBinary) {
 		status = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, numDevices, devices, NULL);
 	}
 	
+    // The double precision bytecodes need cl_khr_fp64: the kernels only implement them when the device supports it
+    for (DecodedInstruction &instruction : decodedCode) {
+        if (isDoubleOpcode(instruction.opcode) && !hasDeviceExtension("cl_khr_fp64")) {
+            cout << "[FP64] The device does not support double precision (cl_khr_fp64)" << endl;
+            return -1;
+        }
+    }
+
 	context = clCreateContext(NULL, numDevices, devices, NULL, NULL, &status);
 	
 	commandQueue = clCreateCommandQueue(context, devices[0], CL_QUEUE_PROFILING_ENABLE, &status);	
@@ -153,18 +265,22 @@ int OCLVM::initOpenCL(string kernelFilename, bool loadBinary) {
             abort();
         }
     } else { 
-	    const char *sourceFile = kernelFilename.c_str();
-	    source = readSource(sourceFile);
-	    program = clCreateProgramWithSource(context, 1, (const char**)&source, NULL, &status);
-        if (status != CL_SUCCESS) {
-            cout << "Error in clCreateProgramWithSource. Error code = " << status  << endl;
-		    abort();	
+        source = nullptr;
+        if (specialize && timeSlice > 0) {
+            cout << "[SPECIALIZER] The specialized kernel can not run in time slices. Using the interpreter kernel" << endl;
+        } else if (specialize) {
+            source = specializedSource();
         }
-
-	    cl_int buildErr;
-	    buildErr = clBuildProgram(program, numDevices, devices, NULL, NULL, NULL);
-        if (buildErr != CL_SUCCESS) {
-            cout << "Error in clBuildProgram. Error code = " << buildErr  << endl;
+        if (source == nullptr) {
+	        const char *sourceFile = kernelFilename.c_str();
+	        source = readSource(sourceFile);
+        }
+        // Load the program from the cache, or build it (for the device of the command queue) and store it
+        programCache = new ProgramCache(context, devices[0], programCacheDirectory);
+	    string options = buildOptions();
+	    program = programCache->build(source, options, &status);
+        if (program == nullptr) {
+            cout << "Error in clBuildProgram. Error code = " << status  << endl;
 		    abort();	
         }
 
@@ -174,64 +290,223 @@ int OCLVM::initOpenCL(string kernelFilename, bool loadBinary) {
 		    abort();
 	    }
     }
+    bufferPool = new BufferPool(context);
+
+    heapMode = selectHeapMode();
+#ifdef CL_VERSION_2_0
+    if (heapMode == SVM_HEAPS) {
+        // Move the heaps into SVM. Heaps resized later keep the SVM allocator.
+        svmMemory = new SVMHeapMemory(context, commandQueue);
+        for (Heap* heap : heaps()) {
+            *heap = Heap(heap->begin(), heap->end(), HeapAllocator<int>(svmMemory));
+        }
+    }
+#endif
+    openCLInitialized = true;
     return 0;
 }
 
-void OCLVM::createBuffers() {
-    this->buffer = new char[BUFFER_SIZE];
-    // Create all buffers
-    cl_int status;
- 	d_code = clCreateBuffer(context, CL_MEM_READ_ONLY, codeSize * sizeof(int), NULL, &status);
-    if (status != CL_SUCCESS) {
-        cout << "Error in clCreateBuffer: " << status << endl;
+HeapMode OCLVM::selectHeapMode() {
+    cl_bool unifiedMemory = CL_FALSE;
+    clGetDeviceInfo(devices[0], CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(cl_bool), &unifiedMemory, NULL);
+    bool svm = false;
+#ifdef CL_VERSION_2_0
+    cl_device_svm_capabilities svmCapabilities = 0;
+    cl_int status = clGetDeviceInfo(devices[0], CL_DEVICE_SVM_CAPABILITIES, sizeof(svmCapabilities), &svmCapabilities, NULL);
+    svm = status == CL_SUCCESS && (svmCapabilities & CL_DEVICE_SVM_COARSE_GRAIN_BUFFER);
+#endif
+
+    HeapMode mode = heapMode;
+    if (mode == AUTO_HEAPS) {
+        if (!unifiedMemory) {
+            mode = COPY_HEAPS;
+        } else {
+            mode = svm ? SVM_HEAPS : HOST_PTR_HEAPS;
+        }
+    } else if (mode == SVM_HEAPS && !svm) {
+        cout << "[HEAPS] The device does not support coarse-grained SVM. Using host pointer buffers" << endl;
+        mode = HOST_PTR_HEAPS;
     }
-    d_stack = clCreateBuffer(context, CL_MEM_READ_WRITE, stackSize * sizeof(int), NULL, &status);
-    d_data = clCreateBuffer(context, CL_MEM_READ_WRITE, dataSize * sizeof(int), NULL, &status);
-    d_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, BUFFER_SIZE * sizeof(char), NULL, &status);
+    const char* names[] = { "auto", "copy", "host pointer", "SVM" };
+    cout << "Heap mode: " << names[mode] << endl;
+    return mode;
 }
 
-void OCLVM::runInterpreter() {
-    if (!buffersCreated) {
-        createBuffers();
-        buffersCreated = true;
+bool OCLVM::hasDeviceExtension(string extension) {
+    size_t size = 0;
+    clGetDeviceInfo(devices[0], CL_DEVICE_EXTENSIONS, 0, NULL, &size);
+    vector<char> names(size + 1, '\0');
+    clGetDeviceInfo(devices[0], CL_DEVICE_EXTENSIONS, size, names.data(), NULL);
+    // Extensions are separated by spaces
+    string extensions = " " + string(names.data()) + " ";
+    return extensions.find(" " + extension + " ") != string::npos;
+}
+
+string OCLVM::buildOptions() {
+    if (!vmAllocated) {
+        // The program has not been verified yet: use the defaults of the kernel
+        return "";
+    }
+    string options = "-DSTACK_SIZE=" + to_string(stackSize);
+    if (checkStackBounds) {
+        options += " -DSTACK_BOUNDS_CHECKS -DFRAME_SIZE=" + to_string(frameDepth);
+    }
+    if (timeSlice > 0) {
+        options += " -DTIME_SLICES";
     }
+    return options;
+}
+
+void OCLVM::prepareBuffer(PooledBuffer &buffer, size_t size, cl_mem_flags flags) {
+    if (!buffer.matches(size, flags)) {
+        buffer = bufferPool->acquire(size, flags);
+    }
+}
 
-    // Copy code from HOST->DEVICE
-    cl_int status = clEnqueueWriteBuffer(commandQueue, d_code, CL_TRUE, 0, codeSize * sizeof(int), code.data(), 0, NULL, &writeEvent[0]);
-    status |= clEnqueueWriteBuffer(commandQueue, d_data, CL_TRUE, 0, dataSize * sizeof(int), data.data(), 0, NULL, &writeEvent[1]);
+void OCLVM::uploadCode() {
+    size_t codeBytes = decodedCode.size() * sizeof(DecodedInstruction);
+    if (codeUploadedTo == d_code.get() && uploadedCode.size() == decodedCode.size()
+        && memcmp(uploadedCode.data(), decodedCode.data(), codeBytes) == 0) {
+        return;
+    }
+    cl_int status = clEnqueueWriteBuffer(commandQueue, d_code.get(), blocking(), 0, codeBytes, decodedCode.data(), 0, NULL, NULL);
     if (status != CL_SUCCESS) {
         cout << "Error in clEnqueueWriteBuffer. Error code = " << status  << endl;
+        return;
+    }
+    uploadedCode = decodedCode;
+    codeUploadedTo = d_code.get();
+}
+
+void OCLVM::releaseKernelEvent() {
+    if (kernelEvent != nullptr) {
+        clReleaseEvent(kernelEvent);
+        kernelEvent = nullptr;
+    }
+}
+
+void OCLVM::bindHeap(Heap &heap, DeviceHeap &device, int argIndex) {
+    size_t bytes = heap.size() * sizeof(int);
+    cl_int status = CL_SUCCESS;
+    switch (heapMode) {
+#ifdef CL_VERSION_2_0
+        case SVM_HEAPS:
+            if (bytes > 0) {
+                status = clEnqueueSVMUnmap(commandQueue, heap.data(), 0, NULL, NULL);
+            }
+            status |= clSetKernelArgSVMPointer(kernel1, argIndex, heap.data());
+            break;
+#endif
+        case HOST_PTR_HEAPS:
+            if (device.hostPointer != heap.data() || device.size != bytes) {
+                // New or resized heap: wrap its memory in a new buffer
+                releaseDeviceHeap(device);
+                device.hostBuffer = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, bytes, heap.data(), &status);
+                device.hostPointer = heap.data();
+                device.size = bytes;
+            } else if (device.mapped) {
+                status = clEnqueueUnmapMemObject(commandQueue, device.hostBuffer, device.hostPointer, 0, NULL, NULL);
+            }
+            device.mapped = false;
+            status |= clSetKernelArg(kernel1, argIndex, sizeof(cl_mem), &device.hostBuffer);
+            break;
+        default:
+            prepareBuffer(device.buffer, bytes, CL_MEM_READ_WRITE);
+            status = clEnqueueWriteBuffer(commandQueue, device.buffer.get(), blocking(), 0, bytes, heap.data(), 0, NULL, NULL);
+            status |= clSetKernelArg(kernel1, argIndex, sizeof(cl_mem), device.buffer.address());
+            break;
+    }
+    if (status != CL_SUCCESS) {
+        cout << "Error in bindHeap. Error code = " << status  << endl;
+    }
+}
+
+void OCLVM::returnHeap(Heap &heap, DeviceHeap &device) {
+    size_t bytes = heap.size() * sizeof(int);
+    cl_int status = CL_SUCCESS;
+    if (bytes == 0) {
+        return;
+    }
+    switch (heapMode) {
+#ifdef CL_VERSION_2_0
+        case SVM_HEAPS:
+            status = clEnqueueSVMMap(commandQueue, blocking(), CL_MAP_READ | CL_MAP_WRITE, heap.data(), bytes, 0, NULL, NULL);
+            break;
+#endif
+        case HOST_PTR_HEAPS:
+            // The mapped pointer is the heap itself (CL_MEM_USE_HOST_PTR)
+            clEnqueueMapBuffer(commandQueue, device.hostBuffer, blocking(), CL_MAP_READ | CL_MAP_WRITE, 0, bytes, 0, NULL, NULL, &status);
+            device.mapped = status == CL_SUCCESS;
+            break;
+        default:
+            status = clEnqueueReadBuffer(commandQueue, device.buffer.get(), blocking(), 0, bytes, heap.data(), 0, NULL, NULL);
+            break;
     }
+    if (status != CL_SUCCESS) {
+        cout << "Error in returnHeap. Error code = " << status  << endl;
+    }
+}
+
+void OCLVM::releaseDeviceHeap(DeviceHeap &device) {
+    if (device.hostBuffer != nullptr) {
+        if (device.mapped) {
+            clEnqueueUnmapMemObject(commandQueue, device.hostBuffer, device.hostPointer, 0, NULL, NULL);
+            clFinish(commandQueue);
+        }
+        clReleaseMemObject(device.hostBuffer);
+    }
+    device.hostBuffer = nullptr;
+    device.hostPointer = nullptr;
+    device.size = 0;
+    device.mapped = false;
+    device.buffer.reset();
+}
+
+void OCLVM::createBuffers() {
+    if (buffer == nullptr) {
+        buffer = new char[BUFFER_SIZE];
+    }
+    prepareBuffer(d_code, decodedSize * sizeof(DecodedInstruction), CL_MEM_READ_ONLY);
+    // One extra slot: the kernel caches the top of the stack and uses stack[-1] as a guard
+    prepareBuffer(d_stack, (stackSize + 1) * sizeof(int), CL_MEM_READ_WRITE);
+    prepareBuffer(d_buffer, BUFFER_SIZE * sizeof(char), CL_MEM_READ_WRITE);
+    prepareBuffer(d_state, STATE_STACK * sizeof(int), CL_MEM_READ_WRITE);
+}
+
+void OCLVM::startRun() {
+    createBuffers();
+
+    // Copy the decoded code (if it changed) from HOST->DEVICE and give the heap to the device
+    uploadCode();
+    bindHeap(data, d_data, 2);
     
     int traceFlag = (trace)? 1: 0;
     // Set arguments to the kernel
-	status  = clSetKernelArg(kernel1, 0, sizeof(cl_mem), &d_code);
-    status |= clSetKernelArg(kernel1, 1, sizeof(cl_mem), &d_stack);
-    status |= clSetKernelArg(kernel1, 2, sizeof(cl_mem), &d_data);
-    status |= clSetKernelArg(kernel1, 3, sizeof(cl_mem), &d_buffer);
-	status |= clSetKernelArg(kernel1, 4, sizeof(cl_int), &codeSize);
+	cl_int status = clSetKernelArg(kernel1, 0, sizeof(cl_mem), d_code.address());
+    status |= clSetKernelArg(kernel1, 1, sizeof(cl_mem), d_stack.address());
+    status |= clSetKernelArg(kernel1, 3, sizeof(cl_mem), d_buffer.address());
+	status |= clSetKernelArg(kernel1, 4, sizeof(cl_int), &decodedSize);
     status |= clSetKernelArg(kernel1, 5, sizeof(cl_int), &ip);
     status |= clSetKernelArg(kernel1, 6, sizeof(cl_int), &fp);
     status |= clSetKernelArg(kernel1, 7, sizeof(cl_int), &sp);
     status |= clSetKernelArg(kernel1, 8, sizeof(cl_int), &traceFlag);
+    status |= clSetKernelArg(kernel1, 9, sizeof(cl_mem), d_state.address());
+    status |= clSetKernelArg(kernel1, 10, sizeof(cl_int), &timeSlice);
     if (status != CL_SUCCESS) {
 		cout << "Error in clSetKernelArgs. Error code = " << status  << endl;
 	}
+}
 
-    // Launch Kernel with 1 thread local and global
-    size_t globalWorkSize[] = {1};
-    size_t localWorkSize[] = {1};
-    status = clEnqueueNDRangeKernel(commandQueue, kernel1, 1, NULL, globalWorkSize, localWorkSize, 0, NULL, &kernelEvent);
-    if (status != CL_SUCCESS) {
-		cout << "Error in clEnqueueNDRangeKernel. Error code = " << status  << endl;
-	}
-
+void OCLVM::finishRun() {
     // Obtain buffer and heap (DEVICE -> HOST)
-    status = clEnqueueReadBuffer(commandQueue, d_buffer, CL_TRUE, 0,  sizeof(char) * BUFFER_SIZE, buffer, 0, NULL, &readEvent[0]);
-    status |= clEnqueueReadBuffer(commandQueue, d_data, CL_TRUE, 0,  sizeof(int) * data.size(), data.data(), 0, NULL, &readEvent[1]);
+    cl_int status = clEnqueueReadBuffer(commandQueue, d_buffer.get(), blocking(), 0,  sizeof(char) * BUFFER_SIZE, buffer, 0, NULL, NULL);
+    returnHeap(data, d_data);
     if (status != CL_SUCCESS) {
         cout << "Error in clEnqueueReadBuffer. Error code = " << status  << endl;
     }
+}
+
+void OCLVM::completeRun() {
     if (DEBUG) {
         for (auto i = 0; i < data.size(); i++) {
             cout << data[i]  << " ";
@@ -240,70 +515,308 @@ void OCLVM::runInterpreter() {
     }
 }
 
+void OCLVM::launchSlice() {
+    // Launch Kernel with 1 thread local and global
+    size_t globalWorkSize[] = {1};
+    size_t localWorkSize[] = {1};
+    releaseKernelEvent();
+    cl_int status = clEnqueueNDRangeKernel(commandQueue, kernel1, 1, NULL, globalWorkSize, localWorkSize, 0, NULL, &kernelEvent);
+    if (status != CL_SUCCESS) {
+		cout << "Error in clEnqueueNDRangeKernel. Error code = " << status  << endl;
+	}
+    numSlices++;
+}
+
+bool OCLVM::runSlice() {
+    cl_int status;
+    if (!runStarted) {
+        waitAsync();
+        startRun();
+        // The first slice starts from the registers passed as arguments
+        if (timeSlice > 0) {
+            int first = SLICE_FIRST;
+            status = clEnqueueWriteBuffer(commandQueue, d_state.get(), CL_TRUE, STATE_STATUS * sizeof(int), sizeof(int), &first, 0, NULL, NULL);
+            if (status != CL_SUCCESS) {
+                cout << "Error in clEnqueueWriteBuffer. Error code = " << status  << endl;
+            }
+        }
+        runStarted = true;
+        numSlices = 0;
+    }
+    launchSlice();
+
+    // Without time slices the kernel runs the whole program. Otherwise read the status saved by the slice: the
+    // registers and the stack stay on the device for the next one.
+    bool halted = true;
+    if (timeSlice > 0) {
+        int sliceStatus = SLICE_HALTED;
+        status = clEnqueueReadBuffer(commandQueue, d_state.get(), CL_TRUE, STATE_STATUS * sizeof(int), sizeof(int), &sliceStatus, 0, NULL, NULL);
+        if (status != CL_SUCCESS) {
+            cout << "Error in clEnqueueReadBuffer. Error code = " << status  << endl;
+        }
+        halted = sliceStatus != SLICE_PREEMPTED;
+    }
+    if (halted) {
+        finishRun();
+        completeRun();
+        runStarted = false;
+    }
+    return halted;
+}
+
+void OCLVM::runInterpreter() {
+    while (!runSlice()) {
+    }
+}
+
+void OCLVM::enqueueRun() {
+    startRun();
+    numSlices = 0;
+    launchSlice();
+    finishRun();
+}
+
+shared_future<void> OCLVM::runInterpreterAsync(function<void()> callback) {
+    if (timeSlice > 0) {
+        cout << "[ASYNC] The time slices are launched by the host. Running the program before returning" << endl;
+        runInterpreter();
+        promise<void> done;
+        done.set_value();
+        if (callback) {
+            thread(callback).detach();
+        }
+        return done.get_future().share();
+    }
+    return enqueueAsync([this] { enqueueRun(); }, callback);
+}
+
+cl_bool OCLVM::blocking() {
+    return asyncEnqueue ? CL_FALSE : CL_TRUE;
+}
+
+shared_future<void> OCLVM::enqueueAsync(function<void()> enqueue, function<void()> callback) {
+    waitAsync();
+    asyncEnqueue = true;
+    enqueue();
+    asyncEnqueue = false;
+
+    asyncPromise = promise<void>();
+    asyncFuture = asyncPromise.get_future().share();
+    asyncCallback = callback;
+    // The run can complete, and its callback enqueue the next one, before clSetEventCallback returns
+    shared_future<void> future = asyncFuture;
+    // The queue is in order: the marker completes after all the commands of the run
+    cl_int status = clEnqueueMarkerWithWaitList(commandQueue, 0, NULL, &asyncEvent);
+    if (status == CL_SUCCESS) {
+        status = clSetEventCallback(asyncEvent, CL_COMPLETE, completeAsync, this);
+    }
+    if (status != CL_SUCCESS) {
+        cout << "Error in clSetEventCallback. Error code = " << status  << endl;
+        // Complete the run on this thread
+        clFinish(commandQueue);
+        completeAsync(asyncEvent, CL_COMPLETE, this);
+    }
+    clFlush(commandQueue);
+    return future;
+}
+
+void CL_CALLBACK OCLVM::completeAsync(cl_event event, cl_int status, void* vm) {
+    OCLVM* self = (OCLVM*) vm;
+    if (status == CL_COMPLETE) {
+        self->completeRun();
+    } else {
+        cout << "[ASYNC] The run failed. Error code = " << status  << endl;
+    }
+    // The VM can be destroyed as soon as the future is ready: do not touch it after that
+    function<void()> callback = move(self->asyncCallback);
+    promise<void> done = move(self->asyncPromise);
+    done.set_value();
+    // OpenCL calls that block are undefined in an event callback, and the callback may enqueue the next run:
+    // run it on a host thread
+    if (callback) {
+        thread(callback).detach();
+    }
+}
+
+void OCLVM::waitAsync() {
+    if (asyncFuture.valid()) {
+        asyncFuture.wait();
+        asyncFuture = shared_future<void>();
+    }
+    if (asyncEvent != nullptr) {
+        clReleaseEvent(asyncEvent);
+        asyncEvent = nullptr;
+    }
+}
+
 // ====================================================================
 // OCLVMPrivate Class
 // ====================================================================
 OCLVMPrivate::OCLVMPrivate(vector<int> code, int mainByteCodeIndex) {
     this->code = code;
     this->codeSize = code.size();
-    this->ip = mainByteCodeIndex;
     this->ins = createAllInstructions();
+    decodeProgram(mainByteCodeIndex);
 }
 
-void OCLVMPrivate::runInterpreter() {
+KernelLayout OCLVMPrivate::kernelLayout() {
+    return PRIVATE_STACK_LAYOUT;
+}
 
-    cout << "Running PRIVATE" << endl;
+void OCLVMPrivate::startRun() {
 
-    this->buffer = new char[BUFFER_SIZE];
+    cout << "Running PRIVATE" << endl;
 
-    // Create all buffers
-    cl_int status;
- 	cl_mem d_code = clCreateBuffer(context, CL_MEM_READ_ONLY, codeSize * sizeof(int), NULL, &status);
-    if (status != CL_SUCCESS) {
-        cout << "Error in clCreateBuffer: " << status << endl;
-    }
-    cl_mem d_stack = clCreateBuffer(context, CL_MEM_READ_WRITE, stackSize * sizeof(int), NULL, &status);
-    cl_mem d_data = clCreateBuffer(context, CL_MEM_READ_WRITE, dataSize * sizeof(int), NULL, &status);
-    cl_mem d_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, BUFFER_SIZE * sizeof(char), NULL, &status);
-    
-    // Copy code from HOST->DEVICE
-    status = clEnqueueWriteBuffer(commandQueue, d_code, CL_TRUE, 0, codeSize * sizeof(int), code.data(), 0, NULL, &writeEvent[0]);
-    status |= clEnqueueWriteBuffer(commandQueue, d_data, CL_TRUE, 0, dataSize * sizeof(int), data.data(), 0, NULL, &writeEvent[1]);
-    if (status != CL_SUCCESS) {
-        cout << "Error in clEnqueueWriteBuffer. Error code = " << status  << endl;
+    // The stack is in private memory: no stack buffer. A preempted slice saves it in the state buffer, with the
+    // guard slot.
+    if (buffer == nullptr) {
+        buffer = new char[BUFFER_SIZE];
     }
+    prepareBuffer(d_code, decodedSize * sizeof(DecodedInstruction), CL_MEM_READ_ONLY);
+    prepareBuffer(d_buffer, BUFFER_SIZE * sizeof(char), CL_MEM_READ_WRITE);
+    prepareBuffer(d_state, (STATE_STACK + stackSize + 1) * sizeof(int), CL_MEM_READ_WRITE);
+
+    // Copy the decoded code (if it changed) from HOST->DEVICE and give the heap to the device
+    uploadCode();
+    bindHeap(data, d_data, 1);
     
     int t = (trace)? 1: 0;
     // Push Arguments
-	status  = clSetKernelArg(kernel1, 0, sizeof(cl_mem), &d_code);
-    status |= clSetKernelArg(kernel1, 1, sizeof(cl_mem), &d_data);
-    status |= clSetKernelArg(kernel1, 2, sizeof(cl_mem), &d_buffer);
-	status |= clSetKernelArg(kernel1, 3, sizeof(cl_int), &codeSize);
+	cl_int status = clSetKernelArg(kernel1, 0, sizeof(cl_mem), d_code.address());
+    status |= clSetKernelArg(kernel1, 2, sizeof(cl_mem), d_buffer.address());
+	status |= clSetKernelArg(kernel1, 3, sizeof(cl_int), &decodedSize);
     status |= clSetKernelArg(kernel1, 4, sizeof(cl_int), &ip);
     status |= clSetKernelArg(kernel1, 5, sizeof(cl_int), &fp);
     status |= clSetKernelArg(kernel1, 6, sizeof(cl_int), &sp);
     status |= clSetKernelArg(kernel1, 7, sizeof(cl_int), &t);
+    status |= clSetKernelArg(kernel1, 8, sizeof(cl_mem), d_state.address());
+    status |= clSetKernelArg(kernel1, 9, sizeof(cl_int), &timeSlice);
     if (status != CL_SUCCESS) {
 		cout << "Error in clSetKernelArgs. Error code = " << status  << endl;
 	}
+}
 
-    // Launch Kernel
-    size_t globalWorkSize[] = {1};
-    size_t localWorkSize[] = {1};
-    status = clEnqueueNDRangeKernel(commandQueue, kernel1, 1, NULL, globalWorkSize, localWorkSize, 0, NULL, &kernelEvent);
+void OCLVMPrivate::completeRun() {
+    OCLVM::completeRun();
+
+    cout << "Program finished: " << endl;
+    cout << "Result: " << buffer;
+}
+
+// ====================================================================
+// OCLVMBatch Class
+// ====================================================================
+OCLVMBatch::OCLVMBatch(vector<int> code, int mainByteCodeIndex) {
+    this->code = code;
+    this->codeSize = code.size();
+    this->ins = createAllInstructions();
+    decodeProgram(mainByteCodeIndex);
+}
+
+OCLVMBatch::~OCLVMBatch() {
+    if (openCLInitialized) {
+        waitAsync();
+        releaseDeviceHeap(d_batchHeap);
+        d_invocations.reset();
+        batchHeap = Heap();
+    }
+}
+
+// The batch kernel has no specialized version
+KernelLayout OCLVMBatch::kernelLayout() {
+    return NO_KERNEL_LAYOUT;
+}
+
+vector<Heap*> OCLVMBatch::heaps() {
+    return { &data, &batchHeap };
+}
+
+int OCLVMBatch::addInvocation(const vector<int> &heap) {
+    if (!vmAllocated) {
+        cout << "[BATCH] setVMConfig must be called before adding invocations" << endl;
+        exit(-1);
+    }
+    if (heap.size() > dataSize) {
+        cout << "[BATCH] The heap of the invocation has " << heap.size() << " values, the heap size is " << dataSize << endl;
+        exit(-1);
+    }
+    int invocation = invocations.size();
+    size_t offset = (size_t) invocation * dataSize;
+    batchHeap.resize(offset + dataSize);
+    copy(heap.begin(), heap.end(), batchHeap.begin() + offset);
+    fill(batchHeap.begin() + offset + heap.size(), batchHeap.end(), 0);
+
+    // All invocations start at the entry point of the program with an empty stack
+    cl_int4 descriptor;
+    descriptor.s[0] = offset;
+    descriptor.s[1] = ip;
+    descriptor.s[2] = sp;
+    descriptor.s[3] = fp;
+    invocations.push_back(descriptor);
+    invocationsUploadedTo = nullptr;
+    return invocation;
+}
+
+void OCLVMBatch::clearInvocations() {
+    invocations.clear();
+    batchHeap.clear();
+    invocationsUploadedTo = nullptr;
+}
+
+int OCLVMBatch::getNumInvocations() {
+    return invocations.size();
+}
+
+int* OCLVMBatch::getInvocationHeap(int invocation) {
+    return batchHeap.data() + (size_t) invocation * dataSize;
+}
+
+void OCLVMBatch::runInterpreter() {
+    waitAsync();
+    enqueueRun();
+    completeRun();
+}
+
+// The results are in the heaps of the invocations
+void OCLVMBatch::completeRun() {
+}
+
+void OCLVMBatch::enqueueRun() {
+    int numInvocations = invocations.size();
+    if (numInvocations == 0) {
+        return;
+    }
+
+    prepareBuffer(d_code, decodedSize * sizeof(DecodedInstruction), CL_MEM_READ_ONLY);
+    prepareBuffer(d_invocations, numInvocations * sizeof(cl_int4), CL_MEM_READ_ONLY);
+
+    // Copy the decoded code and the descriptors (if they changed) and give the heaps to the device
+    uploadCode();
+    cl_int status = CL_SUCCESS;
+    if (invocationsUploadedTo != d_invocations.get()) {
+        status = clEnqueueWriteBuffer(commandQueue, d_invocations.get(), CL_FALSE, 0, numInvocations * sizeof(cl_int4), invocations.data(), 0, NULL, NULL);
+        invocationsUploadedTo = d_invocations.get();
+    }
+    bindHeap(batchHeap, d_batchHeap, 1);
+
+    status |= clSetKernelArg(kernel1, 0, sizeof(cl_mem), d_code.address());
+    status |= clSetKernelArg(kernel1, 2, sizeof(cl_mem), d_invocations.address());
+    status |= clSetKernelArg(kernel1, 3, sizeof(cl_int), &numInvocations);
+    status |= clSetKernelArg(kernel1, 4, sizeof(cl_int), &decodedSize);
     if (status != CL_SUCCESS) {
-		cout << "Error in clEnqueueNDRangeKernel. Error code = " << status  << endl;
-	}
+        cout << "Error in clSetKernelArgs. Error code = " << status  << endl;
+    }
 
-    // Obtain buffer and heap
-    status = clEnqueueReadBuffer(commandQueue, d_buffer, CL_TRUE, 0,  sizeof(char) * BUFFER_SIZE, buffer, 0, NULL, &readEvent[0]);
-    status |= clEnqueueReadBuffer(commandQueue, d_data, CL_TRUE, 0,  sizeof(int) * data.size(), data.data(), 0, NULL, &readEvent[1]);
-     if (status != CL_SUCCESS) {
-        cout << "Error in clEnqueueReadBuffer. Error code = " << status  << endl;
+    // One work-item per invocation. The runtime selects the work-group size.
+    size_t globalWorkSize[] = {(size_t) numInvocations};
+    releaseKernelEvent();
+    status = clEnqueueNDRangeKernel(commandQueue, kernel1, 1, NULL, globalWorkSize, NULL, 0, NULL, &kernelEvent);
+    if (status != CL_SUCCESS) {
+        cout << "Error in clEnqueueNDRangeKernel. Error code = " << status  << endl;
     }
 
-    cout << "Program finished: " << endl;
-    cout << "Result: " << buffer;
+    // Results of all the invocations with one read
+    returnHeap(batchHeap, d_batchHeap);
 }
 
 // ====================================================================
@@ -312,81 +825,465 @@ void OCLVMPrivate::runInterpreter() {
 OCLVMParallel::OCLVMParallel(vector<int> code, int mainByteCodeIndex) {
     this->code = code;
     this->codeSize = code.size();
-    this->ip = mainByteCodeIndex;
     this->ins = createAllInstructions();
+    decodeProgram(mainByteCodeIndex);
+}
+
+OCLVMParallel::~OCLVMParallel() {
+    if (openCLInitialized) {
+        waitAsync();
+        releaseDeviceHeap(d_heaps);
+        d_partials.reset();
+        d_tileCounter.reset();
+        heapData = Heap();
+    }
+}
+
+vector<Heap*> OCLVMParallel::heaps() {
+    return { &data, &heapData };
+}
+
+// The parallel kernel (one work-item per group) has no specialized version
+KernelLayout OCLVMParallel::kernelLayout() {
+    return NO_KERNEL_LAYOUT;
+}
+
+void OCLVMParallel::setHeaps(vector<HeapAccess> access, int heapSize) {
+    if (openCLInitialized && access != heapAccess) {
+        cout << "[HEAPS] The heaps can not change after initOpenCL" << endl;
+        exit(-1);
+    }
+    if (access.empty() || access.size() > MAX_PARALLEL_HEAPS) {
+        cout << "[HEAPS] The program needs between 1 and " << MAX_PARALLEL_HEAPS << " heaps" << endl;
+        exit(-1);
+    }
+    this->heapAccess = access;
+    this->numParallelHeaps = access.size();
+    if (vmAllocated) {
+        // Check the heap numbers of the program again
+        verifyProgram();
+    }
+    setHeapSizes(heapSize);
 }
 
 void OCLVMParallel::setHeapSizes(int dataSize) {
-    this->data1.resize(dataSize);
-    this->data2.resize(dataSize);
-    this->data3.resize(dataSize);
+    if (heapAccess.empty()) {
+        heapAccess.assign(NUM_PARALLEL_HEAPS, READ_WRITE_HEAP);
+    }
+    // Keep the values of every heap, at the offset of its new size
+    Heap resized(heapAccess.size() * (size_t) dataSize, 0, heapData.get_allocator());
+    int keep = min(heapSize, dataSize);
+    for (int h = 0; h < (int) heapAccess.size() && keep > 0; h++) {
+        copy(heapData.begin() + (size_t) h * heapSize, heapData.begin() + (size_t) h * heapSize + keep, resized.begin() + (size_t) h * dataSize);
+    }
+    heapData = move(resized);
+    this->heapSize = dataSize;
+    // The heaps move in the device buffer: resident heaps are copied whole in the next run
+    modifiedRanges.assign(heapAccess.size(), DirtyRanges());
+    heapsUploadedTo = nullptr;
 }
 
 void OCLVMParallel::initHeap() {
-    for (auto i = 0; i < data1.size(); i++) {
-        data1[i] = i;
+    int numHeaps = heapAccess.size();
+    for (int h = 0; h < numHeaps; h++) {
+        int* heap = getHeap(h);
+        for (auto i = 0; i < heapSize; i++) {
+            heap[i] = (h < numHeaps - 1) ? i : 1;
+        }
+        markHeapModified(h, 0, heapSize);
+    }
+}
+
+int OCLVMParallel::getNumHeaps() {
+    return heapAccess.size();
+}
+
+int* OCLVMParallel::getHeap(int heap) {
+    return heapData.data() + (size_t) heap * heapSize;
+}
+
+void OCLVMParallel::setResidentHeaps(bool residentHeaps) {
+    this->residentHeaps = residentHeaps;
+    heapsUploadedTo = nullptr;
+}
+
+void OCLVMParallel::markHeapModified(int heap, int from, int count) {
+    if (heap < 0 || heap >= (int) heapAccess.size()) {
+        cout << "[HEAPS] The program has no heap " << heap << endl;
+        return;
     }
-    for (auto i = 0; i < data2.size(); i++) {
-        data2[i] = i;
+    size_t begin = max(from, 0);
+    size_t end = min((size_t) max(from + count, 0), (size_t) heapSize);
+    modifiedRanges.resize(heapAccess.size());
+    modifiedRanges[heap].add(begin, end);
+}
+
+void OCLVMParallel::syncHeaps() {
+    waitAsync();
+    if (heapMode != COPY_HEAPS || heapsUploadedTo == nullptr) {
+        // The heaps are shared with the device, or they are not on the device
+        return;
+    }
+    cl_int status = CL_SUCCESS;
+    for (int h = 0; h < (int) heapAccess.size(); h++) {
+        if (downloadMask & (1u << h)) {
+            size_t offset = (size_t) h * heapSize * sizeof(int);
+            status |= clEnqueueReadBuffer(commandQueue, d_heaps.buffer.get(), CL_FALSE, offset, heapSize * sizeof(int), getHeap(h), 0, NULL, NULL);
+        }
     }
-    for (auto i = 0; i < data3.size(); i++) {
-        data3[i] = 1;
+    status |= clFinish(commandQueue);
+    if (status != CL_SUCCESS) {
+        cout << "Error in syncHeaps. Error code = " << status  << endl;
     }
 }
 
-void OCLVMParallel::runInterpreter(size_t range) {
+void OCLVMParallel::syncHeap(int heap) {
+    if (heap < 0 || heap >= (int) heapAccess.size()) {
+        cout << "[HEAPS] The program has no heap " << heap << endl;
+        return;
+    }
+    waitAsync();
+    if (heapMode != COPY_HEAPS || heapsUploadedTo == nullptr) {
+        return;
+    }
+    size_t offset = (size_t) heap * heapSize * sizeof(int);
+    cl_int status = clEnqueueReadBuffer(commandQueue, d_heaps.buffer.get(), CL_TRUE, offset, heapSize * sizeof(int), getHeap(heap), 0, NULL, NULL);
+    if (status != CL_SUCCESS) {
+        cout << "Error in syncHeap. Error code = " << status  << endl;
+    }
+}
 
-    this->buffer = new char[BUFFER_SIZE];
+void OCLVMParallel::setWorkGroupSize(int workGroupSize) {
+    this->workGroupSize = workGroupSize;
+}
 
-    // Create all buffers
-    cl_int status;
- 	cl_mem d_code = clCreateBuffer(context, CL_MEM_READ_ONLY, codeSize * sizeof(int), NULL, &status);
-    cl_mem d_data1 = clCreateBuffer(context, CL_MEM_READ_WRITE, data1.size() * sizeof(int), NULL, &status);
-    cl_mem d_data2 = clCreateBuffer(context, CL_MEM_READ_WRITE, data2.size() * sizeof(int), NULL, &status);
-    cl_mem d_data3 = clCreateBuffer(context, CL_MEM_READ_WRITE, data3.size() * sizeof(int), NULL, &status);
-    cl_mem d_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, BUFFER_SIZE * sizeof(char), NULL, &status);
-    
-    // Copy code from HOST->DEVICE
-    status = clEnqueueWriteBuffer(commandQueue, d_code, CL_TRUE, 0, codeSize * sizeof(int), code.data(), 0, NULL, &writeEvent[0]);
-    status |= clEnqueueWriteBuffer(commandQueue, d_data1, CL_TRUE, 0, dataSize * sizeof(int), data1.data(), 0, NULL, &writeEvent[1]);
-    status |= clEnqueueWriteBuffer(commandQueue, d_data2, CL_TRUE, 0, dataSize * sizeof(int), data2.data(), 0, NULL, &writeEvent[2]);
-    status |= clEnqueueWriteBuffer(commandQueue, d_data3, CL_TRUE, 0, dataSize * sizeof(int), data3.data(), 0, NULL, &writeEvent[3]);
+void OCLVMParallel::setTileSize(int tileSize) {
+    this->tileSize = tileSize;
+}
+
+void OCLVMParallel::setGridStride(bool gridStride) {
+    this->gridStride = gridStride;
+}
+
+void OCLVMParallel::setPersistentThreads(bool persistentThreads) {
+    this->persistentThreads = persistentThreads;
+}
+
+size_t OCLVMParallel::getLaunchedWorkItems() {
+    return launchedWorkItems;
+}
+
+size_t OCLVMParallel::bindGrid(size_t globalWorkItems, size_t localWorkItems) {
+    size_t numTiles = (globalWorkItems + localWorkItems - 1) / localWorkItems;
+    size_t numGroups = numTiles;
+    if (gridStride || persistentThreads) {
+        cl_uint computeUnits = 1;
+        clGetDeviceInfo(devices[0], CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &computeUnits, NULL);
+        numGroups = min(numTiles, (size_t) max(computeUnits, (cl_uint) 1) * GRID_STRIDE_GROUPS_PER_UNIT);
+    }
+    cl_int tiles = numTiles;
+    cl_int status = clSetKernelArg(kernel1, 10, sizeof(cl_int), &tiles);
+    // The counter of the tiles handed out after the first tile of every group (argument 11)
+    prepareBuffer(d_tileCounter, sizeof(cl_int), CL_MEM_READ_WRITE);
+    if (persistentThreads) {
+        cl_int zero = 0;
+        status |= clEnqueueFillBuffer(commandQueue, d_tileCounter.get(), &zero, sizeof(cl_int), 0, sizeof(cl_int), 0, NULL, NULL);
+    }
+    status |= clSetKernelArg(kernel1, 11, sizeof(cl_mem), d_tileCounter.address());
     if (status != CL_SUCCESS) {
-        cout << "Error in clEnqueueWriteBuffer. Error code = " << status  << endl;
+        cout << "Error in clSetKernelArg. Error code = " << status  << endl;
+    }
+    return numGroups * localWorkItems;
+}
+
+void OCLVMParallel::computeHeapMasks() {
+    if (heapAccess.empty()) {
+        heapAccess.assign(NUM_PARALLEL_HEAPS, READ_WRITE_HEAP);
+    }
+    modifiedRanges.resize(heapAccess.size());
+    if (tileSize == 0 || tileSize % workGroupSize != 0) {
+        tileSize = workGroupSize;
+    }
+    unsigned loaded = 0;
+    unsigned stored = 0;
+    unsigned globalLoads = 0;
+    unsigned globalStores = 0;
+    // Heaps of doubles and vectors are accessed in global memory, not in the tiles
+    unsigned wideLoads = 0;
+    unsigned wideStores = 0;
+    // Atomics update the elements of the whole heap in global memory
+    unsigned atomics = 0;
+    // LLOAD_TILE reads elements of the neighbour tiles, in global memory
+    unsigned tileLoads = 0;
+    for (DecodedInstruction &instruction : decodedCode) {
+        switch (instruction.opcode) {
+            case PARALLEL_GLOAD_INDEXED:
+            case THREAD_ID_PARALLEL_GLOAD_INDEXED:
+                loaded |= 1u << instruction.operand;
+                break;
+            case PARALLEL_GSTORE_INDEXED:
+                stored |= 1u << instruction.operand;
+                break;
+            case PARALLEL_DLOAD_INDEXED:
+            case PARALLEL_VLOAD4:
+                wideLoads |= 1u << instruction.operand;
+                break;
+            case PARALLEL_DSTORE_INDEXED:
+            case PARALLEL_VSTORE4:
+                wideStores |= 1u << instruction.operand;
+                break;
+            case ATOMIC_ADD:
+            case ATOMIC_MIN:
+            case ATOMIC_MAX:
+            case ATOMIC_CAS:
+                atomics |= 1u << instruction.operand;
+                break;
+            case LLOAD_TILE:
+                tileLoads |= 1u << instruction.operand;
+                break;
+            case GLOAD:
+            case GLOAD_INDEXED:
+            case DUP_GLOAD_INDEXED:
+            case DLOAD_INDEXED:
+            case VLOAD4:
+                globalLoads = 1;
+                break;
+            case GSTORE:
+            case GSTORE_INDEXED:
+            case DSTORE_INDEXED:
+            case VSTORE4:
+                globalStores = 1;
+                break;
+            default:
+                break;
+        }
+    }
+    if ((loaded | stored) & (wideLoads | wideStores)) {
+        cout << "[HEAPS] A heap is accessed both as a heap of ints and as a heap of doubles or vectors" << endl;
+        exit(-1);
+    }
+    if (stored & atomics) {
+        // The tile written back at the end of the group would overwrite the atomic updates
+        cout << "[HEAPS] A heap is updated both with PARALLEL_GSTORE_INDEXED and with atomics" << endl;
+        exit(-1);
+    }
+    unsigned readable = 0;
+    unsigned writable = 0;
+    for (int h = 0; h < (int) heapAccess.size(); h++) {
+        readable |= (heapAccess[h] != WRITE_ONLY_HEAP) ? 1u << h : 0;
+        writable |= (heapAccess[h] != READ_ONLY_HEAP) ? 1u << h : 0;
+    }
+    // A tile that the program stores to is also read: the elements that it does not store are written back
+    tileReadMask = readable & (loaded | stored);
+    tileWriteMask = writable & stored;
+    uploadMask = tileReadMask | (readable & globalLoads) | (readable & globalStores) | (readable & (wideLoads | wideStores | atomics | tileLoads));
+    downloadMask = tileWriteMask | (writable & globalStores) | (writable & (wideStores | atomics));
+}
+
+string OCLVMParallel::buildOptions() {
+    computeHeapMasks();
+    string options = OCLVM::buildOptions();
+    options += " -DNUM_HEAPS=" + to_string(heapAccess.size());
+    options += " -DWORK_GROUP_SIZE=" + to_string(workGroupSize);
+    options += " -DTILE_SIZE=" + to_string(tileSize);
+    options += " -DHEAP_READ_MASK=" + to_string(tileReadMask);
+    options += " -DHEAP_WRITE_MASK=" + to_string(tileWriteMask);
+    if (localAtomicsOpcode != 0) {
+        options += " -DLOCAL_ATOMICS_HEAP=" + to_string(localAtomicsHeap);
+        options += " -DLOCAL_ATOMICS_SIZE=" + to_string(localAtomicsSize);
+        options += " -DLOCAL_ATOMICS_OPCODE=" + to_string(localAtomicsOpcode);
+    }
+    if (scratchpadSize > 0) {
+        options += " -DSCRATCHPAD_SIZE=" + to_string(scratchpadSize);
+    }
+    if (persistentThreads) {
+        options += " -DDYNAMIC_TILES";
+    }
+    return options;
+}
+
+void OCLVMParallel::createHeapBuffers() {
+    if (buffer == nullptr) {
+        buffer = new char[BUFFER_SIZE];
+    }
+    prepareBuffer(d_code, decodedSize * sizeof(DecodedInstruction), CL_MEM_READ_ONLY);
+    prepareBuffer(d_buffer, BUFFER_SIZE * sizeof(char), CL_MEM_READ_WRITE);
+}
+
+void OCLVMParallel::bindHeaps() {
+    cl_int status = CL_SUCCESS;
+    if (heapMode != COPY_HEAPS) {
+        bindHeap(heapData, d_heaps, 1);
+    } else {
+        prepareBuffer(d_heaps.buffer, heapData.size() * sizeof(int), CL_MEM_READ_WRITE);
+        if (residentHeaps && heapsUploadedTo == d_heaps.buffer.get()) {
+            // The heaps are on the device: copy only what the host modified since the last run
+            status |= uploadModifiedRanges();
+        } else {
+            // Copy only the heaps that the kernel reads
+            for (int h = 0; h < (int) heapAccess.size(); h++) {
+                if (uploadMask & (1u << h)) {
+                    size_t offset = (size_t) h * heapSize * sizeof(int);
+                    status |= clEnqueueWriteBuffer(commandQueue, d_heaps.buffer.get(), CL_FALSE, offset, heapSize * sizeof(int), getHeap(h), 0, NULL, NULL);
+                }
+            }
+            heapsUploadedTo = residentHeaps ? d_heaps.buffer.get() : nullptr;
+        }
+        for (DirtyRanges &ranges : modifiedRanges) {
+            ranges.clear();
+        }
+        status |= clSetKernelArg(kernel1, 1, sizeof(cl_mem), d_heaps.buffer.address());
+    }
+    status |= clSetKernelArg(kernel1, 2, sizeof(cl_int), &heapSize);
+    if (status != CL_SUCCESS) {
+        cout << "Error in bindHeaps. Error code = " << status  << endl;
+    }
+}
+
+cl_int OCLVMParallel::uploadModifiedRanges() {
+    cl_int status = CL_SUCCESS;
+    int numHeaps = heapAccess.size();
+    size_t pitch = (size_t) heapSize * sizeof(int);
+    for (int h = 0; h < numHeaps; h++) {
+        if (!(uploadMask & (1u << h))) {
+            continue;
+        }
+        for (pair<size_t, size_t> range : modifiedRanges[h].get()) {
+            int rows = 1;
+            while (h + rows < numHeaps && (uploadMask & (1u << (h + rows))) && modifiedRanges[h + rows].remove(range)) {
+                rows++;
+            }
+            size_t bytes = (range.second - range.first) * sizeof(int);
+            if (rows == 1) {
+                size_t offset = (size_t) h * pitch + range.first * sizeof(int);
+                status |= clEnqueueWriteBuffer(commandQueue, d_heaps.buffer.get(), CL_FALSE, offset, bytes, getHeap(h) + range.first, 0, NULL, NULL);
+            } else {
+                // The host heaps are packed as in the device buffer: both have a pitch of heapSize elements
+                size_t origin[] = {range.first * sizeof(int), (size_t) h, 0};
+                size_t region[] = {bytes, (size_t) rows, 1};
+                status |= clEnqueueWriteBufferRect(commandQueue, d_heaps.buffer.get(), CL_FALSE, origin, origin, region, pitch, 0,
+                                                   pitch, 0, heapData.data(), 0, NULL, NULL);
+            }
+        }
+    }
+    return status;
+}
+
+void OCLVMParallel::returnHeaps() {
+    if (heapMode != COPY_HEAPS) {
+        returnHeap(heapData, d_heaps);
+        return;
+    }
+    if (residentHeaps) {
+        // The heaps stay on the device until syncHeaps
+        cl_int status = blocking() ? clFinish(commandQueue) : CL_SUCCESS;
+        if (status != CL_SUCCESS) {
+            cout << "Error in returnHeaps. Error code = " << status  << endl;
+        }
+        return;
+    }
+    // Read back only the heaps that the kernel writes
+    cl_int status = CL_SUCCESS;
+    for (int h = 0; h < (int) heapAccess.size(); h++) {
+        if (downloadMask & (1u << h)) {
+            size_t offset = (size_t) h * heapSize * sizeof(int);
+            status |= clEnqueueReadBuffer(commandQueue, d_heaps.buffer.get(), CL_FALSE, offset, heapSize * sizeof(int), getHeap(h), 0, NULL, NULL);
+        }
+    }
+    if (blocking()) {
+        status |= clFinish(commandQueue);
+    }
+    if (status != CL_SUCCESS) {
+        cout << "Error in returnHeaps. Error code = " << status  << endl;
+    }
+}
+
+void OCLVMParallel::bindPartials(size_t numGroups) {
+    // OpenCL buffers can not be empty
+    size_t elements = max((size_t) numReductions * numGroups, (size_t) 1);
+    prepareBuffer(d_partials, elements * sizeof(int), CL_MEM_READ_WRITE);
+    cl_int status = CL_SUCCESS;
+    // Groups that do not run a reduction leave its identity
+    for (int r = 0; r < numReductions; r++) {
+        if (reductionOpcodes[r] != 0) {
+            int identity = reductionIdentity(reductionOpcodes[r]);
+            status |= clEnqueueFillBuffer(commandQueue, d_partials.get(), &identity, sizeof(int), r * numGroups * sizeof(int),
+                                          numGroups * sizeof(int), 0, NULL, NULL);
+        }
+    }
+    status |= clSetKernelArg(kernel1, 9, sizeof(cl_mem), d_partials.address());
+    if (status != CL_SUCCESS) {
+        cout << "Error in bindPartials. Error code = " << status  << endl;
     }
+}
+
+void OCLVMParallel::returnReductions(size_t numGroups) {
+    partialGroups = numGroups;
+    if (numReductions == 0) {
+        return;
+    }
+    // One value per reduction and work-group, instead of the heaps
+    partialResults.resize((size_t) numReductions * numGroups);
+    cl_int status = clEnqueueReadBuffer(commandQueue, d_partials.get(), blocking(), 0, partialResults.size() * sizeof(int), partialResults.data(), 0, NULL, NULL);
+    if (status != CL_SUCCESS) {
+        cout << "Error in returnReductions. Error code = " << status  << endl;
+    }
+}
+
+void OCLVMParallel::completeRun() {
+    if (numReductions > 0) {
+        combinePartials(partialResults.data(), partialGroups);
+    }
+}
+
+void OCLVMParallel::launchKernel(size_t globalWorkItems, size_t localWorkItems) {
+    // Also for kernels loaded from a binary, that are not built with buildOptions
+    computeHeapMasks();
+    createHeapBuffers();
+
+    // Copy the decoded code (if it changed) from HOST->DEVICE and give the heaps to the device
+    uploadCode();
+    bindHeaps();
+    // With grid-stride, fewer work-groups than tiles: the partial results are per launched work-group
+    launchedWorkItems = bindGrid(globalWorkItems, localWorkItems);
+    size_t numGroups = launchedWorkItems / localWorkItems;
+    bindPartials(numGroups);
     
     int t = (trace)? 1: 0;
     // Push Arguments
-	status  = clSetKernelArg(kernel1, 0, sizeof(cl_mem), &d_code);
-    status |= clSetKernelArg(kernel1, 1, sizeof(cl_mem), &d_data1);
-    status |= clSetKernelArg(kernel1, 2, sizeof(cl_mem), &d_data2);
-    status |= clSetKernelArg(kernel1, 3, sizeof(cl_mem), &d_data3);
-    status |= clSetKernelArg(kernel1, 4, sizeof(cl_mem), &d_buffer);
-	status |= clSetKernelArg(kernel1, 5, sizeof(cl_int), &codeSize);
-    status |= clSetKernelArg(kernel1, 6, sizeof(cl_int), &ip);
-    status |= clSetKernelArg(kernel1, 7, sizeof(cl_int), &fp);
-    status |= clSetKernelArg(kernel1, 8, sizeof(cl_int), &sp);
-    status |= clSetKernelArg(kernel1, 9, sizeof(cl_int), &t);
+	cl_int status = clSetKernelArg(kernel1, 0, sizeof(cl_mem), d_code.address());
+    status |= clSetKernelArg(kernel1, 3, sizeof(cl_mem), d_buffer.address());
+	status |= clSetKernelArg(kernel1, 4, sizeof(cl_int), &decodedSize);
+    status |= clSetKernelArg(kernel1, 5, sizeof(cl_int), &ip);
+    status |= clSetKernelArg(kernel1, 6, sizeof(cl_int), &fp);
+    status |= clSetKernelArg(kernel1, 7, sizeof(cl_int), &sp);
+    status |= clSetKernelArg(kernel1, 8, sizeof(cl_int), &t);
     if (status != CL_SUCCESS) {
 		cout << "Error in clSetKernelArgs. Error code = " << status  << endl;
 	}
 
     // Launch Kernel
-    size_t globalWorkSize[] = {range};
-    size_t localWorkSize[] = {1};
+    size_t globalWorkSize[] = {launchedWorkItems};
+    size_t localWorkSize[] = {localWorkItems};
+    releaseKernelEvent();
     status = clEnqueueNDRangeKernel(commandQueue, kernel1, 1, NULL, globalWorkSize, localWorkSize, 0, NULL, &kernelEvent);
     if (status != CL_SUCCESS) {
 		cout << "Error in clEnqueueNDRangeKernel. Error code = " << status  << endl;
 	}
 
-    // Obtain buffer and heap
-    status = clEnqueueReadBuffer(commandQueue, d_buffer, CL_TRUE, 0,  sizeof(char) * BUFFER_SIZE, buffer, 0, NULL, &readEvent[0]);
-    status |= clEnqueueReadBuffer(commandQueue, d_data1, CL_TRUE, 0,  sizeof(int) * data1.size(), data1.data(), 0, NULL, &readEvent[1]);
-    status |= clEnqueueReadBuffer(commandQueue, d_data2, CL_TRUE, 0,  sizeof(int) * data2.size(), data2.data(), 0, NULL, &readEvent[2]);
-    status |= clEnqueueReadBuffer(commandQueue, d_data3, CL_TRUE, 0,  sizeof(int) * data3.size(), data3.data(), 0, NULL, &readEvent[3]);
-     if (status != CL_SUCCESS) {
-        cout << "Error in clEnqueueReadBuffer. Error code = " << status  << endl;
-    }
+    // Obtain the heaps. PRINT discards the values in the parallel kernels, so the print buffer is not read.
+    returnHeaps();
+    returnReductions(numGroups);
+}
+
+void OCLVMParallel::runInterpreter(size_t range) {
+    waitAsync();
+    launchKernel(range, 1);
+    completeRun();
+}
+
+shared_future<void> OCLVMParallel::runInterpreterAsync(size_t range, function<void()> callback) {
+    return enqueueAsync([this, range] { launchKernel(range, 1); }, callback);
 }
 
 // ====================================================================
@@ -395,67 +1292,272 @@ void OCLVMParallel::runInterpreter(size_t range) {
 OCLVMParallelLoop::OCLVMParallelLoop(vector<int> code, int mainByteCodeIndex) {
     this->code = code;
     this->codeSize = code.size();
-    this->ip = mainByteCodeIndex;
     this->ins = createAllInstructions();
+    this->workGroupSize = DEFAULT_WORK_GROUP_SIZE;
+    decodeProgram(mainByteCodeIndex);
 }
 
-void OCLVMParallelLoop::runInterpreter(size_t range1, size_t range2) {
+OCLVMParallelLoop::~OCLVMParallelLoop() {
+    if (openCLInitialized) {
+        waitAsync();
+        releaseChunkEvents();
+        for (int slot = 0; slot < STREAM_SLOTS; slot++) {
+            d_chunks[slot].reset();
+        }
+        if (transferQueue != nullptr) {
+            clReleaseCommandQueue(transferQueue);
+        }
+    }
+}
 
-    this->buffer = new char[BUFFER_SIZE];
+KernelLayout OCLVMParallelLoop::kernelLayout() {
+    return PARALLEL_LOOP_LAYOUT;
+}
 
-    // Create all buffers
-    cl_int status;
- 	cl_mem d_code = clCreateBuffer(context, CL_MEM_READ_ONLY, codeSize * sizeof(int), NULL, &status);
-    cl_mem d_data1 = clCreateBuffer(context, CL_MEM_READ_WRITE, data1.size() * sizeof(int), NULL, &status);
-    cl_mem d_data2 = clCreateBuffer(context, CL_MEM_READ_WRITE, data2.size() * sizeof(int), NULL, &status);
-    cl_mem d_data3 = clCreateBuffer(context, CL_MEM_READ_WRITE, data3.size() * sizeof(int), NULL, &status);
-    cl_mem d_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, BUFFER_SIZE * sizeof(char), NULL, &status);
-    
-    // Copy code from HOST->DEVICE
-    status = clEnqueueWriteBuffer(commandQueue, d_code, CL_TRUE, 0, codeSize * sizeof(int), code.data(), 0, NULL, &writeEvent[0]);
-    status |= clEnqueueWriteBuffer(commandQueue, d_data1, CL_TRUE, 0, dataSize * sizeof(int), data1.data(), 0, NULL, &writeEvent[1]);
-    status |= clEnqueueWriteBuffer(commandQueue, d_data2, CL_TRUE, 0, dataSize * sizeof(int), data2.data(), 0, NULL, &writeEvent[2]);
-    status |= clEnqueueWriteBuffer(commandQueue, d_data3, CL_TRUE, 0, dataSize * sizeof(int), data3.data(), 0, NULL, &writeEvent[3]);
-    if (status != CL_SUCCESS) {
-        cout << "Error in clEnqueueWriteBuffer. Error code = " << status  << endl;
+void OCLVMParallelLoop::setChunkSize(size_t workItems) {
+    this->chunkSize = workItems;
+}
+
+int OCLVMParallelLoop::getNumChunks() {
+    return numChunks;
+}
+
+long OCLVMParallelLoop::getKernelTime() {
+    if (chunkKernelEvents.empty()) {
+        return OCLVM::getKernelTime();
     }
-    
+    long time = 0;
+    for (cl_event event : chunkKernelEvents) {
+        time += getTime(event);
+    }
+    return time;
+}
+
+void OCLVMParallelLoop::releaseChunkEvents() {
+    for (cl_event event : chunkKernelEvents) {
+        clReleaseEvent(event);
+    }
+    chunkKernelEvents.clear();
+}
+
+bool OCLVMParallelLoop::isStreamable() {
+    for (DecodedInstruction &instruction : decodedCode) {
+        switch (instruction.opcode) {
+            case GLOAD:
+            case GSTORE:
+            case GLOAD_INDEXED:
+            case GSTORE_INDEXED:
+            case DUP_GLOAD_INDEXED:
+            case DLOAD_INDEXED:
+            case DSTORE_INDEXED:
+            case PARALLEL_DLOAD_INDEXED:
+            case PARALLEL_DSTORE_INDEXED:
+            case VLOAD4:
+            case VSTORE4:
+            case PARALLEL_VLOAD4:
+            case PARALLEL_VSTORE4:
+            case REDUCE_ADD:
+            case REDUCE_MIN:
+            case REDUCE_MAX:
+            case ATOMIC_ADD:
+            case ATOMIC_MIN:
+            case ATOMIC_MAX:
+            case ATOMIC_CAS:
+            case LLOAD_TILE:
+                return false;
+            default:
+                break;
+        }
+    }
+    return true;
+}
+
+size_t OCLVMParallelLoop::streamingChunkSize(size_t globalWorkItems) {
+    if (heapMode != COPY_HEAPS || residentHeaps) {
+        return 0;
+    }
+    // Heap elements per work-item
+    size_t elementsPerItem = tileSize / workGroupSize;
+    size_t chunkItems = chunkSize;
+    if (chunkItems == 0) {
+        cl_ulong globalMemory = 0;
+        cl_ulong maxAllocation = 0;
+        clGetDeviceInfo(devices[0], CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(cl_ulong), &globalMemory, NULL);
+        clGetDeviceInfo(devices[0], CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &maxAllocation, NULL);
+        // Half of the device memory for the heaps, the rest is left for the runtime
+        cl_ulong budget = min(globalMemory / 2, maxAllocation);
+        cl_ulong heapBytes = heapData.size() * sizeof(int);
+        if (heapBytes <= budget) {
+            return 0;
+        }
+        chunkItems = budget / (STREAM_SLOTS * heapAccess.size() * elementsPerItem * sizeof(int));
+    }
+    // Whole work-groups: the parallel heap accesses are relative to the work-group
+    chunkItems = max(chunkItems / workGroupSize, (size_t) 1) * workGroupSize;
+    if (chunkItems >= globalWorkItems) {
+        return 0;
+    }
+    if (!isStreamable()) {
+        cout << "[STREAMING] The program accesses the whole heap (GLOAD/GSTORE, heaps of doubles or vectors, atomics, tiles of LLOAD_TILE) or has reductions. Running without streaming" << endl;
+        return 0;
+    }
+    return chunkItems;
+}
+
+void OCLVMParallelLoop::runStreaming(size_t globalWorkItems, size_t chunkItems) {
+    cl_int status = CL_SUCCESS;
+    if (transferQueue == nullptr) {
+        transferQueue = clCreateCommandQueue(context, devices[0], CL_QUEUE_PROFILING_ENABLE, &status);
+        if (status != CL_SUCCESS) {
+            cout << "Error in create command. Error code = " << status  << endl;
+            return;
+        }
+    }
+
+    // Heap elements of a chunk: the stride between the heaps in the chunk buffers
+    int chunkElements = chunkItems / workGroupSize * tileSize;
+    int numHeaps = heapAccess.size();
+    createHeapBuffers();
+    uploadCode();
+    for (int slot = 0; slot < STREAM_SLOTS; slot++) {
+        prepareBuffer(d_chunks[slot], (size_t) numHeaps * chunkElements * sizeof(int), CL_MEM_READ_WRITE);
+    }
+
     int t = (trace)? 1: 0;
-    // Push Arguments
-	status  = clSetKernelArg(kernel1, 0, sizeof(cl_mem), &d_code);
-    status |= clSetKernelArg(kernel1, 1, sizeof(cl_mem), &d_data1);
-    status |= clSetKernelArg(kernel1, 2, sizeof(cl_mem), &d_data2);
-    status |= clSetKernelArg(kernel1, 3, sizeof(cl_mem), &d_data3);
-    status |= clSetKernelArg(kernel1, 4, sizeof(cl_mem), &d_buffer);
-	status |= clSetKernelArg(kernel1, 5, sizeof(cl_int), &codeSize);
-    status |= clSetKernelArg(kernel1, 6, sizeof(cl_int), &ip);
-    status |= clSetKernelArg(kernel1, 7, sizeof(cl_int), &fp);
-    status |= clSetKernelArg(kernel1, 8, sizeof(cl_int), &sp);
-    status |= clSetKernelArg(kernel1, 9, sizeof(cl_int), &t);
+    status = clSetKernelArg(kernel1, 0, sizeof(cl_mem), d_code.address());
+    status |= clSetKernelArg(kernel1, 2, sizeof(cl_int), &chunkElements);
+    status |= clSetKernelArg(kernel1, 3, sizeof(cl_mem), d_buffer.address());
+    status |= clSetKernelArg(kernel1, 4, sizeof(cl_int), &decodedSize);
+    status |= clSetKernelArg(kernel1, 5, sizeof(cl_int), &ip);
+    status |= clSetKernelArg(kernel1, 6, sizeof(cl_int), &fp);
+    status |= clSetKernelArg(kernel1, 7, sizeof(cl_int), &sp);
+    status |= clSetKernelArg(kernel1, 8, sizeof(cl_int), &t);
     if (status != CL_SUCCESS) {
-		cout << "Error in clSetKernelArgs. Error code = " << status  << endl;
-	}
+        cout << "Error in clSetKernelArgs. Error code = " << status  << endl;
+    }
+    bindPartials(0);
 
-    // Launch Kernel
-    size_t globalWorkSize[] = {range1};
-    size_t localWorkSize[] = {range2};
-    status = clEnqueueNDRangeKernel(commandQueue, kernel1, 1, NULL, globalWorkSize, localWorkSize, 0, NULL, &kernelEvent);
-    if (status != CL_SUCCESS) {
-		cout << "Error in clEnqueueNDRangeKernel. Error code = " << status  << endl;
-	}
+    numChunks = (globalWorkItems + chunkItems - 1) / chunkItems;
+    launchedWorkItems = 0;
+    vector<cl_event> uploaded(numChunks, nullptr);
+    // Marker after the downloads of each chunk: the kernel that reuses its slot waits for it, also when that kernel has
+    // nothing to upload (write-only heaps)
+    vector<cl_event> downloaded(numChunks, nullptr);
+    size_t localWorkItems = workGroupSize;
 
-    // Obtain buffer and heap
-    status = clEnqueueReadBuffer(commandQueue, d_buffer, CL_TRUE, 0,  sizeof(char) * BUFFER_SIZE, buffer, 0, NULL, &readEvent[0]);
-    status |= clEnqueueReadBuffer(commandQueue, d_data1, CL_TRUE, 0,  sizeof(int) * data1.size(), data1.data(), 0, NULL, &readEvent[1]);
-    status |= clEnqueueReadBuffer(commandQueue, d_data2, CL_TRUE, 0,  sizeof(int) * data2.size(), data2.data(), 0, NULL, &readEvent[2]);
-    status |= clEnqueueReadBuffer(commandQueue, d_data3, CL_TRUE, 0,  sizeof(int) * data3.size(), data3.data(), 0, NULL, &readEvent[3]);
+    // Elements of each heap in the chunk: the heaps can be smaller than the range
+    auto chunkElementsOf = [&](int chunk) -> size_t {
+        size_t begin = (size_t) chunk * chunkElements;
+        return (begin < (size_t) heapSize) ? min((size_t) chunkElements, heapSize - begin) : 0;
+    };
+
+    // Upload a chunk once the kernel of the previous chunk in the same slot has finished
+    auto uploadChunk = [&](int chunk) {
+        int slot = chunk % STREAM_SLOTS;
+        size_t begin = (size_t) chunk * chunkElements;
+        size_t elements = chunkElementsOf(chunk);
+        cl_uint numWaits = (chunk >= STREAM_SLOTS) ? 1 : 0;
+        cl_event* waits = (chunk >= STREAM_SLOTS) ? &chunkKernelEvents[chunk - STREAM_SLOTS] : NULL;
+        for (int heap = 0; heap < numHeaps && elements > 0; heap++) {
+            if (!(uploadMask & (1u << heap))) {
+                continue;
+            }
+            // The transfer queue is in order: the event of the last copy marks the whole chunk
+            if (uploaded[chunk] != nullptr) {
+                clReleaseEvent(uploaded[chunk]);
+            }
+            status |= clEnqueueWriteBuffer(transferQueue, d_chunks[slot].get(), CL_FALSE, (size_t) heap * chunkElements * sizeof(int),
+                                           elements * sizeof(int), getHeap(heap) + begin, numWaits, waits, &uploaded[chunk]);
+        }
+        clFlush(transferQueue);
+    };
+
+    uploadChunk(0);
+    for (int chunk = 0; chunk < numChunks; chunk++) {
+        int slot = chunk % STREAM_SLOTS;
+        size_t firstItem = chunk * chunkItems;
+        size_t workItems = bindGrid(min(chunkItems, globalWorkItems - firstItem), localWorkItems);
+        launchedWorkItems = max(launchedWorkItems, workItems);
+        status |= clSetKernelArg(kernel1, 1, sizeof(cl_mem), d_chunks[slot].address());
+        cl_event kernelDone = nullptr;
+        cl_event waits[2];
+        cl_uint numWaits = 0;
+        if (uploaded[chunk] != nullptr) {
+            waits[numWaits++] = uploaded[chunk];
+        }
+        if (chunk >= STREAM_SLOTS) {
+            waits[numWaits++] = downloaded[chunk - STREAM_SLOTS];
+        }
+        status |= clEnqueueNDRangeKernel(commandQueue, kernel1, 1, &firstItem, &workItems, &localWorkItems,
+                                         numWaits, numWaits ? waits : NULL, &kernelDone);
+        chunkKernelEvents.push_back(kernelDone);
+        clFlush(commandQueue);
+
+        // Overlap with the kernel of this chunk: upload the next chunk and download this one when it finishes
+        if (chunk + 1 < numChunks) {
+            uploadChunk(chunk + 1);
+        }
+        size_t begin = (size_t) chunk * chunkElements;
+        size_t elements = chunkElementsOf(chunk);
+        for (int heap = 0; heap < numHeaps && elements > 0; heap++) {
+            if (!(downloadMask & (1u << heap))) {
+                continue;
+            }
+            status |= clEnqueueReadBuffer(transferQueue, d_chunks[slot].get(), CL_FALSE, (size_t) heap * chunkElements * sizeof(int),
+                                          elements * sizeof(int), getHeap(heap) + begin, 1, &kernelDone, NULL);
+        }
+        // The transfer queue is in order: the marker completes after the downloads of the chunk
+        status |= clEnqueueMarkerWithWaitList(transferQueue, 1, &kernelDone, &downloaded[chunk]);
+        clFlush(transferQueue);
+    }
+    status |= clFinish(transferQueue);
+    status |= clFinish(commandQueue);
+    for (cl_event event : uploaded) {
+        if (event != nullptr) {
+            clReleaseEvent(event);
+        }
+    }
+    for (cl_event event : downloaded) {
+        if (event != nullptr) {
+            clReleaseEvent(event);
+        }
+    }
     if (status != CL_SUCCESS) {
-        cout << "Error in clEnqueueReadBuffer. Error code = " << status  << endl;
+        cout << "Error in runStreaming. Error code = " << status  << endl;
+    }
+}
+
+void OCLVMParallelLoop::runInterpreter(size_t range1, size_t range2) {
+    waitAsync();
+    enqueueLoop(range1, range2);
+    completeRun();
+}
+
+shared_future<void> OCLVMParallelLoop::runInterpreterAsync(size_t globalWorkItems, size_t localWorkItems, function<void()> callback) {
+    return enqueueAsync([this, globalWorkItems, localWorkItems] { enqueueLoop(globalWorkItems, localWorkItems); }, callback);
+}
+
+void OCLVMParallelLoop::enqueueLoop(size_t range1, size_t range2) {
+    if (range2 != (size_t) workGroupSize) {
+        cout << "[PARALLEL] The kernel is built for work-groups of " << workGroupSize << " work-items (setWorkGroupSize)" << endl;
+    }
+    releaseChunkEvents();
+    numChunks = 1;
+    computeHeapMasks();
+    size_t chunkItems = streamingChunkSize(range1);
+    if (chunkItems > 0) {
+        runStreaming(range1, chunkItems);
+    } else {
+        launchKernel(range1, workGroupSize);
     }
+}
 
+void OCLVMParallelLoop::completeRun() {
+    OCLVMParallel::completeRun();
     if (DEBUG) {
-        for (auto i = 0; i < data3.size(); i++) {
-            cout << data3[i]  << " ";
+        int* output = getHeap(heapAccess.size() - 1);
+        for (auto i = 0; i < heapSize; i++) {
+            cout << output[i]  << " ";
         }
         cout << "\n";
     }
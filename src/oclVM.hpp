@@ -24,9 +24,12 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <future>
+#include <functional>
 #include "instruction.hpp"
 #include "bytecodes.hpp"
 #include "abstractVM.hpp"
+#include "kernelGenerator.hpp"
 
 #define CL_USE_DEPRECATED_OPENCL_2_0_APIS
 
@@ -36,8 +39,71 @@
 	#include <CL/cl.h>
 #endif
 
+#include "bufferPool.hpp"
+#include "programCache.hpp"
+#include "floatingPoint.hpp"
+#include "dirtyRanges.hpp"
+
 using namespace std;
 
+/*
+ * How the heaps reach the device:
+ *  - COPY_HEAPS: device buffers, written before and read after every run.
+ *  - HOST_PTR_HEAPS: CL_MEM_USE_HOST_PTR buffers over the (page-aligned) heaps. The heaps are mapped for the host
+ *    between runs and unmapped during the kernel, so there is no copy on devices that share memory with the host.
+ *  - SVM_HEAPS: the heaps are allocated in coarse-grained shared virtual memory, mapped for the host between runs.
+ *  - AUTO_HEAPS: selected by initOpenCL. SVM (or host pointers without SVM) on devices with unified memory,
+ *    copies otherwise.
+ */
+enum HeapMode {
+    AUTO_HEAPS,
+    COPY_HEAPS,
+    HOST_PTR_HEAPS,
+    SVM_HEAPS
+};
+
+// State buffer of the single work-item kernels (interpreter.cl and interpreterPrivate.cl): the registers and the
+// status saved when the kernel exits, then the stack of the private kernel
+enum SliceState {
+    STATE_IP,
+    STATE_SP,
+    STATE_FP,
+    STATE_STATUS,
+    STATE_BUFFER_INDEX,
+    STATE_STACK
+};
+
+enum SliceStatus {
+    SLICE_FIRST,
+    SLICE_PREEMPTED,
+    SLICE_HALTED
+};
+
+// Device side of a heap. Only the fields of the heap mode of the VM are used.
+struct DeviceHeap {
+    PooledBuffer buffer;            // COPY_HEAPS
+    cl_mem hostBuffer = nullptr;    // HOST_PTR_HEAPS: buffer over hostPointer
+    int* hostPointer = nullptr;
+    size_t size = 0;
+    bool mapped = false;
+};
+
+#ifdef CL_VERSION_2_0
+/*
+ * Heap memory in coarse-grained SVM. New heaps are mapped for the host, as the VM expects between runs.
+ */
+class SVMHeapMemory : public HeapMemory {
+    public:
+        SVMHeapMemory(cl_context context, cl_command_queue commandQueue);
+        void* allocate(size_t bytes);
+        void release(void* address);
+
+    private:
+        cl_context context;
+        cl_command_queue commandQueue;
+};
+#endif
+
 class OCLVM : public AbstractVM {
 
     public:
@@ -48,6 +114,7 @@ class OCLVM : public AbstractVM {
 
         virtual int initOpenCL(string kernelFilename, bool loadBinary);
 
+        // Take the device buffers of the program from the buffer pool. Buffers are kept between runs.
         void createBuffers();
 
         void setPlatform(int numPlatform);
@@ -56,46 +123,172 @@ class OCLVM : public AbstractVM {
 
         void usePrivateMemory();
 
-        long getKernelTime();
+        // Build a kernel specialized for the program (see kernelGenerator.hpp) instead of the interpreter kernel.
+        // It must be called before initOpenCL.
+        void useSpecializedKernel();
+
+        // Select how the heaps are shared with the device. It must be called before initOpenCL.
+        void setHeapMode(HeapMode mode);
+
+        // Heap mode in use (AUTO_HEAPS is resolved by initOpenCL)
+        HeapMode getHeapMode();
+
+        // Directory of the compiled program cache (see programCache.hpp). An empty directory disables the cache.
+        // It must be called before initOpenCL.
+        void setProgramCacheDirectory(string directory);
+
+        // Compile other kernels with the build options of this program on a background thread, and store them in the
+        // program cache, so that other VMs that run this program start without compiling. It must be called after initOpenCL.
+        void prebuildKernels(vector<string> kernelFilenames);
+
+        virtual long getKernelTime();
+
+        // Number of device buffers created so far. Buffers are reused between runs, so it stays constant
+        int getNumBuffersCreated();
+
+        // Run the program in slices of at most `instructions` bytecodes (0, the default, runs it with one launch).
+        // After a slice the kernel saves ip, sp, fp and the stack in a state buffer and exits, and the next launch
+        // resumes from it, so other jobs can use the device between the slices. It must be called before initOpenCL.
+        // Only the single work-item VMs (OCLVM, OCLVMPrivate) run in slices, and the specialized kernel can not be
+        // preempted: time slices use the interpreter kernel.
+        void setTimeSlice(int instructions);
+
+        // Run the next slice of the program. The first call starts a run, and the one that reaches HALT gives the
+        // heap and the print buffer back to the host. Returns true when the program has halted.
+        bool runSlice();
+
+        // Kernel launches of the last run
+        int getNumSlices();
 
         // Implementation of the Interpreter in OpenCL C
         virtual void runInterpreter();
 
+        // Run the interpreter without blocking the host: the transfers, the kernel and the reads are enqueued as a chain
+        // of commands, and the future is ready when the results are on the host. The heaps and the program must not
+        // change until then. `callback`, if any, runs after that on a new host thread, so it can enqueue the next run
+        // of the VM. A VM has one run in flight: the next run (or the destructor) waits for it. Time slices are launched
+        // by the host, so a program with time slices runs before runInterpreterAsync returns.
+        shared_future<void> runInterpreterAsync(function<void()> callback = nullptr);
+
     protected:
 
         char* readSource(const char* sourceFilename);
         int readBinaryFile(unsigned char **output, size_t *size, const char *name);
         long getTime(cl_event event);
 
+        // Kernel build options: stack size computed by the verifier and bounds checks for recursive programs
+        virtual string buildOptions();
+
+        // Source of the specialized kernel, or nullptr if the program can not be specialized
+        char* specializedSource();
+
+        // Interpreter kernel that the specialized kernel replaces
+        virtual KernelLayout kernelLayout();
+
+        // Keep `buffer` if it has this size and flags, otherwise take another one from the pool
+        void prepareBuffer(PooledBuffer &buffer, size_t size, cl_mem_flags flags);
+
+        // Copy the decoded code to d_code, unless this code is already on the device
+        void uploadCode();
+
+        // Release the event of the previous kernel launch before a new launch
+        void releaseKernelEvent();
+
+        // Heap mode for the device: the one requested, or the best one for AUTO_HEAPS
+        HeapMode selectHeapMode();
+
+        // True if the device of the command queue lists the extension in CL_DEVICE_EXTENSIONS
+        bool hasDeviceExtension(string extension);
+
+        // Heaps of the VM that are passed to the kernel
+        virtual vector<Heap*> heaps();
+
+        // Give the heap to the device and pass it to the kernel as argument `argIndex`
+        void bindHeap(Heap &heap, DeviceHeap &device, int argIndex);
+
+        // Give the heap back to the host after the kernel
+        void returnHeap(Heap &heap, DeviceHeap &device);
+
+        // Take the buffers, give the heap to the device and set the kernel arguments before the first slice
+        virtual void startRun();
+
+        // Give the print buffer and the heap back to the host after the last slice
+        virtual void finishRun();
+
+        // Launch the kernel with one work-item: the whole program or one slice
+        void launchSlice();
+
+        // Enqueue a whole run: transfers, kernel and reads
+        virtual void enqueueRun();
+
+        // Host side of a run once its commands have completed (results of the reductions, outputs)
+        virtual void completeRun();
+
+        // Enqueue a run with `enqueue` without blocking, and complete it from the callback of a marker after its commands
+        shared_future<void> enqueueAsync(function<void()> enqueue, function<void()> callback);
+
+        static void CL_CALLBACK completeAsync(cl_event event, cl_int status, void* vm);
+
+        // Wait for the run in flight, if any
+        void waitAsync();
+
+        // Blocking flag of the transfers: CL_FALSE while an asynchronous run is enqueued
+        cl_bool blocking();
+
+        void releaseDeviceHeap(DeviceHeap &device);
+
         string platformName;
         cl_uint numPlatforms;
-        cl_platform_id *platforms;
-        cl_device_id *devices;
+        cl_platform_id *platforms = nullptr;
+        cl_device_id *devices = nullptr;
         cl_context context;
         cl_command_queue commandQueue;
         cl_kernel kernel1;
         cl_program program;
-        char *source;
+        char *source = nullptr;
         size_t localWorkSize[1];
         size_t lWorkSize;
 
-        cl_event writeEvent[5];
-        cl_event kernelEvent;
-        cl_event readEvent[5];
+        cl_event kernelEvent = nullptr;
 
         int platformNumber = 0;
 
-        char* buffer;
+        char* buffer = nullptr;
 
         bool useLocal = false;
         bool usePrivate = false;
+        bool specialize = false;
+
+        bool openCLInitialized = false;
+
+        ProgramCache* programCache = nullptr;
+        string programCacheDirectory = defaultProgramCacheDirectory();
+
+        BufferPool* bufferPool = nullptr;
+        PooledBuffer d_code;
+        PooledBuffer d_stack;
+        DeviceHeap d_data;
+        PooledBuffer d_buffer;
+        PooledBuffer d_state;
+
+        // Time slices (setTimeSlice): a run is in progress between its first and its last slice
+        int timeSlice = 0;
+        bool runStarted = false;
+        int numSlices = 0;
+
+        // Asynchronous run in flight (runInterpreterAsync)
+        bool asyncEnqueue = false;
+        promise<void> asyncPromise;
+        shared_future<void> asyncFuture;
+        function<void()> asyncCallback;
+        cl_event asyncEvent = nullptr;
 
-        cl_mem d_code;
-        cl_mem d_stack;
-        cl_mem d_data;
-        cl_mem d_buffer;
+        HeapMode heapMode = AUTO_HEAPS;
+        HeapMemory* svmMemory = nullptr;
 
-        bool buffersCreated = false;
+        // Code in d_code, to upload it only when it changes
+        vector<DecodedInstruction> uploadedCode;
+        cl_mem codeUploadedTo = nullptr;
 
         const int BUFFER_SIZE = 100000;
 };
@@ -104,30 +297,254 @@ class OCLVMPrivate : public OCLVM {
     public:
         OCLVMPrivate() {};
         OCLVMPrivate(vector<int> code, int mainByteCodeIndex);
+
+    protected:
+        KernelLayout kernelLayout();
+
+        void startRun();
+
+        void completeRun();
+
+};
+
+/*
+ * Runs many independent invocations of the program with one launch (interpreterBatch.cl), one work-item per invocation.
+ * Each invocation has its own heap of dataSize values. The heaps are packed in one buffer that is given to the device
+ * and read back once per launch, and a descriptor per invocation holds the offset of its heap and its initial ip/sp/fp.
+ */
+class OCLVMBatch : public OCLVM {
+    public:
+        OCLVMBatch() {};
+        OCLVMBatch(vector<int> code, int mainByteCodeIndex);
+        ~OCLVMBatch();
+
+        // Add an invocation with the given heap (at most dataSize values, the rest is zero). Returns its index.
+        // It must be called after setVMConfig.
+        int addInvocation(const vector<int> &heap);
+
+        void clearInvocations();
+
+        int getNumInvocations();
+
+        // Heap of an invocation: its input before runInterpreter and its result after it.
+        // The pointer is valid until the next addInvocation.
+        int* getInvocationHeap(int invocation);
+
+        // Run all the invocations with one launch
         void runInterpreter();
 
+    protected:
+        KernelLayout kernelLayout();
+
+        vector<Heap*> heaps();
+
+        void enqueueRun();
+
+        void completeRun();
+
+        // Heaps of all the invocations, dataSize values each
+        Heap batchHeap;
+        DeviceHeap d_batchHeap;
+
+        vector<cl_int4> invocations;
+        PooledBuffer d_invocations;
+        // Descriptors in d_invocations, to upload them only when the batch changes
+        cl_mem invocationsUploadedTo = nullptr;
 };
 
+/*
+ * Parallel VMs with the heaps declared by the program. The heaps are packed in one buffer (heap h starts at
+ * h * heapSize), and the kernel is built for the number of heaps, the work-group size and the tile size (elements
+ * of each heap that a work-group stages in local memory) with -D options. Heaps that the program only reads are
+ * not copied back, and heaps that it only writes are not copied to the device.
+ */
 class OCLVMParallel : public OCLVM {
     public:
         OCLVMParallel() {};
         OCLVMParallel(vector<int> code, int mainByteCodeIndex);
+        ~OCLVMParallel();
+
+        // One work-item per work-group
         void runInterpreter(size_t range);
+
+        // runInterpreter without blocking the host (see OCLVM::runInterpreterAsync)
+        shared_future<void> runInterpreterAsync(size_t range, function<void()> callback = nullptr);
+
+        // Declare the heaps of the program, with `heapSize` values each: PARALLEL_GLOAD_INDEXED/PARALLEL_GSTORE_INDEXED h
+        // access heap h. The values of a write-only heap that the program does not store are undefined after a run.
+        // The number of heaps and their access can not change after initOpenCL.
+        void setHeaps(vector<HeapAccess> access, int heapSize);
+
+        // Resize the heaps. Without setHeaps, the program has NUM_PARALLEL_HEAPS read-write heaps.
         void setHeapSizes(int dataSize);
+
+        // Every heap holds the indexes of its elements, except the last one (the output), that holds ones
         void initHeap();
 
+        int getNumHeaps();
+
+        // Values of heap `heap`
+        int* getHeap(int heap);
+
+        // Device-resident heaps (COPY_HEAPS): the heaps stay on the device between runs. The first run copies the heaps
+        // that the program reads, and the next runs only the elements that the host marked with markHeapModified. The
+        // heaps are not read back after a run: syncHeaps reads the heaps that the program writes. Resident heaps are not
+        // streamed. Other heap modes share the heaps with the device, so they are never copied.
+        void setResidentHeaps(bool residentHeaps);
+
+        // Elements [from, from + count) of heap `heap` were modified on the host: upload them before the next run of
+        // resident heaps. initHeap marks all the heaps.
+        void markHeapModified(int heap, int from, int count);
+
+        // Read the resident heaps that the program writes (or heap `heap`) back from the device
+        void syncHeaps();
+        void syncHeap(int heap);
+
+        // Work-items per work-group of the kernel. It must be called before initOpenCL.
+        void setWorkGroupSize(int workGroupSize);
+
+        // Elements of each heap per work-group, a multiple of the work-group size (by default, the work-group size).
+        // It must be called before initOpenCL.
+        void setTileSize(int tileSize);
+
+        // Grid-stride: launch a few work-groups per compute unit of the device, that loop over the tiles of the whole
+        // range, instead of one work-group per tile. The interpreter setup is paid once per work-group.
+        void setGridStride(bool gridStride);
+
+        // Persistent threads: launch work-groups as with grid-stride, but every work-group takes its next tile from a
+        // counter in global memory when it finishes one, so the work-groups that get slow tiles (data-dependent loops)
+        // run fewer of them. It must be called before initOpenCL.
+        void setPersistentThreads(bool persistentThreads);
+
+        // Work-items launched in the last run (of every chunk for streamed runs)
+        size_t getLaunchedWorkItems();
+
+        static const int GRID_STRIDE_GROUPS_PER_UNIT = 4;
+
     protected:
-        vector<int> data1;
-        vector<int> data2;
-        vector<int> data3;
+        KernelLayout kernelLayout();
+
+        // Build options of the interpreter, and the heap configuration
+        string buildOptions();
+
+        // Device buffers of the code and the print buffer
+        void createHeapBuffers();
+
+        vector<Heap*> heaps();
+
+        // Heaps that the program reads and writes, in local memory (tileReadMask/tileWriteMask) and with GLOAD/GSTORE on heap 0
+        void computeHeapMasks();
+
+        // Give the heaps to the device (argument 1, and the heap size in argument 2), and take them back after the kernel
+        void bindHeaps();
+        void returnHeaps();
+
+        // Copy the modified ranges of the resident heaps that the program reads. The same range of consecutive heaps
+        // is copied with one rectangular transfer (a row per heap).
+        cl_int uploadModifiedRanges();
+
+        // Buffer of the partial results of the reductions of every work-group (argument 9). After the kernel, the
+        // partial results are read back and combined (getReduction).
+        void bindPartials(size_t numGroups);
+        void returnReductions(size_t numGroups);
+
+        // Combine the partial results of the reductions
+        void completeRun();
+
+        // Launch the kernel on the whole range
+        void launchKernel(size_t globalWorkItems, size_t localWorkItems);
+
+        // Give the number of tiles of a range of `globalWorkItems` (argument 10) and the tile counter (argument 11) to the
+        // kernel, and return the work-items to launch: the whole range, or with grid-stride and persistent threads, at most
+        // GRID_STRIDE_GROUPS_PER_UNIT work-groups per compute unit
+        size_t bindGrid(size_t globalWorkItems, size_t localWorkItems);
+
+        vector<HeapAccess> heapAccess;
+        int heapSize = 0;
+        Heap heapData;
+        DeviceHeap d_heaps;
+        PooledBuffer d_partials;
+        PooledBuffer d_tileCounter;
+
+        // Partial results of the reductions of the last run, read back from d_partials
+        vector<int> partialResults;
+        size_t partialGroups = 0;
+
+        // Resident heaps (setResidentHeaps): ranges modified on the host, and the buffer that holds the heaps, to copy
+        // them whole when it changes
+        bool residentHeaps = false;
+        vector<DirtyRanges> modifiedRanges;
+        cl_mem heapsUploadedTo = nullptr;
+
+        int workGroupSize = 1;
+        int tileSize = 0;
+        bool gridStride = false;
+        bool persistentThreads = false;
+        size_t launchedWorkItems = 0;
+
+        unsigned tileReadMask = 0;
+        unsigned tileWriteMask = 0;
+        unsigned uploadMask = 0;
+        unsigned downloadMask = 0;
 };
 
+/*
+ * Heaps that do not fit in the device memory are streamed in chunks of work-groups. Each chunk runs with a global
+ * offset, and the upload of the next chunk and the download of the previous one (on a second command queue)
+ * overlap with the kernel of the current chunk, using two device buffers.
+ */
 class OCLVMParallelLoop : public OCLVMParallel {
     public:
         OCLVMParallelLoop() {};
         OCLVMParallelLoop(vector<int> code, int mainByteCodeIndex);
+        ~OCLVMParallelLoop();
         void runInterpreter(size_t globalWordItems, size_t localWorkItems);
 
+        // runInterpreter without blocking the host (see OCLVM::runInterpreterAsync). Streamed runs wait for the
+        // transfers of their chunks before returning.
+        shared_future<void> runInterpreterAsync(size_t globalWorkItems, size_t localWorkItems, function<void()> callback = nullptr);
+
+        // Stream the heaps in chunks of `workItems` work-items (rounded to work-groups). With 0 (default), the heaps
+        // are streamed only when they do not fit in the device memory. Only COPY_HEAPS is streamed: shared heaps
+        // are not copied.
+        void setChunkSize(size_t workItems);
+
+        // Number of chunks of the last run (1 if it was not streamed)
+        int getNumChunks();
+
+        // Kernel time of the last run. For streamed runs, the sum of the kernel times of all chunks.
+        long getKernelTime();
+
+        static const int DEFAULT_WORK_GROUP_SIZE = 16;
+
+    protected:
+        KernelLayout kernelLayout();
+
+        // Enqueue the run of the range, streamed or with one launch
+        void enqueueLoop(size_t globalWorkItems, size_t localWorkItems);
+
+        void completeRun();
+
+        // Chunk size for the run, or 0 to run without streaming
+        size_t streamingChunkSize(size_t globalWorkItems);
+
+        // Chunks run with a global offset: only the parallel int heap accesses, relative to the work-group, can be streamed
+        // (atomics address the whole heap, and LLOAD_TILE the elements around the tile of the group).
+        // Programs with reductions are not streamed either: their partial results are indexed by work-group.
+        bool isStreamable();
+
+        void runStreaming(size_t globalWorkItems, size_t chunkItems);
+
+        void releaseChunkEvents();
+
+        static const int STREAM_SLOTS = 2;
+
+        // Device buffers of the chunks, with the chunks of all the heaps packed
+        PooledBuffer d_chunks[STREAM_SLOTS];
+        cl_command_queue transferQueue = nullptr;
+        vector<cl_event> chunkKernelEvents;
+        size_t chunkSize = 0;
+        int numChunks = 1;
 };
 
 #endif 
\ No newline at end of file
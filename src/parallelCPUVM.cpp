@@ -0,0 +1,663 @@
+/*
+ * Copyright (c) 2020-2021, APT Group, Department of Computer Science,
+ * The University of Manchester.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <cmath>
+#include "instruction.hpp"
+#include "bytecodes.hpp"
+#include "parallelCPUVM.hpp"
+#include "floatingPoint.hpp"
+#include "shortVector.hpp"
+#include "reduction.hpp"
+#include "atomics.hpp"
+#include "scratchpad.hpp"
+
+using namespace std;
+
+// Work-groups per chunk: enough chunks for every worker to steal from, but not so many that the queues dominate
+#define CHUNKS_PER_THREAD 8
+
+ParallelCPUVM::ParallelCPUVM(vector<int> code, int mainByteCodeIndex) {
+    this->code = code;
+    this->codeSize = code.size();
+    this->ins = createAllInstructions();
+    decodeProgram(mainByteCodeIndex);
+    this->numThreads = thread::hardware_concurrency();
+    if (this->numThreads < 1) {
+        this->numThreads = 1;
+    }
+    this->laneISA = detectLaneISA();
+}
+
+ParallelCPUVM::~ParallelCPUVM() {
+    delete pool;
+}
+
+void ParallelCPUVM::setNumThreads(int numThreads) {
+    this->numThreads = numThreads;
+    delete pool;
+    pool = nullptr;
+}
+
+void ParallelCPUVM::setLaneExecution(bool enable) {
+    this->laneExecution = enable;
+}
+
+LaneISA ParallelCPUVM::getLaneISA() {
+    return laneISA;
+}
+
+void ParallelCPUVM::setHeaps(vector<HeapAccess> access, int heapSize) {
+    if (access.empty() || access.size() > MAX_PARALLEL_HEAPS) {
+        cout << "[HEAPS] The program needs between 1 and " << MAX_PARALLEL_HEAPS << " heaps" << endl;
+        exit(-1);
+    }
+    this->heapAccess = access;
+    this->numParallelHeaps = access.size();
+    if (vmAllocated) {
+        // Check the heap numbers of the program again
+        verifyProgram();
+    }
+    setHeapSizes(heapSize);
+}
+
+void ParallelCPUVM::setHeapSizes(int dataSize) {
+    if (heapAccess.empty()) {
+        heapAccess.assign(NUM_PARALLEL_HEAPS, READ_WRITE_HEAP);
+    }
+    // Keep the values of every heap, at the offset of its new size
+    Heap resized(heapAccess.size() * (size_t) dataSize, 0);
+    int keep = min(heapSize, dataSize);
+    for (int h = 0; h < (int) heapAccess.size() && keep > 0; h++) {
+        copy(heapData.begin() + (size_t) h * heapSize, heapData.begin() + (size_t) h * heapSize + keep, resized.begin() + (size_t) h * dataSize);
+    }
+    heapData = move(resized);
+    this->heapSize = dataSize;
+}
+
+void ParallelCPUVM::initHeap() {
+    int numHeaps = heapAccess.size();
+    for (int h = 0; h < numHeaps; h++) {
+        int* heap = getHeap(h);
+        for (auto i = 0; i < heapSize; i++) {
+            heap[i] = (h < numHeaps - 1) ? i : 1;
+        }
+    }
+}
+
+int ParallelCPUVM::getNumHeaps() {
+    return heapAccess.size();
+}
+
+int* ParallelCPUVM::getHeap(int heap) {
+    return heapData.data() + (size_t) heap * heapSize;
+}
+
+void ParallelCPUVM::printHeaps() {
+    for (int h = 0; h < (int) heapAccess.size(); h++) {
+        cout << "HEAP " << h << ": " << endl;
+        int* heap = getHeap(h);
+        for (auto i = 0; i < heapSize; i++) {
+            std::cout << heap[i] << ' ';
+        }
+        cout << endl;
+    }
+}
+
+void ParallelCPUVM::runInterpreter() {
+    runInterpreter(heapSize, DEFAULT_LOCAL_SIZE);
+}
+
+void ParallelCPUVM::runInterpreter(size_t globalSize, size_t localSize) {
+    if (pool == nullptr) {
+        pool = new ThreadPool(numThreads);
+    }
+    if (localSize < 1) {
+        localSize = 1;
+    }
+    if (heapAccess.empty()) {
+        setHeapSizes(0);
+    }
+    heaps.resize(heapAccess.size());
+    for (int h = 0; h < (int) heapAccess.size(); h++) {
+        heaps[h] = getHeap(h);
+    }
+    bool lanes = laneExecution && laneISA != LANES_NONE && isLaneProgram(decodedCode, stackDepths);
+    int width = lanes ? laneWidth(laneISA) : 1;
+    // The work-items of a group with collectives are all in flight at once, each one with its own stack
+    bool collectives = hasCollectives();
+    int stacksPerWorker = collectives ? localSize : width;
+    workerStacks.resize(pool->getNumThreads());
+    for (auto &workerStack : workerStacks) {
+        workerStack.resize(stackSize * stacksPerWorker);
+    }
+
+    // The work-group copy of the atomics and the scratchpad are private to the worker that runs the group
+    bool localCopy = localAtomicsOpcode != 0;
+    workerAtomics.resize(pool->getNumThreads());
+    for (auto &copy : workerAtomics) {
+        copy.resize(localCopy ? localAtomicsSize : 0);
+    }
+    workerScratchpads.resize(pool->getNumThreads());
+    for (auto &workerScratchpad : workerScratchpads) {
+        workerScratchpad.resize(scratchpadSize);
+    }
+
+    int numGroups = (globalSize + localSize - 1) / localSize;
+    partials.assign((size_t) numReductions * numGroups, 0);
+    int chunkSize = numGroups / (pool->getNumThreads() * CHUNKS_PER_THREAD);
+    pool->parallelFor(numGroups, chunkSize, [&](int worker, int firstGroup, int lastGroup) {
+        int* stack = workerStacks[worker].data();
+        WorkGroupMemory memory = { localCopy ? workerAtomics[worker].data() : nullptr, workerScratchpads[worker].data() };
+        for (int group = firstGroup; group < lastGroup; group++) {
+            int groupBase = group * localSize;
+            if (lanes) {
+                runLaneGroups(stack, groupBase, localSize, globalSize, width);
+                continue;
+            }
+            if (localCopy) {
+                fill(memory.localAtomics, memory.localAtomics + localAtomicsSize, atomicIdentity(localAtomicsOpcode));
+            }
+            if (collectives) {
+                runCollectiveGroup(stack, memory, group, groupBase, min((int) localSize, (int) globalSize - groupBase), numGroups);
+            } else {
+                for (int localId = 0; localId < (int) localSize && groupBase + localId < (int) globalSize; localId++) {
+                    WorkItemState state = { ip, sp, fp };
+                    runWorkItem(stack, memory, localId, groupBase, state);
+                }
+            }
+            if (localCopy) {
+                flushLocalAtomics(memory.localAtomics);
+            }
+        }
+    });
+    combinePartials(partials.data(), numGroups);
+}
+
+bool ParallelCPUVM::hasCollectives() {
+    for (int i = 0; i < (int) decodedCode.size(); i++) {
+        if (stackDepths[i] != -1 && isCollectiveOpcode(decodedCode[i].opcode)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void ParallelCPUVM::runCollectiveGroup(int* stacks, WorkGroupMemory &memory, int group, int groupBase, int numItems, int numGroups) {
+    vector<WorkItemState> states(numItems, { ip, sp, fp });
+    while (true) {
+        // Run every work-item up to the next collective. Halted work-items have ip -1.
+        int firstWaiting = -1;
+        for (int localId = 0; localId < numItems; localId++) {
+            WorkItemState &state = states[localId];
+            if (state.ip < 0) {
+                continue;
+            }
+            if (!runWorkItem(stacks + localId * stackSize, memory, localId, groupBase, state)) {
+                state.ip = -1;
+            } else if (firstWaiting == -1) {
+                firstWaiting = localId;
+            }
+        }
+        if (firstWaiting == -1) {
+            return;
+        }
+
+        const DecodedInstruction &instruction = decodedCode[states[firstWaiting].ip];
+        int opcode = instruction.opcode;
+        if (opcode == BARRIER || opcode == LLOAD_TILE) {
+            if (opcode == LLOAD_TILE) {
+                // All the work-items pass the same index, offset and count
+                int* top = stacks + firstWaiting * stackSize + states[firstWaiting].sp;
+                loadTile(memory.scratchpad, instruction.operand, groupBase, top[-2], top[-1], top[0]);
+            }
+            for (auto &state : states) {
+                if (state.ip >= 0) {
+                    state.sp -= (opcode == LLOAD_TILE) ? 3 : 0;
+                    state.ip++;
+                }
+            }
+            continue;
+        }
+
+        // The value of every waiting work-item is on top of its stack
+        int result = reductionIdentity(opcode);
+        for (int localId = 0; localId < numItems; localId++) {
+            if (states[localId].ip < 0) {
+                continue;
+            }
+            int &top = stacks[localId * stackSize + states[localId].sp];
+            if (opcode == SCAN_ADD) {
+                int value = top;
+                top = result;
+                result += value;
+            } else {
+                result = combineReduction(opcode, result, top);
+            }
+        }
+        for (int localId = 0; localId < numItems; localId++) {
+            if (states[localId].ip < 0) {
+                continue;
+            }
+            if (opcode != SCAN_ADD) {
+                stacks[localId * stackSize + states[localId].sp] = result;
+            }
+            states[localId].ip++;
+        }
+        if (opcode != SCAN_ADD) {
+            partials[(size_t) instruction.operand * numGroups + group] = result;
+        }
+    }
+}
+
+void ParallelCPUVM::loadTile(int* scratchpad, int heap, int groupBase, int index, int offset, int count) {
+    for (int i = 0; i < count; i++) {
+        int element = groupBase + index + i;
+        scratchpad[offset + i] = (element >= 0 && element < heapSize) ? heaps[heap][element] : 0;
+    }
+}
+
+void ParallelCPUVM::flushLocalAtomics(int* localAtomics) {
+    int* heap = heaps[localAtomicsHeap];
+    int identity = atomicIdentity(localAtomicsOpcode);
+    int size = min(localAtomicsSize, heapSize);
+    for (int i = 0; i < size; i++) {
+        if (localAtomics[i] != identity) {
+            atomicUpdate(localAtomicsOpcode, &heap[i], localAtomics[i]);
+        }
+    }
+}
+
+void ParallelCPUVM::runLaneGroups(int* stack, int groupBase, int localSize, int globalSize, int width) {
+    LaneProgram program = { decodedCode.data(), stackDepths.data(), entryPoint, heaps.data(), (int) heaps.size() };
+    int groupEnd = min(localSize, globalSize - groupBase);
+    for (int firstLocalId = 0; firstLocalId < groupEnd; firstLocalId += width) {
+        int numLanes = min(width, groupEnd - firstLocalId);
+        runLaneGroup(laneISA, program, stack, groupBase, firstLocalId, numLanes);
+    }
+}
+
+bool ParallelCPUVM::runWorkItem(int* stack, WorkGroupMemory &memory, int localId, int groupBase, WorkItemState &state) {
+    const DecodedInstruction* code = decodedCode.data();
+    int* data = heaps[0];
+    int* localAtomics = memory.localAtomics;
+    int* scratchpad = memory.scratchpad;
+    int ip = state.ip;
+    int sp = state.sp;
+    int fp = state.fp;
+
+    while (true) {
+        const DecodedInstruction &instruction = code[ip];
+        ip++;
+        int a, b, c, address, offset, value, numArgs;
+        double x, y, z;
+
+        switch (instruction.opcode) {
+            case DUP:
+                a = stack[sp];
+                stack[++sp] = a;
+                break;
+            case IADD:
+                a = stack[sp--];
+                b = stack[sp--];
+                stack[++sp] = a + b;
+                break;
+            case ISUB:
+                a = stack[sp--];
+                b = stack[sp--];
+                stack[++sp] = a - b;
+                break;
+            case IMUL:
+                a = stack[sp--];
+                b = stack[sp--];
+                stack[++sp] = a * b;
+                break;
+            case IDIV:
+                a = stack[sp--];
+                b = stack[sp--];
+                stack[++sp] = a / b;
+                break;
+            case LSHIFT:
+                stack[sp] = stack[sp] << 1;
+                break;
+            case RSHIFT:
+                stack[sp] = stack[sp] >> 1;
+                break;
+            case ILT:
+                a = stack[sp--];
+                b = stack[sp--];
+                stack[++sp] = (a < b)? TRUE : FALSE;
+                break;
+            case IEQ:
+                a = stack[sp--];
+                b = stack[sp--];
+                stack[++sp] = (a == b)? TRUE : FALSE;
+                break;
+            case BR:
+                ip = instruction.target;
+                break;
+            case BRT:
+                if (stack[sp--] == TRUE) {
+                    ip = instruction.target;
+                }
+                break;
+            case BRF:
+                if (stack[sp--] == FALSE) {
+                    ip = instruction.target;
+                }
+                break;
+            case ICONST:
+                stack[++sp] = instruction.operand;
+                break;
+            case ICONST1:
+                stack[++sp] = 1;
+                break;
+            case LOAD:
+                value = stack[fp + instruction.operand];
+                stack[++sp] = value;
+                break;
+            case STORE:
+                value = stack[sp--];
+                stack[fp + instruction.operand] = value;
+                break;
+            case GLOAD:
+                stack[++sp] = data[instruction.operand];
+                break;
+            case GSTORE:
+                data[instruction.operand] = stack[sp--];
+                break;
+            case GLOAD_INDEXED:
+                offset = stack[sp--];
+                stack[++sp] = data[instruction.operand + offset];
+                break;
+            case GSTORE_INDEXED:
+                value = stack[sp--];
+                offset = stack[sp--];
+                data[instruction.operand + offset] = value;
+                break;
+            case PRINT:
+                // As in the parallel OpenCL kernel, printed values are discarded
+                sp--;
+                break;
+            case POP:
+                sp--;
+                break;
+            case CALL:
+                if (checkStackBounds && sp + 3 + frameDepth >= stackSize) {
+                    cout << "[VM] Stack overflow" << endl;
+                    return false;
+                }
+                numArgs = instruction.operand;
+                stack[++sp] = numArgs;
+                stack[++sp] = fp;
+                stack[++sp] = ip;
+                fp = sp;
+                ip = instruction.target;
+                break;
+            case RET:
+                value = stack[sp--];
+                sp = fp;
+                ip = stack[sp--];
+                fp = stack[sp--];
+                numArgs = stack[sp--];
+                sp -= numArgs;
+                stack[++sp] = value;
+                break;
+            case THREAD_ID:
+                stack[++sp] = localId;
+                break;
+            case PARALLEL_GLOAD_INDEXED:
+                offset = stack[sp--];
+                stack[++sp] = heaps[instruction.operand][groupBase + offset];
+                break;
+            case PARALLEL_GSTORE_INDEXED:
+                value = stack[sp--];
+                offset = stack[sp--];
+                heaps[instruction.operand][groupBase + offset] = value;
+                break;
+            case DUP_ICONST_IEQ_BRT:
+                if (stack[sp] == instruction.operand) {
+                    ip = instruction.target;
+                }
+                break;
+            case DUP_GLOAD_INDEXED:
+                offset = stack[sp];
+                stack[++sp] = data[instruction.operand + offset];
+                break;
+            case ICONST1_IADD:
+                stack[sp] = stack[sp] + 1;
+                break;
+            case THREAD_ID_PARALLEL_GLOAD_INDEXED:
+                stack[++sp] = heaps[instruction.operand][groupBase + localId];
+                break;
+            case FADD:
+                a = stack[sp--];
+                b = stack[sp--];
+                stack[++sp] = floatToBits(bitsToFloat(a) + bitsToFloat(b));
+                break;
+            case FSUB:
+                a = stack[sp--];
+                b = stack[sp--];
+                stack[++sp] = floatToBits(bitsToFloat(a) - bitsToFloat(b));
+                break;
+            case FMUL:
+                a = stack[sp--];
+                b = stack[sp--];
+                stack[++sp] = floatToBits(bitsToFloat(a) * bitsToFloat(b));
+                break;
+            case FDIV:
+                a = stack[sp--];
+                b = stack[sp--];
+                stack[++sp] = floatToBits(bitsToFloat(a) / bitsToFloat(b));
+                break;
+            case FMA:
+                a = stack[sp--];
+                b = stack[sp--];
+                c = stack[sp--];
+                stack[++sp] = floatToBits(fma(bitsToFloat(a), bitsToFloat(b), bitsToFloat(c)));
+                break;
+            case FLT:
+                a = stack[sp--];
+                b = stack[sp--];
+                stack[++sp] = (bitsToFloat(a) < bitsToFloat(b))? TRUE : FALSE;
+                break;
+            case FEQ:
+                a = stack[sp--];
+                b = stack[sp--];
+                stack[++sp] = (bitsToFloat(a) == bitsToFloat(b))? TRUE : FALSE;
+                break;
+            case I2F:
+                stack[sp] = floatToBits((float) stack[sp]);
+                break;
+            case F2I:
+                stack[sp] = (int) bitsToFloat(stack[sp]);
+                break;
+            case DADD:
+                x = loadDouble(&stack[sp - 1]);
+                y = loadDouble(&stack[sp - 3]);
+                sp -= 2;
+                storeDouble(&stack[sp - 1], x + y);
+                break;
+            case DSUB:
+                x = loadDouble(&stack[sp - 1]);
+                y = loadDouble(&stack[sp - 3]);
+                sp -= 2;
+                storeDouble(&stack[sp - 1], x - y);
+                break;
+            case DMUL:
+                x = loadDouble(&stack[sp - 1]);
+                y = loadDouble(&stack[sp - 3]);
+                sp -= 2;
+                storeDouble(&stack[sp - 1], x * y);
+                break;
+            case DDIV:
+                x = loadDouble(&stack[sp - 1]);
+                y = loadDouble(&stack[sp - 3]);
+                sp -= 2;
+                storeDouble(&stack[sp - 1], x / y);
+                break;
+            case DFMA:
+                x = loadDouble(&stack[sp - 1]);
+                y = loadDouble(&stack[sp - 3]);
+                z = loadDouble(&stack[sp - 5]);
+                sp -= 4;
+                storeDouble(&stack[sp - 1], fma(x, y, z));
+                break;
+            case DLT:
+                x = loadDouble(&stack[sp - 1]);
+                y = loadDouble(&stack[sp - 3]);
+                sp -= 3;
+                stack[sp] = (x < y)? TRUE : FALSE;
+                break;
+            case DEQ:
+                x = loadDouble(&stack[sp - 1]);
+                y = loadDouble(&stack[sp - 3]);
+                sp -= 3;
+                stack[sp] = (x == y)? TRUE : FALSE;
+                break;
+            case I2D:
+                x = (double) stack[sp];
+                storeDouble(&stack[sp++], x);
+                break;
+            case D2I:
+                x = loadDouble(&stack[--sp]);
+                stack[sp] = (int) x;
+                break;
+            case F2D:
+                x = (double) bitsToFloat(stack[sp]);
+                storeDouble(&stack[sp++], x);
+                break;
+            case D2F:
+                x = loadDouble(&stack[--sp]);
+                stack[sp] = floatToBits((float) x);
+                break;
+            case DLOAD_INDEXED:
+                address = instruction.operand + 2 * stack[sp];
+                stack[sp] = data[address];
+                stack[++sp] = data[address + 1];
+                break;
+            case DSTORE_INDEXED:
+                address = instruction.operand + 2 * stack[sp - 2];
+                data[address] = stack[sp - 1];
+                data[address + 1] = stack[sp];
+                sp -= 3;
+                break;
+            case PARALLEL_DLOAD_INDEXED:
+                // Element groupBase + offset of a heap of doubles
+                address = 2 * (groupBase + stack[sp]);
+                stack[sp] = heaps[instruction.operand][address];
+                stack[++sp] = heaps[instruction.operand][address + 1];
+                break;
+            case PARALLEL_DSTORE_INDEXED:
+                address = 2 * (groupBase + stack[sp - 2]);
+                heaps[instruction.operand][address] = stack[sp - 1];
+                heaps[instruction.operand][address + 1] = stack[sp];
+                sp -= 3;
+                break;
+            case VLOAD4:
+                address = instruction.operand + 4 * stack[sp];
+                vectorCopy4(&stack[sp], &data[address]);
+                sp += 3;
+                break;
+            case VSTORE4:
+                address = instruction.operand + 4 * stack[sp - 4];
+                vectorCopy4(&data[address], &stack[sp - 3]);
+                sp -= 5;
+                break;
+            case VADD4:
+                vectorAdd4(&stack[sp - 7], &stack[sp - 3], &stack[sp - 7]);
+                sp -= 4;
+                break;
+            case VMUL4:
+                vectorMul4(&stack[sp - 7], &stack[sp - 3], &stack[sp - 7]);
+                sp -= 4;
+                break;
+            case VSUM4:
+                sp -= 3;
+                stack[sp] = vectorSum4(&stack[sp]);
+                break;
+            case VFADD4:
+                vectorFAdd4(&stack[sp - 7], &stack[sp - 3], &stack[sp - 7]);
+                sp -= 4;
+                break;
+            case VFMUL4:
+                vectorFMul4(&stack[sp - 7], &stack[sp - 3], &stack[sp - 7]);
+                sp -= 4;
+                break;
+            case VFSUM4:
+                sp -= 3;
+                stack[sp] = vectorFSum4(&stack[sp]);
+                break;
+            case PARALLEL_VLOAD4:
+                // Element groupBase + offset of a heap of vectors
+                address = 4 * (groupBase + stack[sp]);
+                vectorCopy4(&stack[sp], &heaps[instruction.operand][address]);
+                sp += 3;
+                break;
+            case PARALLEL_VSTORE4:
+                address = 4 * (groupBase + stack[sp - 4]);
+                vectorCopy4(&heaps[instruction.operand][address], &stack[sp - 3]);
+                sp -= 5;
+                break;
+            case LLOAD:
+                offset = stack[sp];
+                stack[sp] = scratchpad[instruction.operand + offset];
+                break;
+            case LSTORE:
+                value = stack[sp--];
+                offset = stack[sp--];
+                scratchpad[instruction.operand + offset] = value;
+                break;
+            case REDUCE_ADD:
+            case REDUCE_MIN:
+            case REDUCE_MAX:
+            case SCAN_ADD:
+            case BARRIER:
+            case LLOAD_TILE:
+                // Wait for the other work-items of the group (runCollectiveGroup)
+                state = { ip - 1, sp, fp };
+                return true;
+            case ATOMIC_ADD:
+            case ATOMIC_MIN:
+            case ATOMIC_MAX:
+                // Element `offset` of the whole heap, not relative to the work-group
+                value = stack[sp--];
+                offset = stack[sp];
+                if (localAtomics != nullptr && instruction.operand == localAtomicsHeap && offset >= 0 && offset < localAtomicsSize) {
+                    stack[sp] = localAtomicUpdate(instruction.opcode, &localAtomics[offset], value);
+                } else {
+                    stack[sp] = atomicUpdate(instruction.opcode, &heaps[instruction.operand][offset], value);
+                }
+                break;
+            case ATOMIC_CAS:
+                value = stack[sp--];
+                a = stack[sp--];
+                offset = stack[sp];
+                stack[sp] = atomicCompareExchange(&heaps[instruction.operand][offset], a, value);
+                break;
+            case HALT:
+                return false;
+            default:
+                cout << "Error" << endl;
+                return false;
+        }
+    }
+}
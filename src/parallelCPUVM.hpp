@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2020-2021, APT Group, Department of Computer Science,
+ * The University of Manchester.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef PARALLEL_CPU_VM_HPP
+#define PARALLEL_CPU_VM_HPP
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include "instruction.hpp"
+#include "bytecodes.hpp"
+#include "abstractVM.hpp"
+#include "threadPool.hpp"
+#include "laneInterpreter.hpp"
+
+using namespace std;
+
+/*
+ * Multi-threaded BC interpreter for the CPU. It runs the parallel bytecode programs of OCLVMParallelLoop without an
+ * OpenCL driver: the program runs once per work-item of the global range, with the same semantics as
+ * interpreterParallelLoop.cl:
+ *  - THREAD_ID pushes the local id of the work-item within its work-group.
+ *  - PARALLEL_GLOAD_INDEXED/PARALLEL_GSTORE_INDEXED h access heap h of the heaps declared with setHeaps
+ *    (NUM_PARALLEL_HEAPS read-write heaps by default), relative to the first work-item of the work-group.
+ *  - PARALLEL_DLOAD_INDEXED/PARALLEL_DSTORE_INDEXED access the heap as a heap of doubles (two elements each).
+ *  - PARALLEL_VLOAD4/PARALLEL_VSTORE4 access the heap as a heap of vectors (four elements each).
+ *  - GLOAD/GSTORE access heap 0, and PRINT discards the value.
+ *  - REDUCE_ADD/REDUCE_MIN/REDUCE_MAX and SCAN_ADD combine the values of the work-items of the work-group. The
+ *    work-items of these programs run up to the next collective one after the other, and then the collective runs
+ *    for the whole group.
+ *  - LLOAD/LSTORE access the scratchpad of the work-group, and LLOAD_TILE and BARRIER are collectives.
+ *  - ATOMIC_ADD/ATOMIC_MIN/ATOMIC_MAX/ATOMIC_CAS update an element of the whole heap with the atomic builtins. With
+ *    setLocalAtomics, the worker that runs a work-group accumulates it in its own copy, and adds it to the heap
+ *    after the group.
+ * Work-groups are distributed in chunks over a work-stealing thread pool, and every worker has its own stack.
+ *
+ * On CPUs with AVX2 or AVX-512, the work-items of a work-group run in lane groups on the SIMD units of the core
+ * (laneInterpreter.hpp), so every bytecode is dispatched once for 8 or 16 work-items. Programs with CALL/RET, and
+ * CPUs without these ISAs, run one work-item at a time.
+ */
+class ParallelCPUVM : public AbstractVM {
+
+    public:
+        ParallelCPUVM(vector<int> code, int mainByteCodeIndex);
+
+        ~ParallelCPUVM();
+
+        // Number of worker threads. The default is the number of hardware threads.
+        void setNumThreads(int numThreads);
+
+        // Run the work-items in SIMD lane groups (default) or one at a time
+        void setLaneExecution(bool enable);
+
+        LaneISA getLaneISA();
+
+        // Declare the heaps of the program, with `heapSize` values each, as OCLVMParallel::setHeaps. The heaps are
+        // packed in one Heap (heap h starts at h * heapSize) and stay in host memory, so the access does not change
+        // what is copied.
+        void setHeaps(vector<HeapAccess> access, int heapSize);
+
+        // Resize the heaps. Without setHeaps, the program has NUM_PARALLEL_HEAPS read-write heaps.
+        void setHeapSizes(int dataSize);
+
+        // Every heap holds the indexes of its elements, except the last one (the output), that holds ones
+        void initHeap();
+
+        int getNumHeaps();
+
+        // Values of heap `heap`
+        int* getHeap(int heap);
+
+        void printHeaps();
+
+        // Run the whole heap with work-groups of DEFAULT_LOCAL_SIZE work-items
+        void runInterpreter();
+
+        void runInterpreter(size_t globalSize, size_t localSize);
+
+        static const int DEFAULT_LOCAL_SIZE = 16;
+
+    private:
+        // Registers of a work-item, saved when it stops at a work-group collective
+        struct WorkItemState {
+            int ip;
+            int sp;
+            int fp;
+        };
+
+        // Memory of the work-group, private to the worker that runs it
+        struct WorkGroupMemory {
+            int* localAtomics;      // copy of the atomics, or nullptr without setLocalAtomics
+            int* scratchpad;        // LLOAD/LSTORE
+        };
+
+        // Run a work-item until HALT (false) or until a work-group collective (true)
+        bool runWorkItem(int* stack, WorkGroupMemory &memory, int localId, int groupBase, WorkItemState &state);
+
+        bool hasCollectives();
+
+        // Run the work-items of a group with collectives, each one with its own stack in `stacks`
+        void runCollectiveGroup(int* stacks, WorkGroupMemory &memory, int group, int groupBase, int numItems, int numGroups);
+
+        // LLOAD_TILE: copy `count` elements of heap `heap` from groupBase + index to the scratchpad at `offset`
+        void loadTile(int* scratchpad, int heap, int groupBase, int index, int offset, int count);
+
+        // Add the work-group copy of the atomics to the heap
+        void flushLocalAtomics(int* localAtomics);
+
+        void runLaneGroups(int* stack, int groupBase, int localSize, int globalSize, int width);
+
+        ThreadPool* pool = nullptr;
+        int numThreads;
+        bool laneExecution = true;
+        LaneISA laneISA;
+
+        vector<HeapAccess> heapAccess;
+        int heapSize = 0;
+        Heap heapData;
+        // Start of every heap in heapData, set for each run
+        vector<int*> heaps;
+
+        vector<vector<int>> workerStacks;
+
+        // Work-group copy of the atomics of every worker (setLocalAtomics)
+        vector<vector<int>> workerAtomics;
+
+        // Scratchpad of every worker
+        vector<vector<int>> workerScratchpads;
+
+        // Partial result of every reduction per work-group: partials[r * numGroups + group]
+        vector<int> partials;
+};
+
+#endif
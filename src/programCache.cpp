@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2020-2021, APT Group, Department of Computer Science,
+ * The University of Manchester.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <atomic>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "programCache.hpp"
+
+using namespace std;
+
+// 64-bit FNV-1a: stable across compilers and runs, unlike std::hash
+static unsigned long long hashString(const string &value, unsigned long long hash) {
+    for (unsigned char c : value) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    // Separator, so that the fields can not shift into each other
+    hash ^= 0xff;
+    hash *= 1099511628211ULL;
+    return hash;
+}
+
+string defaultProgramCacheDirectory() {
+    const char* directory = getenv("PROTONVM_CACHE_DIR");
+    return (directory != nullptr) ? directory : DEFAULT_PROGRAM_CACHE_DIR;
+}
+
+ProgramCache::ProgramCache(cl_context context, cl_device_id device, string directory) {
+    this->context = context;
+    this->device = device;
+    this->directory = directory;
+    this->deviceKey = deviceInfo(CL_DEVICE_NAME) + "|" + deviceInfo(CL_DRIVER_VERSION);
+    if (!directory.empty()) {
+        mkdir(directory.c_str(), 0755);
+    }
+}
+
+ProgramCache::~ProgramCache() {
+    wait();
+}
+
+void ProgramCache::wait() {
+    if (backgroundBuilds.joinable()) {
+        backgroundBuilds.join();
+    }
+}
+
+bool ProgramCache::isEnabled() {
+    return !directory.empty();
+}
+
+int ProgramCache::getNumHits() {
+    return numHits;
+}
+
+string ProgramCache::deviceInfo(cl_device_info info) {
+    size_t size = 0;
+    if (clGetDeviceInfo(device, info, 0, NULL, &size) != CL_SUCCESS || size == 0) {
+        return "";
+    }
+    string value(size, '\0');
+    clGetDeviceInfo(device, info, size, &value[0], NULL);
+    return value.c_str();
+}
+
+string ProgramCache::cacheFile(const string &source, const string &options) {
+    unsigned long long hash = 14695981039346656037ULL;
+    hash = hashString(source, hash);
+    hash = hashString(options, hash);
+    hash = hashString(deviceKey, hash);
+    stringstream name;
+    name << directory << "/" << hex << setw(16) << setfill('0') << hash << ".bin";
+    return name.str();
+}
+
+cl_program ProgramCache::build(const string &source, const string &options, cl_int *status) {
+    if (!isEnabled()) {
+        return buildSource(source, options, status);
+    }
+    string filename = cacheFile(source, options);
+    cl_program program = loadBinary(filename, options);
+    if (program != nullptr) {
+        numHits++;
+        *status = CL_SUCCESS;
+        return program;
+    }
+    program = buildSource(source, options, status);
+    if (program != nullptr) {
+        store(program, filename);
+    }
+    return program;
+}
+
+void ProgramCache::buildInBackground(vector<pair<string, string>> programs) {
+    if (!isEnabled()) {
+        return;
+    }
+    wait();
+    backgroundBuilds = thread([this, programs]() {
+        for (auto &program : programs) {
+            string filename = cacheFile(program.first, program.second);
+            if (access(filename.c_str(), R_OK) == 0) {
+                continue;
+            }
+            cl_int status;
+            cl_program built = buildSource(program.first, program.second, &status);
+            if (built != nullptr) {
+                store(built, filename);
+                clReleaseProgram(built);
+            }
+        }
+    });
+}
+
+cl_program ProgramCache::loadBinary(const string &filename, const string &options) {
+    ifstream file(filename, ios::binary);
+    if (!file) {
+        return nullptr;
+    }
+    vector<unsigned char> binary((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    if (binary.empty()) {
+        return nullptr;
+    }
+    size_t size = binary.size();
+    const unsigned char* binaries[] = { binary.data() };
+    cl_int binaryStatus;
+    cl_int status;
+    cl_program program = clCreateProgramWithBinary(context, 1, &device, &size, binaries, &binaryStatus, &status);
+    if (status == CL_SUCCESS && binaryStatus == CL_SUCCESS) {
+        status = clBuildProgram(program, 1, &device, options.c_str(), NULL, NULL);
+        if (status == CL_SUCCESS) {
+            return program;
+        }
+    }
+    // Stale or corrupt binary (e.g. a driver update with the same version string): build it again
+    cout << "[CACHE] The cached program " << filename << " can not be loaded. Building it from the source" << endl;
+    if (program != nullptr) {
+        clReleaseProgram(program);
+    }
+    remove(filename.c_str());
+    return nullptr;
+}
+
+cl_program ProgramCache::buildSource(const string &source, const string &options, cl_int *status) {
+    const char* sources[] = { source.c_str() };
+    cl_program program = clCreateProgramWithSource(context, 1, sources, NULL, status);
+    if (*status != CL_SUCCESS) {
+        return nullptr;
+    }
+    *status = clBuildProgram(program, 1, &device, options.c_str(), NULL, NULL);
+    if (*status != CL_SUCCESS) {
+        clReleaseProgram(program);
+        return nullptr;
+    }
+    return program;
+}
+
+void ProgramCache::store(cl_program program, const string &filename) {
+    size_t size = 0;
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &size, NULL) != CL_SUCCESS || size == 0) {
+        return;
+    }
+    vector<unsigned char> binary(size);
+    unsigned char* binaries[] = { binary.data() };
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binaries), binaries, NULL) != CL_SUCCESS) {
+        return;
+    }
+    // Write to a temporary file and rename it, so that concurrent processes never load a partial binary
+    static atomic<int> numTemporaries(0);
+    string temporary = filename + "." + to_string(getpid()) + "-" + to_string(numTemporaries++) + ".tmp";
+    {
+        ofstream file(temporary, ios::binary);
+        file.write((const char*) binary.data(), size);
+        if (!file) {
+            remove(temporary.c_str());
+            return;
+        }
+    }
+    rename(temporary.c_str(), filename.c_str());
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2020-2021, APT Group, Department of Computer Science,
+ * The University of Manchester.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef PROGRAM_CACHE_HPP
+#define PROGRAM_CACHE_HPP
+
+#ifndef CL_TARGET_OPENCL_VERSION
+    #define CL_TARGET_OPENCL_VERSION 300
+#endif
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <utility>
+
+#ifdef __APPLE__
+	#include <OpenCL/cl.h>
+#else
+	#include <CL/cl.h>
+#endif
+
+using namespace std;
+
+// Cache directory used when PROTONVM_CACHE_DIR is not set
+#define DEFAULT_PROGRAM_CACHE_DIR ".protonvm-cache"
+
+// PROTONVM_CACHE_DIR, or DEFAULT_PROGRAM_CACHE_DIR
+string defaultProgramCacheDirectory();
+
+/*
+ * On-disk cache of the compiled OpenCL programs of a device. Programs are stored as CL_PROGRAM_BINARIES in files
+ * named after a hash of the kernel source, the build options, the device name and the driver version, so a later
+ * start loads the binary with clCreateProgramWithBinary instead of compiling the source. Binaries that the driver
+ * rejects are removed and built again from the source.
+ */
+class ProgramCache {
+
+    public:
+        // An empty directory disables the cache
+        ProgramCache(cl_context context, cl_device_id device, string directory);
+
+        // Waits for the background builds
+        ~ProgramCache();
+
+        // Program built for the device, from the cache when possible. Returns nullptr if the build fails
+        cl_program build(const string &source, const string &options, cl_int *status);
+
+        // Build the programs (source, options) that are not cached yet on a background thread and store them.
+        // The programs are not kept: later VMs load them from the cache.
+        void buildInBackground(vector<pair<string, string>> programs);
+
+        // Wait for the background builds
+        void wait();
+
+        bool isEnabled();
+
+        int getNumHits();
+
+    private:
+        string cacheFile(const string &source, const string &options);
+
+        cl_program loadBinary(const string &filename, const string &options);
+
+        cl_program buildSource(const string &source, const string &options, cl_int *status);
+
+        void store(cl_program program, const string &filename);
+
+        string deviceInfo(cl_device_info info);
+
+        cl_context context;
+        cl_device_id device;
+        string directory;
+        string deviceKey;
+        thread backgroundBuilds;
+        int numHits = 0;
+};
+
+#endif
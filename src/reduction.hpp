@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2020-2021, APT Group, Department of Computer Science,
+ * The University of Manchester.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef REDUCTION_HPP
+#define REDUCTION_HPP
+
+#include <climits>
+#include "bytecodes.hpp"
+
+/*
+ * REDUCE_ADD/REDUCE_MIN/REDUCE_MAX r combine the value on top of the stack of every work-item of the work-group, and
+ * replace it with the result. The work-item 0 of every work-group stores the result of the group as the partial
+ * result of reduction r, and the VMs combine the partial results of all the work-groups after the run
+ * (getReduction). SCAN_ADD replaces the value with the sum of the values of the work-items before it in the
+ * work-group (exclusive prefix sum).
+ * All the work-items of a work-group must run the same collective bytecodes (as barriers in OpenCL). BARRIER and
+ * LLOAD_TILE (scratchpad.hpp) are collective too.
+ */
+
+// Reduction numbers of a program (the operand of REDUCE_*)
+#define MAX_REDUCTIONS 16
+
+inline bool isReductionOpcode(int opcode) {
+    return opcode == REDUCE_ADD || opcode == REDUCE_MIN || opcode == REDUCE_MAX;
+}
+
+// Bytecodes that all the work-items of a work-group run together
+inline bool isCollectiveOpcode(int opcode) {
+    return isReductionOpcode(opcode) || opcode == SCAN_ADD || opcode == BARRIER || opcode == LLOAD_TILE;
+}
+
+inline int reductionIdentity(int opcode) {
+    switch (opcode) {
+        case REDUCE_MIN:
+            return INT_MAX;
+        case REDUCE_MAX:
+            return INT_MIN;
+        default:
+            return 0;
+    }
+}
+
+inline int combineReduction(int opcode, int a, int b) {
+    switch (opcode) {
+        case REDUCE_MIN:
+            return (a < b) ? a : b;
+        case REDUCE_MAX:
+            return (a > b) ? a : b;
+        default:
+            return a + b;
+    }
+}
+
+#endif
@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2020-2021, APT Group, Department of Computer Science,
+ * The University of Manchester.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef SCRATCHPAD_HPP
+#define SCRATCHPAD_HPP
+
+#include "bytecodes.hpp"
+
+/*
+ * The scratchpad is an array of ints per work-group, declared by the program with setScratchpadSize (local memory in
+ * the OpenCL kernels), that the work-items of the group use to share data:
+ *  - LLOAD/LSTORE k access element k + offset, as GLOAD_INDEXED/GSTORE_INDEXED do on the heap.
+ *  - LLOAD_TILE h copies `count` elements of heap h, from element `index` relative to the first work-item of the
+ *    work-group, to the scratchpad at `offset` (stack: index, offset, count on top). The work-items of the group copy
+ *    the elements together, with a barrier before and after the copy. Elements outside of the heap (the halo of the
+ *    first and the last work-groups) are 0.
+ *  - BARRIER waits for all the work-items of the work-group, so the values that they store are visible to the others.
+ * BARRIER and LLOAD_TILE are work-group collectives: all the work-items of the group must run them.
+ */
+
+inline bool isScratchpadOpcode(int opcode) {
+    return opcode == LLOAD || opcode == LSTORE || opcode == LLOAD_TILE;
+}
+
+#endif
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2020-2021, APT Group, Department of Computer Science,
+ * The University of Manchester.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef SHORT_VECTOR_HPP
+#define SHORT_VECTOR_HPP
+
+#include "bytecodes.hpp"
+#include "floatingPoint.hpp"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#if defined(__SSE4_1__)
+#include <smmintrin.h>
+#endif
+#define SHORT_VECTOR_SSE
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define SHORT_VECTOR_NEON
+#endif
+
+/*
+ * A vector of the vector bytecodes (VLOAD4, VADD4, ...) takes four consecutive stack slots and four consecutive heap
+ * elements, the first element deepest and the last one on top. These helpers run the arithmetic of the C++ VMs on the
+ * four slots with SSE (x86-64) or NEON (ARM) instructions; the OpenCL kernels use int4/float4.
+ * The result may overlap the second vector (the one below the top of the stack).
+ */
+
+inline void vectorAdd4(int* result, const int* a, const int* b) {
+#if defined(SHORT_VECTOR_SSE)
+    __m128i va = _mm_loadu_si128((const __m128i*) a);
+    __m128i vb = _mm_loadu_si128((const __m128i*) b);
+    _mm_storeu_si128((__m128i*) result, _mm_add_epi32(va, vb));
+#elif defined(SHORT_VECTOR_NEON)
+    vst1q_s32(result, vaddq_s32(vld1q_s32(a), vld1q_s32(b)));
+#else
+    for (int i = 0; i < 4; i++) {
+        result[i] = a[i] + b[i];
+    }
+#endif
+}
+
+inline void vectorMul4(int* result, const int* a, const int* b) {
+#if defined(SHORT_VECTOR_SSE) && defined(__SSE4_1__)
+    __m128i va = _mm_loadu_si128((const __m128i*) a);
+    __m128i vb = _mm_loadu_si128((const __m128i*) b);
+    _mm_storeu_si128((__m128i*) result, _mm_mullo_epi32(va, vb));
+#elif defined(SHORT_VECTOR_NEON)
+    vst1q_s32(result, vmulq_s32(vld1q_s32(a), vld1q_s32(b)));
+#else
+    // SSE2 has no 32-bit multiply
+    for (int i = 0; i < 4; i++) {
+        result[i] = a[i] * b[i];
+    }
+#endif
+}
+
+inline int vectorSum4(const int* a) {
+    return a[0] + a[1] + a[2] + a[3];
+}
+
+// Vectors of floats hold the bits of the floats
+inline void vectorFAdd4(int* result, const int* a, const int* b) {
+#if defined(SHORT_VECTOR_SSE)
+    __m128 va = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*) a));
+    __m128 vb = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*) b));
+    _mm_storeu_si128((__m128i*) result, _mm_castps_si128(_mm_add_ps(va, vb)));
+#elif defined(SHORT_VECTOR_NEON)
+    float32x4_t va = vreinterpretq_f32_s32(vld1q_s32(a));
+    float32x4_t vb = vreinterpretq_f32_s32(vld1q_s32(b));
+    vst1q_s32(result, vreinterpretq_s32_f32(vaddq_f32(va, vb)));
+#else
+    for (int i = 0; i < 4; i++) {
+        result[i] = floatToBits(bitsToFloat(a[i]) + bitsToFloat(b[i]));
+    }
+#endif
+}
+
+inline void vectorFMul4(int* result, const int* a, const int* b) {
+#if defined(SHORT_VECTOR_SSE)
+    __m128 va = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*) a));
+    __m128 vb = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*) b));
+    _mm_storeu_si128((__m128i*) result, _mm_castps_si128(_mm_mul_ps(va, vb)));
+#elif defined(SHORT_VECTOR_NEON)
+    float32x4_t va = vreinterpretq_f32_s32(vld1q_s32(a));
+    float32x4_t vb = vreinterpretq_f32_s32(vld1q_s32(b));
+    vst1q_s32(result, vreinterpretq_s32_f32(vmulq_f32(va, vb)));
+#else
+    for (int i = 0; i < 4; i++) {
+        result[i] = floatToBits(bitsToFloat(a[i]) * bitsToFloat(b[i]));
+    }
+#endif
+}
+
+// Summed in order (((x + y) + z) + w), as in the kernels, so all the VMs round the same way
+inline int vectorFSum4(const int* a) {
+    return floatToBits(bitsToFloat(a[0]) + bitsToFloat(a[1]) + bitsToFloat(a[2]) + bitsToFloat(a[3]));
+}
+
+inline void vectorCopy4(int* destination, const int* source) {
+    memcpy(destination, source, 4 * sizeof(int));
+}
+
+// Bytecodes that operate on vectors of four elements
+inline bool isVectorOpcode(int opcode) {
+    return opcode >= VLOAD4 && opcode <= PARALLEL_VSTORE4;
+}
+
+#endif
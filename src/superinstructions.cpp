@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2020-2021, APT Group, Department of Computer Science,
+ * The University of Manchester.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <iostream>
+#include <vector>
+#include "superinstructions.hpp"
+
+using namespace std;
+
+struct FusionPattern {
+    int flag;
+    int fusedOpcode;
+    vector<int> sequence;
+};
+
+// Longest sequences first, so that a shorter pattern never breaks a longer one
+static vector<FusionPattern> fusionPatterns() {
+    return {
+        { FUSE_DUP_ICONST_IEQ_BRT, DUP_ICONST_IEQ_BRT, { DUP, ICONST, IEQ, BRT } },
+        { FUSE_DUP_GLOAD_INDEXED, DUP_GLOAD_INDEXED, { DUP, GLOAD_INDEXED } },
+        { FUSE_ICONST1_IADD, ICONST1_IADD, { ICONST1, IADD } },
+        { FUSE_THREAD_ID_PARALLEL_GLOAD_INDEXED, THREAD_ID_PARALLEL_GLOAD_INDEXED, { THREAD_ID, PARALLEL_GLOAD_INDEXED } },
+    };
+}
+
+static bool matches(vector<DecodedInstruction> &code, vector<bool> &isTarget, int index, FusionPattern &pattern) {
+    int length = pattern.sequence.size();
+    if (index + length > (int) code.size()) {
+        return false;
+    }
+    for (int i = 0; i < length; i++) {
+        if (code[index + i].opcode != pattern.sequence[i]) {
+            return false;
+        }
+        // Control flow can only enter the sequence through its first instruction
+        if (i > 0 && isTarget[index + i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static DecodedInstruction fuse(vector<DecodedInstruction> &code, int index, FusionPattern &pattern) {
+    DecodedInstruction fused;
+    fused.opcode = pattern.fusedOpcode;
+    fused.operand = 0;
+    fused.target = -1;
+    fused.stackEffect = 0;
+    for (int i = 0; i < (int) pattern.sequence.size(); i++) {
+        fused.stackEffect += code[index + i].stackEffect;
+    }
+    switch (pattern.fusedOpcode) {
+        case DUP_ICONST_IEQ_BRT:
+            fused.operand = code[index + 1].operand;    // constant
+            fused.target = code[index + 3].target;      // branch target
+            break;
+        case DUP_GLOAD_INDEXED:
+        case THREAD_ID_PARALLEL_GLOAD_INDEXED:
+            fused.operand = code[index + 1].operand;    // heap address or heap number
+            break;
+    }
+    return fused;
+}
+
+void fuseSuperinstructions(DecodedProgram &program, int superinstructions) {
+    if (superinstructions == FUSE_NONE) {
+        return;
+    }
+    vector<DecodedInstruction> &code = program.instructions;
+    int size = code.size();
+
+    vector<bool> isTarget(size + 1, false);
+    isTarget[program.entryPoint] = true;
+    for (auto &instruction : code) {
+        if (instruction.target >= 0) {
+            isTarget[instruction.target] = true;
+        }
+        if (instruction.opcode == CALL) {
+            // Return address
+            isTarget[&instruction - &code[0] + 1] = true;
+        }
+    }
+
+    vector<FusionPattern> patterns = fusionPatterns();
+    vector<DecodedInstruction> fusedCode;
+    vector<int> oldToNew(size + 1, -1);
+    for (int i = 0; i < size; ) {
+        oldToNew[i] = fusedCode.size();
+        int length = 1;
+        DecodedInstruction instruction = code[i];
+        for (auto &pattern : patterns) {
+            if ((superinstructions & pattern.flag) && matches(code, isTarget, i, pattern)) {
+                instruction = fuse(code, i, pattern);
+                length = pattern.sequence.size();
+                break;
+            }
+        }
+        fusedCode.push_back(instruction);
+        i += length;
+    }
+    oldToNew[size] = fusedCode.size();
+
+    for (auto &instruction : fusedCode) {
+        if (instruction.target >= 0) {
+            instruction.target = oldToNew[instruction.target];
+        }
+    }
+    program.entryPoint = oldToNew[program.entryPoint];
+    program.instructions = fusedCode;
+}
+
+int selectSuperinstructions(vector<long> &pairProfile, double minFraction) {
+    long total = 0;
+    for (auto count : pairProfile) {
+        total += count;
+    }
+    int superinstructions = FUSE_NONE;
+    if (total == 0) {
+        return superinstructions;
+    }
+    for (auto &pattern : fusionPatterns()) {
+        long count = pairProfile[pattern.sequence[0] * TOTAL_INSTRUCTIONS + pattern.sequence[1]];
+        if ((double) count / total >= minFraction) {
+            superinstructions |= pattern.flag;
+        }
+    }
+    return superinstructions;
+}
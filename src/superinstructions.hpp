@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2020-2021, APT Group, Department of Computer Science,
+ * The University of Manchester.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef SUPERINSTRUCTIONS_HPP
+#define SUPERINSTRUCTIONS_HPP
+
+#include <vector>
+#include "instruction.hpp"
+#include "bytecodes.hpp"
+#include "decoder.hpp"
+
+using namespace std;
+
+/*
+ * Superinstruction fusion pass. It rewrites common bytecode sequences of the decoded stream into a single
+ * fused instruction, so that every loop iteration pays fewer dispatches. The default set was chosen from
+ * the pair profile (see VM::enableProfiling) of the vector programs in main.cpp and gpuBenchmark.cpp.
+ */
+#define FUSE_NONE                               0
+#define FUSE_DUP_ICONST_IEQ_BRT                 (1 << 0)
+#define FUSE_DUP_GLOAD_INDEXED                  (1 << 1)
+#define FUSE_ICONST1_IADD                       (1 << 2)
+#define FUSE_THREAD_ID_PARALLEL_GLOAD_INDEXED   (1 << 3)
+#define FUSE_ALL                                ((1 << 4) - 1)
+
+/*
+ * Rewrite the fused sequences enabled in `superinstructions`. A sequence is never fused if a branch or call
+ * lands in the middle of it. Branch targets and the entry point are remapped to the new stream.
+ */
+void fuseSuperinstructions(DecodedProgram &program, int superinstructions);
+
+/*
+ * Select the superinstructions worth fusing from a profile of executed opcode pairs (indexed as
+ * first * TOTAL_INSTRUCTIONS + second). A sequence is selected when its leading pair accounts for
+ * at least `minFraction` of all executed pairs.
+ */
+int selectSuperinstructions(vector<long> &pairProfile, double minFraction);
+
+#endif
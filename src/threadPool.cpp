@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2020-2021, APT Group, Department of Computer Science,
+ * The University of Manchester.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <algorithm>
+#include "threadPool.hpp"
+
+using namespace std;
+
+ThreadPool::ThreadPool(int numThreads) : pendingChunks(0) {
+    if (numThreads < 1) {
+        numThreads = 1;
+    }
+    for (int i = 0; i < numThreads; i++) {
+        queues.push_back(unique_ptr<WorkQueue>(new WorkQueue()));
+    }
+    for (int i = 0; i < numThreads; i++) {
+        threads.push_back(thread(&ThreadPool::workerLoop, this, i));
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        lock_guard<mutex> guard(lock);
+        stop = true;
+    }
+    wakeUp.notify_all();
+    for (auto &t : threads) {
+        t.join();
+    }
+}
+
+int ThreadPool::getNumThreads() {
+    return threads.size();
+}
+
+void ThreadPool::parallelFor(int numItems, int chunkSize, function<void(int, int, int)> task) {
+    if (numItems <= 0) {
+        return;
+    }
+    if (chunkSize < 1) {
+        chunkSize = 1;
+    }
+    int numChunks = (numItems + chunkSize - 1) / chunkSize;
+    int numWorkers = threads.size();
+    {
+        lock_guard<mutex> guard(lock);
+        this->task = task;
+        pendingChunks = numChunks;
+        // Contiguous blocks of chunks per worker, so neighbouring items run on the same core
+        for (int chunk = 0; chunk < numChunks; chunk++) {
+            int worker = (long) chunk * numWorkers / numChunks;
+            int begin = chunk * chunkSize;
+            int end = min(numItems, begin + chunkSize);
+            lock_guard<mutex> queueGuard(queues[worker]->lock);
+            queues[worker]->chunks.push_back(make_pair(begin, end));
+        }
+        generation++;
+    }
+    wakeUp.notify_all();
+
+    unique_lock<mutex> guard(lock);
+    finished.wait(guard, [this]() { return pendingChunks == 0; });
+}
+
+bool ThreadPool::takeChunk(int worker, pair<int, int> &chunk) {
+    {
+        WorkQueue &own = *queues[worker];
+        lock_guard<mutex> guard(own.lock);
+        if (!own.chunks.empty()) {
+            chunk = own.chunks.back();
+            own.chunks.pop_back();
+            return true;
+        }
+    }
+    int numWorkers = queues.size();
+    for (int i = 1; i < numWorkers; i++) {
+        WorkQueue &victim = *queues[(worker + i) % numWorkers];
+        lock_guard<mutex> guard(victim.lock);
+        if (!victim.chunks.empty()) {
+            chunk = victim.chunks.front();
+            victim.chunks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::workerLoop(int worker) {
+    int seenGeneration = 0;
+    while (true) {
+        {
+            unique_lock<mutex> guard(lock);
+            wakeUp.wait(guard, [&]() { return stop || generation != seenGeneration; });
+            if (stop) {
+                return;
+            }
+            seenGeneration = generation;
+        }
+        pair<int, int> chunk;
+        while (takeChunk(worker, chunk)) {
+            task(worker, chunk.first, chunk.second);
+            if (--pendingChunks == 0) {
+                lock_guard<mutex> guard(lock);
+                finished.notify_all();
+            }
+        }
+    }
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2020-2021, APT Group, Department of Computer Science,
+ * The University of Manchester.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <memory>
+
+using namespace std;
+
+/*
+ * Work-stealing thread pool. parallelFor splits a range into chunks and gives every worker a contiguous
+ * block of them. A worker takes chunks from the back of its own queue, and when it runs out it steals
+ * from the front of the other queues, so uneven chunks still keep all the cores busy.
+ */
+class ThreadPool {
+
+    public:
+        ThreadPool(int numThreads);
+
+        ~ThreadPool();
+
+        int getNumThreads();
+
+        // Run task(worker, begin, end) over [0, numItems) in chunks of chunkSize items. Blocks until all chunks finished.
+        void parallelFor(int numItems, int chunkSize, function<void(int, int, int)> task);
+
+    private:
+        struct WorkQueue {
+            mutex lock;
+            deque<pair<int, int>> chunks;
+        };
+
+        void workerLoop(int worker);
+        bool takeChunk(int worker, pair<int, int> &chunk);
+
+        vector<thread> threads;
+        vector<unique_ptr<WorkQueue>> queues;
+
+        mutex lock;
+        condition_variable wakeUp;
+        condition_variable finished;
+        function<void(int, int, int)> task;
+        atomic<int> pendingChunks;
+        int generation = 0;
+        bool stop = false;
+};
+
+#endif
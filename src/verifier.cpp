@@ -0,0 +1,363 @@
+/*
+ * Copyright (c) 2020-2021, APT Group, Department of Computer Science,
+ * The University of Manchester.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <iostream>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include "verifier.hpp"
+#include "reduction.hpp"
+
+using namespace std;
+
+// Stack depths of a single function, relative to its frame pointer
+struct FunctionInfo {
+    int numArgs;                            // smallest number of arguments passed by any CALL
+    int frameDepth;                         // maximum depth of the frame
+    vector<pair<int, int>> calls;           // (callee entry, depth of the frame at the CALL)
+};
+
+// Values that an instruction pops from the stack
+static int stackInputs(DecodedInstruction &instruction) {
+    switch (instruction.opcode) {
+        case VADD4:
+        case VMUL4:
+        case VFADD4:
+        case VFMUL4:
+            return 8;
+        case DFMA:
+            return 6;
+        case VSTORE4:
+        case PARALLEL_VSTORE4:
+            return 5;
+        case VSUM4:
+        case VFSUM4:
+            return 4;
+        case DADD:
+        case DSUB:
+        case DMUL:
+        case DDIV:
+        case DLT:
+        case DEQ:
+            return 4;
+        case FMA:
+        case DSTORE_INDEXED:
+        case PARALLEL_DSTORE_INDEXED:
+        case ATOMIC_CAS:
+        case LLOAD_TILE:
+            return 3;
+        case FADD:
+        case FSUB:
+        case FMUL:
+        case FDIV:
+        case FLT:
+        case FEQ:
+        case D2I:
+        case D2F:
+            return 2;
+        case I2F:
+        case F2I:
+        case I2D:
+        case F2D:
+        case DLOAD_INDEXED:
+        case PARALLEL_DLOAD_INDEXED:
+        case VLOAD4:
+        case PARALLEL_VLOAD4:
+        case REDUCE_ADD:
+        case REDUCE_MIN:
+        case REDUCE_MAX:
+        case SCAN_ADD:
+        case LLOAD:
+            return 1;
+        case IADD:
+        case ISUB:
+        case IMUL:
+        case IDIV:
+        case ILT:
+        case IEQ:
+        case GSTORE_INDEXED:
+        case PARALLEL_GSTORE_INDEXED:
+        case ATOMIC_ADD:
+        case ATOMIC_MIN:
+        case ATOMIC_MAX:
+        case LSTORE:
+            return 2;
+        case BRT:
+        case BRF:
+        case STORE:
+        case GSTORE:
+        case PRINT:
+        case POP:
+        case DUP:
+        case LSHIFT:
+        case RSHIFT:
+        case GLOAD_INDEXED:
+        case PARALLEL_GLOAD_INDEXED:
+        case DUP_ICONST_IEQ_BRT:
+        case DUP_GLOAD_INDEXED:
+        case ICONST1_IADD:
+        case RET:
+            return 1;
+        case CALL:
+            return instruction.operand;
+        default:
+            return 0;
+    }
+}
+
+static bool reportError(const char* message, int index, Instruction* ins, int opcode) {
+    cout << "[VERIFIER] " << message << " at " << print(ins[opcode]) << " (instruction " << index << ")" << endl;
+    return false;
+}
+
+// Check the operands of one instruction, given the depth of the frame before it runs
+static bool checkOperands(DecodedInstruction &instruction, int index, int depth, bool isMain, int numArgs, int dataSize, int numHeaps,
+                          int scratchpadSize, Instruction* ins) {
+    int opcode = instruction.opcode;
+    int operand = instruction.operand;
+    switch (opcode) {
+        case INVALID_OPCODE:
+            return reportError("Invalid opcode", index, ins, opcode);
+        case GLOAD:
+        case GSTORE:
+        case GLOAD_INDEXED:
+        case GSTORE_INDEXED:
+        case DUP_GLOAD_INDEXED:
+        case DLOAD_INDEXED:
+        case DSTORE_INDEXED:
+        case VLOAD4:
+        case VSTORE4:
+            if (operand < 0 || operand >= dataSize) {
+                return reportError("Heap address out of bounds", index, ins, opcode);
+            }
+            break;
+        case PARALLEL_GLOAD_INDEXED:
+        case PARALLEL_GSTORE_INDEXED:
+        case THREAD_ID_PARALLEL_GLOAD_INDEXED:
+        case PARALLEL_DLOAD_INDEXED:
+        case PARALLEL_DSTORE_INDEXED:
+        case PARALLEL_VLOAD4:
+        case PARALLEL_VSTORE4:
+        case ATOMIC_ADD:
+        case ATOMIC_MIN:
+        case ATOMIC_MAX:
+        case ATOMIC_CAS:
+            if (operand < 0 || operand >= numHeaps) {
+                return reportError("Invalid heap number", index, ins, opcode);
+            }
+            break;
+        case LLOAD:
+        case LSTORE:
+            if (operand < 0 || operand >= scratchpadSize) {
+                return reportError("Scratchpad address out of bounds", index, ins, opcode);
+            }
+            break;
+        case LLOAD_TILE:
+            if (operand < 0 || operand >= numHeaps) {
+                return reportError("Invalid heap number", index, ins, opcode);
+            }
+            if (scratchpadSize == 0) {
+                return reportError("No scratchpad declared", index, ins, opcode);
+            }
+            break;
+        case REDUCE_ADD:
+        case REDUCE_MIN:
+        case REDUCE_MAX:
+            if (operand < 0 || operand >= MAX_REDUCTIONS) {
+                return reportError("Invalid reduction number", index, ins, opcode);
+            }
+            break;
+        case LOAD:
+        case STORE: {
+            // STORE writes the slot after popping the value
+            int frameSlots = (opcode == STORE) ? depth - 1 : depth;
+            bool inFrame;
+            if (isMain) {
+                // fp is 0 and the frame starts at stack[0]
+                inFrame = operand >= 0 && operand < frameSlots;
+            } else {
+                // Arguments are below the return address, numArgs and the old fp: fp-3, fp-4, ...
+                bool isArgument = operand <= -3 && operand >= -2 - numArgs;
+                inFrame = isArgument || (operand >= 1 && operand <= frameSlots);
+            }
+            if (!inFrame) {
+                return reportError("Frame slot out of bounds", index, ins, opcode);
+            }
+            break;
+        }
+        case CALL:
+            if (operand < 0) {
+                return reportError("Negative number of arguments", index, ins, opcode);
+            }
+            break;
+        case RET:
+            if (isMain) {
+                return reportError("RET outside of a function", index, ins, opcode);
+            }
+            break;
+    }
+    return true;
+}
+
+/*
+ * Walk all the paths of one function and record the stack depth before each instruction.
+ * The walk stops at RET and HALT; calls continue at the next instruction with the arguments
+ * replaced by the return value.
+ */
+static bool verifyFunction(vector<DecodedInstruction> &code, int entry, bool isMain, FunctionInfo &function, vector<int> &depthAt, int dataSize, int numHeaps,
+                           int scratchpadSize, Instruction* ins) {
+    depthAt.assign(code.size(), -1);
+    vector<int> worklist;
+    depthAt[entry] = 0;
+    worklist.push_back(entry);
+    function.frameDepth = 0;
+
+    while (!worklist.empty()) {
+        int index = worklist.back();
+        worklist.pop_back();
+        DecodedInstruction &instruction = code[index];
+        int opcode = instruction.opcode;
+        int depth = depthAt[index];
+
+        if (depth < stackInputs(instruction)) {
+            return reportError("Stack underflow", index, ins, opcode);
+        }
+        if (!checkOperands(instruction, index, depth, isMain, function.numArgs, dataSize, numHeaps, scratchpadSize, ins)) {
+            return false;
+        }
+
+        int nextDepth = depth + instruction.stackEffect;
+        if (opcode == CALL) {
+            function.calls.push_back(make_pair(instruction.target, depth));
+            nextDepth = depth - instruction.operand + 1;
+        }
+        function.frameDepth = max(function.frameDepth, max(depth, nextDepth));
+
+        vector<int> successors;
+        if (opcode == RET || opcode == HALT) {
+            continue;
+        }
+        if (opcode != BR) {
+            successors.push_back(index + 1);
+        }
+        if (opcode != CALL && hasBranchTarget(opcode)) {
+            successors.push_back(instruction.target);
+        }
+        for (int successor : successors) {
+            if (depthAt[successor] == -1) {
+                depthAt[successor] = nextDepth;
+                worklist.push_back(successor);
+            } else if (depthAt[successor] != nextDepth) {
+                return reportError("Unbalanced stack at join point", successor, ins, code[successor].opcode);
+            }
+        }
+    }
+    return true;
+}
+
+// Slots needed by a function and all its nested calls. Returns -1 if the function is (mutually) recursive.
+static int totalDepth(int entry, map<int, FunctionInfo> &functions, map<int, int> &depths, vector<int> &callStack) {
+    if (depths.count(entry)) {
+        return depths[entry];
+    }
+    if (find(callStack.begin(), callStack.end(), entry) != callStack.end()) {
+        return -1;
+    }
+    callStack.push_back(entry);
+    FunctionInfo &function = functions[entry];
+    int depth = function.frameDepth;
+    for (auto &call : function.calls) {
+        int calleeDepth = totalDepth(call.first, functions, depths, callStack);
+        if (calleeDepth == -1) {
+            depth = -1;
+            break;
+        }
+        // numArgs, old fp and return address, then the callee frame
+        depth = max(depth, call.second + 3 + calleeDepth);
+    }
+    callStack.pop_back();
+    depths[entry] = depth;
+    return depth;
+}
+
+VerifierResult verifyProgram(vector<DecodedInstruction> &code, int entryPoint, int dataSize, int numHeaps, int scratchpadSize, Instruction* ins) {
+    VerifierResult result;
+    result.valid = false;
+    result.bounded = false;
+    result.maxStackDepth = -1;
+    result.maxFrameDepth = 0;
+
+    // Every CALL target starts a function. Its frame can only rely on the arguments that all callers pass.
+    map<int, FunctionInfo> functions;
+    for (auto &instruction : code) {
+        if (instruction.opcode == CALL) {
+            if (functions.count(instruction.target)) {
+                functions[instruction.target].numArgs = min(functions[instruction.target].numArgs, instruction.operand);
+            } else {
+                functions[instruction.target].numArgs = instruction.operand;
+            }
+        }
+    }
+
+    // The VMs combine the partial results of a reduction number with one operation
+    result.reductionOpcodes.assign(MAX_REDUCTIONS, 0);
+    for (int index = 0; index < (int) code.size(); index++) {
+        int opcode = code[index].opcode;
+        int reduction = code[index].operand;
+        if (!isReductionOpcode(opcode) || reduction < 0 || reduction >= MAX_REDUCTIONS) {
+            continue;
+        }
+        if (result.reductionOpcodes[reduction] != 0 && result.reductionOpcodes[reduction] != opcode) {
+            reportError("Reduction used with different operations", index, ins, opcode);
+            return result;
+        }
+        result.reductionOpcodes[reduction] = opcode;
+    }
+
+    FunctionInfo mainFunction;
+    mainFunction.numArgs = 0;
+    if (!verifyFunction(code, entryPoint, true, mainFunction, result.stackDepths, dataSize, numHeaps, scratchpadSize, ins)) {
+        return result;
+    }
+    result.maxFrameDepth = mainFunction.frameDepth;
+    vector<int> functionDepths;
+    for (auto &function : functions) {
+        if (!verifyFunction(code, function.first, false, function.second, functionDepths, dataSize, numHeaps, scratchpadSize, ins)) {
+            return result;
+        }
+        result.maxFrameDepth = max(result.maxFrameDepth, function.second.frameDepth);
+    }
+    result.valid = true;
+
+    // Add the nested frames of every call made by main
+    map<int, int> depths;
+    vector<int> callStack;
+    int depth = mainFunction.frameDepth;
+    bool bounded = true;
+    for (auto &call : mainFunction.calls) {
+        int calleeDepth = totalDepth(call.first, functions, depths, callStack);
+        if (calleeDepth == -1) {
+            bounded = false;
+            break;
+        }
+        depth = max(depth, call.second + 3 + calleeDepth);
+    }
+    result.bounded = bounded;
+    result.maxStackDepth = bounded ? depth : -1;
+    return result;
+}
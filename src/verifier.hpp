@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2020-2021, APT Group, Department of Computer Science,
+ * The University of Manchester.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef VERIFIER_HPP
+#define VERIFIER_HPP
+
+#include <vector>
+#include "instruction.hpp"
+#include "bytecodes.hpp"
+#include "decoder.hpp"
+
+using namespace std;
+
+// Default number of heaps of the parallel interpreters (PARALLEL_GLOAD_INDEXED/PARALLEL_GSTORE_INDEXED)
+#define NUM_PARALLEL_HEAPS 3
+
+/*
+ * Result of the load-time verification of a decoded program. Stack depths are given in number of stack
+ * slots. The depth of a frame counts the slots above its frame pointer (for the main program, the whole
+ * stack), without the frames of its callees.
+ */
+struct VerifierResult {
+    bool valid;             // balanced stack at every join point, no underflow, frame slots and heap addresses in range
+    bool bounded;           // false if the program is recursive, so its maximum stack depth is not known statically
+    int maxStackDepth;      // slots needed by the whole program, including all nested frames (only if bounded)
+    int maxFrameDepth;      // slots needed by the largest single frame
+    vector<int> stackDepths;    // stack depth before each instruction of the main program (-1 if unreachable)
+    vector<int> reductionOpcodes;   // REDUCE_ADD/REDUCE_MIN/REDUCE_MAX of every reduction number (0 if it is not used)
+};
+
+/*
+ * Verify the decoded program starting at `entryPoint`. Every function (the entry point and every CALL target)
+ * is checked with an abstract interpretation of the stack height: the height must be the same on every path
+ * that reaches an instruction, no instruction may pop more values than its frame holds, LOAD/STORE must
+ * address a slot of the frame, constant heap addresses must be below `dataSize`, the parallel heap accesses
+ * must use a heap number below `numHeaps`, LLOAD/LSTORE must address the `scratchpadSize` elements of the scratchpad,
+ * and every reduction number must be used with a single operation.
+ * Errors are reported with the [VERIFIER] prefix.
+ */
+VerifierResult verifyProgram(vector<DecodedInstruction> &code, int entryPoint, int dataSize, int numHeaps, int scratchpadSize, Instruction* ins);
+
+#endif
@@ -18,34 +18,100 @@
 
 #include <iostream>
 #include <vector>
+#include <algorithm>
+#include <cmath>
 #include "instruction.hpp"
 #include "bytecodes.hpp"
 #include "vm.hpp"
+#include "floatingPoint.hpp"
+#include "shortVector.hpp"
 
 using namespace std;
 
 VM::VM(vector<int> code, int mainByteCodeIndex) {
     this->code = code;
     this->codeSize = code.size();
-    this->ip = mainByteCodeIndex;
     this->ins = createAllInstructions();
+    decodeProgram(mainByteCodeIndex);
 }
 
 VM::~VM() {
     if (vmAllocated) {
-        this->stack.clear();
+        this->stackSlots.clear();
         this->data.clear();
     }
 }
 
+void VM::setDispatchMode(DispatchMode mode) {
+#ifndef VM_THREADED_DISPATCH
+    if (mode != SWITCH_DISPATCH) {
+        cout << "[WARNING] Threaded dispatch not supported by this compiler. Using switch dispatch" << endl;
+        mode = SWITCH_DISPATCH;
+    }
+#endif
+    this->dispatchMode = mode;
+}
+
+DispatchMode VM::getDispatchMode() {
+    return dispatchMode;
+}
+
+void VM::enableProfiling() {
+    this->profile = true;
+    this->pairProfile.assign(TOTAL_INSTRUCTIONS * TOTAL_INSTRUCTIONS, 0);
+}
+
+vector<long> VM::getPairProfile() {
+    return pairProfile;
+}
+
+void VM::printProfile(int numPairs) {
+    vector<pair<long, int>> pairs;
+    for (int i = 0; i < (int) pairProfile.size(); i++) {
+        if (pairProfile[i] > 0) {
+            pairs.push_back(make_pair(pairProfile[i], i));
+        }
+    }
+    sort(pairs.rbegin(), pairs.rend());
+    cout << "Hottest bytecode pairs: " << endl;
+    for (int i = 0; i < numPairs && i < (int) pairs.size(); i++) {
+        int first = pairs[i].second / TOTAL_INSTRUCTIONS;
+        int second = pairs[i].second % TOTAL_INSTRUCTIONS;
+        cout << "\t" << print(ins[first]) << " " << print(ins[second]) << ": " << pairs[i].first << endl;
+    }
+}
+
+void VM::profileOpcode(int previousOpcode, int opcode) {
+    if (previousOpcode != INVALID_OPCODE) {
+        pairProfile[previousOpcode * TOTAL_INSTRUCTIONS + opcode]++;
+    }
+}
+
 void VM::runInterpreter() {
-    while (ip < codeSize) {
-        int opcode = code[ip];
+    if (dispatchMode == THREADED_TOS_DISPATCH) {
+        runInterpreterThreadedTOS();
+    } else if (dispatchMode == THREADED_DISPATCH) {
+        runInterpreterThreaded();
+    } else {
+        runInterpreterSwitch();
+    }
+}
+
+void VM::runInterpreterSwitch() {
+    int previousOpcode = INVALID_OPCODE;
+    while (ip < decodedSize) {
+        DecodedInstruction instruction = decodedCode[ip];
+        int opcode = instruction.opcode;
         if (trace) {
             printTrace(opcode);       
         }
+        if (profile) {
+            profileOpcode(previousOpcode, opcode);
+            previousOpcode = opcode;
+        }
         ip++;
         int a, b, c, address, offset, value, numArgs;
+        double x, y, z;
         bool doHalt = false;
 
         switch (opcode) {
@@ -97,51 +163,48 @@ void VM::runInterpreter() {
                 stack[++sp] = c;
                 break;
             case BR:
-                address = code[ip++];
-                ip = address;
+                ip = instruction.target;
                 break;
             case BRT:
-                address = code[ip++];
                 if (stack[sp--] == TRUE) {
-                    ip = address;
+                    ip = instruction.target;
                 }
                 break;
             case BRF:
-                address = code[ip++];
                 if (stack[sp--] == FALSE) {
-                    ip = address;
+                    ip = instruction.target;
                 }
                 break;
             case ICONST:
-                value = code[ip++];
+                value = instruction.operand;
                 stack[++sp] = value;
                 break;
             case ICONST1:
                 stack[++sp] = 1;
                 break;
             case LOAD:
-                address = code[ip++];
+                address = instruction.operand;
                 value = stack[fp + address];
                 stack[++sp] = value;
                 break;
             case GLOAD:
-                address = code[ip++];
+                address = instruction.operand;
                 value = data[address];
                 stack[++sp] = value;
                 break;
             case STORE:
                 value = stack[sp--];
-                address = code[ip++];
+                address = instruction.operand;
                 stack[fp + address] = value;
                 break;
             case GSTORE:
                 value = stack[sp--];
-                address = code[ip++];
+                address = instruction.operand;
                 data[address] = value;
                 break;
             case GLOAD_INDEXED:
                 // GLOAD_INDEXED 30 and offset from the stack
-                address = code[ip++];
+                address = instruction.operand;
                 offset = stack[sp--];
                 value = data[(address + offset)];
                 stack[++sp] = value;
@@ -152,7 +215,7 @@ void VM::runInterpreter() {
                 // offset, second in the stack
                 value = stack[sp--];
                 offset = stack[sp--];
-                address = code[ip++];
+                address = instruction.operand;
                 data[(address + offset)] = value;
                 break;
             case PRINT:
@@ -160,13 +223,17 @@ void VM::runInterpreter() {
                 std::cout << "[VM] " << value << std::endl;
                 break;
             case CALL:
-                address = code[ip++];
-                numArgs = code[ip++];  // num arguments
+                if (checkStackBounds && sp + 3 + frameDepth >= stackSize) {
+                    cout << "[VM] Stack overflow" << endl;
+                    doHalt = true;
+                    break;
+                }
+                numArgs = instruction.operand;  // num arguments
                 stack[++sp] = numArgs;
                 stack[++sp] = fp;
                 stack[++sp] = ip;
                 fp = sp;
-                ip = address;
+                ip = instruction.target;
                 break;
             case RET:
                 value = stack[sp--];
@@ -180,6 +247,187 @@ void VM::runInterpreter() {
             case POP:
                 sp--;
                 break;
+            case DUP_ICONST_IEQ_BRT:
+                if (stack[sp] == instruction.operand) {
+                    ip = instruction.target;
+                }
+                break;
+            case DUP_GLOAD_INDEXED:
+                offset = stack[sp];
+                value = data[(instruction.operand + offset)];
+                stack[++sp] = value;
+                break;
+            case ICONST1_IADD:
+                stack[sp] = stack[sp] + 1;
+                break;
+            case FADD:
+                a = stack[sp--];
+                b = stack[sp--];
+                stack[++sp] = floatToBits(bitsToFloat(a) + bitsToFloat(b));
+                break;
+            case FSUB:
+                a = stack[sp--];
+                b = stack[sp--];
+                stack[++sp] = floatToBits(bitsToFloat(a) - bitsToFloat(b));
+                break;
+            case FMUL:
+                a = stack[sp--];
+                b = stack[sp--];
+                stack[++sp] = floatToBits(bitsToFloat(a) * bitsToFloat(b));
+                break;
+            case FDIV:
+                a = stack[sp--];
+                b = stack[sp--];
+                stack[++sp] = floatToBits(bitsToFloat(a) / bitsToFloat(b));
+                break;
+            case FMA:
+                a = stack[sp--];
+                b = stack[sp--];
+                c = stack[sp--];
+                stack[++sp] = floatToBits(fma(bitsToFloat(a), bitsToFloat(b), bitsToFloat(c)));
+                break;
+            case FLT:
+                a = stack[sp--];
+                b = stack[sp--];
+                stack[++sp] = (bitsToFloat(a) < bitsToFloat(b))? TRUE : FALSE;
+                break;
+            case FEQ:
+                a = stack[sp--];
+                b = stack[sp--];
+                stack[++sp] = (bitsToFloat(a) == bitsToFloat(b))? TRUE : FALSE;
+                break;
+            case I2F:
+                stack[sp] = floatToBits((float) stack[sp]);
+                break;
+            case F2I:
+                stack[sp] = (int) bitsToFloat(stack[sp]);
+                break;
+            case DADD:
+                x = loadDouble(&stack[sp - 1]);
+                y = loadDouble(&stack[sp - 3]);
+                sp -= 2;
+                storeDouble(&stack[sp - 1], x + y);
+                break;
+            case DSUB:
+                x = loadDouble(&stack[sp - 1]);
+                y = loadDouble(&stack[sp - 3]);
+                sp -= 2;
+                storeDouble(&stack[sp - 1], x - y);
+                break;
+            case DMUL:
+                x = loadDouble(&stack[sp - 1]);
+                y = loadDouble(&stack[sp - 3]);
+                sp -= 2;
+                storeDouble(&stack[sp - 1], x * y);
+                break;
+            case DDIV:
+                x = loadDouble(&stack[sp - 1]);
+                y = loadDouble(&stack[sp - 3]);
+                sp -= 2;
+                storeDouble(&stack[sp - 1], x / y);
+                break;
+            case DFMA:
+                x = loadDouble(&stack[sp - 1]);
+                y = loadDouble(&stack[sp - 3]);
+                z = loadDouble(&stack[sp - 5]);
+                sp -= 4;
+                storeDouble(&stack[sp - 1], fma(x, y, z));
+                break;
+            case DLT:
+                x = loadDouble(&stack[sp - 1]);
+                y = loadDouble(&stack[sp - 3]);
+                sp -= 3;
+                stack[sp] = (x < y)? TRUE : FALSE;
+                break;
+            case DEQ:
+                x = loadDouble(&stack[sp - 1]);
+                y = loadDouble(&stack[sp - 3]);
+                sp -= 3;
+                stack[sp] = (x == y)? TRUE : FALSE;
+                break;
+            case I2D:
+                x = (double) stack[sp];
+                storeDouble(&stack[sp++], x);
+                break;
+            case D2I:
+                x = loadDouble(&stack[--sp]);
+                stack[sp] = (int) x;
+                break;
+            case F2D:
+                x = (double) bitsToFloat(stack[sp]);
+                storeDouble(&stack[sp++], x);
+                break;
+            case D2F:
+                x = loadDouble(&stack[--sp]);
+                stack[sp] = floatToBits((float) x);
+                break;
+            case DLOAD_INDEXED:
+                // Two heap elements per double
+                address = instruction.operand + 2 * stack[sp];
+                stack[sp] = data[address];
+                stack[++sp] = data[address + 1];
+                break;
+            case DSTORE_INDEXED:
+                address = instruction.operand + 2 * stack[sp - 2];
+                data[address] = stack[sp - 1];
+                data[address + 1] = stack[sp];
+                sp -= 3;
+                break;
+            case VLOAD4:
+                // Four heap elements per vector
+                address = instruction.operand + 4 * stack[sp];
+                vectorCopy4(&stack[sp], &data[address]);
+                sp += 3;
+                break;
+            case VSTORE4:
+                address = instruction.operand + 4 * stack[sp - 4];
+                vectorCopy4(&data[address], &stack[sp - 3]);
+                sp -= 5;
+                break;
+            case VADD4:
+                vectorAdd4(&stack[sp - 7], &stack[sp - 3], &stack[sp - 7]);
+                sp -= 4;
+                break;
+            case VMUL4:
+                vectorMul4(&stack[sp - 7], &stack[sp - 3], &stack[sp - 7]);
+                sp -= 4;
+                break;
+            case VSUM4:
+                sp -= 3;
+                stack[sp] = vectorSum4(&stack[sp]);
+                break;
+            case VFADD4:
+                vectorFAdd4(&stack[sp - 7], &stack[sp - 3], &stack[sp - 7]);
+                sp -= 4;
+                break;
+            case VFMUL4:
+                vectorFMul4(&stack[sp - 7], &stack[sp - 3], &stack[sp - 7]);
+                sp -= 4;
+                break;
+            case VFSUM4:
+                sp -= 3;
+                stack[sp] = vectorFSum4(&stack[sp]);
+                break;
+            case REDUCE_ADD:
+            case REDUCE_MIN:
+            case REDUCE_MAX:
+                // The sequential VM runs a work-group of one work-item: the value is the result
+                reductions[instruction.operand] = stack[sp];
+                break;
+            case SCAN_ADD:
+                stack[sp] = 0;
+                break;
+            case BARRIER:
+                break;
+            case LLOAD:
+                offset = stack[sp];
+                stack[sp] = scratchpad[instruction.operand + offset];
+                break;
+            case LSTORE:
+                value = stack[sp--];
+                offset = stack[sp--];
+                scratchpad[instruction.operand + offset] = value;
+                break;
             case HALT:
                 doHalt = true;
                 break;
@@ -193,3 +441,995 @@ void VM::runInterpreter() {
         }
     }
 }
+
+#ifdef VM_THREADED_DISPATCH
+
+// Jump to the handler of the instruction at ip. The decoder guarantees that every opcode is in
+// the table and that the program ends with a HALT, so there are no checks on the hot path.
+#define DISPATCH()                                                                        \
+    instruction = &code[ip];                                                              \
+    goto *table[instruction->opcode]
+
+void VM::runInterpreterThreaded() {
+    // Handler addresses indexed by opcode
+    static void* dispatchTable[TOTAL_INSTRUCTIONS] = {
+        &&op_error,                     // INVALID_OPCODE
+        &&op_iadd,                      // IADD
+        &&op_isub,                      // ISUB
+        &&op_imul,                      // IMUL
+        &&op_ilt,                       // ILT
+        &&op_ieq,                       // IEQ
+        &&op_br,                        // BR
+        &&op_brt,                       // BRT
+        &&op_brf,                       // BRF
+        &&op_iconst,                    // ICONST
+        &&op_load,                      // LOAD
+        &&op_gload,                     // GLOAD
+        &&op_store,                     // STORE
+        &&op_gstore,                    // GSTORE
+        &&op_print,                     // PRINT
+        &&op_pop,                       // POP
+        &&op_halt,                      // HALT
+        &&op_call,                      // CALL
+        &&op_ret,                       // RET
+        &&op_dup,                       // DUP
+        &&op_idiv,                      // IDIV
+        &&op_lshift,                    // LSHIFT
+        &&op_rshift,                    // RSHIFT
+        &&op_iconst1,                   // ICONST1
+        &&op_gload_indexed,             // GLOAD_INDEXED
+        &&op_gstore_indexed,            // GSTORE_INDEXED
+        &&op_error,                     // THREAD_ID
+        &&op_error,                     // PARALLEL_GLOAD_INDEXED
+        &&op_error,                     // PARALLEL_GSTORE_INDEXED
+        &&op_dup_iconst_ieq_brt,        // DUP_ICONST_IEQ_BRT
+        &&op_dup_gload_indexed,         // DUP_GLOAD_INDEXED
+        &&op_iconst1_iadd,              // ICONST1_IADD
+        &&op_error,                     // THREAD_ID_PARALLEL_GLOAD_INDEXED
+        &&op_fadd,                      // FADD
+        &&op_fsub,                      // FSUB
+        &&op_fmul,                      // FMUL
+        &&op_fdiv,                      // FDIV
+        &&op_fma,                       // FMA
+        &&op_flt,                       // FLT
+        &&op_feq,                       // FEQ
+        &&op_i2f,                       // I2F
+        &&op_f2i,                       // F2I
+        &&op_dadd,                      // DADD
+        &&op_dsub,                      // DSUB
+        &&op_dmul,                      // DMUL
+        &&op_ddiv,                      // DDIV
+        &&op_dfma,                      // DFMA
+        &&op_dlt,                       // DLT
+        &&op_deq,                       // DEQ
+        &&op_i2d,                       // I2D
+        &&op_d2i,                       // D2I
+        &&op_f2d,                       // F2D
+        &&op_d2f,                       // D2F
+        &&op_dload_indexed,             // DLOAD_INDEXED
+        &&op_dstore_indexed,            // DSTORE_INDEXED
+        &&op_error,                     // PARALLEL_DLOAD_INDEXED
+        &&op_error,                     // PARALLEL_DSTORE_INDEXED
+        &&op_vload4,                    // VLOAD4
+        &&op_vstore4,                   // VSTORE4
+        &&op_vadd4,                     // VADD4
+        &&op_vmul4,                     // VMUL4
+        &&op_vsum4,                     // VSUM4
+        &&op_vfadd4,                    // VFADD4
+        &&op_vfmul4,                    // VFMUL4
+        &&op_vfsum4,                    // VFSUM4
+        &&op_error,                     // PARALLEL_VLOAD4
+        &&op_error,                     // PARALLEL_VSTORE4
+        &&op_reduce,                    // REDUCE_ADD
+        &&op_reduce,                    // REDUCE_MIN
+        &&op_reduce,                    // REDUCE_MAX
+        &&op_scan_add,                  // SCAN_ADD
+        &&op_error,                     // ATOMIC_ADD
+        &&op_error,                     // ATOMIC_MIN
+        &&op_error,                     // ATOMIC_MAX
+        &&op_error,                     // ATOMIC_CAS
+        &&op_barrier,                   // BARRIER
+        &&op_lload,                     // LLOAD
+        &&op_lstore,                    // LSTORE
+        &&op_error,                     // LLOAD_TILE
+    };
+
+    // When tracing or profiling, every opcode goes through the trace/profile handler first, which
+    // then jumps to the real handler. The normal path pays nothing for it.
+    // The table is local to the run, so VMs on different threads do not share it.
+    void* hookTable[TOTAL_INSTRUCTIONS];
+    void** table = dispatchTable;
+    if (trace || profile) {
+        void* hook = trace ? &&op_trace : &&op_profile;
+        for (int i = 0; i < TOTAL_INSTRUCTIONS; i++) {
+            hookTable[i] = hook;
+        }
+        table = hookTable;
+    }
+    int previousOpcode = INVALID_OPCODE;
+    const DecodedInstruction* instruction;
+    int a, b, c, address, offset, value, numArgs;
+    double x, y, z;
+
+    // The VM state lives in locals for the whole run. Keeping ip/sp/fp as members would
+    // force a reload after every store into the stack or the heap, since they may alias.
+    const DecodedInstruction* code = this->decodedCode.data();
+    int* stack = this->stack;
+    int* data = this->data.data();
+    int ip = this->ip;
+    int sp = this->sp;
+    int fp = this->fp;
+
+    DISPATCH();
+
+    op_trace:
+        this->ip = ip;
+        this->sp = sp;
+        printTrace(instruction->opcode);
+        if (!profile) {
+            goto *dispatchTable[instruction->opcode];
+        }
+    op_profile:
+        profileOpcode(previousOpcode, instruction->opcode);
+        previousOpcode = instruction->opcode;
+        goto *dispatchTable[instruction->opcode];
+
+    op_dup:
+        ip++;
+        a = stack[sp];
+        stack[++sp] = a;
+        DISPATCH();
+    op_iadd:
+        ip++;
+        a = stack[sp--];
+        b = stack[sp--];
+        stack[++sp] = a + b;
+        DISPATCH();
+    op_isub:
+        ip++;
+        a = stack[sp--];
+        b = stack[sp--];
+        stack[++sp] = a - b;
+        DISPATCH();
+    op_imul:
+        ip++;
+        a = stack[sp--];
+        b = stack[sp--];
+        stack[++sp] = a * b;
+        DISPATCH();
+    op_idiv:
+        ip++;
+        a = stack[sp--];
+        b = stack[sp--];
+        stack[++sp] = a / b;
+        DISPATCH();
+    op_lshift:
+        ip++;
+        a = stack[sp--];
+        stack[++sp] = a << 1;
+        DISPATCH();
+    op_rshift:
+        ip++;
+        a = stack[sp--];
+        stack[++sp] = a >> 1;
+        DISPATCH();
+    op_ilt:
+        ip++;
+        a = stack[sp--];
+        b = stack[sp--];
+        stack[++sp] = (a < b)? TRUE : FALSE;
+        DISPATCH();
+    op_ieq:
+        ip++;
+        a = stack[sp--];
+        b = stack[sp--];
+        stack[++sp] = (a == b)? TRUE : FALSE;
+        DISPATCH();
+    op_br:
+        ip = instruction->target;
+        DISPATCH();
+    op_brt:
+        ip = (stack[sp--] == TRUE) ? instruction->target : ip + 1;
+        DISPATCH();
+    op_brf:
+        ip = (stack[sp--] == FALSE) ? instruction->target : ip + 1;
+        DISPATCH();
+    op_iconst:
+        ip++;
+        stack[++sp] = instruction->operand;
+        DISPATCH();
+    op_iconst1:
+        ip++;
+        stack[++sp] = 1;
+        DISPATCH();
+    op_load:
+        ip++;
+        address = instruction->operand;
+        value = stack[fp + address];
+        stack[++sp] = value;
+        DISPATCH();
+    op_gload:
+        ip++;
+        address = instruction->operand;
+        stack[++sp] = data[address];
+        DISPATCH();
+    op_store:
+        ip++;
+        address = instruction->operand;
+        value = stack[sp--];
+        stack[fp + address] = value;
+        DISPATCH();
+    op_gstore:
+        ip++;
+        address = instruction->operand;
+        data[address] = stack[sp--];
+        DISPATCH();
+    op_gload_indexed:
+        ip++;
+        address = instruction->operand;
+        offset = stack[sp--];
+        stack[++sp] = data[(address + offset)];
+        DISPATCH();
+    op_gstore_indexed:
+        ip++;
+        address = instruction->operand;
+        value = stack[sp--];
+        offset = stack[sp--];
+        data[(address + offset)] = value;
+        DISPATCH();
+    op_print:
+        ip++;
+        value = stack[sp--];
+        std::cout << "[VM] " << value << std::endl;
+        DISPATCH();
+    op_call:
+        if (checkStackBounds && sp + 3 + frameDepth >= stackSize) {
+            goto op_overflow;
+        }
+        ip++;
+        numArgs = instruction->operand;
+        stack[++sp] = numArgs;
+        stack[++sp] = fp;
+        stack[++sp] = ip;
+        fp = sp;
+        ip = instruction->target;
+        DISPATCH();
+    op_ret:
+        value = stack[sp--];
+        sp = fp;
+        ip = stack[sp--];
+        fp = stack[sp--];
+        numArgs = stack[sp--];
+        sp -= numArgs;
+        stack[++sp] = value;  // return value on top of the stack
+        DISPATCH();
+    op_pop:
+        ip++;
+        sp--;
+        DISPATCH();
+    op_dup_iconst_ieq_brt:
+        ip = (stack[sp] == instruction->operand) ? instruction->target : ip + 1;
+        DISPATCH();
+    op_dup_gload_indexed:
+        ip++;
+        offset = stack[sp];
+        stack[++sp] = data[(instruction->operand + offset)];
+        DISPATCH();
+    op_iconst1_iadd:
+        ip++;
+        stack[sp] = stack[sp] + 1;
+        DISPATCH();
+    op_fadd:
+        ip++;
+        a = stack[sp--];
+        b = stack[sp--];
+        stack[++sp] = floatToBits(bitsToFloat(a) + bitsToFloat(b));
+        DISPATCH();
+    op_fsub:
+        ip++;
+        a = stack[sp--];
+        b = stack[sp--];
+        stack[++sp] = floatToBits(bitsToFloat(a) - bitsToFloat(b));
+        DISPATCH();
+    op_fmul:
+        ip++;
+        a = stack[sp--];
+        b = stack[sp--];
+        stack[++sp] = floatToBits(bitsToFloat(a) * bitsToFloat(b));
+        DISPATCH();
+    op_fdiv:
+        ip++;
+        a = stack[sp--];
+        b = stack[sp--];
+        stack[++sp] = floatToBits(bitsToFloat(a) / bitsToFloat(b));
+        DISPATCH();
+    op_fma:
+        ip++;
+        a = stack[sp--];
+        b = stack[sp--];
+        c = stack[sp--];
+        stack[++sp] = floatToBits(fma(bitsToFloat(a), bitsToFloat(b), bitsToFloat(c)));
+        DISPATCH();
+    op_flt:
+        ip++;
+        a = stack[sp--];
+        b = stack[sp--];
+        stack[++sp] = (bitsToFloat(a) < bitsToFloat(b))? TRUE : FALSE;
+        DISPATCH();
+    op_feq:
+        ip++;
+        a = stack[sp--];
+        b = stack[sp--];
+        stack[++sp] = (bitsToFloat(a) == bitsToFloat(b))? TRUE : FALSE;
+        DISPATCH();
+    op_i2f:
+        ip++;
+        stack[sp] = floatToBits((float) stack[sp]);
+        DISPATCH();
+    op_f2i:
+        ip++;
+        stack[sp] = (int) bitsToFloat(stack[sp]);
+        DISPATCH();
+    op_dadd:
+        ip++;
+        x = loadDouble(&stack[sp - 1]);
+        y = loadDouble(&stack[sp - 3]);
+        sp -= 2;
+        storeDouble(&stack[sp - 1], x + y);
+        DISPATCH();
+    op_dsub:
+        ip++;
+        x = loadDouble(&stack[sp - 1]);
+        y = loadDouble(&stack[sp - 3]);
+        sp -= 2;
+        storeDouble(&stack[sp - 1], x - y);
+        DISPATCH();
+    op_dmul:
+        ip++;
+        x = loadDouble(&stack[sp - 1]);
+        y = loadDouble(&stack[sp - 3]);
+        sp -= 2;
+        storeDouble(&stack[sp - 1], x * y);
+        DISPATCH();
+    op_ddiv:
+        ip++;
+        x = loadDouble(&stack[sp - 1]);
+        y = loadDouble(&stack[sp - 3]);
+        sp -= 2;
+        storeDouble(&stack[sp - 1], x / y);
+        DISPATCH();
+    op_dfma:
+        ip++;
+        x = loadDouble(&stack[sp - 1]);
+        y = loadDouble(&stack[sp - 3]);
+        z = loadDouble(&stack[sp - 5]);
+        sp -= 4;
+        storeDouble(&stack[sp - 1], fma(x, y, z));
+        DISPATCH();
+    op_dlt:
+        ip++;
+        x = loadDouble(&stack[sp - 1]);
+        y = loadDouble(&stack[sp - 3]);
+        sp -= 3;
+        stack[sp] = (x < y)? TRUE : FALSE;
+        DISPATCH();
+    op_deq:
+        ip++;
+        x = loadDouble(&stack[sp - 1]);
+        y = loadDouble(&stack[sp - 3]);
+        sp -= 3;
+        stack[sp] = (x == y)? TRUE : FALSE;
+        DISPATCH();
+    op_i2d:
+        ip++;
+        x = (double) stack[sp];
+        storeDouble(&stack[sp++], x);
+        DISPATCH();
+    op_d2i:
+        ip++;
+        x = loadDouble(&stack[--sp]);
+        stack[sp] = (int) x;
+        DISPATCH();
+    op_f2d:
+        ip++;
+        x = (double) bitsToFloat(stack[sp]);
+        storeDouble(&stack[sp++], x);
+        DISPATCH();
+    op_d2f:
+        ip++;
+        x = loadDouble(&stack[--sp]);
+        stack[sp] = floatToBits((float) x);
+        DISPATCH();
+    op_dload_indexed:
+        ip++;
+        address = instruction->operand + 2 * stack[sp];
+        stack[sp] = data[address];
+        stack[++sp] = data[address + 1];
+        DISPATCH();
+    op_dstore_indexed:
+        ip++;
+        address = instruction->operand + 2 * stack[sp - 2];
+        data[address] = stack[sp - 1];
+        data[address + 1] = stack[sp];
+        sp -= 3;
+        DISPATCH();
+    op_vload4:
+        ip++;
+        address = instruction->operand + 4 * stack[sp];
+        vectorCopy4(&stack[sp], &data[address]);
+        sp += 3;
+        DISPATCH();
+    op_vstore4:
+        ip++;
+        address = instruction->operand + 4 * stack[sp - 4];
+        vectorCopy4(&data[address], &stack[sp - 3]);
+        sp -= 5;
+        DISPATCH();
+    op_vadd4:
+        ip++;
+        vectorAdd4(&stack[sp - 7], &stack[sp - 3], &stack[sp - 7]);
+        sp -= 4;
+        DISPATCH();
+    op_vmul4:
+        ip++;
+        vectorMul4(&stack[sp - 7], &stack[sp - 3], &stack[sp - 7]);
+        sp -= 4;
+        DISPATCH();
+    op_vsum4:
+        ip++;
+        sp -= 3;
+        stack[sp] = vectorSum4(&stack[sp]);
+        DISPATCH();
+    op_vfadd4:
+        ip++;
+        vectorFAdd4(&stack[sp - 7], &stack[sp - 3], &stack[sp - 7]);
+        sp -= 4;
+        DISPATCH();
+    op_vfmul4:
+        ip++;
+        vectorFMul4(&stack[sp - 7], &stack[sp - 3], &stack[sp - 7]);
+        sp -= 4;
+        DISPATCH();
+    op_vfsum4:
+        ip++;
+        sp -= 3;
+        stack[sp] = vectorFSum4(&stack[sp]);
+        DISPATCH();
+    op_reduce:
+        ip++;
+        reductions[instruction->operand] = stack[sp];
+        DISPATCH();
+    op_scan_add:
+        ip++;
+        stack[sp] = 0;
+        DISPATCH();
+    op_barrier:
+        ip++;
+        DISPATCH();
+    op_lload:
+        ip++;
+        stack[sp] = scratchpad[instruction->operand + stack[sp]];
+        DISPATCH();
+    op_lstore:
+        ip++;
+        value = stack[sp--];
+        offset = stack[sp--];
+        scratchpad[instruction->operand + offset] = value;
+        DISPATCH();
+    op_error:
+        ip++;
+        cout << "Error" << endl;
+        DISPATCH();
+    op_overflow:
+        cout << "[VM] Stack overflow" << endl;
+    op_halt:
+        ip++;
+        this->ip = ip;
+        this->sp = sp;
+        this->fp = fp;
+}
+
+
+/*
+ * Threaded engine with top-of-stack caching. The top of the stack lives in a local (tos), and stack[sp]
+ * in memory is stale while it is cached. Arithmetic then needs a single load from the stack instead of
+ * two loads and a store. The cached value is spilled on pushes, CALL, LOAD/STORE of frame slots and HALT.
+ */
+void VM::runInterpreterThreadedTOS() {
+    // Tracing and profiling inspect the stack in memory, so they run on the plain threaded engine
+    if (trace || profile) {
+        runInterpreterThreaded();
+        return;
+    }
+
+    static void* dispatchTable[TOTAL_INSTRUCTIONS] = {
+        &&op_error,                     // INVALID_OPCODE
+        &&op_iadd,                      // IADD
+        &&op_isub,                      // ISUB
+        &&op_imul,                      // IMUL
+        &&op_ilt,                       // ILT
+        &&op_ieq,                       // IEQ
+        &&op_br,                        // BR
+        &&op_brt,                       // BRT
+        &&op_brf,                       // BRF
+        &&op_iconst,                    // ICONST
+        &&op_load,                      // LOAD
+        &&op_gload,                     // GLOAD
+        &&op_store,                     // STORE
+        &&op_gstore,                    // GSTORE
+        &&op_print,                     // PRINT
+        &&op_pop,                       // POP
+        &&op_halt,                      // HALT
+        &&op_call,                      // CALL
+        &&op_ret,                       // RET
+        &&op_dup,                       // DUP
+        &&op_idiv,                      // IDIV
+        &&op_lshift,                    // LSHIFT
+        &&op_rshift,                    // RSHIFT
+        &&op_iconst1,                   // ICONST1
+        &&op_gload_indexed,             // GLOAD_INDEXED
+        &&op_gstore_indexed,            // GSTORE_INDEXED
+        &&op_error,                     // THREAD_ID
+        &&op_error,                     // PARALLEL_GLOAD_INDEXED
+        &&op_error,                     // PARALLEL_GSTORE_INDEXED
+        &&op_dup_iconst_ieq_brt,        // DUP_ICONST_IEQ_BRT
+        &&op_dup_gload_indexed,         // DUP_GLOAD_INDEXED
+        &&op_iconst1_iadd,              // ICONST1_IADD
+        &&op_error,                     // THREAD_ID_PARALLEL_GLOAD_INDEXED
+        &&op_fadd,                      // FADD
+        &&op_fsub,                      // FSUB
+        &&op_fmul,                      // FMUL
+        &&op_fdiv,                      // FDIV
+        &&op_fma,                       // FMA
+        &&op_flt,                       // FLT
+        &&op_feq,                       // FEQ
+        &&op_i2f,                       // I2F
+        &&op_f2i,                       // F2I
+        &&op_dadd,                      // DADD
+        &&op_dsub,                      // DSUB
+        &&op_dmul,                      // DMUL
+        &&op_ddiv,                      // DDIV
+        &&op_dfma,                      // DFMA
+        &&op_dlt,                       // DLT
+        &&op_deq,                       // DEQ
+        &&op_i2d,                       // I2D
+        &&op_d2i,                       // D2I
+        &&op_f2d,                       // F2D
+        &&op_d2f,                       // D2F
+        &&op_dload_indexed,             // DLOAD_INDEXED
+        &&op_dstore_indexed,            // DSTORE_INDEXED
+        &&op_error,                     // PARALLEL_DLOAD_INDEXED
+        &&op_error,                     // PARALLEL_DSTORE_INDEXED
+        &&op_vload4,                    // VLOAD4
+        &&op_vstore4,                   // VSTORE4
+        &&op_vadd4,                     // VADD4
+        &&op_vmul4,                     // VMUL4
+        &&op_vsum4,                     // VSUM4
+        &&op_vfadd4,                    // VFADD4
+        &&op_vfmul4,                    // VFMUL4
+        &&op_vfsum4,                    // VFSUM4
+        &&op_error,                     // PARALLEL_VLOAD4
+        &&op_error,                     // PARALLEL_VSTORE4
+        &&op_reduce,                    // REDUCE_ADD
+        &&op_reduce,                    // REDUCE_MIN
+        &&op_reduce,                    // REDUCE_MAX
+        &&op_scan_add,                  // SCAN_ADD
+        &&op_error,                     // ATOMIC_ADD
+        &&op_error,                     // ATOMIC_MIN
+        &&op_error,                     // ATOMIC_MAX
+        &&op_error,                     // ATOMIC_CAS
+        &&op_barrier,                   // BARRIER
+        &&op_lload,                     // LLOAD
+        &&op_lstore,                    // LSTORE
+        &&op_error,                     // LLOAD_TILE
+    };
+    void** table = dispatchTable;
+    const DecodedInstruction* instruction;
+    int a, b, c, address, offset, value, numArgs;
+    double x, y, z;
+
+    // Pushing onto an empty stack spills the (meaningless) cached top into stack[-1] (stackSlots[0]), and
+    // popping the last element reloads it from there
+    const DecodedInstruction* code = this->decodedCode.data();
+    int* stack = this->stack;
+    int* data = this->data.data();
+    int ip = this->ip;
+    int sp = this->sp;
+    int fp = this->fp;
+    int tos = stack[sp];
+
+    DISPATCH();
+
+    op_dup:
+        ip++;
+        stack[sp++] = tos;
+        DISPATCH();
+    op_iadd:
+        ip++;
+        b = stack[--sp];
+        tos = tos + b;
+        DISPATCH();
+    op_isub:
+        ip++;
+        b = stack[--sp];
+        tos = tos - b;
+        DISPATCH();
+    op_imul:
+        ip++;
+        b = stack[--sp];
+        tos = tos * b;
+        DISPATCH();
+    op_idiv:
+        ip++;
+        b = stack[--sp];
+        tos = tos / b;
+        DISPATCH();
+    op_lshift:
+        ip++;
+        tos = tos << 1;
+        DISPATCH();
+    op_rshift:
+        ip++;
+        tos = tos >> 1;
+        DISPATCH();
+    op_ilt:
+        ip++;
+        b = stack[--sp];
+        tos = (tos < b)? TRUE : FALSE;
+        DISPATCH();
+    op_ieq:
+        ip++;
+        b = stack[--sp];
+        tos = (tos == b)? TRUE : FALSE;
+        DISPATCH();
+    op_br:
+        ip = instruction->target;
+        DISPATCH();
+    op_brt:
+        a = tos;
+        tos = stack[--sp];
+        ip = (a == TRUE) ? instruction->target : ip + 1;
+        DISPATCH();
+    op_brf:
+        a = tos;
+        tos = stack[--sp];
+        ip = (a == FALSE) ? instruction->target : ip + 1;
+        DISPATCH();
+    op_iconst:
+        ip++;
+        stack[sp++] = tos;
+        tos = instruction->operand;
+        DISPATCH();
+    op_iconst1:
+        ip++;
+        stack[sp++] = tos;
+        tos = 1;
+        DISPATCH();
+    op_load:
+        // Spill first: the frame slot can be the cached top
+        ip++;
+        stack[sp++] = tos;
+        tos = stack[fp + instruction->operand];
+        DISPATCH();
+    op_gload:
+        ip++;
+        stack[sp++] = tos;
+        tos = data[instruction->operand];
+        DISPATCH();
+    op_store:
+        // Reload after the store: the frame slot can be the new top
+        ip++;
+        value = tos;
+        sp--;
+        stack[fp + instruction->operand] = value;
+        tos = stack[sp];
+        DISPATCH();
+    op_gstore:
+        ip++;
+        data[instruction->operand] = tos;
+        tos = stack[--sp];
+        DISPATCH();
+    op_gload_indexed:
+        ip++;
+        tos = data[(instruction->operand + tos)];
+        DISPATCH();
+    op_gstore_indexed:
+        ip++;
+        offset = stack[sp - 1];
+        data[(instruction->operand + offset)] = tos;
+        sp -= 2;
+        tos = stack[sp];
+        DISPATCH();
+    op_print:
+        ip++;
+        std::cout << "[VM] " << tos << std::endl;
+        tos = stack[--sp];
+        DISPATCH();
+    op_call:
+        // The whole frame goes to memory, so RET and LOAD/STORE find it there
+        if (checkStackBounds && sp + 3 + frameDepth >= stackSize) {
+            goto op_overflow;
+        }
+        ip++;
+        stack[sp] = tos;
+        stack[sp + 1] = instruction->operand;  // num arguments
+        stack[sp + 2] = fp;
+        stack[sp + 3] = ip;
+        sp += 3;
+        tos = ip;
+        fp = sp;
+        ip = instruction->target;
+        DISPATCH();
+    op_ret:
+        value = tos;
+        ip = stack[fp];
+        numArgs = stack[fp - 2];
+        sp = fp - 2 - numArgs;
+        fp = stack[fp - 1];
+        tos = value;  // return value on top of the stack
+        DISPATCH();
+    op_pop:
+        ip++;
+        tos = stack[--sp];
+        DISPATCH();
+    op_dup_iconst_ieq_brt:
+        ip = (tos == instruction->operand) ? instruction->target : ip + 1;
+        DISPATCH();
+    op_dup_gload_indexed:
+        ip++;
+        stack[sp++] = tos;
+        tos = data[(instruction->operand + tos)];
+        DISPATCH();
+    op_iconst1_iadd:
+        ip++;
+        tos = tos + 1;
+        DISPATCH();
+    op_fadd:
+        ip++;
+        b = stack[--sp];
+        tos = floatToBits(bitsToFloat(tos) + bitsToFloat(b));
+        DISPATCH();
+    op_fsub:
+        ip++;
+        b = stack[--sp];
+        tos = floatToBits(bitsToFloat(tos) - bitsToFloat(b));
+        DISPATCH();
+    op_fmul:
+        ip++;
+        b = stack[--sp];
+        tos = floatToBits(bitsToFloat(tos) * bitsToFloat(b));
+        DISPATCH();
+    op_fdiv:
+        ip++;
+        b = stack[--sp];
+        tos = floatToBits(bitsToFloat(tos) / bitsToFloat(b));
+        DISPATCH();
+    op_fma:
+        ip++;
+        b = stack[sp - 1];
+        c = stack[sp - 2];
+        sp -= 2;
+        tos = floatToBits(fma(bitsToFloat(tos), bitsToFloat(b), bitsToFloat(c)));
+        DISPATCH();
+    op_flt:
+        ip++;
+        b = stack[--sp];
+        tos = (bitsToFloat(tos) < bitsToFloat(b))? TRUE : FALSE;
+        DISPATCH();
+    op_feq:
+        ip++;
+        b = stack[--sp];
+        tos = (bitsToFloat(tos) == bitsToFloat(b))? TRUE : FALSE;
+        DISPATCH();
+    op_i2f:
+        ip++;
+        tos = floatToBits((float) tos);
+        DISPATCH();
+    op_f2i:
+        ip++;
+        tos = (int) bitsToFloat(tos);
+        DISPATCH();
+    // A double on top of the stack is the cached high word and the low word below it
+    op_dadd:
+        ip++;
+        x = bitsToDouble(stack[sp - 1], tos);
+        y = loadDouble(&stack[sp - 3]);
+        sp -= 2;
+        x = x + y;
+        stack[sp - 1] = doubleLowBits(x);
+        tos = doubleHighBits(x);
+        DISPATCH();
+    op_dsub:
+        ip++;
+        x = bitsToDouble(stack[sp - 1], tos);
+        y = loadDouble(&stack[sp - 3]);
+        sp -= 2;
+        x = x - y;
+        stack[sp - 1] = doubleLowBits(x);
+        tos = doubleHighBits(x);
+        DISPATCH();
+    op_dmul:
+        ip++;
+        x = bitsToDouble(stack[sp - 1], tos);
+        y = loadDouble(&stack[sp - 3]);
+        sp -= 2;
+        x = x * y;
+        stack[sp - 1] = doubleLowBits(x);
+        tos = doubleHighBits(x);
+        DISPATCH();
+    op_ddiv:
+        ip++;
+        x = bitsToDouble(stack[sp - 1], tos);
+        y = loadDouble(&stack[sp - 3]);
+        sp -= 2;
+        x = x / y;
+        stack[sp - 1] = doubleLowBits(x);
+        tos = doubleHighBits(x);
+        DISPATCH();
+    op_dfma:
+        ip++;
+        x = bitsToDouble(stack[sp - 1], tos);
+        y = loadDouble(&stack[sp - 3]);
+        z = loadDouble(&stack[sp - 5]);
+        sp -= 4;
+        x = fma(x, y, z);
+        stack[sp - 1] = doubleLowBits(x);
+        tos = doubleHighBits(x);
+        DISPATCH();
+    op_dlt:
+        ip++;
+        x = bitsToDouble(stack[sp - 1], tos);
+        y = loadDouble(&stack[sp - 3]);
+        sp -= 3;
+        tos = (x < y)? TRUE : FALSE;
+        DISPATCH();
+    op_deq:
+        ip++;
+        x = bitsToDouble(stack[sp - 1], tos);
+        y = loadDouble(&stack[sp - 3]);
+        sp -= 3;
+        tos = (x == y)? TRUE : FALSE;
+        DISPATCH();
+    op_i2d:
+        ip++;
+        x = (double) tos;
+        stack[sp++] = doubleLowBits(x);
+        tos = doubleHighBits(x);
+        DISPATCH();
+    op_d2i:
+        ip++;
+        x = bitsToDouble(stack[sp - 1], tos);
+        sp--;
+        tos = (int) x;
+        DISPATCH();
+    op_f2d:
+        ip++;
+        x = (double) bitsToFloat(tos);
+        stack[sp++] = doubleLowBits(x);
+        tos = doubleHighBits(x);
+        DISPATCH();
+    op_d2f:
+        ip++;
+        x = bitsToDouble(stack[sp - 1], tos);
+        sp--;
+        tos = floatToBits((float) x);
+        DISPATCH();
+    op_dload_indexed:
+        ip++;
+        address = instruction->operand + 2 * tos;
+        stack[sp++] = data[address];
+        tos = data[address + 1];
+        DISPATCH();
+    op_dstore_indexed:
+        ip++;
+        address = instruction->operand + 2 * stack[sp - 2];
+        data[address] = stack[sp - 1];
+        data[address + 1] = tos;
+        sp -= 3;
+        tos = stack[sp];
+        DISPATCH();
+    op_vload4:
+        // The last element of the vector is cached in tos
+        ip++;
+        address = instruction->operand + 4 * tos;
+        vectorCopy4(&stack[sp], &data[address]);
+        sp += 3;
+        tos = stack[sp];
+        DISPATCH();
+    op_vstore4:
+        ip++;
+        stack[sp] = tos;
+        address = instruction->operand + 4 * stack[sp - 4];
+        vectorCopy4(&data[address], &stack[sp - 3]);
+        sp -= 5;
+        tos = stack[sp];
+        DISPATCH();
+    op_vadd4:
+        ip++;
+        stack[sp] = tos;
+        vectorAdd4(&stack[sp - 7], &stack[sp - 3], &stack[sp - 7]);
+        sp -= 4;
+        tos = stack[sp];
+        DISPATCH();
+    op_vmul4:
+        ip++;
+        stack[sp] = tos;
+        vectorMul4(&stack[sp - 7], &stack[sp - 3], &stack[sp - 7]);
+        sp -= 4;
+        tos = stack[sp];
+        DISPATCH();
+    op_vsum4:
+        ip++;
+        stack[sp] = tos;
+        sp -= 3;
+        tos = vectorSum4(&stack[sp]);
+        DISPATCH();
+    op_vfadd4:
+        ip++;
+        stack[sp] = tos;
+        vectorFAdd4(&stack[sp - 7], &stack[sp - 3], &stack[sp - 7]);
+        sp -= 4;
+        tos = stack[sp];
+        DISPATCH();
+    op_vfmul4:
+        ip++;
+        stack[sp] = tos;
+        vectorFMul4(&stack[sp - 7], &stack[sp - 3], &stack[sp - 7]);
+        sp -= 4;
+        tos = stack[sp];
+        DISPATCH();
+    op_vfsum4:
+        ip++;
+        stack[sp] = tos;
+        sp -= 3;
+        tos = vectorFSum4(&stack[sp]);
+        DISPATCH();
+    op_reduce:
+        ip++;
+        reductions[instruction->operand] = tos;
+        DISPATCH();
+    op_scan_add:
+        ip++;
+        tos = 0;
+        DISPATCH();
+    op_barrier:
+        ip++;
+        DISPATCH();
+    op_lload:
+        ip++;
+        tos = scratchpad[instruction->operand + tos];
+        DISPATCH();
+    op_lstore:
+        ip++;
+        offset = stack[sp - 1];
+        scratchpad[instruction->operand + offset] = tos;
+        sp -= 2;
+        tos = stack[sp];
+        DISPATCH();
+    op_error:
+        ip++;
+        cout << "Error" << endl;
+        DISPATCH();
+    op_overflow:
+        cout << "[VM] Stack overflow" << endl;
+    op_halt:
+        ip++;
+        stack[sp] = tos;
+        this->ip = ip;
+        this->sp = sp;
+        this->fp = fp;
+}
+
+#undef DISPATCH
+
+#else
+
+void VM::runInterpreterThreaded() {
+    runInterpreterSwitch();
+}
+
+void VM::runInterpreterThreadedTOS() {
+    runInterpreterSwitch();
+}
+
+#endif
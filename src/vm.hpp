@@ -28,6 +28,25 @@
 
 using namespace std;
 
+// Labels-as-values is a GCC/Clang extension. Other compilers only get the switch engine.
+#if defined(__GNUC__) || defined(__clang__)
+    #define VM_THREADED_DISPATCH 1
+#endif
+
+/*
+ * Dispatch engines for the C++ BC interpreter:
+ *  - SWITCH_DISPATCH: every bytecode goes back to a single switch statement.
+ *  - THREADED_DISPATCH: direct-threaded code (computed goto). Each handler jumps straight
+ *    to the handler of the next bytecode, so every handler owns its own indirect branch.
+ *  - THREADED_TOS_DISPATCH: direct-threaded code that also caches the top of the stack in
+ *    a local variable, so arithmetic bytecodes do one stack access instead of three.
+ */
+enum DispatchMode {
+    SWITCH_DISPATCH,
+    THREADED_DISPATCH,
+    THREADED_TOS_DISPATCH
+};
+
 class VM : public AbstractVM {
 
     public:
@@ -35,8 +54,35 @@ class VM : public AbstractVM {
 
         ~VM();
 
+        void setDispatchMode(DispatchMode mode);
+
+        DispatchMode getDispatchMode();
+
+        // Count the executed pairs of opcodes, used to choose the superinstructions to fuse
+        void enableProfiling();
+
+        vector<long> getPairProfile();
+
+        void printProfile(int numPairs);
+
         // Implementation of the Interpreter in C++
         void runInterpreter();
+
+    protected:
+        bool profile = false;
+        vector<long> pairProfile;
+
+    private:
+        void runInterpreterSwitch();
+        void runInterpreterThreaded();
+        void runInterpreterThreadedTOS();
+        void profileOpcode(int previousOpcode, int opcode);
+
+#ifdef VM_THREADED_DISPATCH
+        DispatchMode dispatchMode = THREADED_TOS_DISPATCH;
+#else
+        DispatchMode dispatchMode = SWITCH_DISPATCH;
+#endif
 };
 
 #endif 
\ No newline at end of file